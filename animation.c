@@ -0,0 +1,171 @@
+#include "animation.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct AnimationParser {
+  const char *sourceName;
+  int lineNumber;
+  Animation *animation;
+  int keyCapacity;
+  AnimationKey previousKey;
+} AnimationParser;
+
+static int parseError(const AnimationParser *parser, const char *message,
+                      const char *token) {
+  printf("%s:%d: %s%s%s\n", parser->sourceName, parser->lineNumber, message,
+         token ? ": " : "", token ? token : "");
+  return 1;
+}
+
+static bool parsePoint(char **savePtr, Point *point) {
+  float values[3];
+  for (int i = 0; i < 3; ++i) {
+    char *token = strtok_r(NULL, " \t\r", savePtr);
+    if (!token) {
+      return false;
+    }
+    char *end;
+    values[i] = strtod(token, &end);
+    if (*end != '\0') {
+      return false;
+    }
+  }
+  *point = makePoint(values[0], values[1], values[2]);
+  return true;
+}
+
+static int parseKey(AnimationParser *parser, char **savePtr) {
+  Animation *animation = parser->animation;
+  AnimationKey key = parser->previousKey;
+  char *token = strtok_r(NULL, " \t\r", savePtr);
+  char *end;
+  if (!token || (key.frame = strtol(token, &end, 10), *end != '\0')) {
+    return parseError(parser, "expected a frame number", token);
+  }
+  if (animation->numKeys > 0 && key.frame <= parser->previousKey.frame) {
+    return parseError(parser, "keys must be in increasing frame order", token);
+  }
+  while ((token = strtok_r(NULL, " \t\r", savePtr))) {
+    Point *point;
+    if (strcmp(token, "camera") == 0) {
+      point = &key.cameraPosition;
+    } else if (strcmp(token, "target") == 0) {
+      point = &key.cameraTarget;
+    } else if (strcmp(token, "light") == 0) {
+      point = &key.lightPosition;
+    } else {
+      return parseError(parser, "unknown key property", token);
+    }
+    if (!parsePoint(savePtr, point)) {
+      return parseError(parser, "expected three numbers after", token);
+    }
+  }
+
+  if (animation->numKeys == parser->keyCapacity) {
+    parser->keyCapacity = parser->keyCapacity ? parser->keyCapacity * 2 : 16;
+    animation->keys =
+        realloc(animation->keys, parser->keyCapacity * sizeof(AnimationKey));
+  }
+  animation->keys[animation->numKeys++] = key;
+  parser->previousKey = key;
+  return 0;
+}
+
+static int parseLine(AnimationParser *parser, char *line) {
+  char *comment = strchr(line, '#');
+  if (comment) {
+    *comment = '\0';
+  }
+  char *savePtr;
+  char *directive = strtok_r(line, " \t\r", &savePtr);
+  if (!directive) {
+    return 0;
+  }
+  if (strcmp(directive, "key") == 0) {
+    return parseKey(parser, &savePtr);
+  }
+  return parseError(parser, "unknown directive", directive);
+}
+
+int parseAnimation(const char *description, const char *sourceName,
+                   const AnimationKey *defaults, Animation *animation) {
+  memset(animation, 0, sizeof(Animation));
+  AnimationParser parser = {.sourceName = sourceName,
+                            .animation = animation,
+                            .previousKey = *defaults};
+  char *text = strdup(description);
+  int result = 0;
+  for (char *line = text; line && result == 0;) {
+    char *nextLine = strchr(line, '\n');
+    if (nextLine) {
+      *nextLine++ = '\0';
+    }
+    parser.lineNumber++;
+    result = parseLine(&parser, line);
+    line = nextLine;
+  }
+  if (result == 0 && animation->numKeys == 0) {
+    printf("%s: animation has no keys\n", sourceName);
+    result = 1;
+  }
+  free(text);
+  if (result != 0) {
+    freeAnimation(animation);
+  }
+  return result;
+}
+
+int loadAnimation(const char *filename, const AnimationKey *defaults,
+                  Animation *animation) {
+  FILE *animationFile = fopen(filename, "r");
+  if (!animationFile) {
+    printf("Failed to open animation file: %d (%s)\n", errno,
+           strerror(errno));
+    return 1;
+  }
+  fseek(animationFile, 0, SEEK_END);
+  long size = ftell(animationFile);
+  fseek(animationFile, 0, SEEK_SET);
+  char *description = malloc(size + 1);
+  size_t numRead = fread(description, 1, size, animationFile);
+  description[numRead] = '\0';
+  fclose(animationFile);
+
+  int result = parseAnimation(description, filename, defaults, animation);
+  free(description);
+  return result;
+}
+
+void freeAnimation(Animation *animation) {
+  free(animation->keys);
+  memset(animation, 0, sizeof(Animation));
+}
+
+static Point lerpPoint(float t, Point a, Point b) {
+  return makePoint(lerp(t, a.x, b.x), lerp(t, a.y, b.y), lerp(t, a.z, b.z));
+}
+
+AnimationKey animationFrame(const Animation *animation, int frame) {
+  const AnimationKey *keys = animation->keys;
+  if (frame <= keys[0].frame) {
+    return keys[0];
+  }
+  for (int i = 1; i < animation->numKeys; ++i) {
+    if (frame > keys[i].frame) {
+      continue;
+    }
+    const AnimationKey *a = &keys[i - 1];
+    const AnimationKey *b = &keys[i];
+    float t = (float)(frame - a->frame) / (b->frame - a->frame);
+    return (AnimationKey){
+        .frame = frame,
+        .cameraPosition = lerpPoint(t, a->cameraPosition, b->cameraPosition),
+        .cameraTarget = lerpPoint(t, a->cameraTarget, b->cameraTarget),
+        .lightPosition = lerpPoint(t, a->lightPosition, b->lightPosition)};
+  }
+  return keys[animation->numKeys - 1];
+}
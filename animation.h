@@ -0,0 +1,46 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "math.h"
+
+// Where the camera and the light are on one frame.
+typedef struct AnimationKey {
+  int frame;
+  Point cameraPosition;
+  // The point the camera looks at.
+  Point cameraTarget;
+  Point lightPosition;
+} AnimationKey;
+
+// A camera and light path through a range of frames.
+typedef struct Animation {
+  AnimationKey *keys;
+  int numKeys;
+} Animation;
+
+/**
+ * Animation descriptions are plain text, one key per line, in increasing
+ * frame order. Everything after a '#' is a comment.
+ *
+ *   key FRAME [camera X Y Z] [target X Y Z] [light X Y Z]
+ *
+ * Anything a key leaves out carries over from the previous key, or from the
+ * defaults for the first key. Frames between keys are interpolated linearly;
+ * the animation runs from the first key's frame to the last key's.
+ */
+
+// Compiles an animation description. On failure, prints an error mentioning
+// sourceName and the offending line and returns 1.
+int parseAnimation(const char *description, const char *sourceName,
+                   const AnimationKey *defaults, Animation *animation);
+
+// Reads and compiles an animation description file. Returns 1 on failure.
+int loadAnimation(const char *filename, const AnimationKey *defaults,
+                  Animation *animation);
+
+void freeAnimation(Animation *animation);
+
+// The camera and light on a frame, which is clamped to the animation's range.
+AnimationKey animationFrame(const Animation *animation, int frame);
+
+#endif /* ANIMATION_H */
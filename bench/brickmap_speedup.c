@@ -0,0 +1,135 @@
+// Measures how much a brick map speeds up sphere tracing compared to
+// evaluating the scene analytically, on the default scene and on random
+// sphere scenes of growing size. Every scene gets the default camera's primary
+// rays, marched with the plain scalar marcher both ways. Lookups are lower
+// bounds, so rays take more, cheaper steps through the map; mismatches are
+// grazing rays that run out of steps one way but not the other.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../brickmap.h"
+#include "../math.h"
+#include "../pool.h"
+#include "../scene.h"
+
+static const int kSphereCounts[] = {50, 500, 5000};
+
+static const int kImageSize = 256;
+
+static unsigned int randomState = 1;
+
+static float randomFloat(void) {
+  randomState = randomState * 1664525u + 1013904223u;
+  return (randomState >> 8) / (float)(1 << 24);
+}
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static char *randomSceneDescription(int numSpheres) {
+  size_t capacity = 256 + numSpheres * 96;
+  char *description = malloc(capacity);
+  size_t length = snprintf(description, capacity,
+                           "material wall diffuse 0.7 0.7 0.7\n"
+                           "plane normal 0 1 0 h 0.5 material wall\n");
+  float radius = 0.15f / cbrtf(numSpheres);
+  for (int i = 0; i < numSpheres; ++i) {
+    length += snprintf(description + length, capacity - length,
+                       "sphere center %f %f %f radius %f material wall\n",
+                       randomFloat() - 0.5f, randomFloat() - 0.5f,
+                       randomFloat() - 0.8f, radius);
+  }
+  return description;
+}
+
+// rayMarch() takes a plain SDF, so the scene and map being measured are
+// globals.
+static const Scene *gScene;
+static const BrickMap *gBrickMap;
+
+static float analyticSDF(Point p) { return sceneDistance(gScene, p); }
+
+static float brickMapSDF(Point p) {
+  return brickMapDistance(gBrickMap, gScene, p);
+}
+
+// Returns seconds to march every primary ray, storing whether each one hit.
+static double timePrimaryRays(SDF sdf, bool *hits) {
+  const Point camera = {.x = 0.0f, .y = 0.0f, .z = 0.5f};
+  double start = now();
+  for (int row = 0; row < kImageSize; ++row) {
+    for (int column = 0; column < kImageSize; ++column) {
+      Point target = makePoint(lerp((column + 0.5f) / kImageSize, -0.5, 0.5),
+                               lerp((row + 0.5f) / kImageSize, -0.5, 0.5),
+                               0.0f);
+      Ray ray = makeRay(camera, directionFromPointToPoint(camera, target));
+      hits[row * kImageSize + column] = rayMarch(ray, sdf, kDefaultNumRayMarchSteps, NULL);
+    }
+  }
+  return now() - start;
+}
+
+static void measureScene(const char *name, const Scene *scene,
+                         TilePool *pool) {
+  bool *analyticHits = malloc(kImageSize * kImageSize * sizeof(bool));
+  bool *brickMapHits = malloc(kImageSize * kImageSize * sizeof(bool));
+  double bakeStart = now();
+  BrickMap *map = bakeBrickMap(scene, pool);
+  double bakeTime = now() - bakeStart;
+  gScene = scene;
+  gBrickMap = map;
+  double analyticTime = timePrimaryRays(analyticSDF, analyticHits);
+  double brickMapTime = timePrimaryRays(brickMapSDF, brickMapHits);
+  int numMismatches = 0;
+  for (int i = 0; i < kImageSize * kImageSize; ++i) {
+    if (analyticHits[i] != brickMapHits[i]) {
+      numMismatches++;
+    }
+  }
+  printf("%16s %10.2f %10.1f %12.1f %12.1f %9.2fx %10d\n", name,
+         bakeTime * 1e3, brickMapMemorySize(map) / 1048576.0,
+         analyticTime * 1e3, brickMapTime * 1e3, analyticTime / brickMapTime,
+         numMismatches);
+  freeBrickMap(map);
+  free(brickMapHits);
+  free(analyticHits);
+}
+
+int main(void) {
+  TilePool *pool = createTilePool(defaultNumThreads());
+  if (!pool) {
+    return 1;
+  }
+  printf("Dense grid: %.1f MiB\n", brickMapDenseMemorySize() / 1048576.0);
+  printf("%16s %10s %10s %12s %12s %10s %10s\n", "scene", "bake ms", "MiB",
+         "analytic ms", "brick ms", "speedup", "mismatches");
+
+  Scene scene;
+  if (parseScene(kDefaultSceneDescription, "default scene", &scene) != 0) {
+    return 1;
+  }
+  measureScene("default", &scene, pool);
+  freeScene(&scene);
+
+  int numCounts = sizeof(kSphereCounts) / sizeof(kSphereCounts[0]);
+  for (int c = 0; c < numCounts; ++c) {
+    char *description = randomSceneDescription(kSphereCounts[c]);
+    if (parseScene(description, "random scene", &scene) != 0) {
+      return 1;
+    }
+    free(description);
+    char name[32];
+    snprintf(name, sizeof(name), "%d spheres", kSphereCounts[c]);
+    measureScene(name, &scene, pool);
+    freeScene(&scene);
+  }
+
+  destroyTilePool(pool);
+  return 0;
+}
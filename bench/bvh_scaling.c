@@ -0,0 +1,116 @@
+// Measures how scene evaluation scales with the number of primitives, with and
+// without a BVH. Scenes are random spheres inside the unit cube above a floor
+// plane.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../bvh.h"
+#include "../math.h"
+#include "../scene.h"
+
+static const int kPrimitiveCounts[] = {5, 50, 500, 5000, 50000, 100000};
+
+// Linear evaluation of the largest scenes is slow, so it gets fewer samples.
+static const long kLinearPrimitiveEvaluations = 20000000;
+static const int kNumBVHSamples = 200000;
+
+static unsigned int randomState = 1;
+
+static float randomFloat(void) {
+  randomState = randomState * 1664525u + 1013904223u;
+  return (randomState >> 8) / (float)(1 << 24);
+}
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static char *randomSceneDescription(int numSpheres) {
+  size_t capacity = 256 + numSpheres * 96;
+  char *description = malloc(capacity);
+  size_t length = snprintf(description, capacity,
+                           "material wall diffuse 0.7 0.7 0.7\n"
+                           "plane normal 0 1 0 h 0.5 material wall\n");
+  // Keep the total volume roughly constant as the count grows.
+  float radius = 0.15f / cbrtf(numSpheres);
+  for (int i = 0; i < numSpheres - 1; ++i) {
+    length += snprintf(description + length, capacity - length,
+                       "sphere center %f %f %f radius %f material wall\n",
+                       randomFloat() - 0.5f, randomFloat() - 0.5f,
+                       randomFloat() - 0.5f, radius);
+  }
+  return description;
+}
+
+// Returns nanoseconds per evaluation over the sample points.
+static double timeEvaluations(const Scene *scene, const Point *points,
+                              int numPoints, float *distances) {
+  double start = now();
+  for (int i = 0; i < numPoints; ++i) {
+    distances[i] = sceneDistance(scene, points[i]);
+  }
+  return (now() - start) * 1e9 / numPoints;
+}
+
+int main(void) {
+  Point *points = malloc(kNumBVHSamples * sizeof(Point));
+  for (int i = 0; i < kNumBVHSamples; ++i) {
+    points[i] = makePoint(randomFloat() - 0.5f, randomFloat() - 0.5f,
+                          randomFloat() - 0.5f);
+  }
+  float *linearDistances = malloc(kNumBVHSamples * sizeof(float));
+  float *bvhDistances = malloc(kNumBVHSamples * sizeof(float));
+  // Fault the pages in now rather than during the first timing.
+  memset(linearDistances, 0, kNumBVHSamples * sizeof(float));
+  memset(bvhDistances, 0, kNumBVHSamples * sizeof(float));
+
+  printf("%10s %10s %10s %14s %14s %10s %10s\n", "primitives", "nodes",
+         "build ms", "linear ns/eval", "bvh ns/eval", "speedup",
+         "mismatches");
+  int numCounts = sizeof(kPrimitiveCounts) / sizeof(kPrimitiveCounts[0]);
+  for (int c = 0; c < numCounts; ++c) {
+    int numPrimitives = kPrimitiveCounts[c];
+    char *description = randomSceneDescription(numPrimitives);
+    Scene scene;
+    if (parseScene(description, "random scene", &scene) != 0) {
+      return 1;
+    }
+    free(description);
+
+    freeSceneBVH(&scene);
+    int numLinearSamples = kLinearPrimitiveEvaluations / numPrimitives;
+    if (numLinearSamples > kNumBVHSamples) {
+      numLinearSamples = kNumBVHSamples;
+    }
+    double linearTime =
+        timeEvaluations(&scene, points, numLinearSamples, linearDistances);
+
+    double buildStart = now();
+    buildSceneBVH(&scene);
+    double buildTime = now() - buildStart;
+    double bvhTime =
+        timeEvaluations(&scene, points, kNumBVHSamples, bvhDistances);
+
+    int numMismatches = 0;
+    for (int i = 0; i < numLinearSamples; ++i) {
+      if (linearDistances[i] != bvhDistances[i]) {
+        numMismatches++;
+      }
+    }
+    printf("%10d %10d %10.2f %14.1f %14.1f %9.1fx %10d\n", numPrimitives,
+           scene.bvh->numNodes, buildTime * 1e3, linearTime, bvhTime,
+           linearTime / bvhTime, numMismatches);
+    freeScene(&scene);
+  }
+
+  free(bvhDistances);
+  free(linearDistances);
+  free(points);
+  return 0;
+}
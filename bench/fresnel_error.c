@@ -0,0 +1,111 @@
+// Compares looking a mirror's reflectance up in its Fresnel table, as
+// --fast-fresnel does, with computing it exactly, for the default scene's
+// metals and for a grid of refractive indices and extinction coefficients.
+// Reports the largest difference in any channel over every angle of
+// incidence, and how long each way takes.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../math.h"
+#include "../scene.h"
+
+// Angles of incidence tried, evenly spaced in cosine.
+static const int kNumCosines = 1000001;
+
+static const float kGridValues[] = {0.05, 0.1, 0.2, 0.5, 1.0, 2.0, 3.5, 5.0};
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Keeps the compiler from dropping the results being timed.
+static volatile float gSink;
+
+// The reflectance of a mirror seen at an angle with the given cosine, as
+// shading computes it exactly: the angle is found with acosf() and halved.
+static Color exactReflectance(const Material *material, float cosine) {
+  return conductiveReflectance2(material->refractiveIndex,
+                                material->extinctionCoeff,
+                                acosf(cosine) * 0.5);
+}
+
+static Color tableReflectance(const Material *material, float cosine) {
+  return lookupFresnelTable(material->fresnelTable,
+                            sqrtf(fmaxf(0.5 * (1.0 + cosine), 0.0)));
+}
+
+static float maxError(const Material *material) {
+  float error = 0.0;
+  for (int i = 0; i < kNumCosines; ++i) {
+    float cosine = (float)i / (kNumCosines - 1) * 2.0 - 1.0;
+    Color exact = exactReflectance(material, cosine);
+    Color table = tableReflectance(material, cosine);
+    error = fmaxf(error, fabsf(exact.r - table.r));
+    error = fmaxf(error, fabsf(exact.g - table.g));
+    error = fmaxf(error, fabsf(exact.b - table.b));
+  }
+  return error;
+}
+
+// Returns nanoseconds per call.
+static double timeReflectance(const Material *material,
+                              Color (*reflectance)(const Material *, float)) {
+  float sum = 0.0;
+  double start = now();
+  for (int i = 0; i < kNumCosines; ++i) {
+    sum += reflectance(material, (float)i / (kNumCosines - 1)).g;
+  }
+  double elapsed = now() - start;
+  gSink = sum;
+  return elapsed / kNumCosines * 1e9;
+}
+
+static void measureMaterial(const char *name, const Material *material) {
+  printf("%-24s %12.2e %10.1f %10.1f\n", name, maxError(material),
+         timeReflectance(material, exactReflectance),
+         timeReflectance(material, tableReflectance));
+}
+
+int main(void) {
+  printf("%-24s %12s %10s %10s\n", "material", "max error", "exact ns",
+         "table ns");
+  Scene scene;
+  if (parseScene(kDefaultSceneDescription, "default scene", &scene) != 0) {
+    return 1;
+  }
+  for (int i = 0; i < scene.numMaterials; ++i) {
+    if (scene.materials[i].isConductive) {
+      char name[32];
+      snprintf(name, sizeof(name), "default scene #%d", i);
+      measureMaterial(name, &scene.materials[i]);
+    }
+  }
+  freeScene(&scene);
+
+  int numValues = sizeof(kGridValues) / sizeof(kGridValues[0]);
+  float worstError = 0.0;
+  FresnelTable table;
+  for (int n = 0; n < numValues; ++n) {
+    for (int k = 0; k < numValues; ++k) {
+      Material material = {
+          .isConductive = true,
+          .refractiveIndex = makeColor(kGridValues[n], kGridValues[n],
+                                       kGridValues[n]),
+          .extinctionCoeff = makeColor(kGridValues[k], kGridValues[k],
+                                       kGridValues[k]),
+          .fresnelTable = &table};
+      buildFresnelTable(material.refractiveIndex, material.extinctionCoeff,
+                        &table);
+      worstError = fmaxf(worstError, maxError(&material));
+    }
+  }
+  printf("Largest error for indices and coefficients from %.2f to %.2f: "
+         "%.2e\n",
+         kGridValues[0], kGridValues[numValues - 1], worstError);
+  return 0;
+}
@@ -0,0 +1,480 @@
+// Renders a set of canonical scenes and views at fixed settings with every
+// render mode, compares each image to the stored golden image of its view,
+// and prints the results as JSON:
+//
+//   out/golden_check [check|update] [golden directory] [path to main]
+//
+// update renders the exact path, the renderer with no speed options, into
+// the golden directory (golden by default). check renders every mode, keeping
+// the best of a few runs' times, and reports each one's PSNR, SSIM and
+// largest channel error against the golden image and its speedup over the
+// exact path, then the same per mode over all views. The exact path has to
+// match its golden images, and each fast mode has to stay within the quality
+// it's accepted at; the exit status is 1 if any render doesn't. Speedups are
+// reported but not held to anything. Progress goes to stderr.
+//
+// The times are only meaningful for an optimized renderer, which is what the
+// "Build main (release)" task makes: out/mainRelease, the default.
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <math.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static const int kNumRuns = 3;
+
+// The settings every render shares. Modes may override them. Rays get steps
+// enough to converge, where the low preset would give up on rays grazing
+// surfaces, so the golden images are what the exact path converges to and
+// the quality a mode loses is lost to the mode.
+static const char *const kSettings[] = {
+    "-q", "low", "--steps", "5000", "-W", "192", "-H", "144",
+    "--samples", "4", "-f", "bmp"};
+
+// Identical images have no noise to measure, so their PSNR is reported as
+// this.
+static const double kIdenticalPSNR = 100.0;
+
+// SSIM is computed on the luma of kSSIMWindow x kSSIMWindow windows placed
+// every kSSIMStride pixels.
+#define kSSIMWindow 8
+#define kSSIMStride 4
+
+static const char *const kMirrorsScene =
+    "material gold diffuse 1 1 1 conductive ior 0.183 0.421 1.373 "
+    "extinction 3.424 2.346 1.77\n"
+    "material wall diffuse 0.7 0.7 0.7\n"
+    "plane normal 1 0 0 h 0.4 material gold\n"
+    "plane normal -1 0 0 h 0.4 material gold\n"
+    "plane normal 0 1 0 h 0.5 material wall\n"
+    "sphere center 0 0 -0.5 radius 0.15 material wall\n";
+
+static const int kNumRandomSpheres = 300;
+
+typedef struct View {
+  const char *name;
+  // The scene's description, or NULL for the built-in scene.
+  const char *scene;
+  // Options naming the camera and light, ending in NULL.
+  const char *options[7];
+} View;
+
+// The spheres view's scene, made by main().
+static char *gRandomScene;
+
+static View kViews[] = {
+    {"default", NULL, {NULL}},
+    {"default-above",
+     NULL,
+     {"--camera", "0.3,0.35,0.45", "--target", "0,-0.1,-0.2", "--light",
+      "0.2,0.3,0.4", NULL}},
+    {"mirrors", NULL, {"--target", "0,0,-0.5", NULL}},
+    {"spheres", NULL, {"--camera", "0,0.1,0.6", NULL}},
+};
+
+// The stand-in for a path in the scratch directory, named after the view and
+// mode, in a mode's options.
+static const char kScratchPath[] = "@";
+
+typedef struct Mode {
+  const char *name;
+  // Options added to the view's, ending in NULL.
+  const char *options[5];
+  // The least PSNR and SSIM, and the largest channel error, the mode is
+  // accepted at. Quality lost to the mode is measured against the exact
+  // path's golden images.
+  double minPSNR;
+  double minSSIM;
+  int maxError;
+} Mode;
+
+// The exact path comes first, and the scene kernel and fast Fresnel terms find
+// exactly the same image, so all three must match the golden images exactly.
+// Every other threshold is the worst measured over the views less a small
+// margin. Speedups are only reported: one machine's best of a few runs'
+// times moves by up to a fifth between checks, more than some modes gain.
+static const Mode kModes[] = {
+    {"exact", {NULL}, 100.0, 1.0, 0},
+    {"scene-kernel", {"--scene-kernel", kScratchPath, NULL}, 100.0, 1.0, 0},
+    {"brick-map", {"-b", kScratchPath, NULL}, 52.0, 0.9993, 14},
+    {"depth-prepass", {"--depth-prepass", NULL}, 53.0, 0.9994, 13},
+    {"fast-fresnel", {"--fast-fresnel", NULL}, 100.0, 1.0, 0},
+    {"relax", {"--relax", "all", NULL}, 37.5, 0.988, 66},
+    {"shadow-cache",
+     {"--shadow-cache", "256", "--shadow-cache-file", kScratchPath, NULL},
+     55.0,
+     0.9997,
+     58},
+    {"adaptive", {"-a", "4", NULL}, 62.0, 0.9998, 8},
+    {"denoise", {"--samples", "1", "--denoise", "2", NULL}, 28.5, 0.96, 75},
+};
+
+typedef struct Image {
+  int width;
+  int height;
+  // 3 bytes per pixel, rows packed.
+  uint8_t *pixels;
+} Image;
+
+typedef struct Comparison {
+  double psnr;
+  double ssim;
+  int maxError;
+} Comparison;
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static char *randomSceneDescription(int numSpheres) {
+  unsigned int randomState = 1;
+  size_t capacity = 256 + numSpheres * 96;
+  char *description = malloc(capacity);
+  size_t length = snprintf(description, capacity,
+                           "material wall diffuse 0.7 0.7 0.7\n"
+                           "material gold diffuse 0.9 0.7 0.2\n"
+                           "plane normal 0 1 0 h 0.5 material wall\n");
+  float radius = 0.15f / cbrtf(numSpheres);
+  for (int i = 0; i < numSpheres; ++i) {
+    float position[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      randomState = randomState * 1664525u + 1013904223u;
+      position[axis] = (randomState >> 8) / (float)(1 << 24);
+    }
+    length += snprintf(description + length, capacity - length,
+                       "sphere center %f %f %f radius %f material %s\n",
+                       position[0] - 0.5f, position[1] - 0.5f,
+                       position[2] - 0.8f, radius, i % 2 ? "gold" : "wall");
+  }
+  return description;
+}
+
+// Reads a bitmap as writeBitmap() writes them: 24 bits per pixel, bottom row
+// first. Returns false if the file isn't one.
+static bool readBitmap(const char *filename, Image *image) {
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    return false;
+  }
+  uint8_t header[54];
+  bool ok = fread(header, 1, sizeof(header), file) == sizeof(header) &&
+            header[0] == 'B' && header[1] == 'M' && header[28] == 24;
+  uint32_t pixelsOffset = 0;
+  int32_t width = 0;
+  int32_t height = 0;
+  if (ok) {
+    memcpy(&pixelsOffset, header + 10, 4);
+    memcpy(&width, header + 18, 4);
+    memcpy(&height, header + 22, 4);
+    ok = width > 0 && height > 0 && fseek(file, pixelsOffset, SEEK_SET) == 0;
+  }
+  if (ok) {
+    size_t rowSize = ((size_t)width * 3 + 3) & ~(size_t)3;
+    image->width = width;
+    image->height = height;
+    image->pixels = malloc((size_t)width * height * 3);
+    uint8_t *row = malloc(rowSize);
+    for (int y = 0; y < height && ok; ++y) {
+      ok = fread(row, 1, rowSize, file) == rowSize;
+      memcpy(image->pixels + (size_t)y * width * 3, row, (size_t)width * 3);
+    }
+    free(row);
+    if (!ok) {
+      free(image->pixels);
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+static double luma(const uint8_t *pixel) {
+  // Pixels are stored blue first.
+  return 0.114 * pixel[0] + 0.587 * pixel[1] + 0.299 * pixel[2];
+}
+
+// The mean structural similarity of the images' luma over windows of them.
+static double structuralSimilarity(const Image *a, const Image *b) {
+  const double c1 = (0.01 * 255) * (0.01 * 255);
+  const double c2 = (0.03 * 255) * (0.03 * 255);
+  const int n = kSSIMWindow * kSSIMWindow;
+  double sum = 0.0;
+  int numWindows = 0;
+  for (int top = 0; top + kSSIMWindow <= a->height; top += kSSIMStride) {
+    for (int left = 0; left + kSSIMWindow <= a->width; left += kSSIMStride) {
+      double sumA = 0.0, sumB = 0.0, sumAA = 0.0, sumBB = 0.0, sumAB = 0.0;
+      for (int y = top; y < top + kSSIMWindow; ++y) {
+        for (int x = left; x < left + kSSIMWindow; ++x) {
+          size_t offset = ((size_t)y * a->width + x) * 3;
+          double lumaA = luma(a->pixels + offset);
+          double lumaB = luma(b->pixels + offset);
+          sumA += lumaA;
+          sumB += lumaB;
+          sumAA += lumaA * lumaA;
+          sumBB += lumaB * lumaB;
+          sumAB += lumaA * lumaB;
+        }
+      }
+      double meanA = sumA / n;
+      double meanB = sumB / n;
+      double varianceA = sumAA / n - meanA * meanA;
+      double varianceB = sumBB / n - meanB * meanB;
+      double covariance = sumAB / n - meanA * meanB;
+      sum += (2 * meanA * meanB + c1) * (2 * covariance + c2) /
+             ((meanA * meanA + meanB * meanB + c1) *
+              (varianceA + varianceB + c2));
+      numWindows++;
+    }
+  }
+  return numWindows ? sum / numWindows : 1.0;
+}
+
+static Comparison compareImages(const Image *a, const Image *b) {
+  size_t numValues = (size_t)a->width * a->height * 3;
+  double squaredError = 0.0;
+  Comparison comparison = {0};
+  for (size_t i = 0; i < numValues; ++i) {
+    int error = abs(a->pixels[i] - b->pixels[i]);
+    squaredError += error * error;
+    if (error > comparison.maxError) {
+      comparison.maxError = error;
+    }
+  }
+  double meanSquaredError = squaredError / numValues;
+  comparison.psnr =
+      meanSquaredError > 0.0
+          ? fmin(10.0 * log10(255.0 * 255.0 / meanSquaredError),
+                 kIdenticalPSNR)
+          : kIdenticalPSNR;
+  comparison.ssim = structuralSimilarity(a, b);
+  return comparison;
+}
+
+// Runs the renderer on a view with a mode's options. Returns its wall-clock
+// time, or a negative number if it failed.
+static double render(const char *mainPath, const View *view,
+                     const char *sceneFilename, const Mode *mode,
+                     const char *scratchPath, const char *outputFilename) {
+  const char *argv[40];
+  int argc = 0;
+  argv[argc++] = mainPath;
+  for (size_t i = 0; i < sizeof(kSettings) / sizeof(kSettings[0]); ++i) {
+    argv[argc++] = kSettings[i];
+  }
+  if (sceneFilename) {
+    argv[argc++] = "-c";
+    argv[argc++] = sceneFilename;
+  }
+  for (int i = 0; view->options[i]; ++i) {
+    argv[argc++] = view->options[i];
+  }
+  for (int i = 0; mode->options[i]; ++i) {
+    argv[argc++] =
+        mode->options[i] == kScratchPath ? scratchPath : mode->options[i];
+  }
+  argv[argc++] = "-o";
+  argv[argc++] = outputFilename;
+  argv[argc] = NULL;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  double start = now();
+  pid_t pid;
+  int error = posix_spawn(&pid, mainPath, &actions, NULL,
+                          (char *const *)argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error != 0) {
+    return -1.0;
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    return -1.0;
+  }
+  return now() - start;
+}
+
+static int removePath(const char *path, const struct stat *status, int type,
+                      struct FTW *ftw) {
+  (void)status;
+  (void)type;
+  (void)ftw;
+  return remove(path);
+}
+
+int main(int argc, char **argv) {
+  bool updates = argc > 1 && strcmp(argv[1], "update") == 0;
+  if (argc > 1 && !updates && strcmp(argv[1], "check") != 0) {
+    fprintf(stderr, "Usage: %s [check|update] [golden directory] [main]\n",
+            argv[0]);
+    return 1;
+  }
+  const char *goldenDirectory = argc > 2 ? argv[2] : "golden";
+  const char *mainPath = argc > 3 ? argv[3] : "out/mainRelease";
+  if (updates && mkdir(goldenDirectory, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s\n", goldenDirectory);
+    return 1;
+  }
+
+  char scratchDirectory[] = "/tmp/golden_check_XXXXXX";
+  if (!mkdtemp(scratchDirectory)) {
+    fprintf(stderr, "Failed to create a scratch directory\n");
+    return 1;
+  }
+  gRandomScene = randomSceneDescription(kNumRandomSpheres);
+  kViews[2].scene = kMirrorsScene;
+  kViews[3].scene = gRandomScene;
+
+  int numViews = sizeof(kViews) / sizeof(kViews[0]);
+  int numModes = updates ? 1 : sizeof(kModes) / sizeof(kModes[0]);
+  // Per mode, over all views: the product of the speedups, for their
+  // geometric mean, the least speedup and the worst quality.
+  double speedupProducts[sizeof(kModes) / sizeof(kModes[0])];
+  double minSpeedups[sizeof(kModes) / sizeof(kModes[0])];
+  Comparison worst[sizeof(kModes) / sizeof(kModes[0])];
+  bool passes[sizeof(kModes) / sizeof(kModes[0])];
+  for (int m = 0; m < numModes; ++m) {
+    speedupProducts[m] = 1.0;
+    minSpeedups[m] = INFINITY;
+    worst[m] = (Comparison){kIdenticalPSNR, 1.0, 0};
+    passes[m] = true;
+  }
+
+  int result = 0;
+  if (!updates) {
+    printf("{\n  \"results\": [\n");
+  }
+  for (int v = 0; v < numViews && result == 0; ++v) {
+    const View *view = &kViews[v];
+    char sceneFilename[256];
+    if (view->scene) {
+      snprintf(sceneFilename, sizeof(sceneFilename), "%s/%s.scene",
+               scratchDirectory, view->name);
+      FILE *file = fopen(sceneFilename, "w");
+      bool isWritten = file && fputs(view->scene, file) != EOF;
+      if (file && fclose(file) != 0) {
+        isWritten = false;
+      }
+      if (!isWritten) {
+        fprintf(stderr, "Failed to write %s\n", sceneFilename);
+        result = 1;
+        break;
+      }
+    }
+    char goldenFilename[256];
+    snprintf(goldenFilename, sizeof(goldenFilename), "%s/%s.bmp",
+             goldenDirectory, view->name);
+    Image golden = {0};
+    if (!updates && !readBitmap(goldenFilename, &golden)) {
+      fprintf(stderr, "No golden image %s; run %s update first\n",
+              goldenFilename, argv[0]);
+      result = 1;
+      break;
+    }
+
+    double exactSeconds = 0.0;
+    for (int m = 0; m < numModes && result == 0; ++m) {
+      const Mode *mode = &kModes[m];
+      fprintf(stderr, "%s %s\n", view->name, mode->name);
+      char scratchPath[256];
+      char outputFilename[300];
+      snprintf(scratchPath, sizeof(scratchPath), "%s/%s-%s", scratchDirectory,
+               view->name, mode->name);
+      if (updates) {
+        snprintf(outputFilename, sizeof(outputFilename), "%s",
+                 goldenFilename);
+      } else {
+        snprintf(outputFilename, sizeof(outputFilename), "%s.bmp",
+                 scratchPath);
+      }
+      // Caches a mode keeps in the scratch directory are made by the first
+      // run and reused by the rest, as they would be between renders.
+      double best = INFINITY;
+      for (int run = 0; run < (updates ? 1 : kNumRuns); ++run) {
+        double seconds =
+            render(mainPath, view, view->scene ? sceneFilename : NULL, mode,
+                   scratchPath, outputFilename);
+        if (seconds < 0.0) {
+          fprintf(stderr, "Failed to render %s %s with %s\n", view->name,
+                  mode->name, mainPath);
+          result = 1;
+          break;
+        }
+        best = fmin(best, seconds);
+      }
+      if (result != 0 || updates) {
+        continue;
+      }
+      if (m == 0) {
+        exactSeconds = best;
+      }
+
+      Image image;
+      if (!readBitmap(outputFilename, &image) ||
+          image.width != golden.width || image.height != golden.height) {
+        fprintf(stderr, "%s doesn't match %s's size\n", outputFilename,
+                goldenFilename);
+        result = 1;
+        break;
+      }
+      Comparison comparison = compareImages(&image, &golden);
+      free(image.pixels);
+      double speedup = exactSeconds / best;
+      bool isAccepted = comparison.psnr >= mode->minPSNR &&
+                        comparison.ssim >= mode->minSSIM &&
+                        comparison.maxError <= mode->maxError;
+      speedupProducts[m] *= speedup;
+      minSpeedups[m] = fmin(minSpeedups[m], speedup);
+      worst[m].psnr = fmin(worst[m].psnr, comparison.psnr);
+      worst[m].ssim = fmin(worst[m].ssim, comparison.ssim);
+      if (comparison.maxError > worst[m].maxError) {
+        worst[m].maxError = comparison.maxError;
+      }
+      passes[m] = passes[m] && isAccepted;
+      bool isLast = v == numViews - 1 && m == numModes - 1;
+      printf("    {\"view\": \"%s\", \"mode\": \"%s\", \"seconds\": %.6f, "
+             "\"speedup\": %.3f, \"psnr_db\": %.2f, \"ssim\": %.5f, "
+             "\"max_error\": %d, \"pass\": %s}%s\n",
+             view->name, mode->name, best, speedup, comparison.psnr,
+             comparison.ssim, comparison.maxError,
+             isAccepted ? "true" : "false", isLast ? "" : ",");
+    }
+    free(golden.pixels);
+  }
+
+  if (!updates && result == 0) {
+    printf("  ],\n  \"modes\": [\n");
+    for (int m = 0; m < numModes; ++m) {
+      printf("    {\"mode\": \"%s\", \"speedup\": %.3f, \"min_speedup\": "
+             "%.3f, \"min_psnr_db\": %.2f, \"min_ssim\": %.5f, "
+             "\"max_error\": %d, \"pass\": %s}%s\n",
+             kModes[m].name, pow(speedupProducts[m], 1.0 / numViews),
+             minSpeedups[m], worst[m].psnr, worst[m].ssim, worst[m].maxError,
+             passes[m] ? "true" : "false", m == numModes - 1 ? "" : ",");
+      if (!passes[m]) {
+        result = 1;
+      }
+    }
+    printf("  ]\n}\n");
+  }
+  nftw(scratchDirectory, removePath, 16, FTW_DEPTH | FTW_PHYS);
+  free(gRandomScene);
+  return result;
+}
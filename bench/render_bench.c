@@ -0,0 +1,346 @@
+// Times the render kernels on their own and whole frames end to end, and
+// prints the results as JSON so they can be compared across commits:
+//
+//   out/render_bench [path to main] > bench.json
+//
+// Kernels run on the default scene, over the hit points and directions of the
+// default camera's primary rays. Frames are rendered by running the main
+// binary (out/main by default) at several sizes and thread counts, and the
+// best of a few runs is kept. Progress goes to stderr.
+
+#include <fcntl.h>
+#include <math.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../math.h"
+#include "../packet.h"
+#include "../scene.h"
+
+extern char **environ;
+
+static const int kImageSize = 128;
+
+// Kernels run for at least this long.
+static const double kMinKernelSeconds = 0.5;
+
+static const int kFrameSizes[] = {128, 256, 512};
+static const int kNumFrameRuns = 3;
+
+static const Point kCameraPosition = {.x = 0.0f, .y = 0.0f, .z = 0.5f};
+static const Point kLightPosition = {.x = -0.2f, .y = 0.2f, .z = 0.5f};
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// The kernels are plain functions of the scene, so it's a global, and every
+// SDF evaluation goes through a counter.
+static Scene gScene;
+static long gNumSDFEvaluations;
+
+static float countingSDF(Point p) {
+  gNumSDFEvaluations++;
+  return sceneDistance(&gScene, p);
+}
+
+// Keeps the compiler from dropping the kernels' results.
+static volatile float gSink;
+
+typedef struct Inputs {
+  Ray *rays;
+  int numRays;
+  // The points where the rays hit, and their rays' directions.
+  Point *hitPoints;
+  Vector *hitDirections;
+  int numHits;
+} Inputs;
+
+static Inputs makeInputs(void) {
+  Inputs inputs = {.numRays = kImageSize * kImageSize};
+  inputs.rays = malloc(inputs.numRays * sizeof(Ray));
+  inputs.hitPoints = malloc(inputs.numRays * sizeof(Point));
+  inputs.hitDirections = malloc(inputs.numRays * sizeof(Vector));
+  for (int row = 0; row < kImageSize; ++row) {
+    for (int column = 0; column < kImageSize; ++column) {
+      Point target = makePoint(lerp((column + 0.5f) / kImageSize, -0.5, 0.5),
+                               lerp((row + 0.5f) / kImageSize, -0.5, 0.5),
+                               0.0f);
+      Ray ray = makeRay(kCameraPosition,
+                        directionFromPointToPoint(kCameraPosition, target));
+      inputs.rays[row * kImageSize + column] = ray;
+      Point hitPoint;
+      if (rayMarch(ray, countingSDF, kDefaultNumRayMarchSteps, &hitPoint)) {
+        inputs.hitPoints[inputs.numHits] = hitPoint;
+        inputs.hitDirections[inputs.numHits++] = ray.direction;
+      }
+    }
+  }
+  return inputs;
+}
+
+static void freeInputs(Inputs *inputs) {
+  free(inputs->hitDirections);
+  free(inputs->hitPoints);
+  free(inputs->rays);
+}
+
+typedef struct Kernel {
+  const char *name;
+  // What one call works on, for the report: "ray", "point" or "call".
+  const char *unit;
+  // Runs the kernel over the inputs once and returns how many units that was.
+  long (*run)(const Inputs *inputs);
+} Kernel;
+
+static long runSphereSDF(const Inputs *inputs) {
+  float sum = 0.0f;
+  for (int i = 0; i < inputs->numHits; ++i) {
+    sum += sphereSDF(inputs->hitPoints[i], 0.1f);
+  }
+  gSink = sum;
+  return inputs->numHits;
+}
+
+static long runApplyTransform(const Inputs *inputs) {
+  Transform transform = combineTransforms(makeRotationY(0.3f),
+                                          makeRotationX(0.7f));
+  float sum = 0.0f;
+  for (int i = 0; i < inputs->numHits; ++i) {
+    sum += applyTransform(transform, inputs->hitDirections[i]).x;
+  }
+  gSink = sum;
+  return inputs->numHits;
+}
+
+static long runSceneDistance(const Inputs *inputs) {
+  float sum = 0.0f;
+  for (int i = 0; i < inputs->numHits; ++i) {
+    sum += countingSDF(inputs->hitPoints[i]);
+  }
+  gSink = sum;
+  return inputs->numHits;
+}
+
+static long runEvaluateScene(const Inputs *inputs) {
+  int sum = 0;
+  for (int i = 0; i < inputs->numHits; ++i) {
+    sum += evaluateScene(&gScene, inputs->hitPoints[i]).materialId;
+    gNumSDFEvaluations++;
+  }
+  gSink = sum;
+  return inputs->numHits;
+}
+
+static long runSampleScene(const Inputs *inputs) {
+  float sum = 0.0f;
+  for (int i = 0; i < inputs->numHits; ++i) {
+    sum += sampleScene(&gScene, inputs->hitPoints[i]).gradient.x;
+    gNumSDFEvaluations++;
+  }
+  gSink = sum;
+  return inputs->numHits;
+}
+
+static long runNormal(const Inputs *inputs) {
+  float sum = 0.0f;
+  for (int i = 0; i < inputs->numHits; ++i) {
+    sum += normalForPointAndSDF(inputs->hitPoints[i], countingSDF).x;
+  }
+  gSink = sum;
+  return inputs->numHits;
+}
+
+static long runRayMarch(const Inputs *inputs) {
+  int numHits = 0;
+  for (int i = 0; i < inputs->numRays; ++i) {
+    numHits +=
+        rayMarch(inputs->rays[i], countingSDF, kDefaultNumRayMarchSteps, NULL);
+  }
+  gSink = numHits;
+  return inputs->numRays;
+}
+
+static long runRayMarchPackets(const Inputs *inputs) {
+  bool *hits = malloc(inputs->numRays * sizeof(bool));
+  Point *points = malloc(inputs->numRays * sizeof(Point));
+  rayMarchPackets(detectPacketBackend(), &gScene, NULL, inputs->rays,
+                  inputs->numRays, kDefaultNumRayMarchSteps, NULL, hits,
+                  points);
+  gSink = hits[inputs->numRays / 2];
+  free(points);
+  free(hits);
+  return inputs->numRays;
+}
+
+static long runSoftShadow(const Inputs *inputs) {
+  float sum = 0.0f;
+  for (int i = 0; i < inputs->numHits; ++i) {
+    Point point = inputs->hitPoints[i];
+    Vector toLight = directionFromPointToPoint(point, kLightPosition);
+    sum += softShadow(addVectorToPoint(point, toLight, 0.01), kLightPosition,
+                      countingSDF, 8.0);
+  }
+  gSink = sum;
+  return inputs->numHits;
+}
+
+static long runConductiveReflectance(const Inputs *inputs) {
+  const Color gold = makeColor(0.183, 0.421, 1.373);
+  const Color goldExtinction = makeColor(3.424, 2.346, 1.770);
+  float sum = 0.0f;
+  for (int i = 0; i < inputs->numHits; ++i) {
+    float angle = acosf(-inputs->hitDirections[i].z) * 0.5f;
+    sum += conductiveReflectance2(gold, goldExtinction, angle).g;
+  }
+  gSink = sum;
+  return inputs->numHits;
+}
+
+static const Kernel kKernels[] = {
+    {"sphereSDF", "call", runSphereSDF},
+    {"applyTransform", "call", runApplyTransform},
+    {"sceneDistance", "point", runSceneDistance},
+    {"evaluateScene", "point", runEvaluateScene},
+    {"sampleScene", "point", runSampleScene},
+    {"normalForPointAndSDF", "point", runNormal},
+    {"rayMarch", "ray", runRayMarch},
+    {"rayMarchPackets", "ray", runRayMarchPackets},
+    {"softShadow", "ray", runSoftShadow},
+    {"conductiveReflectance2", "call", runConductiveReflectance},
+};
+
+static void benchmarkKernel(const Kernel *kernel, const Inputs *inputs,
+                            bool isLast) {
+  fprintf(stderr, "kernel %s\n", kernel->name);
+  long numUnits = 0;
+  int numRuns = 0;
+  gNumSDFEvaluations = 0;
+  double start = now();
+  double elapsed;
+  do {
+    numUnits += kernel->run(inputs);
+    numRuns++;
+    elapsed = now() - start;
+  } while (elapsed < kMinKernelSeconds);
+  // rayMarchPackets() evaluates the scene itself, so count its evaluations
+  // with the scalar marcher, which takes the same steps.
+  long numSDFEvaluations = gNumSDFEvaluations;
+  if (kernel->run == runRayMarchPackets) {
+    gNumSDFEvaluations = 0;
+    runRayMarch(inputs);
+    numSDFEvaluations = gNumSDFEvaluations * numRuns;
+  }
+  printf("    {\"name\": \"%s\", \"unit\": \"%s\", \"count\": %ld, "
+         "\"seconds\": %.6f, \"ns_per_%s\": %.2f, \"%ss_per_sec\": %.0f, "
+         "\"sdf_evaluations_per_sec\": %.0f}%s\n",
+         kernel->name, kernel->unit, numUnits, elapsed, kernel->unit,
+         elapsed / numUnits * 1e9, kernel->unit, numUnits / elapsed,
+         numSDFEvaluations / elapsed, isLast ? "" : ",");
+}
+
+// Runs the renderer once. Returns its wall-clock time, or a negative number
+// if it failed.
+static double renderFrame(const char *mainPath, int size, int numThreads,
+                          const char *outputFilename) {
+  char sizeArg[16];
+  char threadsArg[16];
+  snprintf(sizeArg, sizeof(sizeArg), "%d", size);
+  snprintf(threadsArg, sizeof(threadsArg), "%d", numThreads);
+  char *const argv[] = {(char *)mainPath, "-q",       "low",
+                        "-W",             sizeArg,    "-H",
+                        sizeArg,          "-j",       threadsArg,
+                        "-o",             (char *)outputFilename, NULL};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  double start = now();
+  pid_t pid;
+  int error = posix_spawn(&pid, mainPath, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error != 0) {
+    return -1.0;
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    return -1.0;
+  }
+  return now() - start;
+}
+
+// Prints a frame result, or returns false if the renderer couldn't be run.
+static bool benchmarkFrame(const char *mainPath, int size, int numThreads,
+                           bool isLast) {
+  fprintf(stderr, "frame %dx%d, %d threads\n", size, size, numThreads);
+  char outputFilename[64];
+  snprintf(outputFilename, sizeof(outputFilename), "/tmp/render_bench_%d.bmp",
+           (int)getpid());
+  double best = INFINITY;
+  for (int run = 0; run < kNumFrameRuns; ++run) {
+    double seconds = renderFrame(mainPath, size, numThreads, outputFilename);
+    if (seconds < 0.0) {
+      fprintf(stderr, "Failed to run %s\n", mainPath);
+      return false;
+    }
+    best = min(best, seconds);
+  }
+  unlink(outputFilename);
+  // The low preset casts a 4x4 grid of primary rays per pixel.
+  long numPixels = (long)size * size;
+  long numPrimaryRays = numPixels * 16;
+  printf("    {\"width\": %d, \"height\": %d, \"threads\": %d, "
+         "\"seconds\": %.6f, \"ns_per_pixel\": %.2f, "
+         "\"primary_rays_per_sec\": %.0f}%s\n",
+         size, size, numThreads, best, best / numPixels * 1e9,
+         numPrimaryRays / best, isLast ? "" : ",");
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *mainPath = argc > 1 ? argv[1] : "out/main";
+  if (parseScene(kDefaultSceneDescription, "default scene", &gScene) != 0) {
+    return 1;
+  }
+  Inputs inputs = makeInputs();
+  int numCores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threadCounts[] = {1, numCores};
+  int numThreadCounts = numCores > 1 ? 2 : 1;
+
+  printf("{\n");
+  printf("  \"packet_backend\": \"%s\",\n",
+         packetBackendName(detectPacketBackend()));
+  printf("  \"cores\": %d,\n", numCores);
+  printf("  \"kernels\": [\n");
+  int numKernels = sizeof(kKernels) / sizeof(kKernels[0]);
+  for (int k = 0; k < numKernels; ++k) {
+    benchmarkKernel(&kKernels[k], &inputs, k == numKernels - 1);
+  }
+  printf("  ],\n");
+  printf("  \"frames\": [\n");
+  int numSizes = sizeof(kFrameSizes) / sizeof(kFrameSizes[0]);
+  int result = 0;
+  for (int s = 0; s < numSizes && result == 0; ++s) {
+    for (int t = 0; t < numThreadCounts && result == 0; ++t) {
+      bool isLast = s == numSizes - 1 && t == numThreadCounts - 1;
+      if (!benchmarkFrame(mainPath, kFrameSizes[s], threadCounts[t],
+                          isLast)) {
+        result = 1;
+      }
+    }
+  }
+  printf("  ]\n");
+  printf("}\n");
+
+  freeInputs(&inputs);
+  freeScene(&gScene);
+  return result;
+}
@@ -1,9 +1,14 @@
 #include "bitmap.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #pragma pack(push, 1)
 typedef struct {
@@ -33,41 +38,166 @@ Pixel makePixel(uint8_t r, uint8_t g, uint8_t b) {
   return (Pixel){.r = r, .g = g, .b = b};
 }
 
-int writeBitmap(Pixel *pixels, int imageWidth, int imageHeight,
-                const char *filename) {
-  int numPixels = imageWidth * imageHeight;
+struct BitmapFile {
+  int fd;
+  int imageWidth;
+  int imageHeight;
+  // Rows are padded to a multiple of 4 bytes.
+  size_t rowSize;
+  // The errno of the first write that failed, or 0.
+  atomic_int writeError;
+};
 
-  BitmapFileHeader header;
-  header.magic = *((uint16_t *)"BM");
-  header.fileSize = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) +
-                    sizeof(Pixel) * numPixels;
-  header.reserved1 = 0;
-  header.reserved2 = 0;
-  header.pixelsOffset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+static size_t paddedRowSize(int imageWidth) {
+  return ((size_t)imageWidth * sizeof(Pixel) + 3) & ~(size_t)3;
+}
+
+static const size_t kPixelsOffset =
+    sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+
+// Writes all of buffer at offset, retrying short writes. Returns an errno
+// value, or 0 on success.
+static int writeFully(int fd, const void *buffer, size_t size, off_t offset) {
+  const char *bytes = buffer;
+  while (size > 0) {
+    ssize_t numWritten = pwrite(fd, bytes, size, offset);
+    if (numWritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    bytes += numWritten;
+    size -= numWritten;
+    offset += numWritten;
+  }
+  return 0;
+}
+
+// Fills in the headers of an imageWidth x imageHeight bitmap. Returns false if
+// the image is too large for the format.
+static bool fillBitmapHeaders(int imageWidth, int imageHeight,
+                              BitmapFileHeader *header,
+                              BitmapInfoHeader *coreHeader) {
+  size_t imageSize = paddedRowSize(imageWidth) * imageHeight;
+  if (imageSize > UINT32_MAX - kPixelsOffset) {
+    printf("Image is too large for a bitmap: %dx%d\n", imageWidth,
+           imageHeight);
+    return false;
+  }
+
+  header->magic = *((uint16_t *)"BM");
+  header->fileSize = kPixelsOffset + imageSize;
+  header->reserved1 = 0;
+  header->reserved2 = 0;
+  header->pixelsOffset = kPixelsOffset;
 
+  coreHeader->headerSize = sizeof(BitmapInfoHeader);
+  coreHeader->bitmapWidth = imageWidth;
+  coreHeader->bitmapHeight = imageHeight;
+  coreHeader->numColorPlanes = 1;
+  coreHeader->numBitsPerPixel = sizeof(Pixel) * CHAR_BIT;
+  coreHeader->compressionMethod = 0;
+  coreHeader->imageSize = imageSize;
+  coreHeader->horizontalResolution = 0;
+  coreHeader->verticalResolution = 0;
+  coreHeader->numColorPaletteColors = 0;
+  coreHeader->numImportantColorsUsed = 0;
+  return true;
+}
+
+BitmapFile *createBitmapFile(const char *filename, int imageWidth,
+                             int imageHeight) {
+  BitmapFileHeader header;
   BitmapInfoHeader coreHeader;
-  coreHeader.headerSize = sizeof(BitmapInfoHeader);
-  coreHeader.bitmapWidth = imageWidth;
-  coreHeader.bitmapHeight = imageHeight;
-  coreHeader.numColorPlanes = 1;
-  coreHeader.numBitsPerPixel = sizeof(Pixel) * CHAR_BIT;
-  coreHeader.compressionMethod = 0;
-  coreHeader.imageSize = sizeof(Pixel) * numPixels;
-  coreHeader.horizontalResolution = 0;
-  coreHeader.verticalResolution = 0;
-  coreHeader.numColorPaletteColors = 0;
-  coreHeader.numImportantColorsUsed = 0;
-
-  FILE *imageFile = fopen(filename, "w+");
-  if (!imageFile) {
+  if (!fillBitmapHeaders(imageWidth, imageHeight, &header, &coreHeader)) {
+    return NULL;
+  }
+
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
     printf("Failed to open image file: %d (%s)\n", errno, strerror(errno));
-    return 1;
+    return NULL;
+  }
+  // Size the file up front, so rows can land in any order and the padding
+  // reads back as zeros.
+  int error = ftruncate(fd, header.fileSize) != 0 ? errno : 0;
+  if (!error) {
+    error = writeFully(fd, &header, sizeof(header), 0);
+  }
+  if (!error) {
+    error = writeFully(fd, &coreHeader, sizeof(coreHeader), sizeof(header));
+  }
+  if (error) {
+    printf("Failed to write image file: %d (%s)\n", error, strerror(error));
+    close(fd);
+    return NULL;
   }
 
-  fwrite(&header, sizeof(BitmapFileHeader), 1, imageFile);
-  fwrite(&coreHeader, sizeof(BitmapInfoHeader), 1, imageFile);
-  fwrite(pixels, sizeof(Pixel), numPixels, imageFile);
-  fclose(imageFile);
+  BitmapFile *file = calloc(1, sizeof(BitmapFile));
+  file->fd = fd;
+  file->imageWidth = imageWidth;
+  file->imageHeight = imageHeight;
+  file->rowSize = paddedRowSize(imageWidth);
+  atomic_init(&file->writeError, 0);
+  return file;
+}
 
+void writeBitmapPixels(BitmapFile *file, int row, int column,
+                       const Pixel *pixels, int numPixels) {
+  off_t offset =
+      kPixelsOffset + (off_t)row * file->rowSize + column * sizeof(Pixel);
+  int error = writeFully(file->fd, pixels, numPixels * sizeof(Pixel), offset);
+  if (error) {
+    int noError = 0;
+    atomic_compare_exchange_strong(&file->writeError, &noError, error);
+  }
+}
+
+int closeBitmapFile(BitmapFile *file) {
+  int error = atomic_load(&file->writeError);
+  if (close(file->fd) != 0 && !error) {
+    error = errno;
+  }
+  free(file);
+  if (error) {
+    printf("Failed to write image file: %d (%s)\n", error, strerror(error));
+    return 1;
+  }
   return 0;
-}
\ No newline at end of file
+}
+
+int writeBitmap(const Pixel *pixels, int imageWidth, int imageHeight,
+                const char *filename) {
+  BitmapFile *file = createBitmapFile(filename, imageWidth, imageHeight);
+  if (!file) {
+    return 1;
+  }
+  for (int row = 0; row < imageHeight; ++row) {
+    writeBitmapPixels(file, row, 0, &pixels[(size_t)row * imageWidth],
+                      imageWidth);
+  }
+  return closeBitmapFile(file);
+}
+
+uint8_t *encodeBitmap(const Pixel *pixels, int imageWidth, int imageHeight,
+                      size_t *size) {
+  BitmapFileHeader header;
+  BitmapInfoHeader coreHeader;
+  if (!fillBitmapHeaders(imageWidth, imageHeight, &header, &coreHeader)) {
+    return NULL;
+  }
+  uint8_t *bytes = calloc(header.fileSize, 1);
+  if (!bytes) {
+    return NULL;
+  }
+  memcpy(bytes, &header, sizeof(header));
+  memcpy(bytes + sizeof(header), &coreHeader, sizeof(coreHeader));
+  size_t rowSize = paddedRowSize(imageWidth);
+  for (int row = 0; row < imageHeight; ++row) {
+    memcpy(bytes + kPixelsOffset + row * rowSize,
+           &pixels[(size_t)row * imageWidth], imageWidth * sizeof(Pixel));
+  }
+  *size = header.fileSize;
+  return bytes;
+}
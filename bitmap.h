@@ -1,6 +1,7 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct Pixel {
@@ -11,7 +12,30 @@ typedef struct Pixel {
 
 Pixel makePixel(uint8_t r, uint8_t g, uint8_t b);
 
-int writeBitmap(Pixel *pixels, int imageWidth, int imageHeight,
+// A bitmap file being written a piece at a time, in any order and from any
+// number of threads. Row 0 is the bottom row of the image.
+typedef struct BitmapFile BitmapFile;
+
+// Creates filename and sizes it for the whole image up front. Returns NULL on
+// failure.
+BitmapFile *createBitmapFile(const char *filename, int imageWidth,
+                             int imageHeight);
+
+// Writes numPixels pixels into a row, starting at column. Failures are
+// reported by closeBitmapFile().
+void writeBitmapPixels(BitmapFile *file, int row, int column,
+                       const Pixel *pixels, int numPixels);
+
+// Closes the file. Returns 1 if it or any earlier write failed.
+int closeBitmapFile(BitmapFile *file);
+
+// Writes a whole image of imageWidth x imageHeight pixels, bottom row first.
+int writeBitmap(const Pixel *pixels, int imageWidth, int imageHeight,
                 const char *filename);
 
+// writeBitmap() into memory. Returns the file's bytes, which the caller frees,
+// or NULL on failure.
+uint8_t *encodeBitmap(const Pixel *pixels, int imageWidth, int imageHeight,
+                      size_t *size);
+
 #endif /* BITMAP_H */
\ No newline at end of file
@@ -0,0 +1,328 @@
+#include "brickmap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define kBrickMapVersion 1
+
+#define kNumBricks \
+  (kBrickMapBricksPerAxis * kBrickMapBricksPerAxis * kBrickMapBricksPerAxis)
+#define kVoxelsPerAxis (kBrickMapBricksPerAxis * kBrickMapVoxelsPerBrick)
+#define kBrickSamplesPerAxis (kBrickMapVoxelsPerBrick + 1)
+#define kSamplesPerBrick \
+  (kBrickSamplesPerAxis * kBrickSamplesPerAxis * kBrickSamplesPerAxis)
+
+// Brick slots that don't refer to a near brick.
+enum {
+  // Nothing within the band: the distance is bounded from the center sample.
+  kBrickFar = -1,
+  // Deep inside a primitive. Rays never get here, so there's nothing to gain
+  // from caching it.
+  kBrickInside = -2,
+};
+
+static const float kVoxelSize = 1.0f / kVoxelsPerAxis;
+static const float kBrickSize = 1.0f / kBrickMapBricksPerAxis;
+
+// The distance field is 1-Lipschitz, so a sample is within a voxel diagonal of
+// the distance anywhere in the voxel, and so is any blend of the voxel's
+// corner samples. The padding covers the rounding in the blend.
+#define kVoxelDiagonal (1.7320508f * kVoxelSize)
+#define kInterpolationMargin (kVoxelDiagonal * 1.001f + 1e-6f)
+
+// Lookups closer than this to a surface use the exact distance.
+#define kExactBand (0.5f * kVoxelDiagonal)
+
+typedef struct BrickMapHeader {
+  char magic[8];
+  uint64_t sceneHash;
+  uint32_t version;
+  uint32_t bricksPerAxis;
+  uint32_t voxelsPerBrick;
+  uint32_t numNearBricks;
+} BrickMapHeader;
+
+static const char kBrickMapMagic[8] = "SDFBRICK";
+
+// FNV-1a over the tape. Instructions are zeroed before they're filled in, so
+// the padding hashes the same every time.
+static uint64_t sceneGeometryHash(const Scene *scene) {
+  const uint8_t *bytes = (const uint8_t *)scene->tape;
+  size_t size = scene->tapeLength * sizeof(SceneInstruction);
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static size_t dataSizeForBricks(int numNearBricks) {
+  return sizeof(BrickMapHeader) + kNumBricks * sizeof(int32_t) +
+         kNumBricks * sizeof(float) +
+         (size_t)numNearBricks * kSamplesPerBrick * sizeof(float);
+}
+
+// Points the map's arrays into its data, which starts with a valid header.
+static void attachData(BrickMap *map, void *data, size_t dataSize,
+                       bool isMapped) {
+  const BrickMapHeader *header = data;
+  map->sceneHash = header->sceneHash;
+  map->numNearBricks = header->numNearBricks;
+  map->brickSlots = (const int32_t *)(header + 1);
+  map->centerDistances = (const float *)(map->brickSlots + kNumBricks);
+  map->samples = map->centerDistances + kNumBricks;
+  map->data = data;
+  map->dataSize = dataSize;
+  map->isMapped = isMapped;
+}
+
+static Point brickCenter(int brick) {
+  int x = brick % kBrickMapBricksPerAxis;
+  int y = brick / kBrickMapBricksPerAxis % kBrickMapBricksPerAxis;
+  int z = brick / (kBrickMapBricksPerAxis * kBrickMapBricksPerAxis);
+  return makePoint(-0.5f + (x + 0.5f) * kBrickSize,
+                   -0.5f + (y + 0.5f) * kBrickSize,
+                   -0.5f + (z + 0.5f) * kBrickSize);
+}
+
+typedef struct BakeJob {
+  const Scene *scene;
+  int32_t *brickSlots;
+  float *centerDistances;
+  // The bricks with samples, in slot order.
+  int *nearBricks;
+  float *samples;
+} BakeJob;
+
+static void classifyBrick(int brick, void *context) {
+  BakeJob *job = context;
+  float distance = sceneDistance(job->scene, brickCenter(brick));
+  float halfDiagonal = 0.5f * 1.7320508f * kBrickSize;
+  job->centerDistances[brick] = distance;
+  if (distance - halfDiagonal >= kExactBand) {
+    job->brickSlots[brick] = kBrickFar;
+  } else if (distance + halfDiagonal <= -kExactBand) {
+    job->brickSlots[brick] = kBrickInside;
+  } else {
+    job->brickSlots[brick] = 0;
+  }
+}
+
+static void sampleBrick(int slot, void *context) {
+  BakeJob *job = context;
+  int brick = job->nearBricks[slot];
+  int x0 = brick % kBrickMapBricksPerAxis * kBrickMapVoxelsPerBrick;
+  int y0 = brick / kBrickMapBricksPerAxis % kBrickMapBricksPerAxis *
+           kBrickMapVoxelsPerBrick;
+  int z0 = brick / (kBrickMapBricksPerAxis * kBrickMapBricksPerAxis) *
+           kBrickMapVoxelsPerBrick;
+  float *samples = job->samples + (size_t)slot * kSamplesPerBrick;
+  for (int z = 0; z < kBrickSamplesPerAxis; ++z) {
+    for (int y = 0; y < kBrickSamplesPerAxis; ++y) {
+      for (int x = 0; x < kBrickSamplesPerAxis; ++x) {
+        Point p = makePoint(-0.5f + (x0 + x) * kVoxelSize,
+                            -0.5f + (y0 + y) * kVoxelSize,
+                            -0.5f + (z0 + z) * kVoxelSize);
+        *samples++ = sceneDistance(job->scene, p);
+      }
+    }
+  }
+}
+
+BrickMap *bakeBrickMap(const Scene *scene, TilePool *pool) {
+  BakeJob job = {.scene = scene,
+                 .brickSlots = malloc(kNumBricks * sizeof(int32_t)),
+                 .centerDistances = malloc(kNumBricks * sizeof(float)),
+                 .nearBricks = malloc(kNumBricks * sizeof(int))};
+  runTasks(pool, kNumBricks, classifyBrick, &job);
+
+  int numNearBricks = 0;
+  for (int brick = 0; brick < kNumBricks; ++brick) {
+    if (job.brickSlots[brick] >= 0) {
+      job.nearBricks[numNearBricks] = brick;
+      job.brickSlots[brick] = numNearBricks++;
+    }
+  }
+
+  size_t dataSize = dataSizeForBricks(numNearBricks);
+  BrickMapHeader *header = malloc(dataSize);
+  if (!header) {
+    printf("Failed to allocate %zu bytes for the brick map\n", dataSize);
+    free(job.nearBricks);
+    free(job.centerDistances);
+    free(job.brickSlots);
+    return NULL;
+  }
+  memcpy(header->magic, kBrickMapMagic, sizeof(header->magic));
+  header->sceneHash = sceneGeometryHash(scene);
+  header->version = kBrickMapVersion;
+  header->bricksPerAxis = kBrickMapBricksPerAxis;
+  header->voxelsPerBrick = kBrickMapVoxelsPerBrick;
+  header->numNearBricks = numNearBricks;
+  BrickMap *map = calloc(1, sizeof(BrickMap));
+  attachData(map, header, dataSize, false);
+  memcpy((void *)map->brickSlots, job.brickSlots,
+         kNumBricks * sizeof(int32_t));
+  memcpy((void *)map->centerDistances, job.centerDistances,
+         kNumBricks * sizeof(float));
+  job.samples = (float *)map->samples;
+  runTasks(pool, numNearBricks, sampleBrick, &job);
+
+  free(job.nearBricks);
+  free(job.centerDistances);
+  free(job.brickSlots);
+  return map;
+}
+
+int saveBrickMap(const BrickMap *map, const char *filename) {
+  // Write next to the destination and rename, so renders mapping the old file
+  // never see a partial one.
+  size_t pathSize = strlen(filename) + sizeof(".tmp");
+  char *tempFilename = malloc(pathSize);
+  snprintf(tempFilename, pathSize, "%s.tmp", filename);
+  FILE *file = fopen(tempFilename, "wb");
+  if (!file) {
+    printf("Failed to create brick map file: %d (%s)\n", errno,
+           strerror(errno));
+    free(tempFilename);
+    return 1;
+  }
+  size_t numWritten = fwrite(map->data, 1, map->dataSize, file);
+  int closeResult = fclose(file);
+  if (numWritten != map->dataSize || closeResult != 0 ||
+      rename(tempFilename, filename) != 0) {
+    printf("Failed to write brick map file: %d (%s)\n", errno,
+           strerror(errno));
+    unlink(tempFilename);
+    free(tempFilename);
+    return 1;
+  }
+  free(tempFilename);
+  return 0;
+}
+
+BrickMap *loadBrickMap(const char *filename, const Scene *scene) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      printf("Failed to open brick map file: %d (%s)\n", errno,
+             strerror(errno));
+    }
+    return NULL;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 ||
+      (size_t)status.st_size < sizeof(BrickMapHeader)) {
+    close(fd);
+    printf("%s: not a brick map, rebaking\n", filename);
+    return NULL;
+  }
+  size_t dataSize = status.st_size;
+  void *data = mmap(NULL, dataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    printf("Failed to map brick map file: %d (%s)\n", errno, strerror(errno));
+    return NULL;
+  }
+
+  const BrickMapHeader *header = data;
+  if (memcmp(header->magic, kBrickMapMagic, sizeof(header->magic)) != 0 ||
+      header->version != kBrickMapVersion ||
+      header->bricksPerAxis != kBrickMapBricksPerAxis ||
+      header->voxelsPerBrick != kBrickMapVoxelsPerBrick ||
+      dataSizeForBricks(header->numNearBricks) != dataSize ||
+      header->sceneHash != sceneGeometryHash(scene)) {
+    munmap(data, dataSize);
+    printf("%s: baked from a different scene or version, rebaking\n",
+           filename);
+    return NULL;
+  }
+  BrickMap *map = calloc(1, sizeof(BrickMap));
+  attachData(map, data, dataSize, true);
+  return map;
+}
+
+void freeBrickMap(BrickMap *map) {
+  if (!map) {
+    return;
+  }
+  if (map->isMapped) {
+    munmap(map->data, map->dataSize);
+  } else {
+    free(map->data);
+  }
+  free(map);
+}
+
+float brickMapBound(const BrickMap *map, Point p) {
+  float u = (p.x + 0.5f) * kVoxelsPerAxis;
+  float v = (p.y + 0.5f) * kVoxelsPerAxis;
+  float w = (p.z + 0.5f) * kVoxelsPerAxis;
+  // Written so that NaNs fail too.
+  if (!(u >= 0.0f && u < kVoxelsPerAxis && v >= 0.0f && v < kVoxelsPerAxis &&
+        w >= 0.0f && w < kVoxelsPerAxis)) {
+    return -1.0f;
+  }
+  int x = (int)u;
+  int y = (int)v;
+  int z = (int)w;
+  int brick = ((z / kBrickMapVoxelsPerBrick) * kBrickMapBricksPerAxis +
+               y / kBrickMapVoxelsPerBrick) *
+                  kBrickMapBricksPerAxis +
+              x / kBrickMapVoxelsPerBrick;
+  int32_t slot = map->brickSlots[brick];
+  if (slot == kBrickFar) {
+    // The field is 1-Lipschitz, so this stays at least kExactBand.
+    Point center = brickCenter(brick);
+    return map->centerDistances[brick] -
+           pointDistanceFromOrigin(makePoint(p.x - center.x, p.y - center.y,
+                                             p.z - center.z));
+  }
+  if (slot == kBrickInside) {
+    return -1.0f;
+  }
+
+  int lx = x % kBrickMapVoxelsPerBrick;
+  int ly = y % kBrickMapVoxelsPerBrick;
+  int lz = z % kBrickMapVoxelsPerBrick;
+  float tx = u - x;
+  float ty = v - y;
+  float tz = w - z;
+  const float *s = map->samples + (size_t)slot * kSamplesPerBrick +
+                   (lz * kBrickSamplesPerAxis + ly) * kBrickSamplesPerAxis + lx;
+  const int dy = kBrickSamplesPerAxis;
+  const int dz = kBrickSamplesPerAxis * kBrickSamplesPerAxis;
+  float s00 = s[0] + (s[1] - s[0]) * tx;
+  float s10 = s[dy] + (s[dy + 1] - s[dy]) * tx;
+  float s01 = s[dz] + (s[dz + 1] - s[dz]) * tx;
+  float s11 = s[dz + dy] + (s[dz + dy + 1] - s[dz + dy]) * tx;
+  float s0 = s00 + (s10 - s00) * ty;
+  float s1 = s01 + (s11 - s01) * ty;
+  float bound = s0 + (s1 - s0) * tz - kInterpolationMargin;
+  if (bound < kExactBand) {
+    return -1.0f;
+  }
+  return bound;
+}
+
+float brickMapDistance(const BrickMap *map, const Scene *scene, Point p) {
+  float bound = brickMapBound(map, p);
+  if (bound < 0.0f) {
+    return sceneDistance(scene, p);
+  }
+  return bound;
+}
+
+size_t brickMapMemorySize(const BrickMap *map) { return map->dataSize; }
+
+size_t brickMapDenseMemorySize(void) {
+  return (size_t)(kVoxelsPerAxis + 1) * (kVoxelsPerAxis + 1) *
+         (kVoxelsPerAxis + 1) * sizeof(float);
+}
@@ -0,0 +1,69 @@
+#ifndef BRICKMAP_H
+#define BRICKMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "math.h"
+#include "pool.h"
+#include "scene.h"
+
+// The map covers the 1x1x1 cube centered at the origin that the scene lives
+// in, split into kBrickMapBricksPerAxis^3 bricks of kBrickMapVoxelsPerBrick^3
+// voxels each.
+#define kBrickMapBricksPerAxis 32
+#define kBrickMapVoxelsPerBrick 8
+
+// A sparse sampling of a scene's distance field. Bricks that come near a
+// surface store the distance at every voxel corner; the rest store only the
+// distance at their center. Lookups return a lower bound on the distance, so
+// sphere tracing with them never oversteps, and switch to the exact scene
+// distance within a narrow band around surfaces, so intersections are still
+// found with the exact field.
+//
+// The map's memory has the same layout as its file, so a saved map is loaded
+// by mapping the file rather than reading it.
+typedef struct BrickMap {
+  uint64_t sceneHash;
+  int numNearBricks;
+  // For every brick, its index among the near bricks, or one of the negative
+  // kinds in brickmap.c.
+  const int32_t *brickSlots;
+  // The scene distance at the center of every brick.
+  const float *centerDistances;
+  // (kBrickMapVoxelsPerBrick + 1)^3 samples per near brick, x fastest.
+  const float *samples;
+
+  void *data;
+  size_t dataSize;
+  bool isMapped;
+} BrickMap;
+
+// Samples the scene's distance field on the pool's threads. Returns NULL if
+// the scene can't be cached.
+BrickMap *bakeBrickMap(const Scene *scene, TilePool *pool);
+
+// Writes the map to a file. Returns 1 on failure.
+int saveBrickMap(const BrickMap *map, const char *filename);
+
+// Maps a map saved by saveBrickMap(). Returns NULL if the file doesn't exist,
+// can't be read or was baked from a different scene.
+BrickMap *loadBrickMap(const char *filename, const Scene *scene);
+
+void freeBrickMap(BrickMap *map);
+
+// A lower bound on sceneDistance(scene, p), which is exact near surfaces and
+// outside the map's cube. scene must be the scene the map was baked from.
+float brickMapDistance(const BrickMap *map, const Scene *scene, Point p);
+
+// brickMapDistance() where the map bounds the distance by itself, and -1
+// where it would evaluate the scene instead.
+float brickMapBound(const BrickMap *map, Point p);
+
+// The bytes the map occupies and the bytes a dense grid with the same
+// resolution would.
+size_t brickMapMemorySize(const BrickMap *map);
+size_t brickMapDenseMemorySize(void);
+
+#endif /* BRICKMAP_H */
@@ -0,0 +1,226 @@
+#include "bvh.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Leaves hold at most this many primitives.
+#define kMaxLeafPrimitives 4
+
+typedef struct BVHItem {
+  float center[3];
+  float radius;
+  int instruction;
+  float sortKey;
+} BVHItem;
+
+// The world-space bounding sphere of a sphere instruction. A sphere in a frame
+// is centered where M * (p + frameOffset) + sphereOffset = 0, i.e. at
+// p = M^T * -sphereOffset - frameOffset, since M is a rotation.
+static BVHItem sphereItem(const Scene *scene, const int *frameInstructions,
+                          int instructionIndex) {
+  const SceneInstruction *sphere = &scene->tape[instructionIndex];
+  double center[3] = {-sphere->translation[0], -sphere->translation[1],
+                      -sphere->translation[2]};
+  if (sphere->frame != 0) {
+    const SceneInstruction *frame =
+        &scene->tape[frameInstructions[sphere->frame]];
+    const Transform *m = &frame->transform;
+    double rotated[3] = {
+        m->a * center[0] + m->d * center[1] + m->g * center[2],
+        m->b * center[0] + m->e * center[1] + m->h * center[2],
+        m->c * center[0] + m->f * center[1] + m->i * center[2],
+    };
+    for (int i = 0; i < 3; ++i) {
+      center[i] = rotated[i] - frame->translation[i];
+    }
+  }
+  // Pad the radius so float rounding in the sphere's own evaluation can't take
+  // it below its node's lower bound.
+  float radius = fabsf(sphere->radius);
+  BVHItem item = {.radius = radius + 1e-5f * (1.0f + radius),
+                  .instruction = instructionIndex};
+  for (int i = 0; i < 3; ++i) {
+    item.center[i] = center[i];
+  }
+  return item;
+}
+
+static int compareItems(const void *a, const void *b) {
+  float ka = ((const BVHItem *)a)->sortKey;
+  float kb = ((const BVHItem *)b)->sortKey;
+  return (ka > kb) - (ka < kb);
+}
+
+// Builds the subtree over items[0, count) and returns its root's index.
+// primitivesOffset is the position of items[0] in bvh->primitives.
+static int buildNode(BVH *bvh, BVHItem *items, int count,
+                     int primitivesOffset) {
+  int nodeIndex = bvh->numNodes++;
+  BVHNode *node = &bvh->nodes[nodeIndex];
+  node->radius = 0.0f;
+  for (int axis = 0; axis < 3; ++axis) {
+    node->lower[axis] = INFINITY;
+    node->upper[axis] = -INFINITY;
+  }
+  for (int i = 0; i < count; ++i) {
+    const BVHItem *item = &items[i];
+    for (int axis = 0; axis < 3; ++axis) {
+      node->lower[axis] = min(node->lower[axis], item->center[axis]);
+      node->upper[axis] = max(node->upper[axis], item->center[axis]);
+    }
+    node->radius = max(node->radius, item->radius);
+  }
+
+  if (count <= kMaxLeafPrimitives) {
+    node->first = primitivesOffset;
+    node->count = count;
+    for (int i = 0; i < count; ++i) {
+      bvh->primitives[primitivesOffset + i] = items[i].instruction;
+    }
+    return nodeIndex;
+  }
+
+  // Split at the median along the axis where the centers spread the most.
+  int splitAxis = 0;
+  for (int axis = 1; axis < 3; ++axis) {
+    if (node->upper[axis] - node->lower[axis] >
+        node->upper[splitAxis] - node->lower[splitAxis]) {
+      splitAxis = axis;
+    }
+  }
+  for (int i = 0; i < count; ++i) {
+    items[i].sortKey = items[i].center[splitAxis];
+  }
+  qsort(items, count, sizeof(BVHItem), compareItems);
+  int numLeft = count / 2;
+  buildNode(bvh, items, numLeft, primitivesOffset);
+  // The node array is allocated up front, so node is still valid.
+  node->first = buildNode(bvh, items + numLeft, count - numLeft,
+                          primitivesOffset + numLeft);
+  node->count = 0;
+  return nodeIndex;
+}
+
+void buildSceneBVH(Scene *scene) {
+  freeSceneBVH(scene);
+  BVH *bvh = calloc(1, sizeof(BVH));
+  bvh->unbounded = malloc(scene->tapeLength * sizeof(int));
+  bvh->primitives = malloc(scene->tapeLength * sizeof(int));
+  BVHItem *items = malloc(scene->tapeLength * sizeof(BVHItem));
+
+  int frameInstructions[kMaxSceneFrames] = {0};
+  int numItems = 0;
+  for (int i = 0; i < scene->tapeLength; ++i) {
+    const SceneInstruction *instruction = &scene->tape[i];
+    if (instruction->op == kSceneOpFrame) {
+      frameInstructions[instruction->frame] = i;
+    }
+    if (instruction->op == kSceneOpSphere) {
+      items[numItems++] = sphereItem(scene, frameInstructions, i);
+    } else {
+      bvh->unbounded[bvh->numUnbounded++] = i;
+    }
+  }
+
+  // A binary tree with at least one primitive per leaf has fewer than twice as
+  // many nodes as primitives.
+  bvh->nodes = malloc((2 * numItems + 1) * sizeof(BVHNode));
+  if (numItems > 0) {
+    buildNode(bvh, items, numItems, 0);
+  }
+  free(items);
+  scene->bvh = bvh;
+}
+
+void freeSceneBVH(Scene *scene) {
+  BVH *bvh = scene->bvh;
+  if (!bvh) {
+    return;
+  }
+  free(bvh->nodes);
+  free(bvh->primitives);
+  free(bvh->unbounded);
+  free(bvh);
+  scene->bvh = NULL;
+}
+
+static inline float axisDistance(float lower, float upper, float p) {
+  return p < lower ? lower - p : p > upper ? p - upper : 0.0f;
+}
+
+float bvhNodeLowerBound(const BVHNode *node, Point p) {
+  float dx = axisDistance(node->lower[0], node->upper[0], p.x);
+  float dy = axisDistance(node->lower[1], node->upper[1], p.y);
+  float dz = axisDistance(node->lower[2], node->upper[2], p.z);
+  return sqrtf(dx * dx + dy * dy + dz * dz) - node->radius;
+}
+
+typedef struct BVHStackEntry {
+  int node;
+  // The node's lower bound.
+  float distance;
+} BVHStackEntry;
+
+static inline void unionWithPrimitive(SDFResult *result, const Scene *scene,
+                                      int primitive, const Point *frames) {
+  const SceneInstruction *instruction = &scene->tape[primitive];
+  float distance = scenePrimitiveDistance(instruction, frames);
+  // Like unionOp(), but ties go to the primitive found first.
+  if (unionOp(result->distance, distance) != result->distance) {
+    *result = (SDFResult){.distance = distance,
+                          .materialId = instruction->materialId,
+                          .primitive = primitive};
+  }
+}
+
+SDFResult bvhEvaluateScene(const Scene *scene, Point p) {
+  const BVH *bvh = scene->bvh;
+  Point frames[kMaxSceneFrames];
+  frames[0] = p;
+  SDFResult result = {.distance = INFINITY, .materialId = 0, .primitive = -1};
+  for (int i = 0; i < bvh->numUnbounded; ++i) {
+    const SceneInstruction *instruction = &scene->tape[bvh->unbounded[i]];
+    if (instruction->op == kSceneOpFrame) {
+      runSceneFrame(instruction, frames);
+    } else {
+      unionWithPrimitive(&result, scene, bvh->unbounded[i], frames);
+    }
+  }
+  if (bvh->numNodes == 0) {
+    return result;
+  }
+
+  // Visit the nodes nearest child first, skipping any that can't hold anything
+  // closer than the closest primitive found so far.
+  BVHStackEntry stack[kMaxBVHStackSize];
+  int stackSize = 0;
+  stack[stackSize++] = (BVHStackEntry){
+      .node = 0, .distance = bvhNodeLowerBound(&bvh->nodes[0], p)};
+  while (stackSize > 0) {
+    BVHStackEntry entry = stack[--stackSize];
+    if (entry.distance >= result.distance) {
+      continue;
+    }
+    const BVHNode *node = &bvh->nodes[entry.node];
+    if (node->count > 0) {
+      for (int i = 0; i < node->count; ++i) {
+        unionWithPrimitive(&result, scene, bvh->primitives[node->first + i],
+                           frames);
+      }
+      continue;
+    }
+    BVHStackEntry nearer = {.node = entry.node + 1};
+    BVHStackEntry farther = {.node = node->first};
+    nearer.distance = bvhNodeLowerBound(&bvh->nodes[nearer.node], p);
+    farther.distance = bvhNodeLowerBound(&bvh->nodes[farther.node], p);
+    if (farther.distance < nearer.distance) {
+      BVHStackEntry swap = nearer;
+      nearer = farther;
+      farther = swap;
+    }
+    stack[stackSize++] = farther;
+    stack[stackSize++] = nearer;
+  }
+  return result;
+}
@@ -0,0 +1,59 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "math.h"
+#include "scene.h"
+
+// Scenes with at least this many primitives get a BVH when they're loaded.
+#define kMinBVHPrimitives 16
+
+// Traversal stacks of this size can't overflow: trees are split at the median,
+// so they're never deeper than log2 of an int's worth of primitives.
+#define kMaxBVHStackSize 64
+
+// A node of the hierarchy. Nodes are stored depth first, so an inner node's
+// first child immediately follows it.
+typedef struct BVHNode {
+  // An axis-aligned box containing the center of every sphere below the node.
+  float lower[3];
+  float upper[3];
+  // The largest radius of any sphere below the node.
+  float radius;
+  // For leaves, primitives[first, first + count). For inner nodes (count ==
+  // 0), the index of the second child.
+  int first;
+  int count;
+} BVHNode;
+
+// A bounding volume hierarchy over a scene's spheres. Planes have no bound and
+// are evaluated on every query. The distance to a node's box of centers minus
+// its largest radius is a lower bound on the signed distance to every sphere
+// below it, inside or out, so subtrees that can't beat the closest primitive
+// found so far are skipped.
+typedef struct BVH {
+  BVHNode *nodes;
+  int numNodes;
+  // Tape indices of the bounded primitives, grouped by leaf.
+  int *primitives;
+  // Tape indices of frame instructions and unbounded primitives, in tape
+  // order.
+  int *unbounded;
+  int numUnbounded;
+} BVH;
+
+// Builds a BVH over the scene's primitives and attaches it to the scene, so
+// sceneDistance() and evaluateScene() use it from now on.
+void buildSceneBVH(Scene *scene);
+
+// Detaches and frees the scene's BVH, if any.
+void freeSceneBVH(Scene *scene);
+
+// Returns a lower bound on the signed distance from p to the spheres below
+// the node.
+float bvhNodeLowerBound(const BVHNode *node, Point p);
+
+// Equivalent to evaluateScene(), except that when several primitives are
+// exactly the same distance away the material may come from any of them.
+SDFResult bvhEvaluateScene(const Scene *scene, Point p);
+
+#endif /* BVH_H */
@@ -0,0 +1,216 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kCheckpointVersion 1
+
+typedef struct CheckpointHeader {
+  char magic[8];
+  uint64_t settingsHash;
+  uint32_t version;
+  uint32_t imageWidth;
+  uint32_t imageHeight;
+  uint32_t numTiles;
+} CheckpointHeader;
+
+static const char kCheckpointMagic[8] = "RMCKPT01";
+
+// The header is followed by a byte per tile, 1 once the tile's pixels are on
+// disk, and then by the framebuffer, 8-byte aligned.
+struct Checkpoint {
+  char *filename;
+  void *data;
+  size_t dataSize;
+  uint8_t *doneFlags;
+  Pixel *pixels;
+  int numTiles;
+  // Tiles finished since the last flush, and room to list them while
+  // flushing.
+  atomic_uchar *isPending;
+  int *flushedTiles;
+  pthread_mutex_t flushLock;
+  double intervalSeconds;
+  double lastFlushTime;
+};
+
+static double monotonicSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static size_t pixelsOffset(int numTiles) {
+  return (sizeof(CheckpointHeader) + numTiles + 7) & ~(size_t)7;
+}
+
+// Writes a new, empty checkpoint next to filename and renames it over
+// filename, so the file is never there without its header. Returns the open
+// file, or -1 on failure.
+static int createCheckpointFile(const char *filename,
+                                const CheckpointHeader *header,
+                                size_t dataSize) {
+  size_t tmpFilenameSize = strlen(filename) + 5;
+  char *tmpFilename = malloc(tmpFilenameSize);
+  snprintf(tmpFilename, tmpFilenameSize, "%s.tmp", filename);
+  int fd = open(tmpFilename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  // The rest of the file, the flags and pixels, starts out zeroed.
+  bool ok = fd >= 0 && ftruncate(fd, dataSize) == 0 &&
+            pwrite(fd, header, sizeof(*header), 0) == sizeof(*header) &&
+            fsync(fd) == 0 && rename(tmpFilename, filename) == 0;
+  if (!ok) {
+    printf("Failed to create checkpoint file: %d (%s)\n", errno,
+           strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmpFilename);
+    }
+    fd = -1;
+  }
+  free(tmpFilename);
+  return fd;
+}
+
+Checkpoint *openCheckpoint(const char *filename, uint64_t settingsHash,
+                           int imageWidth, int imageHeight, int numTiles,
+                           int intervalSeconds, bool resumes) {
+  CheckpointHeader header = {.settingsHash = settingsHash,
+                             .version = kCheckpointVersion,
+                             .imageWidth = imageWidth,
+                             .imageHeight = imageHeight,
+                             .numTiles = numTiles};
+  memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+  size_t dataSize = pixelsOffset(numTiles) +
+                    (size_t)imageWidth * imageHeight * sizeof(Pixel);
+
+  int fd = -1;
+  if (resumes) {
+    fd = open(filename, O_RDWR);
+    if (fd < 0 && errno != ENOENT) {
+      printf("Failed to open checkpoint file: %d (%s)\n", errno,
+             strerror(errno));
+      return NULL;
+    }
+    if (fd < 0) {
+      printf("No checkpoint in %s, starting from the beginning\n", filename);
+    }
+  }
+  if (fd >= 0) {
+    CheckpointHeader savedHeader;
+    struct stat status;
+    if (pread(fd, &savedHeader, sizeof(savedHeader), 0) !=
+            sizeof(savedHeader) ||
+        fstat(fd, &status) != 0 || (size_t)status.st_size != dataSize ||
+        memcmp(&savedHeader, &header, sizeof(header)) != 0) {
+      close(fd);
+      // Rather than throwing away someone's hours of rendering.
+      printf("%s is a checkpoint of a different render; render with the same "
+             "settings or remove it\n",
+             filename);
+      return NULL;
+    }
+  } else {
+    fd = createCheckpointFile(filename, &header, dataSize);
+    if (fd < 0) {
+      return NULL;
+    }
+  }
+  void *data =
+      mmap(NULL, dataSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    printf("Failed to map checkpoint file: %d (%s)\n", errno,
+           strerror(errno));
+    return NULL;
+  }
+
+  Checkpoint *checkpoint = calloc(1, sizeof(Checkpoint));
+  checkpoint->filename = strdup(filename);
+  checkpoint->data = data;
+  checkpoint->dataSize = dataSize;
+  checkpoint->doneFlags = (uint8_t *)data + sizeof(CheckpointHeader);
+  checkpoint->pixels = (Pixel *)((uint8_t *)data + pixelsOffset(numTiles));
+  checkpoint->numTiles = numTiles;
+  checkpoint->isPending = calloc(numTiles, sizeof(atomic_uchar));
+  checkpoint->flushedTiles = malloc(numTiles * sizeof(int));
+  pthread_mutex_init(&checkpoint->flushLock, NULL);
+  checkpoint->intervalSeconds = intervalSeconds;
+  checkpoint->lastFlushTime = monotonicSeconds();
+  return checkpoint;
+}
+
+Pixel *checkpointPixels(Checkpoint *checkpoint) { return checkpoint->pixels; }
+
+bool isCheckpointTileDone(const Checkpoint *checkpoint, int tile) {
+  return checkpoint->doneFlags[tile] != 0;
+}
+
+int numCheckpointTilesDone(const Checkpoint *checkpoint) {
+  int numDone = 0;
+  for (int tile = 0; tile < checkpoint->numTiles; ++tile) {
+    numDone += checkpoint->doneFlags[tile] != 0;
+  }
+  return numDone;
+}
+
+// Flushes the pixels of the tiles finished so far, then flags them. Only
+// pages written since the last flush go to disk, so each flush costs about
+// the tiles it covers. The caller holds the flush lock.
+static void flushCheckpoint(Checkpoint *checkpoint) {
+  int numFlushed = 0;
+  for (int tile = 0; tile < checkpoint->numTiles; ++tile) {
+    if (atomic_exchange(&checkpoint->isPending[tile], 0)) {
+      checkpoint->flushedTiles[numFlushed++] = tile;
+    }
+  }
+  if (msync(checkpoint->data, checkpoint->dataSize, MS_SYNC) != 0) {
+    // The tiles stay unflagged and are rendered again on resume.
+    printf("Failed to flush checkpoint: %d (%s)\n", errno, strerror(errno));
+    return;
+  }
+  for (int i = 0; i < numFlushed; ++i) {
+    checkpoint->doneFlags[checkpoint->flushedTiles[i]] = 1;
+  }
+  msync(checkpoint->data, checkpoint->dataSize, MS_SYNC);
+  checkpoint->lastFlushTime = monotonicSeconds();
+}
+
+void finishCheckpointTile(Checkpoint *checkpoint, int tile) {
+  atomic_store(&checkpoint->isPending[tile], 1);
+  // Threads that find a flush under way carry on rendering; it or the next
+  // one picks their tiles up.
+  if (pthread_mutex_trylock(&checkpoint->flushLock) != 0) {
+    return;
+  }
+  if (monotonicSeconds() - checkpoint->lastFlushTime >=
+      checkpoint->intervalSeconds) {
+    flushCheckpoint(checkpoint);
+  }
+  pthread_mutex_unlock(&checkpoint->flushLock);
+}
+
+void closeCheckpoint(Checkpoint *checkpoint, bool removesFile) {
+  if (!checkpoint) {
+    return;
+  }
+  if (removesFile) {
+    unlink(checkpoint->filename);
+  } else {
+    flushCheckpoint(checkpoint);
+  }
+  munmap(checkpoint->data, checkpoint->dataSize);
+  pthread_mutex_destroy(&checkpoint->flushLock);
+  free(checkpoint->flushedTiles);
+  free(checkpoint->isPending);
+  free(checkpoint->filename);
+  free(checkpoint);
+}
@@ -0,0 +1,43 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+
+// A render's finished tiles, kept in a file mapped into memory so that a
+// render cut short can pick up where it left off. The file holds the whole
+// framebuffer and a flag for every tile; tiles render straight into the
+// mapped framebuffer and are flagged as they finish. Every so often the
+// framebuffer is flushed to disk and only then are the tiles finished since
+// the last flush flagged in the file, so a flagged tile's pixels are always
+// on disk, whenever the process stops.
+typedef struct Checkpoint Checkpoint;
+
+// Opens the checkpoint in filename for an imageWidth x imageHeight image of
+// numTiles tiles rendered with the settings settingsHash stands for, flushing
+// it at most every intervalSeconds. With resumes set, the tiles an earlier
+// render with the same settings finished are kept, and if there is no such
+// file the render starts afresh. Otherwise any file there is replaced.
+// Returns NULL on failure, or if the file is for different settings.
+Checkpoint *openCheckpoint(const char *filename, uint64_t settingsHash,
+                           int imageWidth, int imageHeight, int numTiles,
+                           int intervalSeconds, bool resumes);
+
+// The framebuffer, row by row, bottom row first.
+Pixel *checkpointPixels(Checkpoint *checkpoint);
+
+bool isCheckpointTileDone(const Checkpoint *checkpoint, int tile);
+
+int numCheckpointTilesDone(const Checkpoint *checkpoint);
+
+// Marks a tile whose pixels are all in the framebuffer as finished, flushing
+// the checkpoint if the interval is up. Safe to call from any thread.
+void finishCheckpointTile(Checkpoint *checkpoint, int tile);
+
+// Unmaps the checkpoint, flushing it first or, with removesFile set,
+// deleting its file.
+void closeCheckpoint(Checkpoint *checkpoint, bool removesFile);
+
+#endif /* CHECKPOINT_H */
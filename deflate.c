@@ -0,0 +1,506 @@
+#include "deflate.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define kWindowSize 32768
+#define kHashBits 15
+#define kMinMatch 3
+#define kMaxMatch 258
+// How many earlier positions with the same hash a match is looked for at, and
+// the match length that ends the search early.
+#define kMaxChainLength 32
+#define kNiceMatch 128
+// Symbols per block. Each block gets codes fitted to its own symbols.
+#define kBlockSymbols 16384
+
+#define kNumLitLenCodes 286
+#define kNumDistanceCodes 30
+#define kNumCodeLengthCodes 19
+#define kMaxCodeLength 15
+#define kMaxCodeLengthCodeLength 7
+#define kEndOfBlock 256
+
+static const uint16_t kLengthBase[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t kLengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                             1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                             4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t kDistanceBase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t kDistanceExtraBits[30] = {0, 0, 0, 0, 1, 1, 2,  2,
+                                               3, 3, 4, 4, 5, 5, 6,  6,
+                                               7, 7, 8, 8, 9, 9, 10, 10,
+                                               11, 11, 12, 12, 13, 13};
+// The order code length code lengths are stored in.
+static const uint8_t kCodeLengthOrder[kNumCodeLengthCodes] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+const uint8_t kDeflateStreamEnd[2] = {0x03, 0x00};
+
+// A literal byte, with a distance of 0, or a match.
+typedef struct Symbol {
+  uint16_t length;
+  uint16_t distance;
+} Symbol;
+
+// Bits go out least significant first, as deflate packs them.
+typedef struct BitWriter {
+  uint8_t *bytes;
+  size_t size;
+  size_t capacity;
+  uint64_t bits;
+  int numBits;
+  bool failed;
+} BitWriter;
+
+static void putBits(BitWriter *writer, uint32_t value, int numBits) {
+  writer->bits |= (uint64_t)value << writer->numBits;
+  writer->numBits += numBits;
+  while (writer->numBits >= 8) {
+    if (writer->size == writer->capacity) {
+      size_t capacity = writer->capacity * 2;
+      uint8_t *bytes = realloc(writer->bytes, capacity);
+      if (!bytes) {
+        writer->failed = true;
+        writer->numBits = 0;
+        return;
+      }
+      writer->bytes = bytes;
+      writer->capacity = capacity;
+    }
+    writer->bytes[writer->size++] = writer->bits & 0xff;
+    writer->bits >>= 8;
+    writer->numBits -= 8;
+  }
+}
+
+// Pads the last byte with zeros.
+static void alignToByte(BitWriter *writer) {
+  putBits(writer, 0, (8 - writer->numBits % 8) % 8);
+}
+
+typedef struct HuffmanNode {
+  uint32_t weight;
+  int parent;
+} HuffmanNode;
+
+typedef struct Leaf {
+  uint32_t weight;
+  int symbol;
+} Leaf;
+
+static int compareLeaves(const void *a, const void *b) {
+  const Leaf *leafA = a;
+  const Leaf *leafB = b;
+  if (leafA->weight != leafB->weight) {
+    return leafA->weight < leafB->weight ? -1 : 1;
+  }
+  return leafA->symbol - leafB->symbol;
+}
+
+// Huffman code lengths for symbols with the given frequencies, none longer
+// than maxLength. Codes that come out too long are rebuilt with the
+// frequencies flattened, halving them, which rarely takes more than a round
+// and costs little compression.
+static void buildCodeLengths(const uint32_t *frequencies, int numSymbols,
+                             int maxLength, uint8_t *lengths) {
+  Leaf leaves[kNumLitLenCodes];
+  HuffmanNode nodes[2 * kNumLitLenCodes];
+  int numLeaves = 0;
+  memset(lengths, 0, numSymbols);
+  for (int symbol = 0; symbol < numSymbols; ++symbol) {
+    if (frequencies[symbol]) {
+      leaves[numLeaves++] = (Leaf){frequencies[symbol], symbol};
+    }
+  }
+  if (numLeaves == 0) {
+    return;
+  }
+  // Decoders want complete codes, so a lone symbol gets a partner.
+  if (numLeaves == 1) {
+    leaves[numLeaves++] = (Leaf){1, leaves[0].symbol == 0 ? 1 : 0};
+  }
+
+  for (;;) {
+    qsort(leaves, numLeaves, sizeof(Leaf), compareLeaves);
+    // Leaves are nodes 0 to numLeaves - 1, in order of weight, and internal
+    // nodes follow in the order they're made, which is also by weight, so
+    // the two lightest nodes are always at the front of one run or the other.
+    for (int i = 0; i < numLeaves; ++i) {
+      nodes[i] = (HuffmanNode){leaves[i].weight, -1};
+    }
+    int nextLeaf = 0;
+    int nextInternal = numLeaves;
+    int numNodes = numLeaves;
+    while (numNodes < 2 * numLeaves - 1) {
+      int children[2];
+      for (int i = 0; i < 2; ++i) {
+        if (nextLeaf < numLeaves &&
+            (nextInternal == numNodes ||
+             nodes[nextLeaf].weight <= nodes[nextInternal].weight)) {
+          children[i] = nextLeaf++;
+        } else {
+          children[i] = nextInternal++;
+        }
+      }
+      nodes[numNodes] = (HuffmanNode){
+          nodes[children[0]].weight + nodes[children[1]].weight, -1};
+      nodes[children[0]].parent = numNodes;
+      nodes[children[1]].parent = numNodes;
+      numNodes++;
+    }
+    // Parents come after their children, so depths fill in from the root.
+    int depths[2 * kNumLitLenCodes];
+    depths[numNodes - 1] = 0;
+    int maxDepth = 0;
+    for (int node = numNodes - 2; node >= 0; --node) {
+      depths[node] = depths[nodes[node].parent] + 1;
+      if (node < numLeaves && depths[node] > maxDepth) {
+        maxDepth = depths[node];
+      }
+    }
+    if (maxDepth <= maxLength) {
+      for (int i = 0; i < numLeaves; ++i) {
+        lengths[leaves[i].symbol] = depths[i];
+      }
+      return;
+    }
+    for (int i = 0; i < numLeaves; ++i) {
+      leaves[i].weight = (leaves[i].weight >> 1) | 1;
+    }
+  }
+}
+
+static uint16_t reverseBits(uint16_t code, int numBits) {
+  uint16_t reversed = 0;
+  for (int i = 0; i < numBits; ++i) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  return reversed;
+}
+
+// The canonical codes for the lengths, bit-reversed, as Huffman codes are
+// packed starting from their most significant bit.
+static void buildCodes(const uint8_t *lengths, int numSymbols,
+                       uint16_t *codes) {
+  int numCodesOfLength[kMaxCodeLength + 1] = {0};
+  for (int symbol = 0; symbol < numSymbols; ++symbol) {
+    numCodesOfLength[lengths[symbol]]++;
+  }
+  numCodesOfLength[0] = 0;
+  uint16_t nextCode[kMaxCodeLength + 1];
+  uint16_t code = 0;
+  for (int length = 1; length <= kMaxCodeLength; ++length) {
+    code = (code + numCodesOfLength[length - 1]) << 1;
+    nextCode[length] = code;
+  }
+  for (int symbol = 0; symbol < numSymbols; ++symbol) {
+    int length = lengths[symbol];
+    codes[symbol] = length ? reverseBits(nextCode[length]++, length) : 0;
+  }
+}
+
+static int lengthCode(int length) {
+  int code = 28;
+  while (kLengthBase[code] > length) {
+    code--;
+  }
+  return code;
+}
+
+static int distanceCode(int distance) {
+  int code = 29;
+  while (kDistanceBase[code] > distance) {
+    code--;
+  }
+  return code;
+}
+
+// Run-length encodes code lengths with the code length codes: 16 repeats the
+// previous length 3 to 6 times, 17 and 18 are runs of 3 to 10 and 11 to 138
+// zeros. Returns the number of codes, with their extra bits in extras.
+static int encodeCodeLengths(const uint8_t *lengths, int numLengths,
+                             uint8_t *codes, uint8_t *extras) {
+  int numCodes = 0;
+  int i = 0;
+  while (i < numLengths) {
+    int length = lengths[i];
+    int runLength = 1;
+    while (i + runLength < numLengths && lengths[i + runLength] == length) {
+      runLength++;
+    }
+    i += runLength;
+    if (length == 0) {
+      while (runLength >= 11) {
+        int count = runLength < 138 ? runLength : 138;
+        codes[numCodes] = 18;
+        extras[numCodes++] = count - 11;
+        runLength -= count;
+      }
+      if (runLength >= 3) {
+        codes[numCodes] = 17;
+        extras[numCodes++] = runLength - 3;
+        runLength = 0;
+      }
+    } else {
+      codes[numCodes] = length;
+      extras[numCodes++] = 0;
+      runLength--;
+      while (runLength >= 3) {
+        int count = runLength < 6 ? runLength : 6;
+        codes[numCodes] = 16;
+        extras[numCodes++] = count - 3;
+        runLength -= count;
+      }
+    }
+    for (; runLength > 0; --runLength) {
+      codes[numCodes] = length;
+      extras[numCodes++] = 0;
+    }
+  }
+  return numCodes;
+}
+
+// Writes the symbols as a block with dynamic Huffman codes.
+static void writeBlock(BitWriter *writer, const Symbol *symbols,
+                       int numSymbols) {
+  uint32_t litLenFrequencies[kNumLitLenCodes] = {0};
+  uint32_t distanceFrequencies[kNumDistanceCodes] = {0};
+  for (int i = 0; i < numSymbols; ++i) {
+    if (symbols[i].distance == 0) {
+      litLenFrequencies[symbols[i].length]++;
+    } else {
+      litLenFrequencies[257 + lengthCode(symbols[i].length)]++;
+      distanceFrequencies[distanceCode(symbols[i].distance)]++;
+    }
+  }
+  litLenFrequencies[kEndOfBlock] = 1;
+
+  uint8_t litLenLengths[kNumLitLenCodes];
+  uint8_t distanceLengths[kNumDistanceCodes];
+  buildCodeLengths(litLenFrequencies, kNumLitLenCodes, kMaxCodeLength,
+                   litLenLengths);
+  buildCodeLengths(distanceFrequencies, kNumDistanceCodes, kMaxCodeLength,
+                   distanceLengths);
+  // A block without matches still describes a distance code.
+  bool hasDistances = false;
+  for (int code = 0; code < kNumDistanceCodes; ++code) {
+    hasDistances |= distanceLengths[code] != 0;
+  }
+  if (!hasDistances) {
+    distanceLengths[0] = 1;
+  }
+  int numLitLenCodes = kNumLitLenCodes;
+  while (litLenLengths[numLitLenCodes - 1] == 0) {
+    numLitLenCodes--;
+  }
+  int numDistanceCodes = kNumDistanceCodes;
+  while (distanceLengths[numDistanceCodes - 1] == 0) {
+    numDistanceCodes--;
+  }
+  // The lengths of the literal/length codes followed by the distance codes',
+  // as the block header stores them.
+  uint8_t lengths[kNumLitLenCodes + kNumDistanceCodes];
+  memcpy(lengths, litLenLengths, numLitLenCodes);
+  memcpy(lengths + numLitLenCodes, distanceLengths, numDistanceCodes);
+
+  uint8_t lengthCodes[kNumLitLenCodes + kNumDistanceCodes];
+  uint8_t lengthExtras[kNumLitLenCodes + kNumDistanceCodes];
+  int numLengthCodes =
+      encodeCodeLengths(lengths, numLitLenCodes + numDistanceCodes,
+                        lengthCodes, lengthExtras);
+  uint32_t codeLengthFrequencies[kNumCodeLengthCodes] = {0};
+  for (int i = 0; i < numLengthCodes; ++i) {
+    codeLengthFrequencies[lengthCodes[i]]++;
+  }
+  uint8_t codeLengthLengths[kNumCodeLengthCodes];
+  buildCodeLengths(codeLengthFrequencies, kNumCodeLengthCodes,
+                   kMaxCodeLengthCodeLength, codeLengthLengths);
+  int numCodeLengthCodes = kNumCodeLengthCodes;
+  while (numCodeLengthCodes > 4 &&
+         codeLengthLengths[kCodeLengthOrder[numCodeLengthCodes - 1]] == 0) {
+    numCodeLengthCodes--;
+  }
+
+  uint16_t litLenCodes[kNumLitLenCodes];
+  uint16_t distanceCodes[kNumDistanceCodes];
+  uint16_t codeLengthCodes[kNumCodeLengthCodes];
+  buildCodes(litLenLengths, kNumLitLenCodes, litLenCodes);
+  buildCodes(distanceLengths, kNumDistanceCodes, distanceCodes);
+  buildCodes(codeLengthLengths, kNumCodeLengthCodes, codeLengthCodes);
+
+  // Not final, dynamic codes.
+  putBits(writer, 0, 1);
+  putBits(writer, 2, 2);
+  putBits(writer, numLitLenCodes - 257, 5);
+  putBits(writer, numDistanceCodes - 1, 5);
+  putBits(writer, numCodeLengthCodes - 4, 4);
+  for (int i = 0; i < numCodeLengthCodes; ++i) {
+    putBits(writer, codeLengthLengths[kCodeLengthOrder[i]], 3);
+  }
+  static const uint8_t kRepeatExtraBits[3] = {2, 3, 7};
+  for (int i = 0; i < numLengthCodes; ++i) {
+    int code = lengthCodes[i];
+    putBits(writer, codeLengthCodes[code], codeLengthLengths[code]);
+    if (code >= 16) {
+      putBits(writer, lengthExtras[i], kRepeatExtraBits[code - 16]);
+    }
+  }
+
+  for (int i = 0; i < numSymbols; ++i) {
+    Symbol symbol = symbols[i];
+    if (symbol.distance == 0) {
+      putBits(writer, litLenCodes[symbol.length],
+              litLenLengths[symbol.length]);
+      continue;
+    }
+    int code = lengthCode(symbol.length);
+    putBits(writer, litLenCodes[257 + code], litLenLengths[257 + code]);
+    putBits(writer, symbol.length - kLengthBase[code],
+            kLengthExtraBits[code]);
+    code = distanceCode(symbol.distance);
+    putBits(writer, distanceCodes[code], distanceLengths[code]);
+    putBits(writer, symbol.distance - kDistanceBase[code],
+            kDistanceExtraBits[code]);
+  }
+  putBits(writer, litLenCodes[kEndOfBlock], litLenLengths[kEndOfBlock]);
+}
+
+static uint32_t hashAt(const uint8_t *bytes) {
+  uint32_t value = bytes[0] | bytes[1] << 8 | bytes[2] << 16;
+  return (value * 2654435761u) >> (32 - kHashBits);
+}
+
+uint8_t *deflateBlocks(const uint8_t *data, size_t size,
+                       size_t *compressedSize) {
+  if (size > INT32_MAX) {
+    return NULL;
+  }
+  BitWriter writer = {.capacity = size / 2 + 64};
+  writer.bytes = malloc(writer.capacity);
+  // The most recent position with each hash, and for each position in the
+  // window, the one before it with the same hash.
+  int32_t *head = malloc((1 << kHashBits) * sizeof(int32_t));
+  int32_t *previous = malloc(kWindowSize * sizeof(int32_t));
+  Symbol *symbols = malloc(kBlockSymbols * sizeof(Symbol));
+  if (!writer.bytes || !head || !previous || !symbols) {
+    free(writer.bytes);
+    free(head);
+    free(previous);
+    free(symbols);
+    return NULL;
+  }
+  memset(head, 0xff, (1 << kHashBits) * sizeof(int32_t));
+
+  int numSymbols = 0;
+  int32_t position = 0;
+  int32_t end = size;
+  while (position < end) {
+    int bestLength = 0;
+    int bestDistance = 0;
+    if (end - position >= kMinMatch) {
+      int maxLength = end - position < kMaxMatch ? end - position : kMaxMatch;
+      uint32_t hash = hashAt(data + position);
+      int32_t candidate = head[hash];
+      for (int chain = 0; candidate >= 0 && chain < kMaxChainLength &&
+                          position - candidate <= kWindowSize;
+           ++chain) {
+        const uint8_t *a = data + candidate;
+        const uint8_t *b = data + position;
+        if (a[bestLength] == b[bestLength]) {
+          int length = 0;
+          while (length < maxLength && a[length] == b[length]) {
+            length++;
+          }
+          if (length > bestLength) {
+            bestLength = length;
+            bestDistance = position - candidate;
+            if (length >= kNiceMatch || length == maxLength) {
+              break;
+            }
+          }
+        }
+        int32_t next = previous[candidate & (kWindowSize - 1)];
+        // Slots are reused as the window moves on, and then lead forwards.
+        if (next >= candidate) {
+          break;
+        }
+        candidate = next;
+      }
+    }
+
+    int numCovered = 1;
+    if (bestLength >= kMinMatch) {
+      symbols[numSymbols++] = (Symbol){bestLength, bestDistance};
+      numCovered = bestLength;
+    } else {
+      symbols[numSymbols++] = (Symbol){data[position], 0};
+    }
+    for (int i = 0; i < numCovered; ++i, ++position) {
+      if (end - position >= kMinMatch) {
+        uint32_t hash = hashAt(data + position);
+        previous[position & (kWindowSize - 1)] = head[hash];
+        head[hash] = position;
+      }
+    }
+    if (numSymbols == kBlockSymbols) {
+      writeBlock(&writer, symbols, numSymbols);
+      numSymbols = 0;
+    }
+  }
+  if (numSymbols > 0) {
+    writeBlock(&writer, symbols, numSymbols);
+  }
+  // An empty stored block: not final, stored, aligned, and a length of 0 with
+  // its complement.
+  putBits(&writer, 0, 3);
+  alignToByte(&writer);
+  putBits(&writer, 0xffff0000u, 32);
+
+  free(symbols);
+  free(previous);
+  free(head);
+  if (writer.failed) {
+    free(writer.bytes);
+    return NULL;
+  }
+  *compressedSize = writer.size;
+  return writer.bytes;
+}
+
+#define kAdlerModulus 65521
+// The most bytes that can be summed before the sums overflow 32 bits.
+#define kAdlerRun 5552
+
+uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size) {
+  uint32_t a = adler & 0xffff;
+  uint32_t b = adler >> 16;
+  while (size > 0) {
+    size_t runSize = size < kAdlerRun ? size : kAdlerRun;
+    for (size_t i = 0; i < runSize; ++i) {
+      a += data[i];
+      b += a;
+    }
+    a %= kAdlerModulus;
+    b %= kAdlerModulus;
+    data += runSize;
+    size -= runSize;
+  }
+  return b << 16 | a;
+}
+
+uint32_t combineAdler32(uint32_t first, uint32_t second, size_t secondSize) {
+  // The second piece's sums, had they started from the first's: a adds up
+  // to both pieces' bytes, and b gains the first's a for every byte of the
+  // second.
+  uint64_t remainder = secondSize % kAdlerModulus;
+  uint64_t a = (first & 0xffff) + (second & 0xffff) + kAdlerModulus - 1;
+  uint64_t b = (remainder * (first & 0xffff)) % kAdlerModulus +
+               (first >> 16) + (second >> 16) + kAdlerModulus - remainder;
+  return (uint32_t)(b % kAdlerModulus) << 16 | (uint32_t)(a % kAdlerModulus);
+}
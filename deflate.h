@@ -0,0 +1,27 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compresses data into deflate blocks (RFC 1951) with Huffman codes fitted to
+// it, followed by an empty stored block so the output ends on a byte
+// boundary. No block is marked final, and matches only reach back within
+// data, so pieces of a stream compressed on their own can be concatenated,
+// in order, into one stream, which kDeflateStreamEnd ends. Returns the
+// compressed bytes, which the caller frees, or NULL on failure.
+uint8_t *deflateBlocks(const uint8_t *data, size_t size,
+                       size_t *compressedSize);
+
+// An empty final block, which ends a stream of deflateBlocks() pieces.
+extern const uint8_t kDeflateStreamEnd[2];
+
+// The Adler-32 checksum of zlib streams, continued from adler over data.
+// Streams start from 1.
+uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size);
+
+// The Adler-32 of two pieces of data, given the checksum of each and the size
+// of the second.
+uint32_t combineAdler32(uint32_t first, uint32_t second, size_t secondSize);
+
+#endif /* DEFLATE_H */
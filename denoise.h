@@ -0,0 +1,52 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "bitmap.h"
+#include "pool.h"
+
+// The buffers a G-buffer holds for every pixel. Each is the mean over the
+// pixel's samples that hit something, except for the color, which is the
+// pixel's color before it's rounded to a Pixel, and the material, which is
+// that of the first sample that hit something.
+typedef enum GBufferPlane {
+  kGBufferRed,
+  kGBufferGreen,
+  kGBufferBlue,
+  // The distance from the camera to the surface, or 0 if nothing was hit.
+  kGBufferDepth,
+  kGBufferNormalX,
+  kGBufferNormalY,
+  kGBufferNormalZ,
+  // How much of the light gets to diffuse surfaces, from 0 to 1.
+  kGBufferVisibility,
+  // The material's index, or -1 if nothing was hit.
+  kGBufferMaterial,
+  kNumGBufferPlanes,
+} GBufferPlane;
+
+typedef struct GBuffer {
+  int width;
+  int height;
+  // One value per pixel, row by row.
+  float *planes[kNumGBufferPlanes];
+} GBuffer;
+
+// Returns NULL if the buffers can't be allocated.
+GBuffer *createGBuffer(int width, int height);
+
+void freeGBuffer(GBuffer *gbuffer);
+
+// Filters the G-buffer's colors on the pool's threads and stores the result in
+// pixels, row by row. Images rendered with subPixelsDim x subPixelsDim samples
+// per pixel, for grids too coarse to cover their pixels, first have each
+// pixel blended with its neighbours to stand in for the rest of its
+// footprint; that is where coarse grids differ from fine ones the most, along
+// edges. numPasses passes of an edge-avoiding à-trous wavelet filter follow.
+// Pass i blends each pixel with those 2^i pixels apart in a 5 x 5 grid around
+// it, weighted down across changes of material, depth, normal, light
+// visibility and color, so it smooths noise on surfaces without blurring
+// across their edges. The G-buffer is left as it was.
+void denoiseGBuffer(const GBuffer *gbuffer, int subPixelsDim, int numPasses,
+                    TilePool *pool, Pixel *pixels);
+
+#endif /* DENOISE_H */
@@ -0,0 +1,488 @@
+#include "distribute.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "netutil.h"
+
+// Sent by a worker when it connects.
+typedef struct HelloMessage {
+  char magic[8];
+  uint64_t settingsHash;
+} HelloMessage;
+
+static const char kHelloMagic[8] = "RMTILES1";
+
+// Sent by the coordinator to hand out a tile, or with one of the negative
+// indices below to send a worker away. Workers send back the tile's index as
+// an int32_t followed by its pixels.
+typedef struct TileMessage {
+  int32_t index;
+  int32_t row, column;
+  int32_t numRows, numColumns;
+} TileMessage;
+
+enum {
+  kTileDone = -1,
+  kTileRejected = -2,
+};
+
+// How long a worker keeps trying to reach a coordinator that isn't listening
+// yet.
+#define kConnectSeconds 10.0
+
+// How often the coordinator looks for slow tiles and exited workers when
+// nothing arrives.
+#define kPollMilliseconds 100
+
+struct Coordinator {
+  int listenFd;
+  int port;
+};
+
+typedef struct Connection {
+  int fd;
+  bool hasSaidHello;
+  // The tile being rendered, or -1.
+  int tileIndex;
+  double startTime;
+  // The message being received, which is empty while the worker is idle.
+  uint8_t *buffer;
+  size_t messageSize;
+  size_t numReceived;
+} Connection;
+
+// Which tiles are left and where they are.
+typedef struct TileQueue {
+  const Tile *tiles;
+  int numTiles;
+  // The copies of each tile being rendered.
+  int *numCopies;
+  bool *isDone;
+  int numDone;
+  // Tiles handed out before whose workers left.
+  int *returnedTiles;
+  int numReturnedTiles;
+  // Tiles from here on haven't been handed out.
+  int nextTile;
+  double tileSecondsSum;
+  // Workers whose settings matched.
+  int numWorkers;
+  int numReassigned;
+  int numDuplicated;
+} TileQueue;
+
+static size_t tilePixelsSize(Tile tile) {
+  return (size_t)tile.numRows * tile.numColumns * sizeof(Pixel);
+}
+
+Coordinator *createCoordinator(const char *host, int port) {
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM,
+                           .ai_flags = AI_NUMERICSERV};
+  struct addrinfo *addresses;
+  int error = getaddrinfo(host ? host : "localhost", service, &hints,
+                          &addresses);
+  if (error != 0) {
+    printf("Failed to look up %s: %s\n", host ? host : "localhost",
+           gai_strerror(error));
+    return NULL;
+  }
+  int fd = -1;
+  struct sockaddr_storage address;
+  socklen_t addressSize = sizeof(address);
+  for (struct addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int yes = 1;
+    int no = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (a->ai_family == AF_INET6) {
+      // :: takes IPv4 workers as well.
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+    }
+    if (bind(fd, a->ai_addr, a->ai_addrlen) != 0 ||
+        listen(fd, SOMAXCONN) != 0 ||
+        getsockname(fd, (struct sockaddr *)&address, &addressSize) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    printf("Failed to listen on %s port %d: %d (%s)\n",
+           host ? host : "localhost", port, errno, strerror(errno));
+    return NULL;
+  }
+  Coordinator *coordinator = malloc(sizeof(Coordinator));
+  coordinator->listenFd = fd;
+  coordinator->port =
+      ntohs(address.ss_family == AF_INET6
+                ? ((struct sockaddr_in6 *)&address)->sin6_port
+                : ((struct sockaddr_in *)&address)->sin_port);
+  return coordinator;
+}
+
+void destroyCoordinator(Coordinator *coordinator) {
+  if (!coordinator) {
+    return;
+  }
+  close(coordinator->listenFd);
+  free(coordinator);
+}
+
+int coordinatorPort(const Coordinator *coordinator) {
+  return coordinator->port;
+}
+
+// The oldest tile that is only being rendered once and has been at it for
+// kSlowTileFactor times the mean, or -1.
+static int slowestTile(const TileQueue *queue, const Connection *connections,
+                       int numConnections) {
+  if (queue->numDone == 0) {
+    return -1;
+  }
+  double deadline = monotonicSeconds() -
+                    kSlowTileFactor * queue->tileSecondsSum / queue->numDone;
+  int slowest = -1;
+  double slowestStart = deadline;
+  for (int i = 0; i < numConnections; ++i) {
+    int tile = connections[i].tileIndex;
+    if (tile >= 0 && queue->numCopies[tile] == 1 &&
+        connections[i].startTime < slowestStart) {
+      slowest = tile;
+      slowestStart = connections[i].startTime;
+    }
+  }
+  return slowest;
+}
+
+// The next tile for an idle worker, or -1 if there's nothing to give it.
+static int takeTile(TileQueue *queue, const Connection *connections,
+                    int numConnections) {
+  while (queue->numReturnedTiles > 0) {
+    int tile = queue->returnedTiles[--queue->numReturnedTiles];
+    if (!queue->isDone[tile] && queue->numCopies[tile] == 0) {
+      return tile;
+    }
+  }
+  if (queue->nextTile < queue->numTiles) {
+    return queue->nextTile++;
+  }
+  int tile = slowestTile(queue, connections, numConnections);
+  if (tile >= 0) {
+    queue->numDuplicated++;
+  }
+  return tile;
+}
+
+static bool assignTile(Connection *connection, TileQueue *queue, int tile) {
+  Tile t = queue->tiles[tile];
+  TileMessage message = {.index = tile,
+                         .row = t.row,
+                         .column = t.column,
+                         .numRows = t.numRows,
+                         .numColumns = t.numColumns};
+  connection->tileIndex = tile;
+  connection->startTime = monotonicSeconds();
+  connection->messageSize = sizeof(int32_t) + tilePixelsSize(t);
+  connection->numReceived = 0;
+  connection->buffer = realloc(connection->buffer, connection->messageSize);
+  queue->numCopies[tile]++;
+  return sendAll(connection->fd, &message, sizeof(message));
+}
+
+// Closes a worker's connection, handing its tile back out if nobody else is
+// rendering it.
+static void dropConnection(Connection *connection, TileQueue *queue) {
+  int tile = connection->tileIndex;
+  if (tile >= 0 && !queue->isDone[tile] && --queue->numCopies[tile] == 0) {
+    queue->returnedTiles[queue->numReturnedTiles++] = tile;
+    queue->numReassigned++;
+  }
+  close(connection->fd);
+  free(connection->buffer);
+  connection->buffer = NULL;
+  connection->fd = -1;
+  connection->tileIndex = -1;
+}
+
+// Acts on a complete message. Returns false if the worker should be dropped.
+static bool handleMessage(Connection *connection, TileQueue *queue,
+                          uint64_t settingsHash, TileResultFunc store,
+                          void *context) {
+  if (!connection->hasSaidHello) {
+    const HelloMessage *hello = (const HelloMessage *)connection->buffer;
+    if (memcmp(hello->magic, kHelloMagic, sizeof(hello->magic)) != 0 ||
+        hello->settingsHash != settingsHash) {
+      TileMessage reject = {.index = kTileRejected};
+      sendAll(connection->fd, &reject, sizeof(reject));
+      printf("Turned away a worker with different render settings\n");
+      return false;
+    }
+    connection->hasSaidHello = true;
+    queue->numWorkers++;
+    connection->messageSize = 0;
+    return true;
+  }
+  int tile = connection->tileIndex;
+  int32_t index;
+  memcpy(&index, connection->buffer, sizeof(index));
+  if (index != tile) {
+    return false;
+  }
+  if (!queue->isDone[tile]) {
+    store(queue->tiles[tile], (const Pixel *)(connection->buffer + sizeof(index)),
+          context);
+    queue->isDone[tile] = true;
+    queue->numDone++;
+    queue->tileSecondsSum += monotonicSeconds() - connection->startTime;
+  }
+  queue->numCopies[tile]--;
+  connection->tileIndex = -1;
+  connection->messageSize = 0;
+  return true;
+}
+
+// Reads what has arrived from a worker. Returns false if it should be
+// dropped.
+static bool receiveFromWorker(Connection *connection, TileQueue *queue,
+                              uint64_t settingsHash, TileResultFunc store,
+                              void *context) {
+  if (connection->messageSize == 0) {
+    // Idle workers have nothing to say, so this is them leaving.
+    return false;
+  }
+  ssize_t numReceived =
+      recv(connection->fd, connection->buffer + connection->numReceived,
+           connection->messageSize - connection->numReceived, 0);
+  if (numReceived < 0 && errno == EINTR) {
+    return true;
+  }
+  if (numReceived <= 0) {
+    return false;
+  }
+  connection->numReceived += numReceived;
+  if (connection->numReceived < connection->messageSize) {
+    return true;
+  }
+  return handleMessage(connection, queue, settingsHash, store, context);
+}
+
+// Whether every worker the caller started has exited.
+static bool haveWorkersExited(pid_t *workerPids, int numWorkerPids) {
+  bool haveExited = true;
+  for (int i = 0; i < numWorkerPids; ++i) {
+    if (workerPids[i] > 0 && waitpid(workerPids[i], NULL, WNOHANG) != 0) {
+      workerPids[i] = 0;
+    }
+    haveExited = haveExited && workerPids[i] <= 0;
+  }
+  return haveExited;
+}
+
+int coordinateTiles(Coordinator *coordinator, uint64_t settingsHash,
+                    const Tile *tiles, int numTiles, const pid_t *workerPids,
+                    int numWorkerPids, TileResultFunc store, void *context) {
+  TileQueue queue = {.tiles = tiles,
+                     .numTiles = numTiles,
+                     .numCopies = calloc(numTiles, sizeof(int)),
+                     .isDone = calloc(numTiles, sizeof(bool)),
+                     .returnedTiles = malloc(numTiles * sizeof(int))};
+  pid_t *livePids = malloc(numWorkerPids * sizeof(pid_t));
+  memcpy(livePids, workerPids, numWorkerPids * sizeof(pid_t));
+  Connection *connections = NULL;
+  struct pollfd *pollFds = NULL;
+  int numConnections = 0;
+  int result = 0;
+
+  while (queue.numDone < numTiles) {
+    for (int i = 0; i < numConnections; ++i) {
+      Connection *connection = &connections[i];
+      if (connection->fd < 0 || !connection->hasSaidHello ||
+          connection->tileIndex >= 0) {
+        continue;
+      }
+      int tile = takeTile(&queue, connections, numConnections);
+      if (tile < 0) {
+        break;
+      }
+      if (!assignTile(connection, &queue, tile)) {
+        dropConnection(connection, &queue);
+      }
+    }
+    // Drop closed connections.
+    int numOpen = 0;
+    for (int i = 0; i < numConnections; ++i) {
+      if (connections[i].fd >= 0) {
+        connections[numOpen++] = connections[i];
+      }
+    }
+    numConnections = numOpen;
+    if (numConnections == 0 && numWorkerPids > 0 &&
+        haveWorkersExited(livePids, numWorkerPids)) {
+      printf("Every worker exited with %d of %d tiles left\n",
+             numTiles - queue.numDone, numTiles);
+      result = 1;
+      break;
+    }
+
+    pollFds = realloc(pollFds, (numConnections + 1) * sizeof(struct pollfd));
+    pollFds[0] = (struct pollfd){.fd = coordinator->listenFd, .events = POLLIN};
+    for (int i = 0; i < numConnections; ++i) {
+      pollFds[i + 1] = (struct pollfd){.fd = connections[i].fd, .events = POLLIN};
+    }
+    if (poll(pollFds, numConnections + 1, kPollMilliseconds) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Failed to wait for workers: %d (%s)\n", errno, strerror(errno));
+      result = 1;
+      break;
+    }
+    for (int i = 0; i < numConnections; ++i) {
+      if (pollFds[i + 1].revents &&
+          !receiveFromWorker(&connections[i], &queue, settingsHash, store,
+                             context)) {
+        dropConnection(&connections[i], &queue);
+      }
+    }
+    if (pollFds[0].revents & POLLIN) {
+      int fd = accept(coordinator->listenFd, NULL, NULL);
+      if (fd >= 0) {
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        connections =
+            realloc(connections, (numConnections + 1) * sizeof(Connection));
+        connections[numConnections++] =
+            (Connection){.fd = fd,
+                         .tileIndex = -1,
+                         .buffer = malloc(sizeof(HelloMessage)),
+                         .messageSize = sizeof(HelloMessage)};
+      }
+    }
+  }
+
+  TileMessage done = {.index = kTileDone};
+  for (int i = 0; i < numConnections; ++i) {
+    if (connections[i].fd >= 0) {
+      sendAll(connections[i].fd, &done, sizeof(done));
+      close(connections[i].fd);
+      free(connections[i].buffer);
+    }
+  }
+  if (result == 0) {
+    printf("Coordinated %d tiles over %d workers: %d handed out again after "
+           "their worker left, %d slow tiles copied\n",
+           numTiles, queue.numWorkers, queue.numReassigned, queue.numDuplicated);
+  }
+  free(pollFds);
+  free(connections);
+  free(livePids);
+  free(queue.returnedTiles);
+  free(queue.isDone);
+  free(queue.numCopies);
+  return result;
+}
+
+// Connects to HOST:PORT, retrying for a while in case the coordinator is still
+// starting up. Returns -1 on failure.
+static int connectToCoordinator(const char *address) {
+  const char *colon = strrchr(address, ':');
+  if (!colon || colon == address || colon[1] == '\0') {
+    printf("Coordinator address must be HOST:PORT: %s\n", address);
+    return -1;
+  }
+  char *host = strndup(address, colon - address);
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *addresses;
+  int error = getaddrinfo(host, colon + 1, &hints, &addresses);
+  free(host);
+  if (error != 0) {
+    printf("Failed to look up %s: %s\n", address, gai_strerror(error));
+    return -1;
+  }
+  double deadline = monotonicSeconds() + kConnectSeconds;
+  int fd = -1;
+  while (fd < 0) {
+    for (struct addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    if (fd < 0 && monotonicSeconds() >= deadline) {
+      printf("Failed to connect to %s: %d (%s)\n", address, errno,
+             strerror(errno));
+      break;
+    }
+    if (fd < 0) {
+      usleep(100000);
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd >= 0) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+  return fd;
+}
+
+int serveTiles(const char *address, uint64_t settingsHash,
+               TileRenderFunc render, void *context) {
+  int fd = connectToCoordinator(address);
+  if (fd < 0) {
+    return 1;
+  }
+  HelloMessage hello = {.settingsHash = settingsHash};
+  memcpy(hello.magic, kHelloMagic, sizeof(hello.magic));
+  bool ok = sendAll(fd, &hello, sizeof(hello));
+  uint8_t *buffer = NULL;
+  int result = 1;
+  TileMessage message;
+  while (ok && (ok = receiveAll(fd, &message, sizeof(message)))) {
+    if (message.index == kTileDone) {
+      result = 0;
+      break;
+    }
+    if (message.index == kTileRejected) {
+      printf("The coordinator at %s renders with different settings\n",
+             address);
+      break;
+    }
+    Tile tile = {.row = message.row,
+                 .column = message.column,
+                 .numRows = message.numRows,
+                 .numColumns = message.numColumns};
+    if (message.index < 0 || tile.numRows <= 0 || tile.numColumns <= 0) {
+      printf("Bad tile from the coordinator at %s\n", address);
+      break;
+    }
+    size_t pixelsSize = tilePixelsSize(tile);
+    buffer = realloc(buffer, sizeof(int32_t) + pixelsSize);
+    memcpy(buffer, &message.index, sizeof(int32_t));
+    render(tile, (Pixel *)(buffer + sizeof(int32_t)), context);
+    ok = sendAll(fd, buffer, sizeof(int32_t) + pixelsSize);
+  }
+  if (!ok) {
+    printf("Lost the connection to the coordinator at %s\n", address);
+  }
+  free(buffer);
+  close(fd);
+  return result;
+}
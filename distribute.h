@@ -0,0 +1,59 @@
+#ifndef DISTRIBUTE_H
+#define DISTRIBUTE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bitmap.h"
+#include "pool.h"
+
+// Rendering a still across processes. A coordinator listens on a TCP port and
+// hands tiles out one at a time to the workers that connect, which render them
+// and send back their pixels. Workers announce a hash of their render
+// settings, and the coordinator turns away any whose settings differ from its
+// own, so tiles come back as the coordinator would have rendered them.
+//
+// The tile of a worker that disconnects is handed out again. Once every tile
+// has been handed out, idle workers are also given copies of tiles that have
+// been rendering for more than kSlowTileFactor times the mean tile time, and
+// whichever copy comes back first is kept.
+//
+// Messages are sent in the host's byte order, so every process has to run on
+// a machine of the same endianness.
+
+#define kSlowTileFactor 3.0
+
+// Called on every finished tile with its pixels, row by row.
+typedef void (*TileResultFunc)(Tile tile, const Pixel *pixels, void *context);
+
+// Renders a tile into pixels, row by row.
+typedef void (*TileRenderFunc)(Tile tile, Pixel *pixels, void *context);
+
+typedef struct Coordinator Coordinator;
+
+// Listens on host's port, or on any free port if it's 0. Workers aren't
+// authenticated beyond their settings hash, so host is the loopback address
+// if it's NULL, and only a host given explicitly (an address of this
+// machine, or :: or 0.0.0.0 for all of them) takes workers from elsewhere.
+// Returns NULL on failure.
+Coordinator *createCoordinator(const char *host, int port);
+
+void destroyCoordinator(Coordinator *coordinator);
+
+// The port the coordinator listens on.
+int coordinatorPort(const Coordinator *coordinator);
+
+// Hands out tiles until every one of them has come back, passing each to store
+// as it arrives. workerPids are worker processes the caller started; if they
+// have all exited while no other worker is connected, nothing is left to
+// render the remaining tiles. Returns 1 on failure.
+int coordinateTiles(Coordinator *coordinator, uint64_t settingsHash,
+                    const Tile *tiles, int numTiles, const pid_t *workerPids,
+                    int numWorkerPids, TileResultFunc store, void *context);
+
+// Connects to the coordinator at HOST:PORT and renders tiles for it until it
+// has none left. Returns 1 on failure.
+int serveTiles(const char *address, uint64_t settingsHash,
+               TileRenderFunc render, void *context);
+
+#endif /* DISTRIBUTE_H */
@@ -0,0 +1,648 @@
+#include "imagefile.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "deflate.h"
+
+// Roughly how many bytes of filtered rows go into a PNG strip. Each strip
+// starts a fresh deflate window, so smaller strips spread out over more
+// threads but compress a little worse.
+#define kPngStripBytes (128 * 1024)
+
+static const uint8_t kPngSignature[8] = {0x89, 'P', 'N', 'G',
+                                         '\r', '\n', 0x1a, '\n'};
+// Deflate with a 32 KiB window and no preset dictionary.
+static const uint8_t kZlibHeader[2] = {0x78, 0x01};
+
+typedef enum PngFilter {
+  kPngFilterNone,
+  kPngFilterSub,
+  kPngFilterUp,
+  kPngFilterAverage,
+  kPngFilterPaeth,
+  kNumPngFilters,
+} PngFilter;
+
+typedef struct QoiPixel {
+  uint8_t r, g, b, a;
+} QoiPixel;
+
+// The state QOI carries from one pixel to the next.
+typedef struct QoiEncoder {
+  QoiPixel index[64];
+  QoiPixel previous;
+  int runLength;
+} QoiEncoder;
+
+typedef struct EncodedStrip {
+  bool isReady;
+  // QOI only: the strip's pixels, until the strip is written.
+  Pixel *pixels;
+  // PNG only: the compressed strip, and the size and Adler-32 of the
+  // filtered rows it holds.
+  uint8_t *bytes;
+  size_t size;
+  size_t rawSize;
+  uint32_t adler;
+} EncodedStrip;
+
+struct ImageFile {
+  ImageFormat format;
+  // BMP files are written as the pixels come in.
+  BitmapFile *bitmap;
+  FILE *stream;
+  int imageWidth;
+  int imageHeight;
+  int rowsPerStrip;
+  int numStrips;
+  // Each strip's pixels, top row first, from when its first pixel comes in
+  // until it is encoded, so only strips still rendering take up memory.
+  Pixel **stripPixels;
+  pthread_mutex_t pixelsLock;
+  // For every strip, how many of its pixels are still to come.
+  atomic_int *numPixelsLeft;
+  EncodedStrip *strips;
+  // Held while writing strips out, which happens in order.
+  pthread_mutex_t writeLock;
+  int numStripsWritten;
+  uint32_t adler;
+  QoiEncoder qoi;
+  atomic_bool failed;
+};
+
+bool parseImageFormat(const char *name, ImageFormat *format) {
+  for (ImageFormat candidate = kImageFormatBMP; candidate < kImageFormatRaw;
+       ++candidate) {
+    if (strcmp(name, imageFormatExtension(candidate)) == 0) {
+      *format = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+ImageFormat imageFormatForFilename(const char *filename) {
+  const char *extension = strrchr(filename, '.');
+  for (ImageFormat format = kImageFormatBMP;
+       extension && format < kImageFormatRaw; ++format) {
+    if (strcasecmp(extension + 1, imageFormatExtension(format)) == 0) {
+      return format;
+    }
+  }
+  return kImageFormatBMP;
+}
+
+const char *imageFormatExtension(ImageFormat format) {
+  static const char *const kExtensions[] = {"bmp", "qoi", "png", "raw"};
+  return kExtensions[format];
+}
+
+static void putBigEndian32(uint8_t *bytes, uint32_t value) {
+  bytes[0] = value >> 24;
+  bytes[1] = value >> 16;
+  bytes[2] = value >> 8;
+  bytes[3] = value;
+}
+
+/**
+ * PNG.
+ */
+
+static uint32_t gCrcTable[256];
+static pthread_once_t gCrcTableOnce = PTHREAD_ONCE_INIT;
+
+static void fillCrcTable(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = crc & 1 ? 0xedb88320u ^ (crc >> 1) : crc >> 1;
+    }
+    gCrcTable[i] = crc;
+  }
+}
+
+static uint32_t updateCrc(uint32_t crc, const uint8_t *bytes, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    crc = gCrcTable[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+static void writePngChunk(FILE *stream, const char *type,
+                          const uint8_t *data, size_t size) {
+  pthread_once(&gCrcTableOnce, fillCrcTable);
+  uint8_t header[8];
+  putBigEndian32(header, size);
+  memcpy(header + 4, type, 4);
+  uint32_t crc = updateCrc(0xffffffffu, header + 4, 4);
+  crc = updateCrc(crc, data, size) ^ 0xffffffffu;
+  uint8_t trailer[4];
+  putBigEndian32(trailer, crc);
+  fwrite(header, 1, sizeof(header), stream);
+  if (size > 0) {
+    fwrite(data, 1, size, stream);
+  }
+  fwrite(trailer, 1, sizeof(trailer), stream);
+}
+
+static int paethPredictor(int left, int up, int upLeft) {
+  int estimate = left + up - upLeft;
+  int toLeft = abs(estimate - left);
+  int toUp = abs(estimate - up);
+  int toUpLeft = abs(estimate - upLeft);
+  if (toLeft <= toUp && toLeft <= toUpLeft) {
+    return left;
+  }
+  return toUp <= toUpLeft ? up : upLeft;
+}
+
+// Filters a row of RGB bytes with filter into out. previous is the row above,
+// or NULL to treat it as zeros.
+static void filterPngRow(PngFilter filter, const uint8_t *row,
+                         const uint8_t *previous, int size, uint8_t *out) {
+  for (int i = 0; i < size; ++i) {
+    int left = i >= 3 ? row[i - 3] : 0;
+    int up = previous ? previous[i] : 0;
+    if (filter == kPngFilterSub) {
+      out[i] = row[i] - left;
+    } else if (filter == kPngFilterUp) {
+      out[i] = row[i] - up;
+    } else if (filter == kPngFilterAverage) {
+      out[i] = row[i] - (left + up) / 2;
+    } else if (filter == kPngFilterPaeth) {
+      int upLeft = previous && i >= 3 ? previous[i - 3] : 0;
+      out[i] = row[i] - paethPredictor(left, up, upLeft);
+    } else {
+      out[i] = row[i];
+    }
+  }
+}
+
+// A row of a strip's pixels. File rows count from the top.
+static Pixel *stripRow(const ImageFile *file, Pixel *stripPixels,
+                       int fileRow) {
+  return &stripPixels[(size_t)(fileRow % file->rowsPerStrip) *
+                      file->imageWidth];
+}
+
+static void copyRgbRow(const ImageFile *file, const Pixel *pixels,
+                       uint8_t *rgb) {
+  for (int x = 0; x < file->imageWidth; ++x) {
+    rgb[3 * x] = pixels[x].r;
+    rgb[3 * x + 1] = pixels[x].g;
+    rgb[3 * x + 2] = pixels[x].b;
+  }
+}
+
+// Filters and compresses a strip. Each row gets the filter whose output sums
+// to the least in absolute value, the usual guess at what compresses best.
+// The row above a strip may not be in yet, so the first row of a strip only
+// uses the filters that don't look at it.
+static EncodedStrip compressPngStrip(const ImageFile *file, int strip,
+                                     Pixel *pixels) {
+  int firstRow = strip * file->rowsPerStrip;
+  int numRows = file->imageHeight - firstRow < file->rowsPerStrip
+                    ? file->imageHeight - firstRow
+                    : file->rowsPerStrip;
+  int rowSize = file->imageWidth * 3;
+  size_t rawSize = (size_t)numRows * (rowSize + 1);
+  uint8_t *raw = malloc(rawSize);
+  uint8_t *rows = malloc(2 * rowSize);
+  uint8_t *candidates = malloc(kNumPngFilters * rowSize);
+  EncodedStrip encoded = {.rawSize = rawSize};
+  if (!raw || !rows || !candidates) {
+    free(raw);
+    free(rows);
+    free(candidates);
+    return encoded;
+  }
+  uint8_t *out = raw;
+  for (int i = 0; i < numRows; ++i) {
+    uint8_t *row = rows + (i % 2) * rowSize;
+    const uint8_t *previous = i > 0 ? rows + ((i + 1) % 2) * rowSize : NULL;
+    copyRgbRow(file, stripRow(file, pixels, firstRow + i), row);
+    int numFilters = previous ? kNumPngFilters : kPngFilterUp;
+    int bestFilter = 0;
+    long bestCost = -1;
+    for (int filter = 0; filter < numFilters; ++filter) {
+      uint8_t *candidate = candidates + filter * rowSize;
+      filterPngRow(filter, row, previous, rowSize, candidate);
+      long cost = 0;
+      for (int x = 0; x < rowSize; ++x) {
+        cost += abs((int8_t)candidate[x]);
+      }
+      if (bestCost < 0 || cost < bestCost) {
+        bestCost = cost;
+        bestFilter = filter;
+      }
+    }
+    *out++ = bestFilter;
+    memcpy(out, candidates + bestFilter * rowSize, rowSize);
+    out += rowSize;
+  }
+  encoded.adler = adler32(1, raw, rawSize);
+  encoded.bytes = deflateBlocks(raw, rawSize, &encoded.size);
+  free(candidates);
+  free(rows);
+  free(raw);
+  return encoded;
+}
+
+static void writePngHeader(ImageFile *file) {
+  uint8_t header[13] = {0};
+  putBigEndian32(header, file->imageWidth);
+  putBigEndian32(header + 4, file->imageHeight);
+  // 8 bits per channel, RGB; compression, filtering and interlacing are the
+  // defaults.
+  header[8] = 8;
+  header[9] = 2;
+  fwrite(kPngSignature, 1, sizeof(kPngSignature), file->stream);
+  writePngChunk(file->stream, "IHDR", header, sizeof(header));
+  // The image data chunks together make up one zlib stream, so it starts in a
+  // chunk of its own.
+  writePngChunk(file->stream, "IDAT", kZlibHeader, sizeof(kZlibHeader));
+  file->adler = 1;
+}
+
+static void writePngStrip(ImageFile *file, EncodedStrip *strip) {
+  if (!strip->bytes) {
+    atomic_store(&file->failed, true);
+    return;
+  }
+  writePngChunk(file->stream, "IDAT", strip->bytes, strip->size);
+  file->adler = combineAdler32(file->adler, strip->adler, strip->rawSize);
+}
+
+static void writePngTrailer(ImageFile *file) {
+  uint8_t end[sizeof(kDeflateStreamEnd) + 4];
+  memcpy(end, kDeflateStreamEnd, sizeof(kDeflateStreamEnd));
+  putBigEndian32(end + sizeof(kDeflateStreamEnd), file->adler);
+  writePngChunk(file->stream, "IDAT", end, sizeof(end));
+  writePngChunk(file->stream, "IEND", NULL, 0);
+}
+
+/**
+ * QOI, the "Quite OK Image" format: each pixel is a run of the previous one,
+ * a recently seen color, a small difference from the previous one, or the
+ * color in full.
+ */
+
+enum {
+  kQoiOpIndex = 0x00,
+  kQoiOpDiff = 0x40,
+  kQoiOpLuma = 0x80,
+  kQoiOpRun = 0xc0,
+  kQoiOpRGB = 0xfe,
+};
+
+#define kQoiMaxRunLength 62
+
+static void writeQoiHeader(ImageFile *file) {
+  uint8_t header[14] = {'q', 'o', 'i', 'f'};
+  putBigEndian32(header + 4, file->imageWidth);
+  putBigEndian32(header + 8, file->imageHeight);
+  // RGB, sRGB.
+  header[12] = 3;
+  header[13] = 0;
+  fwrite(header, 1, sizeof(header), file->stream);
+  memset(&file->qoi, 0, sizeof(file->qoi));
+  file->qoi.previous = (QoiPixel){0, 0, 0, 255};
+}
+
+static void flushQoiRun(QoiEncoder *encoder, FILE *stream) {
+  if (encoder->runLength > 0) {
+    putc(kQoiOpRun | (encoder->runLength - 1), stream);
+    encoder->runLength = 0;
+  }
+}
+
+static void encodeQoiPixel(QoiEncoder *encoder, Pixel pixel, FILE *stream) {
+  QoiPixel color = {pixel.r, pixel.g, pixel.b, 255};
+  QoiPixel previous = encoder->previous;
+  if (color.r == previous.r && color.g == previous.g &&
+      color.b == previous.b) {
+    if (++encoder->runLength == kQoiMaxRunLength) {
+      flushQoiRun(encoder, stream);
+    }
+    return;
+  }
+  flushQoiRun(encoder, stream);
+  int hash = (color.r * 3 + color.g * 5 + color.b * 7 + color.a * 11) % 64;
+  QoiPixel *seen = &encoder->index[hash];
+  if (seen->r == color.r && seen->g == color.g && seen->b == color.b &&
+      seen->a == color.a) {
+    putc(kQoiOpIndex | hash, stream);
+  } else {
+    *seen = color;
+    int dr = (int8_t)(color.r - previous.r);
+    int dg = (int8_t)(color.g - previous.g);
+    int db = (int8_t)(color.b - previous.b);
+    int drg = dr - dg;
+    int dbg = db - dg;
+    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+      putc(kQoiOpDiff | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2), stream);
+    } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 &&
+               dbg <= 7) {
+      putc(kQoiOpLuma | (dg + 32), stream);
+      putc((drg + 8) << 4 | (dbg + 8), stream);
+    } else {
+      uint8_t bytes[4] = {kQoiOpRGB, color.r, color.g, color.b};
+      fwrite(bytes, 1, sizeof(bytes), stream);
+    }
+  }
+  encoder->previous = color;
+}
+
+static void writeQoiStrip(ImageFile *file, int strip, Pixel *stripPixels) {
+  if (!stripPixels) {
+    atomic_store(&file->failed, true);
+    return;
+  }
+  int firstRow = strip * file->rowsPerStrip;
+  for (int fileRow = firstRow;
+       fileRow < firstRow + file->rowsPerStrip &&
+       fileRow < file->imageHeight;
+       ++fileRow) {
+    const Pixel *pixels = stripRow(file, stripPixels, fileRow);
+    for (int x = 0; x < file->imageWidth; ++x) {
+      encodeQoiPixel(&file->qoi, pixels[x], file->stream);
+    }
+  }
+}
+
+static void writeQoiTrailer(ImageFile *file) {
+  static const uint8_t kEnd[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  flushQoiRun(&file->qoi, file->stream);
+  fwrite(kEnd, 1, sizeof(kEnd), file->stream);
+}
+
+/**
+ * Strips.
+ */
+
+// The strip's pixels, allocated zeroed when the first of them comes in.
+// Returns NULL, and marks the file failed, if they can't be allocated.
+static Pixel *acquireStripPixels(ImageFile *file, int strip) {
+  pthread_mutex_lock(&file->pixelsLock);
+  Pixel *pixels = file->stripPixels[strip];
+  if (!pixels) {
+    pixels = calloc((size_t)file->rowsPerStrip * file->imageWidth,
+                    sizeof(Pixel));
+    file->stripPixels[strip] = pixels;
+    if (!pixels) {
+      atomic_store(&file->failed, true);
+    }
+  }
+  pthread_mutex_unlock(&file->pixelsLock);
+  return pixels;
+}
+
+// Encodes a strip whose pixels are all in and writes out every strip ready
+// to go, in order. Each strip's pixels are freed once it is encoded.
+static void finishStrip(ImageFile *file, int strip) {
+  Pixel *pixels = acquireStripPixels(file, strip);
+  pthread_mutex_lock(&file->pixelsLock);
+  file->stripPixels[strip] = NULL;
+  pthread_mutex_unlock(&file->pixelsLock);
+  EncodedStrip encoded = {0};
+  if (file->format == kImageFormatPNG) {
+    if (pixels) {
+      encoded = compressPngStrip(file, strip, pixels);
+    }
+    free(pixels);
+  } else {
+    encoded.pixels = pixels;
+  }
+  encoded.isReady = true;
+  pthread_mutex_lock(&file->writeLock);
+  file->strips[strip] = encoded;
+  while (file->numStripsWritten < file->numStrips &&
+         file->strips[file->numStripsWritten].isReady) {
+    EncodedStrip *next = &file->strips[file->numStripsWritten];
+    if (file->format == kImageFormatPNG) {
+      writePngStrip(file, next);
+    } else {
+      writeQoiStrip(file, file->numStripsWritten, next->pixels);
+    }
+    free(next->bytes);
+    next->bytes = NULL;
+    free(next->pixels);
+    next->pixels = NULL;
+    file->numStripsWritten++;
+  }
+  pthread_mutex_unlock(&file->writeLock);
+}
+
+// An image file writing to stream, which it closes.
+static ImageFile *createImageStream(FILE *stream, ImageFormat format,
+                                    int imageWidth, int imageHeight) {
+  ImageFile *file = calloc(1, sizeof(ImageFile));
+  if (!file) {
+    printf("Failed to allocate the image\n");
+    fclose(stream);
+    return NULL;
+  }
+  file->format = format;
+  file->stream = stream;
+  file->imageWidth = imageWidth;
+  file->imageHeight = imageHeight;
+  size_t rowSize = (size_t)imageWidth * 3 + 1;
+  // QOI is encoded a pixel at a time, so its strips are single rows.
+  file->rowsPerStrip = 1;
+  if (format == kImageFormatPNG) {
+    file->rowsPerStrip = (kPngStripBytes + rowSize - 1) / rowSize;
+  }
+  file->numStrips =
+      (imageHeight + file->rowsPerStrip - 1) / file->rowsPerStrip;
+  file->stripPixels = calloc(file->numStrips, sizeof(Pixel *));
+  file->numPixelsLeft = malloc(file->numStrips * sizeof(atomic_int));
+  file->strips = calloc(file->numStrips, sizeof(EncodedStrip));
+  if (!file->stripPixels || !file->numPixelsLeft || !file->strips) {
+    printf("Failed to allocate the image\n");
+    fclose(stream);
+    free(file->stripPixels);
+    free(file->numPixelsLeft);
+    free(file->strips);
+    free(file);
+    return NULL;
+  }
+  for (int strip = 0; strip < file->numStrips; ++strip) {
+    int numRows = imageHeight - strip * file->rowsPerStrip;
+    numRows = numRows < file->rowsPerStrip ? numRows : file->rowsPerStrip;
+    atomic_init(&file->numPixelsLeft[strip], numRows * imageWidth);
+  }
+  pthread_mutex_init(&file->writeLock, NULL);
+  pthread_mutex_init(&file->pixelsLock, NULL);
+  atomic_init(&file->failed, false);
+  if (format == kImageFormatPNG) {
+    writePngHeader(file);
+  } else {
+    writeQoiHeader(file);
+  }
+  return file;
+}
+
+ImageFile *createImageFile(const char *filename, ImageFormat format,
+                           int imageWidth, int imageHeight) {
+  if (format == kImageFormatBMP) {
+    BitmapFile *bitmap = createBitmapFile(filename, imageWidth, imageHeight);
+    if (!bitmap) {
+      return NULL;
+    }
+    ImageFile *file = calloc(1, sizeof(ImageFile));
+    if (!file) {
+      printf("Failed to allocate the image\n");
+      closeBitmapFile(bitmap);
+      return NULL;
+    }
+    file->format = format;
+    file->bitmap = bitmap;
+    return file;
+  }
+  if (format == kImageFormatRaw) {
+    printf("Raw images can only be sent, not written to files\n");
+    return NULL;
+  }
+  FILE *stream = fopen(filename, "wb");
+  if (!stream) {
+    printf("Failed to open image file: %d (%s)\n", errno, strerror(errno));
+    return NULL;
+  }
+  return createImageStream(stream, format, imageWidth, imageHeight);
+}
+
+void writeImagePixels(ImageFile *file, int row, int column,
+                      const Pixel *pixels, int numPixels) {
+  if (file->bitmap) {
+    writeBitmapPixels(file->bitmap, row, column, pixels, numPixels);
+    return;
+  }
+  int fileRow = file->imageHeight - 1 - row;
+  int strip = fileRow / file->rowsPerStrip;
+  Pixel *stripPixels = acquireStripPixels(file, strip);
+  if (stripPixels) {
+    memcpy(&stripRow(file, stripPixels, fileRow)[column], pixels,
+           numPixels * sizeof(Pixel));
+  }
+  if (atomic_fetch_sub(&file->numPixelsLeft[strip], numPixels) ==
+      numPixels) {
+    finishStrip(file, strip);
+  }
+}
+
+int closeImageFile(ImageFile *file) {
+  if (file->bitmap) {
+    int result = closeBitmapFile(file->bitmap);
+    free(file);
+    return result;
+  }
+  for (int strip = 0; strip < file->numStrips; ++strip) {
+    if (atomic_exchange(&file->numPixelsLeft[strip], 0) > 0) {
+      finishStrip(file, strip);
+    }
+  }
+  if (file->format == kImageFormatPNG) {
+    writePngTrailer(file);
+  } else {
+    writeQoiTrailer(file);
+  }
+  bool failed = atomic_load(&file->failed) || ferror(file->stream);
+  int error = failed ? errno : 0;
+  if (fclose(file->stream) != 0 && !failed) {
+    failed = true;
+    error = errno;
+  }
+  pthread_mutex_destroy(&file->pixelsLock);
+  pthread_mutex_destroy(&file->writeLock);
+  free(file->strips);
+  free(file->numPixelsLeft);
+  free(file->stripPixels);
+  free(file);
+  if (failed) {
+    printf("Failed to write image file: %d (%s)\n", error, strerror(error));
+    return 1;
+  }
+  return 0;
+}
+
+typedef struct StripJob {
+  ImageFile *file;
+  const Pixel *pixels;
+} StripJob;
+
+static void writeStripRows(int strip, void *context) {
+  StripJob *job = context;
+  ImageFile *file = job->file;
+  int firstRow = strip * file->rowsPerStrip;
+  for (int fileRow = firstRow;
+       fileRow < firstRow + file->rowsPerStrip &&
+       fileRow < file->imageHeight;
+       ++fileRow) {
+    int row = file->imageHeight - 1 - fileRow;
+    writeImagePixels(file, row, 0, &job->pixels[(size_t)row * file->imageWidth],
+                     file->imageWidth);
+  }
+}
+
+// Writes the whole image into a file made by createImageStream().
+static int writeImageStream(ImageFile *file, const Pixel *pixels,
+                            TilePool *pool) {
+  StripJob job = {.file = file, .pixels = pixels};
+  if (pool) {
+    runTasks(pool, file->numStrips, writeStripRows, &job);
+  } else {
+    for (int strip = 0; strip < file->numStrips; ++strip) {
+      writeStripRows(strip, &job);
+    }
+  }
+  return closeImageFile(file);
+}
+
+int writeImage(const Pixel *pixels, int imageWidth, int imageHeight,
+               ImageFormat format, const char *filename, TilePool *pool) {
+  if (format == kImageFormatBMP) {
+    return writeBitmap(pixels, imageWidth, imageHeight, filename);
+  }
+  ImageFile *file =
+      createImageFile(filename, format, imageWidth, imageHeight);
+  if (!file) {
+    return 1;
+  }
+  return writeImageStream(file, pixels, pool);
+}
+
+uint8_t *encodeImage(const Pixel *pixels, int imageWidth, int imageHeight,
+                     ImageFormat format, TilePool *pool, size_t *size) {
+  if (format == kImageFormatBMP) {
+    return encodeBitmap(pixels, imageWidth, imageHeight, size);
+  }
+  if (format == kImageFormatRaw) {
+    size_t rawSize = (size_t)imageWidth * imageHeight * sizeof(Pixel);
+    uint8_t *bytes = malloc(rawSize);
+    if (bytes) {
+      memcpy(bytes, pixels, rawSize);
+      *size = rawSize;
+    }
+    return bytes;
+  }
+  char *bytes = NULL;
+  size_t streamSize = 0;
+  FILE *stream = open_memstream(&bytes, &streamSize);
+  if (!stream) {
+    return NULL;
+  }
+  ImageFile *file = createImageStream(stream, format, imageWidth, imageHeight);
+  // The stream's buffer is only final once the stream is closed.
+  if (!file || writeImageStream(file, pixels, pool) != 0) {
+    free(bytes);
+    return NULL;
+  }
+  *size = streamSize;
+  return (uint8_t *)bytes;
+}
@@ -0,0 +1,63 @@
+#ifndef IMAGEFILE_H
+#define IMAGEFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+#include "pool.h"
+
+typedef enum ImageFormat {
+  kImageFormatBMP,
+  kImageFormatQOI,
+  kImageFormatPNG,
+  // width x height 3-byte BGR pixels, bottom row first. Only the render
+  // server sends these; files are never raw.
+  kImageFormatRaw,
+} ImageFormat;
+
+// Parses bmp, qoi or png.
+bool parseImageFormat(const char *name, ImageFormat *format);
+
+// The format filename's extension names, or BMP if it names none.
+ImageFormat imageFormatForFilename(const char *filename);
+
+const char *imageFormatExtension(ImageFormat format);
+
+// An image file being written a piece at a time, in any order and from any
+// number of threads, like a BitmapFile. Row 0 is the bottom row of the image.
+// PNG and QOI images are stored top row first, so they are split into strips
+// of rows from the top, and each strip is encoded and written once its last
+// pixel comes in and the strips above it are out. PNG strips are compressed
+// on their own, by the thread that completes them, so they compress in
+// parallel and while later rows are still rendering. Only the strips not
+// yet encoded are held in memory.
+typedef struct ImageFile ImageFile;
+
+// Creates filename for an imageWidth x imageHeight image. Returns NULL on
+// failure.
+ImageFile *createImageFile(const char *filename, ImageFormat format,
+                           int imageWidth, int imageHeight);
+
+// Writes numPixels pixels into a row, starting at column. Each pixel must be
+// written exactly once. Failures are reported by closeImageFile().
+void writeImagePixels(ImageFile *file, int row, int column,
+                      const Pixel *pixels, int numPixels);
+
+// Writes out any strips not yet complete, with the pixels never written as
+// black, and closes the file. Returns 1 if it or any earlier write failed.
+int closeImageFile(ImageFile *file);
+
+// Writes a whole image of imageWidth x imageHeight pixels, bottom row first,
+// encoding strips on the pool's threads. pool may be NULL, to encode on the
+// calling thread.
+int writeImage(const Pixel *pixels, int imageWidth, int imageHeight,
+               ImageFormat format, const char *filename, TilePool *pool);
+
+// writeImage() into memory. Returns the file's bytes, which the caller frees,
+// or NULL on failure.
+uint8_t *encodeImage(const Pixel *pixels, int imageWidth, int imageHeight,
+                     ImageFormat format, TilePool *pool, size_t *size);
+
+#endif /* IMAGEFILE_H */
@@ -1,217 +1,2898 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "animation.h"
 #include "bitmap.h"
+#include "brickmap.h"
+#include "checkpoint.h"
+#include "denoise.h"
+#include "distribute.h"
+#include "imagefile.h"
 #include "math.h"
+#include "packet.h"
+#include "pool.h"
+#include "progressive.h"
+#include "scene.h"
+#include "server.h"
+#include "scenekernel.h"
+#include "shadowcache.h"
+#include "temporal.h"
+
+// Render settings that used to be fixed at compile time. The HQ build
+// defaults to the high preset.
+typedef struct QualityPreset {
+  const char *name;
+  int imageWidth;
+  int imageHeight;
+  int subPixelsDim;
+  int numRayMarchSteps;
+} QualityPreset;
+
+const QualityPreset kQualityPresets[] = {
+    {.name = "low",
+     .imageWidth = 256,
+     .imageHeight = 256,
+     .subPixelsDim = 4,
+     .numRayMarchSteps = 128},
+    {.name = "high",
+     .imageWidth = 1024,
+     .imageHeight = 1024,
+     .subPixelsDim = 1,
+     .numRayMarchSteps = 1024},
+};
 
 #if HQ
-const int kNumPixelRows = 1024;
-const int kNumPixelColumns = 1024;
-const int kNumSubPixelsDim = 1;
+const QualityPreset *const kDefaultQuality = &kQualityPresets[1];
 #else
-const int kNumPixelRows = 256;
-const int kNumPixelColumns = 256;
-const int kNumSubPixelsDim = 4;
+const QualityPreset *const kDefaultQuality = &kQualityPresets[0];
 #endif
 
-// The number of rays to cast per pixel.
-const int kNumSubPixels = kNumSubPixelsDim * kNumSubPixelsDim;
-
-// Our scene exists within a 1x1x1 cube centered at the origin.
-const Point kCameraPosition = {.x = 0.0, .y = 0.0, .z = 0.5};
-const Point kLightPosition = {.x = -0.2, .y = 0.2, .z = 0.5};
+// Our scene exists within a 1x1x1 cube centered at the origin. These are the
+// defaults; the camera and light can be moved from the command line or by an
+// animation.
+const Point kDefaultCameraPosition = {.x = 0.0, .y = 0.0, .z = 0.5};
+const Point kDefaultCameraTarget = {.x = 0.0, .y = 0.0, .z = 0.0};
+const Point kDefaultLightPosition = {.x = -0.2, .y = 0.2, .z = 0.5};
 
 const int kMaxBrightness = 0xFF;
 
-typedef struct Material {
-  Color diffuse;
-  bool isConductive;
-  // How much a ray of light bends when passing from one medium to another.
-  Color refractiveIndex;
-  // The reduction in intensity as light propagates through the material due to
-  // scattering of light and absorption.
-  Color extinctionCoeff;
-} Material;
-
-typedef struct SDFResult {
-  float distance;
-  Material material;
-} SDFResult;
-
 #define kWhiteColor \
   (Color) { .r = 1.0, .g = 1.0, .b = 1.0 }
-#define kGreyColor \
-  (Color) { .r = 0.7, .g = 0.7, .b = 0.7 }
-
-#define kGoldRefractiveIndex \
-  { .r = 0.183, .g = 0.421, .b = 1.373 }
-#define kGoldExtinctionCoeff \
-  { .r = 3.424, .g = 2.346, .b = 1.77 }
-
-#define kSilverRefractiveIndex \
-  { .r = 0.159, .g = 0.145, .b = 0.135 }
-#define kSilverExtinctionCoeff \
-  { .r = 3.929, .g = 3.190, .b = 2.380 }
-
-const Material kGoldMaterial = {.diffuse = kWhiteColor,
-                                .isConductive = true,
-                                .refractiveIndex = kGoldRefractiveIndex,
-                                .extinctionCoeff = kGoldExtinctionCoeff};
-
-const Material kSilverMaterial = {.diffuse = kWhiteColor,
-                                  .isConductive = true,
-                                  .refractiveIndex = kSilverRefractiveIndex,
-                                  .extinctionCoeff = kSilverExtinctionCoeff};
-
-const Material kPlaneMaterial = {.diffuse = kGreyColor,
-                                 .isConductive = false,
-                                 .refractiveIndex = kWhiteColor,
-                                 .extinctionCoeff = kWhiteColor};
-
-const Vector kIVector = {.x = 1.0, .y = 0.0, .z = 0.0};
-const Vector kJVector = {.x = 0.0, .y = 1.0, .z = 0.0};
-const Vector kKVector = {.x = 0.0, .y = 0.0, .z = 1.0};
-
-SDFResult unionOp2(SDFResult result, float distance, Material material) {
-  float unionDistance = unionOp(result.distance, distance);
-  SDFResult otherResult = {.distance = distance, .material = material};
-  return unionDistance == result.distance ? result : otherResult;
-}
-
-float planeSDF2(Point p, Vector n) { return planeSDF(p, n, 0.0); }
-
-SDFResult sceneSDF2(Point p) {
-  Transform planeTransform = makeRotationY(0.8);
-  Point planeTx = makePoint(p.x, p.y + 0.25, p.z + 1.0);
-  Point planeTx2 = vectorToPoint(
-      applyTransform(planeTransform, vectorFromOriginToPoint(planeTx)));
-
-  Point sphere1Tx = makePoint(p.x + 0.15, p.y - 0.2, p.z - 0.15);
-  SDFResult result = {.distance = sphereSDF(sphere1Tx, 0.1),
-                      .material = kGoldMaterial};
-
-  Point sphere2Tx = makePoint(p.x - 0.2, p.y, p.z + 0);
-  result = unionOp2(result, sphereSDF(sphere2Tx, 0.2), kSilverMaterial);
-  result = unionOp2(result, planeSDF2(planeTx2, kIVector), kPlaneMaterial);
-  result = unionOp2(result, planeSDF2(planeTx2, kJVector), kPlaneMaterial);
-  result = unionOp2(result, planeSDF2(planeTx2, kKVector), kPlaneMaterial);
-  return result;
+
+/**
+ * Per-pixel costs, counted only in builds with -DINSTRUMENT=1 so that normal
+ * builds don't pay for them. Every march step, SDF evaluation, shadow step and
+ * bounce is charged to the pixel whose primary ray it was done for. Tile
+ * functions point gThreadRayCosts at each of a batch's rays' pixel costs
+ * before marching it, and gThreadCost is the one being charged at the moment.
+ */
+
+#if INSTRUMENT
+typedef enum CostMetric {
+  // Primary and reflection march steps.
+  kCostMarchSteps,
+  kCostSDFEvaluations,
+  kCostShadowSteps,
+  // The most reflections any of the pixel's paths took.
+  kCostBounceDepth,
+  // Rays of any type that ran out of steps.
+  kCostOutOfSteps,
+  kNumCostMetrics,
+} CostMetric;
+
+// Names for the summary and the heatmaps' filenames.
+const char *const kCostMetricNames[kNumCostMetrics] = {
+    "steps", "sdf", "shadow", "bounces", "outofsteps"};
+
+typedef struct PixelCost {
+  int counts[kNumCostMetrics];
+} PixelCost;
+
+_Thread_local PixelCost *const *gThreadRayCosts;
+_Thread_local PixelCost *gThreadCost;
+
+void chargeCost(CostMetric metric, int amount) {
+  if (gThreadCost) {
+    gThreadCost->counts[metric] += amount;
+  }
+}
+
+// Charges what follows to cost, or to nothing if it's NULL.
+void chargeTo(PixelCost *cost) { gThreadCost = cost; }
+
+// Charges what follows to the pixel of ray i of the batch.
+void chargeRay(int i) {
+  gThreadCost = gThreadRayCosts ? gThreadRayCosts[i] : NULL;
+}
+#else
+#define chargeCost(metric, amount)
+#define chargeTo(cost)
+#define chargeRay(i)
+#endif
+
+// The scene being rendered. sceneSDF() has to be a plain SDF, so it can't take
+// the scene as an argument.
+Scene gScene;
+
+// gScene compiled into specialized code, if it has been.
+SceneKernel *gSceneKernel;
+
+float sceneSDF(Point p) {
+  chargeCost(kCostSDFEvaluations, 1);
+  if (gSceneKernel) {
+    return gSceneKernel->distance(p);
+  }
+  return sceneDistance(&gScene, p);
+}
+
+// An optional cache of gScene's distance field.
+BrickMap *gBrickMap;
+
+// The SDF rays are marched through. It only has to be exact near surfaces, so
+// it uses the brick map when there is one. Normals and soft shadows depend on
+// the distances themselves and keep using sceneSDF().
+float marchSDF(Point p) {
+  chargeCost(kCostSDFEvaluations, 1);
+  if (gBrickMap) {
+    return brickMapDistance(gBrickMap, &gScene, p);
+  }
+  if (gSceneKernel) {
+    return gSceneKernel->distance(p);
+  }
+  return sceneDistance(&gScene, p);
+}
+
+// The surface normal at p, by finite differences.
+Vector sceneNormal(Point p) {
+  if (gSceneKernel) {
+    return gSceneKernel->normal(p);
+  }
+  return normalForPointAndSDF(p, sceneSDF);
+}
+
+typedef enum RayType {
+  kRayPrimary,
+  kRayReflection,
+  kRayShadow,
+  kNumRayTypes,
+} RayType;
+
+const char *const kRayTypeNames[kNumRayTypes] = {"primary", "reflection",
+                                                 "shadow"};
+
+// How much the enhanced marcher stretches its steps.
+const float kMarchRelaxation = 1.2;
+
+// How far the enhanced marcher follows rays before calling them misses. Scenes
+// are modelled around a unit cube.
+const float kMarchMaxDistance = 1000.0;
+
+// The most plain steps a cone test's hit is marched on to reach the surface.
+#define kConeHitRefinementSteps 32
+
+typedef struct RenderContext {
+  int imageWidth;
+  int imageHeight;
+  // Pixels are split into a subPixelsDim x subPixelsDim grid of primary rays.
+  int subPixelsDim;
+  int numRayMarchSteps;
+  Point cameraPosition;
+  Point lightPosition;
+  // Image coordinates in [-0.5, 0.5] map to imagePlaneCenter +
+  // x * imagePlaneRight + y * imagePlaneUp. Set by aimCamera().
+  Point imagePlaneCenter;
+  Vector imagePlaneRight;
+  Vector imagePlaneUp;
+  // The radius of a primary ray's cone per unit of distance. Set by
+  // aimCamera().
+  float pixelConeRadius;
+  PacketBackend packetBackend;
+  // Ray types marched by sphereTrace() with kMarchRelaxation, and cones for
+  // secondary rays, rather than by plain sphere tracing.
+  bool isRelaxedMarch[kNumRayTypes];
+  // Whether to count march steps, which marches every ray with sphereTrace().
+  bool countsMarchSteps;
+  // Whether renderTile() starts primary rays where a cone-marching prepass
+  // found the scene to begin.
+  bool usesDepthPrepass;
+  // Reuses the last frame's hits and colors for animations, if set.
+  TemporalCache *temporalCache;
+  // Whether mirrors look their reflectance up in their materials' Fresnel
+  // tables rather than computing it exactly.
+  bool usesFresnelTables;
+  // Light visibility baked for lightPosition, if set.
+  ShadowCache *shadowCache;
+#if INSTRUMENT
+  // The fixed grid's costs, row by row, if they're being counted.
+  PixelCost *pixelCosts;
+#endif
+  // Finished pixel rows go into the framebuffer if there is one and straight
+  // to the output file otherwise, which writes them out as soon as its format
+  // allows.
+  Pixel *framebuffer;
+  ImageFile *output;
+  // The part of the image the framebuffer holds, or an empty tile if it holds
+  // the whole image.
+  Tile framebufferTile;
+  // If set, tiles fill in the G-buffer instead of storing pixels, and
+  // renderImage() stores them once denoiseGBuffer() has filtered the whole
+  // image with numDenoisePasses edge-avoiding passes.
+  GBuffer *gbuffer;
+  int numDenoisePasses;
+
+  // Adaptive sampling only. Pixels are split into an adaptiveDim x
+  // adaptiveDim grid, of which the first pass samples adaptiveDim cells.
+  int adaptiveDim;
+  atomic_long numRefinedPixels;
+} RenderContext;
+
+// Places the camera at position, looking at target. The image plane passes
+// through the target and is as wide as the camera is far from it, the view
+// the default camera has always had, stretched to the image's aspect ratio.
+void aimCamera(RenderContext *renderContext, Point position, Point target) {
+  Vector toTarget = vectorFromPointToPoint(position, target);
+  Vector forward = normalizedVector(toTarget);
+  Vector right = crossProduct(forward, makeVector(0.0, 1.0, 0.0));
+  if (vectorLength(right) == 0.0) {
+    // Looking straight up or down.
+    right = makeVector(1.0, 0.0, 0.0);
+  }
+  right = normalizedVector(right);
+  Vector up = crossProduct(right, forward);
+  float scale = vectorLength(toTarget) / 0.5;
+  float aspectRatio =
+      (float)renderContext->imageWidth / renderContext->imageHeight;
+  renderContext->cameraPosition = position;
+  renderContext->imagePlaneCenter = target;
+  renderContext->imagePlaneRight = scaleVector(right, scale * aspectRatio);
+  renderContext->imagePlaneUp = scaleVector(up, scale);
+  // Each sub-pixel's ray gets its own share of the pixel.
+  float samplePlaneWidth = vectorLength(renderContext->imagePlaneRight) /
+                           renderContext->imageWidth /
+                           renderContext->subPixelsDim;
+  renderContext->pixelConeRadius =
+      0.5 * samplePlaneWidth / vectorLength(toTarget);
+}
+
+/**
+ * March statistics. Each thread counts its own steps and adds them to the
+ * totals after every tile.
+ */
+
+typedef struct MarchStats {
+  long numRays[kNumRayTypes];
+  long numSteps[kNumRayTypes];
+  long numOutOfSteps[kNumRayTypes];
+  long numEscaped[kNumRayTypes];
+  // The depth prepass's cones.
+  long numCones;
+  long numConeSteps;
+} MarchStats;
+
+_Thread_local MarchStats gThreadMarchStats;
+MarchStats gMarchStats;
+pthread_mutex_t gMarchStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void countMarch(RayType type, const MarchResult *march) {
+  gThreadMarchStats.numRays[type]++;
+  gThreadMarchStats.numSteps[type] += march->numSteps;
+  if (march->outcome == kMarchOutOfSteps) {
+    gThreadMarchStats.numOutOfSteps[type]++;
+  } else if (march->outcome == kMarchEscaped) {
+    gThreadMarchStats.numEscaped[type]++;
+  }
+}
+
+void flushMarchStats(const RenderContext *renderContext) {
+  if (!renderContext->countsMarchSteps) {
+    return;
+  }
+  pthread_mutex_lock(&gMarchStatsMutex);
+  for (int type = 0; type < kNumRayTypes; ++type) {
+    gMarchStats.numRays[type] += gThreadMarchStats.numRays[type];
+    gMarchStats.numSteps[type] += gThreadMarchStats.numSteps[type];
+    gMarchStats.numOutOfSteps[type] += gThreadMarchStats.numOutOfSteps[type];
+    gMarchStats.numEscaped[type] += gThreadMarchStats.numEscaped[type];
+  }
+  gMarchStats.numCones += gThreadMarchStats.numCones;
+  gMarchStats.numConeSteps += gThreadMarchStats.numConeSteps;
+  pthread_mutex_unlock(&gMarchStatsMutex);
+  memset(&gThreadMarchStats, 0, sizeof(MarchStats));
+}
+
+// Counts a march in the march stats and charges it to the current pixel.
+void recordMarch(const RenderContext *renderContext, RayType type,
+                 const MarchResult *march) {
+  if (renderContext->countsMarchSteps) {
+    countMarch(type, march);
+  }
+  chargeCost(type == kRayShadow ? kCostShadowSteps : kCostMarchSteps,
+             march->numSteps);
+  chargeCost(kCostOutOfSteps, march->outcome == kMarchOutOfSteps);
+}
+
+void printMarchStats(const RenderContext *renderContext) {
+  printf("%-10s %-8s %12s %12s %10s %14s %10s\n", "rays", "march", "count",
+         "steps", "per ray", "out of steps", "escaped");
+  for (int type = 0; type < kNumRayTypes; ++type) {
+    long numRays = gMarchStats.numRays[type];
+    printf("%-10s %-8s %12ld %12ld %10.2f %14ld %10ld\n", kRayTypeNames[type],
+           renderContext->isRelaxedMarch[type] ? "relaxed" : "plain", numRays,
+           gMarchStats.numSteps[type],
+           numRays ? (double)gMarchStats.numSteps[type] / numRays : 0.0,
+           gMarchStats.numOutOfSteps[type], gMarchStats.numEscaped[type]);
+  }
+  if (gMarchStats.numCones > 0) {
+    printf("%-10s %-8s %12ld %12ld %10.2f\n", "cone", "prepass",
+           gMarchStats.numCones, gMarchStats.numConeSteps,
+           (double)gMarchStats.numConeSteps / gMarchStats.numCones);
+  }
+}
+
+// Whether every march has to be recorded, which only the one-ray-at-a-time
+// marchers do.
+bool recordsMarches(const RenderContext *renderContext) {
+#if INSTRUMENT
+  // Only sphereTrace() reports its steps.
+  if (renderContext->pixelCosts) {
+    return true;
+  }
+#endif
+  return renderContext->countsMarchSteps;
 }
 
-float sceneSDF(Point p) { return sceneSDF2(p).distance; }
+// Whether rays of the type have to go through sphereTrace() when they're
+// marched one at a time.
+bool usesSphereTrace(const RenderContext *renderContext, RayType type) {
+  return renderContext->isRelaxedMarch[type] || recordsMarches(renderContext);
+}
 
-// Returns the amount of incoming light reflected from a conductive material in
-// the range of [0.0, 1.0].
-// https://www.pbr-book.org/3ed-2018/Reflection_Models/Specular_Reflection_and_Transmission
-float conductiveReflectance(float refractiveIndex, float extinctionCoeff,
-                            float angle) {
-  float n = refractiveIndex;
-  float k = extinctionCoeff;
-  float t = angle;
-  float rp = ((n * n + k * k) * cosf(t) * cosf(t) - 2.0 * n * cosf(t) + 1.0) /
-             ((n * n + k * k) * cosf(t) * cosf(t) + 2.0 * n * cosf(t) + 1.0);
-  float rs = ((n * n + k * k) - 2.0 * n * cosf(t) + cosf(t) * cosf(t)) /
-             ((n * n + k * k) + 2.0 * n * cosf(t) + cosf(t) * cosf(t));
-  return (rp + rs) * 0.5;
+MarchSettings marchSettings(const RenderContext *renderContext,
+                            RayType type) {
+  if (!renderContext->isRelaxedMarch[type]) {
+    return (MarchSettings){
+        .relaxation = 1.0, .coneRadius = 0.0, .maxDistance = INFINITY};
+  }
+  // Primary rays get no hit cone. It would take any ray passing within half a
+  // sub-pixel of a silhouette as a hit, widening every silhouette, which on
+  // scenes of many small spheres changes much of the image. Secondary rays
+  // measure their cones from their own origins, which underestimates them
+  // and so errs towards precision.
+  return (MarchSettings){
+      .relaxation = kMarchRelaxation,
+      .coneRadius = type == kRayPrimary ? 0.0 : renderContext->pixelConeRadius,
+      .maxDistance = kMarchMaxDistance};
 }
 
-Color conductiveReflectance2(Color refractiveIndex, Color extinctionCoeff,
-                             float angle) {
-  float r = conductiveReflectance(refractiveIndex.r, extinctionCoeff.r, angle);
-  float g = conductiveReflectance(refractiveIndex.g, extinctionCoeff.g, angle);
-  float b = conductiveReflectance(refractiveIndex.b, extinctionCoeff.b, angle);
-  return makeColor(r, g, b);
+// Moves a hit that a cone test accepted up to a cone's radius in front of the
+// surface onto it, so it's shaded and reflected from the surface, by marching
+// on with plain steps. Rays that only pass near a surface stop where they got
+// closest to it.
+Point refineConeHit(Point point, Vector direction) {
+  float d = marchSDF(point);
+  for (int i = 0; i < kConeHitRefinementSteps && d > SDF_EPSILON; ++i) {
+    Point next = addVectorToPoint(point, direction, d);
+    float nextD = marchSDF(next);
+    if (nextD >= d) {
+      break;
+    }
+    point = next;
+    d = nextD;
+  }
+  return point;
+}
+
+// Marches a ray of the given type the way the context asks for.
+bool marchRay(const RenderContext *renderContext, RayType type, Ray ray,
+              int maxSteps, Point *intersectionPoint) {
+  if (!usesSphereTrace(renderContext, type)) {
+    if (gSceneKernel && !gBrickMap) {
+      return gSceneKernel->rayMarch(ray, maxSteps, intersectionPoint);
+    }
+    return rayMarch(ray, marchSDF, maxSteps, intersectionPoint);
+  }
+  MarchSettings settings = marchSettings(renderContext, type);
+  MarchResult march = sphereTrace(ray, marchSDF, maxSteps, &settings);
+  recordMarch(renderContext, type, &march);
+  *intersectionPoint = march.point;
+  if (march.outcome == kMarchHit && settings.coneRadius > 0.0) {
+    *intersectionPoint = refineConeHit(march.point, ray.direction);
+  }
+  return march.outcome == kMarchHit;
+}
+
+// How much light from the light gets to point, from 0 in full shadow to 1.
+float lightVisibility(const RenderContext *renderContext, Point point,
+                      Point lightPosition) {
+  if (!usesSphereTrace(renderContext, kRayShadow)) {
+    if (gSceneKernel) {
+      return gSceneKernel->softShadow(point, lightPosition, 8.0);
+    }
+    return softShadow(point, lightPosition, sceneSDF, 8.0);
+  }
+  // Plain shadow marches are never cut short, like softShadow()'s.
+  int maxSteps = renderContext->isRelaxedMarch[kRayShadow]
+                     ? renderContext->numRayMarchSteps
+                     : INT_MAX;
+  MarchSettings settings = marchSettings(renderContext, kRayShadow);
+  MarchResult march;
+  float visibility = sphereTraceSoftShadow(point, lightPosition, sceneSDF, 8.0,
+                                           maxSteps, &settings, &march);
+  recordMarch(renderContext, kRayShadow, &march);
+  return visibility;
 }
 
 float angleBetweenVectors(Vector a, Vector b) {
   return acosf(dotProduct(a, b) / (vectorLength(a) * vectorLength(b)));
 }
 
-// The color of a point depends on the position of lights and the direction of
-// the viewer, the material of the object at the point, etc.
-Color pointColor(Point point, Vector direction, int numBounces) {
-  Vector normal = normalForPointAndSDF(point, sceneSDF);
-  Material material = sceneSDF2(point).material;
-  if (!material.isConductive) {
-    // When raymarching from the intersection point to the light, we need
-    // to start a little ways away from the intersection point so that we
-    // don't just hit the same intersection point again.
-    Vector pointToLightDir = directionFromPointToPoint(point, kLightPosition);
-    Point nearbyIntPoint = addVectorToPoint(point, pointToLightDir, 0.01);
-    float shadow = lerp(
-        softShadow(nearbyIntPoint, kLightPosition, sceneSDF, 8.0), 0.2, 1.0);
-    // dp = 1.0 means the vectors have the same direction.
-    // dp = -1.0 means the vectors have opposite directions.
-    float dp = dotProduct(normal, pointToLightDir);
-    float diffuseT = invLerp(dp, -1.0, 1.0) * shadow;
-    return scaleColor(material.diffuse, diffuseT);
-  }
-  if (numBounces == 0) {
-    // The material at this point is conductive, but we are out of bounces, so
-    // just return something. If this happens then we need to do more bounces
-    // for our specific scene.
-    return kWhiteColor;
-  }
-  // Perform a ray march from the point in the direction of the reflection to
-  // find the color of the object in the reflection.
-  Vector reflectionDirection = subtractVectors(
-      direction, scaleVector(normal, 2.0 * dotProduct(direction, normal)));
-  Point nearbyIntPoint = addVectorToPoint(point, reflectionDirection, 0.001);
-  Ray reflectionRay = makeRay(nearbyIntPoint, reflectionDirection);
-  Point reflectIntPoint;
-  if (!rayMarch(reflectionRay, sceneSDF, &reflectIntPoint)) {
-    // The reflection hit nothing in our scene.
-    return makeColor(0.0, 0.0, 0.0);
-  }
-  Color colorInReflection =
-      pointColor(reflectIntPoint, direction, numBounces - 1);
-  float lightAngle =
-      angleBetweenVectors(scaleVector(direction, -1.0), normal) * 0.5;
-  Color reflectance = conductiveReflectance2(
-      material.refractiveIndex, material.extinctionCoeff, lightAngle);
-  return multiplyColors(colorInReflection, reflectance);
-}
-
-Color pixelColor(Point point) {
-  Vector cameraToPointDir = directionFromPointToPoint(kCameraPosition, point);
-  Ray cameraToPixelRay = makeRay(kCameraPosition, cameraToPointDir);
-  Point intPoint;
-  if (!rayMarch(cameraToPixelRay, sceneSDF, &intPoint)) {
-    return makeColor(0.0, 0.0, 0.0);
-  }
-  return pointColor(intPoint, cameraToPointDir, 64);
-}
-
-int main() {
-  Pixel pixels[kNumPixelRows * kNumPixelColumns];
-  for (int pixelRow = 0; pixelRow < kNumPixelRows; ++pixelRow) {
-    for (int pixelColumn = 0; pixelColumn < kNumPixelColumns; ++pixelColumn) {
+Ray primaryRay(const RenderContext *renderContext, Point point) {
+  Point cameraPosition = renderContext->cameraPosition;
+  Vector cameraToPointDir = directionFromPointToPoint(cameraPosition, point);
+  return makeRay(cameraPosition, cameraToPointDir);
+}
+
+// The point on the image plane at a fractional pixel row and column.
+Point imagePlanePoint(const RenderContext *renderContext,
+                      float pixelRowAdjusted, float pixelColumnAdjusted) {
+  // Convert from ([0, numPixelRows], [0, numPixelColumns]) to
+  // ([0.0, 1.0], [0.0, 1.0]), and then to ([-0.5, 0.5], [-0.5, 0.5])
+  float x = lerp(pixelColumnAdjusted / renderContext->imageWidth, -0.5, 0.5);
+  float y = lerp(pixelRowAdjusted / renderContext->imageHeight, -0.5, 0.5);
+  Point center = renderContext->imagePlaneCenter;
+  Vector right = renderContext->imagePlaneRight;
+  Vector up = renderContext->imagePlaneUp;
+  return makePoint(center.x + right.x * x + up.x * y,
+                   center.y + right.y * x + up.y * y,
+                   center.z + right.z * x + up.z * y);
+}
+
+// The point on the image plane that a sub-pixel's primary ray passes through,
+// when each pixel is split into a subPixelsDim x subPixelsDim grid.
+Point subPixelPoint(const RenderContext *renderContext, int pixelRow,
+                    int pixelColumn, int subPixelsDim, int subPixel) {
+  // Adjust pixelRow and pixelColumn to account for subsampling.
+  float offset = 1.0 / subPixelsDim / 2.0;
+  float subPixelRowOffset =
+      (subPixel / subPixelsDim) / (float)subPixelsDim + offset;
+  float subPixelColumnOffset =
+      (subPixel % subPixelsDim) / (float)subPixelsDim + offset;
+  return imagePlanePoint(renderContext, pixelRow + subPixelRowOffset,
+                         pixelColumn + subPixelColumnOffset);
+}
+
+void marchRays(const RenderContext *renderContext, RayType type,
+               const Ray *rays, int numRays, int maxSteps, bool *hits,
+               Point *intPoints) {
+  if (recordsMarches(renderContext) ||
+      (gSceneKernel &&
+       renderContext->packetBackend == kPacketBackendScalar)) {
+    // Packets don't report their steps, and the scene kernel beats scalar
+    // packets, so march one ray at a time.
+    for (int i = 0; i < numRays; ++i) {
+      chargeRay(i);
+      hits[i] = marchRay(renderContext, type, rays[i], maxSteps, &intPoints[i]);
+    }
+    return;
+  }
+  MarchSettings settings = marchSettings(renderContext, type);
+  rayMarchPackets(renderContext->packetBackend, &gScene, gBrickMap, rays,
+                  numRays, maxSteps,
+                  renderContext->isRelaxedMarch[type] ? &settings : NULL, hits,
+                  intPoints);
+  if (renderContext->isRelaxedMarch[type] && settings.coneRadius > 0.0) {
+    for (int i = 0; i < numRays; ++i) {
+      if (hits[i]) {
+        intPoints[i] = refineConeHit(intPoints[i], rays[i].direction);
+      }
+    }
+  }
+}
+
+void marchPrimaryRays(const RenderContext *renderContext, const Ray *rays,
+                      int numRays, bool *hits, Point *intPoints) {
+  marchRays(renderContext, kRayPrimary, rays, numRays,
+            renderContext->numRayMarchSteps, hits, intPoints);
+}
+
+/**
+ * Path shading. The hits of a batch of primary rays are followed bounce by
+ * bounce instead of one path at a time. Each bounce's hit points go into a
+ * queue, sorted by material, so that diffuse points and mirrors are each
+ * shaded in one run. The reflection rays of a whole bounce are then marched
+ * together as packets. A mirror's color depends on its reflection's color, so
+ * colors are gathered back from the deepest bounce once every path has ended.
+ * Paths end at diffuse surfaces, when their reflection misses, after
+ * kMaxBounces reflections, or once their throughput drops below
+ * kMinPathThroughput.
+ */
+
+const int kMaxBounces = 64;
+
+// Paths end once no channel of their throughput, the product of the
+// reflectances along them, reaches this. Whatever they would have added is
+// less than half a brightness level.
+const float kMinPathThroughput = 1.0 / 512;
+
+typedef struct PathVertex {
+  Point point;
+  // Every bounce is shaded as if seen along the primary ray.
+  Vector direction;
+  // The index of the vertex this one is the reflection of in the previous
+  // bounce's queue, or for primary hits the index of the ray.
+  int parent;
+  int materialId;
+  Vector normal;
+  // The product of the reflectances of the vertices before this one.
+  Color throughput;
+  // Only for mirrors.
+  Color reflectance;
+  // Only for diffuse surfaces.
+  float visibility;
+  Color color;
+#if INSTRUMENT
+  // The pixel the vertex's path is charged to.
+  PixelCost *cost;
+#endif
+} PathVertex;
+
+// How much light from the light gets to a point on a surface.
+float surfaceLightVisibility(const RenderContext *renderContext, Point point) {
+  // When raymarching from the intersection point to the light, we need
+  // to start a little ways away from the intersection point so that we
+  // don't just hit the same intersection point again.
+  Point lightPosition = renderContext->lightPosition;
+  Vector pointToLightDir = directionFromPointToPoint(point, lightPosition);
+  Point nearbyIntPoint = addVectorToPoint(point, pointToLightDir, 0.01);
+  return lightVisibility(renderContext, nearbyIntPoint, lightPosition);
+}
+
+// How much light from the light gets to a point on a diffuse surface, from
+// the shadow cache if it has it.
+float diffuseLightVisibility(const RenderContext *renderContext, Point point) {
+  float visibility = renderContext->shadowCache
+                         ? shadowCacheVisibility(renderContext->shadowCache,
+                                                 point)
+                         : -1.0;
+  if (visibility < 0.0) {
+    visibility = surfaceLightVisibility(renderContext, point);
+  }
+  return visibility;
+}
+
+// The color of a point on a diffuse surface that a visibility fraction of the
+// light gets to.
+Color diffuseColor(const RenderContext *renderContext, Point point,
+                   Vector normal, const Material *material, float visibility) {
+  float shadow = lerp(visibility, 0.2, 1.0);
+  Vector pointToLightDir =
+      directionFromPointToPoint(point, renderContext->lightPosition);
+  // dp = 1.0 means the vectors have the same direction.
+  // dp = -1.0 means the vectors have opposite directions.
+  float dp = dotProduct(normal, pointToLightDir);
+  float diffuseT = invLerp(dp, -1.0, 1.0) * shadow;
+  return scaleColor(material->diffuse, diffuseT);
+}
+
+// How much of the light arriving at a mirror along -direction it reflects.
+Color mirrorReflectance(const RenderContext *renderContext,
+                        const Material *material, Vector direction,
+                        Vector normal) {
+  if (!renderContext->usesFresnelTables) {
+    float lightAngle =
+        angleBetweenVectors(scaleVector(direction, -1.0), normal) * 0.5;
+    return conductiveReflectance2(material->refractiveIndex,
+                                  material->extinctionCoeff, lightAngle);
+  }
+  // Both vectors are unit length, so this is the cosine of the angle between
+  // them, and the half-angle formula gives the cosine of half of it without an
+  // acosf() and a cosf().
+  float cosine = -dotProduct(direction, normal);
+  float halfAngleCosine = sqrtf(max(0.5 * (1.0 + cosine), 0.0));
+  return lookupFresnelTable(material->fresnelTable, halfAngleCosine);
+}
+
+// Finds the normal and material at every vertex and returns the vertices
+// sorted by material. Frees vertices.
+PathVertex *evaluatePathVertices(PathVertex *vertices, int numVertices) {
+  int *materialStarts = calloc(gScene.numMaterials + 1, sizeof(int));
+  for (int i = 0; i < numVertices; ++i) {
+    PathVertex *vertex = &vertices[i];
+    chargeTo(vertex->cost);
+    chargeCost(kCostSDFEvaluations, 1);
+    SceneSample sample = sampleScene(&gScene, vertex->point);
+    vertex->normal = sample.hasGradient
+                         ? normalizedVector(sample.gradient)
+                         : sceneNormal(vertex->point);
+    vertex->materialId = sample.materialId;
+    materialStarts[vertex->materialId + 1]++;
+  }
+  for (int id = 0; id < gScene.numMaterials; ++id) {
+    materialStarts[id + 1] += materialStarts[id];
+  }
+  PathVertex *sorted = malloc(numVertices * sizeof(PathVertex));
+  for (int i = 0; i < numVertices; ++i) {
+    sorted[materialStarts[vertices[i].materialId]++] = vertices[i];
+  }
+  free(materialStarts);
+  free(vertices);
+  return sorted;
+}
+
+// Shades one bounce's vertices. Fills reflectionRays with the rays of the
+// mirrors whose paths go on, and reflecting with the mirrors' indices, and
+// returns how many there are.
+int shadePathVertices(const RenderContext *renderContext, PathVertex *vertices,
+                      int numVertices, int numBounces, Ray *reflectionRays,
+                      int *reflecting) {
+  int numReflections = 0;
+  for (int i = 0; i < numVertices; ++i) {
+    PathVertex *vertex = &vertices[i];
+    chargeTo(vertex->cost);
+    const Material *material = &gScene.materials[vertex->materialId];
+    if (!material->isConductive) {
+      vertex->visibility = diffuseLightVisibility(renderContext, vertex->point);
+      vertex->color = diffuseColor(renderContext, vertex->point, vertex->normal,
+                                   material, vertex->visibility);
+      continue;
+    }
+    if (numBounces == 0) {
+      // The material at this point is conductive, but we are out of bounces,
+      // so just return something. If this happens then we need to do more
+      // bounces for our specific scene.
+      vertex->color = kWhiteColor;
+      continue;
+    }
+    Vector direction = vertex->direction;
+    Vector normal = vertex->normal;
+    vertex->reflectance =
+        mirrorReflectance(renderContext, material, direction, normal);
+    Color throughput = multiplyColors(vertex->throughput, vertex->reflectance);
+    if (max(throughput.r, max(throughput.g, throughput.b)) <
+        kMinPathThroughput) {
+      vertex->color = makeColor(0.0, 0.0, 0.0);
+      continue;
+    }
+    // Perform a ray march from the point in the direction of the reflection
+    // to find the color of the object in the reflection.
+    Vector reflectionDirection = subtractVectors(
+        direction, scaleVector(normal, 2.0 * dotProduct(direction, normal)));
+    Point nearbyIntPoint =
+        addVectorToPoint(vertex->point, reflectionDirection, 0.001);
+    reflectionRays[numReflections] =
+        makeRay(nearbyIntPoint, reflectionDirection);
+    reflecting[numReflections++] = i;
+  }
+  return numReflections;
+}
+
+// shadeRays(), which also stores the material and normal found at each
+// primary hit in hitMaterials and hitNormals, and if hitVisibilities is set,
+// the light visibility of diffuse ones in it.
+void shadeRaysKeepingHits(const RenderContext *renderContext, const Ray *rays,
+                          const bool *hits, const Point *intPoints,
+                          int numRays, Color *colors, int *hitMaterials,
+                          Vector *hitNormals, float *hitVisibilities) {
+  PathVertex *queues[kMaxBounces + 1];
+  int queueLengths[kMaxBounces + 1];
+  PathVertex *queue = malloc(numRays * sizeof(PathVertex));
+  int queueLength = 0;
+#if INSTRUMENT
+  PixelCost *const *primaryCosts = gThreadRayCosts;
+  PixelCost **reflectionCosts = malloc(numRays * sizeof(PixelCost *));
+#endif
+  for (int i = 0; i < numRays; ++i) {
+    if (!hits[i]) {
+      colors[i] = makeColor(0.0, 0.0, 0.0);
+      continue;
+    }
+    queue[queueLength++] = (PathVertex){.point = intPoints[i],
+                                        .direction = rays[i].direction,
+                                        .parent = i,
+                                        .throughput = kWhiteColor};
+#if INSTRUMENT
+    queue[queueLength - 1].cost = primaryCosts ? primaryCosts[i] : NULL;
+#endif
+  }
+  Ray *reflectionRays = malloc(numRays * sizeof(Ray));
+  bool *reflectionHits = malloc(numRays * sizeof(bool));
+  Point *reflectionPoints = malloc(numRays * sizeof(Point));
+  int *reflecting = malloc(numRays * sizeof(int));
+
+  int numQueues = 0;
+  while (queueLength > 0) {
+    queue = evaluatePathVertices(queue, queueLength);
+    queues[numQueues] = queue;
+    queueLengths[numQueues] = queueLength;
+    int numReflections =
+        shadePathVertices(renderContext, queue, queueLength,
+                          kMaxBounces - numQueues, reflectionRays, reflecting);
+    numQueues++;
+#if INSTRUMENT
+    for (int r = 0; r < numReflections; ++r) {
+      reflectionCosts[r] = queue[reflecting[r]].cost;
+    }
+    gThreadRayCosts = reflectionCosts;
+#endif
+    marchRays(renderContext, kRayReflection, reflectionRays, numReflections,
+              renderContext->numRayMarchSteps, reflectionHits,
+              reflectionPoints);
+#if INSTRUMENT
+    gThreadRayCosts = primaryCosts;
+#endif
+
+    PathVertex *nextQueue = malloc(numReflections * sizeof(PathVertex));
+    int nextQueueLength = 0;
+    for (int r = 0; r < numReflections; ++r) {
+      PathVertex *vertex = &queue[reflecting[r]];
+      if (!reflectionHits[r]) {
+        // The reflection hit nothing in our scene.
+        vertex->color = makeColor(0.0, 0.0, 0.0);
+        continue;
+      }
+      nextQueue[nextQueueLength++] = (PathVertex){
+          .point = reflectionPoints[r],
+          .direction = vertex->direction,
+          .parent = reflecting[r],
+          .throughput =
+              multiplyColors(vertex->throughput, vertex->reflectance)};
+#if INSTRUMENT
+      PixelCost *cost = nextQueue[nextQueueLength - 1].cost = vertex->cost;
+      if (cost && cost->counts[kCostBounceDepth] < numQueues) {
+        cost->counts[kCostBounceDepth] = numQueues;
+      }
+#endif
+    }
+    queue = nextQueue;
+    queueLength = nextQueueLength;
+  }
+  free(queue);
+  chargeTo(NULL);
+
+  for (int q = numQueues - 1; q > 0; --q) {
+    for (int i = 0; i < queueLengths[q]; ++i) {
+      const PathVertex *vertex = &queues[q][i];
+      PathVertex *parent = &queues[q - 1][vertex->parent];
+      parent->color = multiplyColors(vertex->color, parent->reflectance);
+    }
+    free(queues[q]);
+  }
+  if (numQueues > 0) {
+    for (int i = 0; i < queueLengths[0]; ++i) {
+      const PathVertex *vertex = &queues[0][i];
+      colors[vertex->parent] = vertex->color;
+      if (hitMaterials) {
+        hitMaterials[vertex->parent] = vertex->materialId;
+        hitNormals[vertex->parent] = vertex->normal;
+      }
+      if (hitVisibilities) {
+        hitVisibilities[vertex->parent] = vertex->visibility;
+      }
+    }
+    free(queues[0]);
+  }
+#if INSTRUMENT
+  free(reflectionCosts);
+#endif
+  free(reflecting);
+  free(reflectionPoints);
+  free(reflectionHits);
+  free(reflectionRays);
+}
+
+// Finds the color seen along each of a batch of primary rays, given the
+// results of marching them.
+void shadeRays(const RenderContext *renderContext, const Ray *rays,
+               const bool *hits, const Point *intPoints, int numRays,
+               Color *colors) {
+  shadeRaysKeepingHits(renderContext, rays, hits, intPoints, numRays, colors,
+                       NULL, NULL, NULL);
+}
+
+// The color seen along a primary ray, given the result of marching it.
+Color primaryRayColor(const RenderContext *renderContext, Ray ray, bool hit,
+                      Point intPoint) {
+  Color color;
+  shadeRays(renderContext, &ray, &hit, &intPoint, 1, &color);
+  return color;
+}
+
+void storePixelRow(const RenderContext *renderContext, int pixelRow,
+                   int pixelColumn, const Pixel *pixels, int numPixels) {
+  Tile tile = renderContext->framebufferTile;
+  if (renderContext->framebuffer && tile.numColumns > 0) {
+    memcpy(&renderContext->framebuffer[(size_t)(pixelRow - tile.row) *
+                                           tile.numColumns +
+                                       pixelColumn - tile.column],
+           pixels, numPixels * sizeof(Pixel));
+  } else if (renderContext->framebuffer) {
+    memcpy(&renderContext->framebuffer[(size_t)pixelRow *
+                                           renderContext->imageWidth +
+                                       pixelColumn],
+           pixels, numPixels * sizeof(Pixel));
+  } else {
+    writeImagePixels(renderContext->output, pixelRow, pixelColumn, pixels,
+                     numPixels);
+  }
+}
+
+// Stores a pixel's color and the guides the denoiser needs from its samples,
+// given the results of marching and shading them.
+void storeGBufferPixel(const RenderContext *renderContext, int pixelRow,
+                       int pixelColumn, Color color, const bool *hits,
+                       const Point *intPoints, const int *hitMaterials,
+                       const Vector *hitNormals, const float *hitVisibilities,
+                       int numSamples) {
+  GBuffer *gbuffer = renderContext->gbuffer;
+  float material = -1.0;
+  float depth = 0.0;
+  float visibility = 0.0;
+  Vector normal = makeVector(0.0, 0.0, 0.0);
+  int numHits = 0;
+  for (int i = 0; i < numSamples; ++i) {
+    if (!hits[i]) {
+      continue;
+    }
+    if (numHits++ == 0) {
+      material = hitMaterials[i];
+    }
+    depth += vectorLength(
+        vectorFromPointToPoint(renderContext->cameraPosition, intPoints[i]));
+    visibility += hitVisibilities[i];
+    normal.x += hitNormals[i].x;
+    normal.y += hitNormals[i].y;
+    normal.z += hitNormals[i].z;
+  }
+  if (numHits > 0) {
+    depth /= numHits;
+    visibility /= numHits;
+  }
+  if (vectorLength(normal) > 0.0) {
+    normal = normalizedVector(normal);
+  }
+  float values[kNumGBufferPlanes] = {
+      [kGBufferRed] = color.r,        [kGBufferGreen] = color.g,
+      [kGBufferBlue] = color.b,       [kGBufferDepth] = depth,
+      [kGBufferNormalX] = normal.x,   [kGBufferNormalY] = normal.y,
+      [kGBufferNormalZ] = normal.z,   [kGBufferVisibility] = visibility,
+      [kGBufferMaterial] = material};
+  size_t index = (size_t)pixelRow * gbuffer->width + pixelColumn;
+  for (int plane = 0; plane < kNumGBufferPlanes; ++plane) {
+    gbuffer->planes[plane][index] = values[plane];
+  }
+}
+
+/**
+ * Depth prepass. Before a tile's primary rays are marched, a cone is marched
+ * from the camera through the whole tile, then through each quarter of it
+ * starting where the tile's cone stopped, and so on down to small blocks of
+ * pixels. A cone advances by however much the empty sphere around a point on
+ * its axis is wider than the cone there, so every ray inside it is clear of
+ * the scene up to where it stops. Primary rays then start there instead of at
+ * the camera.
+ */
+
+// Blocks this small or smaller aren't split further.
+const int kDepthPrepassBlockSize = 4;
+
+const int kConeMarchSteps = 32;
+
+// Marches a cone containing every ray through the block's pixels, from
+// startDistance, which all of them must be able to start at. Returns how far
+// they can all start from the camera.
+float coneMarch(const RenderContext *renderContext, Tile block,
+                float startDistance) {
+  Point cameraPosition = renderContext->cameraPosition;
+  Vector axis = directionFromPointToPoint(
+      cameraPosition,
+      imagePlanePoint(renderContext, block.row + block.numRows * 0.5,
+                      block.column + block.numColumns * 0.5));
+  // How far the block's rays get from the axis per unit of distance, which is
+  // greatest at the block's corners. Padded against rounding.
+  float spread = 0.0;
+  for (int corner = 0; corner < 4; ++corner) {
+    float row = block.row + (corner / 2) * block.numRows;
+    float column = block.column + (corner % 2) * block.numColumns;
+    Vector direction = directionFromPointToPoint(
+        cameraPosition, imagePlanePoint(renderContext, row, column));
+    spread = max(spread, vectorLength(subtractVectors(direction, axis)));
+  }
+  spread = spread * 1.001 + 1e-6;
+
+  float t = startDistance;
+  int numSteps = 0;
+  while (numSteps < kConeMarchSteps) {
+    float d = marchSDF(addVectorToPoint(cameraPosition, axis, t));
+    numSteps++;
+    float step = d - spread * t;
+    if (step <= SDF_EPSILON) {
+      break;
+    }
+    t += step;
+  }
+  gThreadMarchStats.numCones++;
+  gThreadMarchStats.numConeSteps += numSteps;
+  return t;
+}
+
+// Cone-marches the block and its quarters, storing each of the tile's pixels'
+// start distance in startDistances, row by row.
+void coneMarchBlock(const RenderContext *renderContext, Tile tile, Tile block,
+                    float startDistance, float *startDistances) {
+  float t = coneMarch(renderContext, block, startDistance);
+  if (block.numRows <= kDepthPrepassBlockSize &&
+      block.numColumns <= kDepthPrepassBlockSize) {
+    for (int row = block.row; row < block.row + block.numRows; ++row) {
+      for (int column = block.column;
+           column < block.column + block.numColumns; ++column) {
+        startDistances[(row - tile.row) * tile.numColumns + column -
+                       tile.column] = t;
+      }
+    }
+    return;
+  }
+  int numTopRows = (block.numRows + 1) / 2;
+  int numLeftColumns = (block.numColumns + 1) / 2;
+  for (int quarter = 0; quarter < 4; ++quarter) {
+    Tile child = {.row = block.row, .column = block.column,
+                  .numRows = numTopRows, .numColumns = numLeftColumns};
+    if (quarter / 2) {
+      child.row += numTopRows;
+      child.numRows = block.numRows - numTopRows;
+    }
+    if (quarter % 2) {
+      child.column += numLeftColumns;
+      child.numColumns = block.numColumns - numLeftColumns;
+    }
+    if (child.numRows > 0 && child.numColumns > 0) {
+      coneMarchBlock(renderContext, tile, child, t, startDistances);
+    }
+  }
+}
+
+// The view the temporal cache projects the last frame's hits into.
+TemporalCamera temporalCamera(const RenderContext *renderContext) {
+  return (TemporalCamera){.position = renderContext->cameraPosition,
+                          .imagePlaneCenter = renderContext->imagePlaneCenter,
+                          .imagePlaneRight = renderContext->imagePlaneRight,
+                          .imagePlaneUp = renderContext->imagePlaneUp,
+                          .pixelConeRadius = renderContext->pixelConeRadius};
+}
+
+// shadeRays() for a renderTile() row, which reuses colors splatted from the
+// last frame where the same surface is still in view, and keeps every ray's
+// sample for the next frame.
+void shadeRaysWithTemporalCache(const RenderContext *renderContext,
+                                const Ray *rays, const bool *hits,
+                                const Point *intPoints,
+                                const size_t *sampleIndices, int numRays,
+                                Color *colors) {
+  TemporalCache *cache = renderContext->temporalCache;
+  Ray *shadedRays = malloc(numRays * sizeof(Ray));
+  bool *shadedHits = malloc(numRays * sizeof(bool));
+  Point *shadedPoints = malloc(numRays * sizeof(Point));
+  Color *shadedColors = malloc(numRays * sizeof(Color));
+  int *shadedMaterials = malloc(numRays * sizeof(int));
+  Vector *shadedNormals = malloc(numRays * sizeof(Vector));
+  int *shaded = malloc(numRays * sizeof(int));
+  int numShaded = 0;
+  long numReused = 0;
+  TemporalCamera camera = temporalCamera(renderContext);
+  for (int i = 0; i < numRays; ++i) {
+    const TemporalSample *sample =
+        hits[i] ? reusableTemporalSample(cache, &gScene, &camera,
+                                         renderContext->lightPosition,
+                                         sampleIndices[i], intPoints[i])
+                : NULL;
+    if (sample) {
+      SceneSample hit = sampleScene(&gScene, intPoints[i]);
+      Vector normal = hit.hasGradient
+                          ? normalizedVector(hit.gradient)
+                          : sceneNormal(intPoints[i]);
+      if (hit.materialId == sample->materialId &&
+          dotProduct(normal, sample->normal) >= kTemporalReuseMinCosine) {
+        cache->nextSamples[sampleIndices[i]] =
+            (TemporalSample){.materialId = hit.materialId,
+                             .hitPoint = intPoints[i],
+                             .shadedPoint = sample->shadedPoint,
+                             .normal = normal,
+                             .color = sample->color};
+        colors[i] = sample->color;
+        numReused++;
+        continue;
+      }
+    }
+    shadedRays[numShaded] = rays[i];
+    shadedHits[numShaded] = hits[i];
+    shadedPoints[numShaded] = intPoints[i];
+    shaded[numShaded++] = i;
+  }
+  if (numShaded > 0) {
+    shadeRaysKeepingHits(renderContext, shadedRays, shadedHits, shadedPoints,
+                         numShaded, shadedColors, shadedMaterials,
+                         shadedNormals, NULL);
+  }
+  for (int s = 0; s < numShaded; ++s) {
+    int i = shaded[s];
+    colors[i] = shadedColors[s];
+    TemporalSample *next = &cache->nextSamples[sampleIndices[i]];
+    *next = (TemporalSample){.materialId = -1,
+                             .hitPoint = intPoints[i],
+                             .shadedPoint = intPoints[i],
+                             .color = shadedColors[s]};
+    if (shadedHits[s]) {
+      next->materialId = shadedMaterials[s];
+      next->normal = shadedNormals[s];
+    }
+  }
+  atomic_fetch_add(&cache->numReusedColors, numReused);
+  free(shaded);
+  free(shadedNormals);
+  free(shadedMaterials);
+  free(shadedColors);
+  free(shadedPoints);
+  free(shadedHits);
+  free(shadedRays);
+}
+
+// Renders a tile one pixel row at a time. The primary rays of a row are
+// ordered pixel by pixel, sub-pixel by sub-pixel, so each packet holds
+// neighbouring and therefore coherent rays.
+void renderTile(Tile tile, void *context) {
+  RenderContext *renderContext = context;
+  int subPixelsDim = renderContext->subPixelsDim;
+  int numSubPixels = subPixelsDim * subPixelsDim;
+  int numRays = tile.numColumns * numSubPixels;
+  Ray *rays = malloc(numRays * sizeof(Ray));
+  bool *hits = malloc(numRays * sizeof(bool));
+  Point *intPoints = malloc(numRays * sizeof(Point));
+  Color *colors = malloc(numRays * sizeof(Color));
+  Pixel *rowPixels = malloc(tile.numColumns * sizeof(Pixel));
+  GBuffer *gbuffer = renderContext->gbuffer;
+  int *hitMaterials = NULL;
+  Vector *hitNormals = NULL;
+  float *hitVisibilities = NULL;
+  if (gbuffer) {
+    hitMaterials = malloc(numRays * sizeof(int));
+    hitNormals = malloc(numRays * sizeof(Vector));
+    hitVisibilities = malloc(numRays * sizeof(float));
+  }
+  TemporalCache *temporalCache = renderContext->temporalCache;
+  size_t *sampleIndices = NULL;
+  long numSeededRays = 0;
+  if (temporalCache) {
+    sampleIndices = malloc(numRays * sizeof(size_t));
+  }
+  float *startDistances = NULL;
+  if (renderContext->usesDepthPrepass) {
+    startDistances = malloc(tile.numRows * tile.numColumns * sizeof(float));
+    coneMarchBlock(renderContext, tile, tile, 0.0, startDistances);
+  }
+#if INSTRUMENT
+  PixelCost **rayCosts = malloc(numRays * sizeof(PixelCost *));
+  gThreadRayCosts = renderContext->pixelCosts ? rayCosts : NULL;
+#endif
+
+  for (int pixelRow = tile.row; pixelRow < tile.row + tile.numRows;
+       ++pixelRow) {
+    for (int i = 0; i < numRays; ++i) {
+      int pixelColumn = tile.column + i / numSubPixels;
+#if INSTRUMENT
+      if (renderContext->pixelCosts) {
+        rayCosts[i] =
+            &renderContext->pixelCosts[(size_t)pixelRow *
+                                           renderContext->imageWidth +
+                                       pixelColumn];
+      }
+#endif
+      rays[i] = primaryRay(
+          renderContext, subPixelPoint(renderContext, pixelRow, pixelColumn,
+                                       subPixelsDim, i % numSubPixels));
+      float t = 0.0;
+      if (startDistances) {
+        t = startDistances[(pixelRow - tile.row) * tile.numColumns +
+                           i / numSubPixels];
+      }
+      if (temporalCache) {
+        sampleIndices[i] = temporalSampleIndex(temporalCache, pixelRow,
+                                               pixelColumn, i % numSubPixels);
+        float temporalT = temporalStartDistance(
+            temporalCache, sampleIndices[i], rays[i], marchSDF);
+        if (temporalT > t) {
+          t = temporalT;
+          numSeededRays++;
+        }
+      }
+      if (t > 0.0) {
+        rays[i].origin = addVectorToPoint(rays[i].origin, rays[i].direction, t);
+      }
+    }
+    marchPrimaryRays(renderContext, rays, numRays, hits, intPoints);
+    if (temporalCache) {
+      shadeRaysWithTemporalCache(renderContext, rays, hits, intPoints,
+                                 sampleIndices, numRays, colors);
+    } else {
+      shadeRaysKeepingHits(renderContext, rays, hits, intPoints, numRays,
+                           colors, hitMaterials, hitNormals, hitVisibilities);
+    }
+
+    for (int column = 0; column < tile.numColumns; ++column) {
+      Color colorSum = makeColor(0.0, 0.0, 0.0);
+      for (int subPixel = 0; subPixel < numSubPixels; ++subPixel) {
+        colorSum = addColors(colorSum, colors[column * numSubPixels + subPixel]);
+      }
+      Color avgColor = scaleColor(colorSum, 0xFF / numSubPixels);
+      if (gbuffer) {
+        int first = column * numSubPixels;
+        storeGBufferPixel(renderContext, pixelRow, tile.column + column,
+                          avgColor, &hits[first], &intPoints[first],
+                          &hitMaterials[first], &hitNormals[first],
+                          &hitVisibilities[first], numSubPixels);
+      } else {
+        rowPixels[column] = makePixel(avgColor.r, avgColor.g, avgColor.b);
+      }
+    }
+    if (!gbuffer) {
+      storePixelRow(renderContext, pixelRow, tile.column, rowPixels,
+                    tile.numColumns);
+    }
+  }
+
+  flushMarchStats(renderContext);
+#if INSTRUMENT
+  gThreadRayCosts = NULL;
+  free(rayCosts);
+#endif
+  if (temporalCache) {
+    atomic_fetch_add(&temporalCache->numSeededRays, numSeededRays);
+  }
+  free(startDistances);
+  free(sampleIndices);
+  free(hitVisibilities);
+  free(hitNormals);
+  free(hitMaterials);
+  free(rowPixels);
+  free(colors);
+  free(intPoints);
+  free(hits);
+  free(rays);
+}
+
+/**
+ * Adaptive sampling. A first pass fires one sample in every row and column of
+ * each pixel's grid. A second pass fills in the rest of the grid only where
+ * the first pass's samples disagree with each other or where the pixel's
+ * average differs from a neighbour's, i.e. along edges, in detailed
+ * reflections and across penumbrae. Refined pixels come out exactly as the
+ * fixed grid would render them.
+ *
+ * Both passes run tile by tile. The first pass also covers a one-pixel apron
+ * around the tile, so pixels on its edge can be compared with their
+ * neighbours without waiting for the neighbouring tiles.
+ */
+
+// The largest difference, in any channel, that still counts as flat.
+const float kAdaptiveContrastThreshold = 0.04;
+
+int greatestCommonDivisor(int a, int b) {
+  while (b != 0) {
+    int remainder = a % b;
+    a = b;
+    b = remainder;
+  }
+  return a;
+}
+
+// The grid column of the first-pass sample in a grid row. Stepping by a
+// number coprime with the grid size visits every column exactly once, and
+// stepping by about half of it spreads the samples out.
+int firstPassColumn(int gridRow, int subPixelsDim) {
+  int step = subPixelsDim / 2 + 1;
+  while (step > 1 && greatestCommonDivisor(step, subPixelsDim) != 1) {
+    step--;
+  }
+  return gridRow * step % subPixelsDim;
+}
+
+float colorContrast(Color a, Color b) {
+  return max(fabsf(a.r - b.r), max(fabsf(a.g - b.g), fabsf(a.b - b.b)));
+}
+
+// The first pass's results for a tile and its apron.
+typedef struct FirstPass {
+  Tile region;
+  // adaptiveDim samples per pixel of the region, row by row.
+  Color *samples;
+  Color *means;
+} FirstPass;
+
+int firstPassIndex(const FirstPass *firstPass, int pixelRow, int pixelColumn) {
+  return (pixelRow - firstPass->region.row) * firstPass->region.numColumns +
+         pixelColumn - firstPass->region.column;
+}
+
+void renderFirstPass(const RenderContext *renderContext, FirstPass *firstPass,
+                     Ray *rays, bool *hits, Point *intPoints, Color *colors) {
+  int dim = renderContext->adaptiveDim;
+  Tile region = firstPass->region;
+  int numRays = region.numColumns * dim;
+  for (int pixelRow = region.row; pixelRow < region.row + region.numRows;
+       ++pixelRow) {
+    for (int i = 0; i < numRays; ++i) {
+      int gridRow = i % dim;
+      int subPixel = gridRow * dim + firstPassColumn(gridRow, dim);
+      rays[i] = primaryRay(
+          renderContext, subPixelPoint(renderContext, pixelRow,
+                                       region.column + i / dim, dim, subPixel));
+    }
+    marchPrimaryRays(renderContext, rays, numRays, hits, intPoints);
+    shadeRays(renderContext, rays, hits, intPoints, numRays, colors);
+
+    for (int column = 0; column < region.numColumns; ++column) {
+      int index = firstPassIndex(firstPass, pixelRow, region.column + column);
+      Color *samples = &firstPass->samples[index * dim];
+      Color colorSum = makeColor(0.0, 0.0, 0.0);
+      for (int sample = 0; sample < dim; ++sample) {
+        samples[sample] = colors[column * dim + sample];
+        colorSum = addColors(colorSum, samples[sample]);
+      }
+      firstPass->means[index] = scaleColor(colorSum, 1.0 / dim);
+    }
+  }
+}
+
+bool needsRefinement(const RenderContext *renderContext,
+                     const FirstPass *firstPass, int pixelRow,
+                     int pixelColumn) {
+  int dim = renderContext->adaptiveDim;
+  int index = firstPassIndex(firstPass, pixelRow, pixelColumn);
+  Color mean = firstPass->means[index];
+  for (int sample = 0; sample < dim; ++sample) {
+    if (colorContrast(firstPass->samples[index * dim + sample], mean) >
+        kAdaptiveContrastThreshold) {
+      return true;
+    }
+  }
+  const int kNeighbourOffsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  for (int i = 0; i < 4; ++i) {
+    int row = pixelRow + kNeighbourOffsets[i][0];
+    int column = pixelColumn + kNeighbourOffsets[i][1];
+    if (row < 0 || row >= renderContext->imageHeight || column < 0 ||
+        column >= renderContext->imageWidth) {
+      continue;
+    }
+    Color neighbour = firstPass->means[firstPassIndex(firstPass, row, column)];
+    if (colorContrast(neighbour, mean) > kAdaptiveContrastThreshold) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void renderAdaptiveTile(Tile tile, void *context) {
+  RenderContext *renderContext = context;
+  int dim = renderContext->adaptiveDim;
+  int gridSize = dim * dim;
+
+  FirstPass firstPass;
+  Tile *region = &firstPass.region;
+  region->row = tile.row > 0 ? tile.row - 1 : 0;
+  region->column = tile.column > 0 ? tile.column - 1 : 0;
+  int regionEndRow = tile.row + tile.numRows + 1;
+  int regionEndColumn = tile.column + tile.numColumns + 1;
+  if (regionEndRow > renderContext->imageHeight) {
+    regionEndRow = renderContext->imageHeight;
+  }
+  if (regionEndColumn > renderContext->imageWidth) {
+    regionEndColumn = renderContext->imageWidth;
+  }
+  region->numRows = regionEndRow - region->row;
+  region->numColumns = regionEndColumn - region->column;
+  int numRegionPixels = region->numRows * region->numColumns;
+  firstPass.samples = malloc(numRegionPixels * dim * sizeof(Color));
+  firstPass.means = malloc(numRegionPixels * sizeof(Color));
+
+  int maxRays = region->numColumns * dim;
+  if (maxRays < tile.numColumns * (gridSize - dim)) {
+    maxRays = tile.numColumns * (gridSize - dim);
+  }
+  Ray *rays = malloc(maxRays * sizeof(Ray));
+  bool *hits = malloc(maxRays * sizeof(bool));
+  Point *intPoints = malloc(maxRays * sizeof(Point));
+  Color *colors = malloc(maxRays * sizeof(Color));
+  bool *isRefined = malloc(tile.numColumns * sizeof(bool));
+  Pixel *rowPixels = malloc(tile.numColumns * sizeof(Pixel));
+  long numRefinedPixels = 0;
+
+  renderFirstPass(renderContext, &firstPass, rays, hits, intPoints, colors);
+
+  for (int pixelRow = tile.row; pixelRow < tile.row + tile.numRows;
+       ++pixelRow) {
+    int numRays = 0;
+    for (int column = 0; column < tile.numColumns; ++column) {
+      int pixelColumn = tile.column + column;
+      isRefined[column] =
+          needsRefinement(renderContext, &firstPass, pixelRow, pixelColumn);
+      if (!isRefined[column]) {
+        continue;
+      }
+      for (int subPixel = 0; subPixel < gridSize; ++subPixel) {
+        if (subPixel % dim != firstPassColumn(subPixel / dim, dim)) {
+          rays[numRays++] = primaryRay(
+              renderContext, subPixelPoint(renderContext, pixelRow,
+                                           pixelColumn, dim, subPixel));
+        }
+      }
+    }
+    marchPrimaryRays(renderContext, rays, numRays, hits, intPoints);
+    shadeRays(renderContext, rays, hits, intPoints, numRays, colors);
+
+    int i = 0;
+    for (int column = 0; column < tile.numColumns; ++column) {
+      int index = firstPassIndex(&firstPass, pixelRow, tile.column + column);
+      const Color *samples = &firstPass.samples[index * dim];
       Color colorSum = makeColor(0.0, 0.0, 0.0);
+      float scale;
+      if (isRefined[column]) {
+        // Sum in grid order, as renderTile() does.
+        for (int subPixel = 0; subPixel < gridSize; ++subPixel) {
+          Color subPixelColor;
+          if (subPixel % dim == firstPassColumn(subPixel / dim, dim)) {
+            subPixelColor = samples[subPixel / dim];
+          } else {
+            subPixelColor = colors[i++];
+          }
+          colorSum = addColors(colorSum, subPixelColor);
+        }
+        scale = sampleSumScale(gridSize, dim);
+        numRefinedPixels++;
+      } else {
+        for (int sample = 0; sample < dim; ++sample) {
+          colorSum = addColors(colorSum, samples[sample]);
+        }
+        scale = sampleSumScale(dim, dim);
+      }
+      Color avgColor = scaleColor(colorSum, scale);
+      rowPixels[column] = makePixel(avgColor.r, avgColor.g, avgColor.b);
+    }
+    storePixelRow(renderContext, pixelRow, tile.column, rowPixels,
+                  tile.numColumns);
+  }
+
+  flushMarchStats(renderContext);
+  atomic_fetch_add(&renderContext->numRefinedPixels, numRefinedPixels);
+  free(rowPixels);
+  free(isRefined);
+  free(colors);
+  free(intPoints);
+  free(hits);
+  free(rays);
+  free(firstPass.means);
+  free(firstPass.samples);
+}
+
+void renderAdaptive(TilePool *pool, int tileSize, RenderContext *context) {
+  long numPixels = (long)context->imageWidth * context->imageHeight;
+  int dim = context->adaptiveDim;
+  atomic_init(&context->numRefinedPixels, 0);
+  renderTiles(pool, context->imageWidth, context->imageHeight, tileSize,
+              renderAdaptiveTile, context);
+  long numRefinedPixels = atomic_load(&context->numRefinedPixels);
+  printf("Adaptive sampling refined %ld of %ld pixels: %.2f rays per pixel, "
+         "against %d for the full grid\n",
+         numRefinedPixels, numPixels,
+         dim + (double)numRefinedPixels / numPixels * (dim * dim - dim),
+         dim * dim);
+}
+
+// Filters the G-buffer the tiles filled in and stores the image's pixels.
+void denoiseImage(TilePool *pool, const RenderContext *context) {
+  int width = context->imageWidth;
+  Pixel *pixels =
+      context->framebuffer
+          ? context->framebuffer
+          : malloc((size_t)width * context->imageHeight * sizeof(Pixel));
+  denoiseGBuffer(context->gbuffer, context->subPixelsDim,
+                 context->numDenoisePasses, pool, pixels);
+  if (pixels != context->framebuffer) {
+    for (int row = 0; row < context->imageHeight; ++row) {
+      storePixelRow(context, row, 0, &pixels[(size_t)row * width], width);
+    }
+    free(pixels);
+  }
+}
+
+void renderImage(TilePool *pool, int tileSize, RenderContext *context) {
+  if (context->adaptiveDim > 0) {
+    renderAdaptive(pool, tileSize, context);
+    return;
+  }
+  renderTiles(pool, context->imageWidth, context->imageHeight, tileSize,
+              renderTile, context);
+  if (context->gbuffer) {
+    denoiseImage(pool, context);
+  }
+}
+
+#if INSTRUMENT
+/**
+ * Cost heatmaps. Each cost metric is written out as its own image, scaled so
+ * that its 99th percentile is white and anything above is clipped, and
+ * summarized with percentiles and a histogram of power-of-two buckets.
+ */
+
+const int kHistogramBarWidth = 50;
+
+int compareInts(const void *a, const void *b) {
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+// Maps t in [0, 1] from black through red and yellow to white.
+Pixel heatmapPixel(float t) {
+  float r = fminf(fmaxf(t * 3.0, 0.0), 1.0);
+  float g = fminf(fmaxf(t * 3.0 - 1.0, 0.0), 1.0);
+  float b = fminf(fmaxf(t * 3.0 - 2.0, 0.0), 1.0);
+  return makePixel(r * kMaxBrightness, g * kMaxBrightness,
+                   b * kMaxBrightness);
+}
+
+void printCostHistogram(const int *sortedValues, size_t numValues) {
+  // Bucket 0 holds zeros and bucket b > 0 holds [2^(b - 1), 2^b).
+  long bucketCounts[33] = {0};
+  int numBuckets = 1;
+  long largestCount = 0;
+  for (size_t i = 0; i < numValues; ++i) {
+    int bucket = 0;
+    while (bucket < 32 && sortedValues[i] >= (1L << bucket)) {
+      bucket++;
+    }
+    bucketCounts[bucket]++;
+    if (bucket >= numBuckets) {
+      numBuckets = bucket + 1;
+    }
+    if (bucketCounts[bucket] > largestCount) {
+      largestCount = bucketCounts[bucket];
+    }
+  }
+  for (int bucket = 0; bucket < numBuckets; ++bucket) {
+    char range[32];
+    if (bucket == 0) {
+      snprintf(range, sizeof(range), "0");
+    } else {
+      snprintf(range, sizeof(range), "%ld-%ld", 1L << (bucket - 1),
+               (1L << bucket) - 1);
+    }
+    int barLength = (int)(bucketCounts[bucket] * kHistogramBarWidth /
+                          largestCount);
+    printf("  %12s %10ld", range, bucketCounts[bucket]);
+    if (barLength > 0) {
+      printf(" %.*s", barLength,
+             "##################################################");
+    }
+    printf("\n");
+  }
+}
+
+// Writes a heatmap of each cost metric to prefix-NAME.bmp, and prints a
+// summary of each. Returns 1 if any image couldn't be written.
+int writeCostHeatmaps(const PixelCost *costs, int imageWidth, int imageHeight,
+                      const char *prefix) {
+  size_t numPixels = (size_t)imageWidth * imageHeight;
+  int *values = malloc(numPixels * sizeof(int));
+  int *sortedValues = malloc(numPixels * sizeof(int));
+  Pixel *pixels = malloc(numPixels * sizeof(Pixel));
+  size_t filenameSize = strlen(prefix) + 32;
+  char *filename = malloc(filenameSize);
+  int result = 0;
+  for (int metric = 0; metric < kNumCostMetrics; ++metric) {
+    long total = 0;
+    for (size_t i = 0; i < numPixels; ++i) {
+      values[i] = costs[i].counts[metric];
+      total += values[i];
+    }
+    memcpy(sortedValues, values, numPixels * sizeof(int));
+    qsort(sortedValues, numPixels, sizeof(int), compareInts);
+    int p99 = sortedValues[numPixels * 99 / 100];
+    printf("%s per pixel: total %ld, mean %.2f, p50 %d, p90 %d, p99 %d, "
+           "max %d\n",
+           kCostMetricNames[metric], total, (double)total / numPixels,
+           sortedValues[numPixels / 2], sortedValues[numPixels * 9 / 10], p99,
+           sortedValues[numPixels - 1]);
+    printCostHistogram(sortedValues, numPixels);
+
+    int scale = p99 > 0 ? p99 : max(sortedValues[numPixels - 1], 1);
+    for (size_t i = 0; i < numPixels; ++i) {
+      pixels[i] = heatmapPixel((float)values[i] / scale);
+    }
+    snprintf(filename, filenameSize, "%s-%s.bmp", prefix,
+             kCostMetricNames[metric]);
+    if (writeBitmap(pixels, imageWidth, imageHeight, filename) != 0) {
+      result = 1;
+    }
+  }
+  free(filename);
+  free(pixels);
+  free(sortedValues);
+  free(values);
+  return result;
+}
+#endif
+
+// How often --resume saves finished tiles if --checkpoint doesn't say.
+const int kDefaultCheckpointSeconds = 60;
+
+// Options without a short form.
+enum {
+  kOptionSamples = 256,
+  kOptionSteps,
+  kOptionCamera,
+  kOptionTarget,
+  kOptionLight,
+  kOptionAnimation,
+  kOptionFrames,
+  kOptionBudget,
+  kOptionRelax,
+  kOptionMarchStats,
+  kOptionDepthPrepass,
+  kOptionHeatmaps,
+  kOptionFastFresnel,
+  kOptionTemporal,
+  kOptionShadowCache,
+  kOptionShadowCacheFile,
+  kOptionCoordinator,
+  kOptionSpawnWorkers,
+  kOptionWorker,
+  kOptionServe,
+  kOptionDenoise,
+  kOptionSceneKernel,
+  kOptionCheckpoint,
+  kOptionResume,
+};
+
+typedef struct Options {
+  int numThreads;
+  int tileSize;
+  PacketBackend packetBackend;
+  const char *sceneFilename;
+  const char *outputFilename;
+  ImageFormat outputFormat;
+  bool hasOutputFormat;
+  // Settings left at 0 come from the quality preset.
+  const QualityPreset *quality;
+  int imageWidth;
+  int imageHeight;
+  int subPixelsDim;
+  int numRayMarchSteps;
+  AnimationKey view;
+  const char *brickMapFilename;
+  // 0 for the fixed grid.
+  int adaptiveDim;
+  const char *animationFilename;
+  bool hasFrameRange;
+  int firstFrame;
+  int lastFrame;
+  // Render progressively for this long if not 0.
+  int budgetMilliseconds;
+  bool isRelaxedMarch[kNumRayTypes];
+  bool countsMarchSteps;
+  bool usesDepthPrepass;
+  bool usesFresnelTables;
+  // Whether animation frames reuse the previous frame's hits and colors.
+  bool usesTemporalCache;
+  // Cells per axis of the shadow cache, or 0 for none.
+  int shadowCacheCells;
+  // Where to keep the baked shadow cache between runs, if anywhere.
+  const char *shadowCacheFilename;
+  // Whether to hand tiles out to worker processes, listening on
+  // coordinatorPort of coordinatorHost, or of the loopback address if that's
+  // NULL.
+  bool isCoordinator;
+  char *coordinatorHost;
+  int coordinatorPort;
+  int numSpawnedWorkers;
+  // The coordinator to render tiles for, as HOST:PORT.
+  const char *workerAddress;
+  // Where to listen for render requests, if set.
+  const char *serverPath;
+  // Whether to filter the finished image, with how many edge-avoiding passes.
+  bool denoises;
+  int numDenoisePasses;
+  // Where to keep compiled scene kernels, if the scene is to be compiled.
+  const char *sceneKernelDirectory;
+  // How often to save finished tiles to OUTPUT.checkpoint, or 0 not to.
+  int checkpointSeconds;
+  // Whether to skip the tiles the checkpoint says are finished.
+  bool resumes;
+  // Where to write cost heatmaps, in instrumented builds.
+  const char *heatmapPrefix;
+} Options;
+
+void printUsage(const char *programName) {
+  printf(
+      "Usage: %s [options]\n"
+      "  -j, --threads N     Number of render threads (default: all cores)\n"
+      "  -t, --tile-size N   Width and height of a render tile (default: 32)\n"
+      "  -s, --simd NAME     Ray packet backend: scalar, sse, avx2 or avx512\n"
+      "                      (default: the widest the CPU supports)\n"
+      "  -c, --scene FILE    Scene description (default: the built-in scene)\n"
+      "  -o, --output FILE   Output image (default: image.bmp, or\n"
+      "                      frame####.bmp for animations, where the #s\n"
+      "                      become the frame number)\n"
+      "  -f, --format NAME   Output format: bmp, qoi or png (default: the\n"
+      "                      output's extension, or bmp)\n"
+      "  -q, --quality NAME  Preset for the settings below: low or high\n"
+      "                      (default: %s)\n"
+      "  -W, --width N       Image width in pixels\n"
+      "  -H, --height N      Image height in pixels\n"
+      "      --samples N     Cast N x N primary rays per pixel\n"
+      "      --steps N       Give up on rays after N march steps\n"
+      "      --camera X,Y,Z  Camera position\n"
+      "      --target X,Y,Z  The point the camera looks at\n"
+      "      --light X,Y,Z   Light position\n"
+      "  -b, --brick-map FILE\n"
+      "                      Cache the scene's distance field in FILE, baking\n"
+      "                      it first if FILE is missing or stale. Lookups\n"
+      "                      cost more than the distances of scenes with up\n"
+      "                      to a few hundred primitives, so those render\n"
+      "                      slower with it\n"
+      "  -a, --adaptive N    Sample pixels adaptively, refining edges and\n"
+      "                      other detail up to an N x N grid\n"
+      "      --animation FILE\n"
+      "                      Render every frame of a camera and light path\n"
+      "      --frames A-B    Only render frames A to B of the animation\n"
+      "      --budget MS     Render progressively for MS milliseconds,\n"
+      "                      writing out the image after every pass\n"
+      "      --relax TYPES   March the listed ray types (primary, reflection,\n"
+      "                      shadow or all, separated by commas) with\n"
+      "                      over-relaxed steps, and secondary rays with\n"
+      "                      pixel-sized hit cones\n"
+      "      --march-stats   Count march steps by ray type\n"
+      "      --depth-prepass Start primary rays where cones marched through\n"
+      "                      each tile found the scene to begin\n"
+      "      --fast-fresnel  Look mirrors' reflectance up in tables rather\n"
+      "                      than computing it exactly (within 1e-4)\n"
+      "      --temporal      Start each animation frame's rays from the last\n"
+      "                      frame's hits, reusing their colors where the\n"
+      "                      same surface is still in view\n"
+      "      --shadow-cache N\n"
+      "                      Bake the light's visibility into a grid of N\n"
+      "                      cells per axis (a multiple of 8; 256 is a good\n"
+      "                      start), rebaking it whenever the light moves.\n"
+      "                      Shading near shadows' edges still marches\n"
+      "                      shadow rays. Baking costs more than a single\n"
+      "                      image saves, so it pays off over animations,\n"
+      "                      --serve or --shadow-cache-file\n"
+      "      --shadow-cache-file FILE\n"
+      "                      Keep the shadow cache in FILE, baking it first\n"
+      "                      if FILE is missing or was baked for another\n"
+      "                      scene, light or resolution\n"
+      "      --coordinator [HOST:]PORT\n"
+      "                      Hand tiles out to worker processes connecting\n"
+      "                      to PORT (0 picks a free one) of HOST, by\n"
+      "                      default this machine's loopback address only;\n"
+      "                      workers are trusted, so only name an address\n"
+      "                      others can reach, or ::, on a trusted network\n"
+      "      --spawn-workers N\n"
+      "                      Start N workers on this machine for the\n"
+      "                      coordinator, splitting --threads between them\n"
+      "      --worker HOST:PORT\n"
+      "                      Render tiles for the coordinator at HOST:PORT,\n"
+      "                      which must be given the same render options\n"
+      "      --serve PATH    Render requests from clients of a Unix socket at\n"
+      "                      PATH, keeping the scene, caches and threads warm\n"
+      "                      between them; the options above are the\n"
+      "                      requests' defaults\n"
+      "      --denoise N     Blend pixels rendered with under 4 x 4 samples\n"
+      "                      into their neighbours to make up for the\n"
+      "                      samples they lack, then smooth the image with N\n"
+      "                      passes of a filter that stops at changes of\n"
+      "                      depth, normal, material and shadow\n"
+      "      --scene-kernel DIR\n"
+      "                      Compile the scene into specialized code with\n"
+      "                      $CC (default: cc), keeping it in DIR for later\n"
+      "                      runs; falls back on the generic code if that\n"
+      "                      fails\n"
+      "      --checkpoint SECONDS\n"
+      "                      Save finished tiles to OUTPUT.checkpoint every\n"
+      "                      SECONDS seconds, removing it once the image is\n"
+      "                      written\n"
+      "      --resume        Skip the tiles a checkpoint of an interrupted\n"
+      "                      render with the same options has saved\n"
+      "                      (checkpointing every %d seconds unless\n"
+      "                      --checkpoint says otherwise)\n",
+      programName, kDefaultQuality->name, kDefaultCheckpointSeconds);
+#if INSTRUMENT
+  printf("      --heatmaps PREFIX\n"
+         "                      Count what every pixel costs, writing a\n"
+         "                      heatmap of each count to PREFIX-NAME.bmp\n");
+#endif
+}
+
+bool parsePointOption(const char *text, Point *point) {
+  char trailing;
+  return sscanf(text, "%f,%f,%f%c", &point->x, &point->y, &point->z,
+                &trailing) == 3;
+}
+
+// Parses a comma-separated list of ray type names, or "all", setting
+// types[type] for each type in it.
+bool parseRayTypes(const char *text, bool *types) {
+  char *list = strdup(text);
+  bool ok = true;
+  char *savePtr;
+  for (char *name = strtok_r(list, ",", &savePtr); name && ok;
+       name = strtok_r(NULL, ",", &savePtr)) {
+    ok = false;
+    for (int type = 0; type < kNumRayTypes; ++type) {
+      if (strcmp(name, "all") == 0 || strcmp(name, kRayTypeNames[type]) == 0) {
+        types[type] = true;
+        ok = true;
+      }
+    }
+  }
+  free(list);
+  return ok;
+}
 
-      for (int subPixel = 0; subPixel < kNumSubPixels; ++subPixel) {
-        // Adjust pixelRow and pixelColumn to account for subsampling.
-        float offset = 1.0 / kNumSubPixelsDim / 2.0;
-        float subPixelRowOffset =
-            (subPixel / kNumSubPixelsDim) / (float)kNumSubPixelsDim + offset;
-        float subPixelColumnOffset =
-            (subPixel % kNumSubPixelsDim) / (float)kNumSubPixelsDim + offset;
-        float pixelRowAdjusted = pixelRow + subPixelRowOffset;
-        float pixelColumnAdjusted = pixelColumn + subPixelColumnOffset;
+bool parseOptions(int argc, char **argv, Options *options) {
+  static const struct option kLongOptions[] = {
+      {"threads", required_argument, NULL, 'j'},
+      {"tile-size", required_argument, NULL, 't'},
+      {"simd", required_argument, NULL, 's'},
+      {"scene", required_argument, NULL, 'c'},
+      {"output", required_argument, NULL, 'o'},
+      {"format", required_argument, NULL, 'f'},
+      {"quality", required_argument, NULL, 'q'},
+      {"width", required_argument, NULL, 'W'},
+      {"height", required_argument, NULL, 'H'},
+      {"samples", required_argument, NULL, kOptionSamples},
+      {"steps", required_argument, NULL, kOptionSteps},
+      {"camera", required_argument, NULL, kOptionCamera},
+      {"target", required_argument, NULL, kOptionTarget},
+      {"light", required_argument, NULL, kOptionLight},
+      {"brick-map", required_argument, NULL, 'b'},
+      {"adaptive", required_argument, NULL, 'a'},
+      {"animation", required_argument, NULL, kOptionAnimation},
+      {"frames", required_argument, NULL, kOptionFrames},
+      {"budget", required_argument, NULL, kOptionBudget},
+      {"relax", required_argument, NULL, kOptionRelax},
+      {"march-stats", no_argument, NULL, kOptionMarchStats},
+      {"depth-prepass", no_argument, NULL, kOptionDepthPrepass},
+      {"fast-fresnel", no_argument, NULL, kOptionFastFresnel},
+      {"temporal", no_argument, NULL, kOptionTemporal},
+      {"shadow-cache", required_argument, NULL, kOptionShadowCache},
+      {"shadow-cache-file", required_argument, NULL, kOptionShadowCacheFile},
+      {"coordinator", required_argument, NULL, kOptionCoordinator},
+      {"spawn-workers", required_argument, NULL, kOptionSpawnWorkers},
+      {"worker", required_argument, NULL, kOptionWorker},
+      {"serve", required_argument, NULL, kOptionServe},
+      {"denoise", required_argument, NULL, kOptionDenoise},
+      {"scene-kernel", required_argument, NULL, kOptionSceneKernel},
+      {"checkpoint", required_argument, NULL, kOptionCheckpoint},
+      {"resume", no_argument, NULL, kOptionResume},
+#if INSTRUMENT
+      {"heatmaps", required_argument, NULL, kOptionHeatmaps},
+#endif
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+  *options = (Options){.numThreads = defaultNumThreads(),
+                       .tileSize = 32,
+                       .packetBackend = detectPacketBackend(),
+                       .quality = kDefaultQuality,
+                       .view = {.cameraPosition = kDefaultCameraPosition,
+                                .cameraTarget = kDefaultCameraTarget,
+                                .lightPosition = kDefaultLightPosition}};
+  int option;
+  while ((option = getopt_long(argc, argv, "j:t:s:c:o:f:q:W:H:b:a:h",
+                               kLongOptions, NULL)) != -1) {
+    bool ok = true;
+    switch (option) {
+      case 'j':
+        options->numThreads = atoi(optarg);
+        break;
+      case 't':
+        options->tileSize = atoi(optarg);
+        break;
+      case 's':
+        if (!parsePacketBackend(optarg, &options->packetBackend)) {
+          printf("Unsupported SIMD backend: %s\n", optarg);
+          return false;
+        }
+        break;
+      case 'c':
+        options->sceneFilename = optarg;
+        break;
+      case 'o':
+        options->outputFilename = optarg;
+        break;
+      case 'f':
+        options->hasOutputFormat = true;
+        ok = parseImageFormat(optarg, &options->outputFormat);
+        break;
+      case 'q':
+        options->quality = NULL;
+        for (size_t i = 0;
+             i < sizeof(kQualityPresets) / sizeof(kQualityPresets[0]); ++i) {
+          if (strcmp(optarg, kQualityPresets[i].name) == 0) {
+            options->quality = &kQualityPresets[i];
+          }
+        }
+        ok = options->quality != NULL;
+        break;
+      case 'W':
+        ok = (options->imageWidth = atoi(optarg)) > 0;
+        break;
+      case 'H':
+        ok = (options->imageHeight = atoi(optarg)) > 0;
+        break;
+      case kOptionSamples:
+        ok = (options->subPixelsDim = atoi(optarg)) > 0;
+        break;
+      case kOptionSteps:
+        ok = (options->numRayMarchSteps = atoi(optarg)) > 0;
+        break;
+      case kOptionCamera:
+        ok = parsePointOption(optarg, &options->view.cameraPosition);
+        break;
+      case kOptionTarget:
+        ok = parsePointOption(optarg, &options->view.cameraTarget);
+        break;
+      case kOptionLight:
+        ok = parsePointOption(optarg, &options->view.lightPosition);
+        break;
+      case 'b':
+        options->brickMapFilename = optarg;
+        break;
+      case 'a':
+        ok = (options->adaptiveDim = atoi(optarg)) > 0;
+        break;
+      case kOptionAnimation:
+        options->animationFilename = optarg;
+        break;
+      case kOptionFrames:
+        options->hasFrameRange = true;
+        ok = sscanf(optarg, "%d-%d", &options->firstFrame,
+                    &options->lastFrame) == 2 &&
+             options->firstFrame <= options->lastFrame;
+        break;
+      case kOptionBudget:
+        ok = (options->budgetMilliseconds = atoi(optarg)) > 0;
+        break;
+      case kOptionRelax:
+        ok = parseRayTypes(optarg, options->isRelaxedMarch);
+        break;
+      case kOptionMarchStats:
+        options->countsMarchSteps = true;
+        break;
+      case kOptionDepthPrepass:
+        options->usesDepthPrepass = true;
+        break;
+      case kOptionFastFresnel:
+        options->usesFresnelTables = true;
+        break;
+      case kOptionTemporal:
+        options->usesTemporalCache = true;
+        break;
+      case kOptionShadowCache:
+        ok = (options->shadowCacheCells = atoi(optarg)) > 0;
+        break;
+      case kOptionShadowCacheFile:
+        options->shadowCacheFilename = optarg;
+        break;
+      case kOptionCoordinator: {
+        options->isCoordinator = true;
+        const char *port = optarg;
+        const char *colon = strrchr(optarg, ':');
+        if (colon) {
+          options->coordinatorHost = strndup(optarg, colon - optarg);
+          port = colon + 1;
+        }
+        options->coordinatorPort = atoi(port);
+        ok = (!colon || colon > optarg) && options->coordinatorPort >= 0 &&
+             options->coordinatorPort < 65536;
+        break;
+      }
+      case kOptionSpawnWorkers:
+        ok = (options->numSpawnedWorkers = atoi(optarg)) > 0;
+        break;
+      case kOptionWorker:
+        options->workerAddress = optarg;
+        break;
+      case kOptionServe:
+        options->serverPath = optarg;
+        break;
+      case kOptionDenoise:
+        options->denoises = true;
+        ok = (options->numDenoisePasses = atoi(optarg)) >= 0;
+        break;
+      case kOptionSceneKernel:
+        options->sceneKernelDirectory = optarg;
+        break;
+      case kOptionCheckpoint:
+        ok = (options->checkpointSeconds = atoi(optarg)) > 0;
+        break;
+      case kOptionResume:
+        options->resumes = true;
+        break;
+      case kOptionHeatmaps:
+        options->heatmapPrefix = optarg;
+        break;
+      default:
+        ok = false;
+        break;
+    }
+    if (!ok) {
+      printUsage(argv[0]);
+      return false;
+    }
+  }
+  if (options->numThreads < 1 || options->tileSize < 1) {
+    printUsage(argv[0]);
+    return false;
+  }
+  if (options->budgetMilliseconds &&
+      (options->animationFilename || options->adaptiveDim)) {
+    printf("--budget can't be combined with --animation or --adaptive\n");
+    return false;
+  }
+  if (options->usesDepthPrepass &&
+      (options->budgetMilliseconds || options->adaptiveDim)) {
+    printf("--depth-prepass only works with the fixed grid, not with "
+           "--budget or --adaptive\n");
+    return false;
+  }
+  if (options->usesTemporalCache &&
+      (!options->animationFilename || options->adaptiveDim)) {
+    printf("--temporal only works for animations on the fixed grid, not with "
+           "--adaptive\n");
+    return false;
+  }
+  if (options->heatmapPrefix &&
+      (options->budgetMilliseconds || options->adaptiveDim ||
+       options->animationFilename)) {
+    printf("--heatmaps only works with a single fixed-grid image, not with "
+           "--budget, --adaptive or --animation\n");
+    return false;
+  }
+  if (options->shadowCacheFilename && !options->shadowCacheCells) {
+    printf("--shadow-cache-file needs --shadow-cache\n");
+    return false;
+  }
+  if (options->heatmapPrefix && options->sceneKernelDirectory) {
+    printf("--heatmaps can't count what --scene-kernel's code costs\n");
+    return false;
+  }
+  if (options->workerAddress) {
+    // Spawned workers are given the coordinator's own options.
+    options->isCoordinator = false;
+    options->numSpawnedWorkers = 0;
+  }
+  if (options->numSpawnedWorkers && !options->isCoordinator) {
+    printf("--spawn-workers needs --coordinator\n");
+    return false;
+  }
+  if ((options->isCoordinator || options->workerAddress) &&
+      (options->budgetMilliseconds || options->adaptiveDim ||
+       options->animationFilename || options->heatmapPrefix)) {
+    printf("--coordinator and --worker only work with a single fixed-grid "
+           "image, not with --budget, --adaptive, --animation or "
+           "--heatmaps\n");
+    return false;
+  }
+  if (options->serverPath &&
+      (options->budgetMilliseconds || options->animationFilename ||
+       options->heatmapPrefix || options->isCoordinator ||
+       options->workerAddress)) {
+    printf("--serve can't be combined with --budget, --animation, "
+           "--heatmaps, --coordinator or --worker\n");
+    return false;
+  }
+  if (options->denoises &&
+      (options->budgetMilliseconds || options->adaptiveDim ||
+       options->usesTemporalCache || options->isCoordinator ||
+       options->workerAddress || options->serverPath)) {
+    printf("--denoise only works with the fixed grid, not with --budget, "
+           "--adaptive, --temporal, --coordinator, --worker or --serve\n");
+    return false;
+  }
+  if (options->resumes && !options->checkpointSeconds) {
+    options->checkpointSeconds = kDefaultCheckpointSeconds;
+  }
+  if (options->checkpointSeconds &&
+      (options->budgetMilliseconds || options->adaptiveDim ||
+       options->animationFilename || options->heatmapPrefix ||
+       options->denoises || options->isCoordinator ||
+       options->workerAddress || options->serverPath)) {
+    printf("--checkpoint and --resume only work with a single fixed-grid "
+           "image, not with --budget, --adaptive, --animation, --heatmaps, "
+           "--denoise, --coordinator, --worker or --serve\n");
+    return false;
+  }
+  if (!options->imageWidth) {
+    options->imageWidth = options->quality->imageWidth;
+  }
+  if (!options->imageHeight) {
+    options->imageHeight = options->quality->imageHeight;
+  }
+  if (!options->subPixelsDim) {
+    options->subPixelsDim = options->quality->subPixelsDim;
+  }
+  if (!options->numRayMarchSteps) {
+    options->numRayMarchSteps = options->quality->numRayMarchSteps;
+  }
+  if (!options->hasOutputFormat && options->outputFilename) {
+    options->outputFormat = imageFormatForFilename(options->outputFilename);
+  }
+  if (!options->outputFilename) {
+    static char defaultFilename[16];
+    snprintf(defaultFilename, sizeof(defaultFilename), "%s.%s",
+             options->animationFilename ? "frame####" : "image",
+             imageFormatExtension(options->outputFormat));
+    options->outputFilename = defaultFilename;
+  }
+  return true;
+}
 
-        // Convert from ([0, numPixelRows], [0, numPixelColumns]) to
-        // ([0.0, 1.0], [0.0, 1.0]), and then to ([-0.5, 0.5], [-0.5, 0.5])
-        float x = lerp(pixelColumnAdjusted / kNumPixelColumns, -0.5, 0.5);
-        float y = lerp(pixelRowAdjusted / kNumPixelRows, -0.5, 0.5);
-        Point subPixelPoint = makePoint(x, y, 0.0);
-        Color subPixelColor = pixelColor(subPixelPoint);
-        colorSum = addColors(colorSum, subPixelColor);
+double wallClockSeconds(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Loads the brick map from filename, or bakes and saves it if the file is
+// missing or was baked from another scene. Returns NULL on failure.
+BrickMap *prepareBrickMap(const char *filename, TilePool *pool) {
+  double start = wallClockSeconds();
+  BrickMap *map = loadBrickMap(filename, &gScene);
+  const char *source = "loaded";
+  if (!map) {
+    map = bakeBrickMap(&gScene, pool);
+    if (!map) {
+      return NULL;
+    }
+    // A map that can't be saved still speeds up this render.
+    saveBrickMap(map, filename);
+    source = "baked";
+  }
+  printf("Brick map %s in %.2f s: %d bricks near surfaces, %.1f MiB "
+         "(a dense grid would take %.1f MiB)\n",
+         source, wallClockSeconds() - start, map->numNearBricks,
+         brickMapMemorySize(map) / 1048576.0,
+         brickMapDenseMemorySize() / 1048576.0);
+  return map;
+}
+
+/**
+ * Progressive rendering, in the passes progressive.c plans. When the budget
+ * runs out partway through a pass, the rest of its tiles are skipped and
+ * rendering stops there. The first pass always finishes.
+ */
+
+typedef struct ProgressiveRender {
+  RenderContext *renderContext;
+  ProgressivePixel *pixels;
+  ProgressivePass pass;
+  // How many steps pixel-center rays have been marched before the pass.
+  int numCenterSteps;
+  // Tiles that start after passDeadline are skipped.
+  double passDeadline;
+  atomic_bool isPassIncomplete;
+} ProgressiveRender;
+
+void renderProgressiveTile(Tile tile, void *context) {
+  ProgressiveRender *progressive = context;
+  if (wallClockSeconds() >= progressive->passDeadline) {
+    atomic_store(&progressive->isPassIncomplete, true);
+    return;
+  }
+  const RenderContext *renderContext = progressive->renderContext;
+  const ProgressivePass *pass = &progressive->pass;
+  int subPixelsDim = renderContext->subPixelsDim;
+  int raysPerPixel = pass->kind == kPassGridRow ? subPixelsDim : 1;
+  int maxSteps = renderContext->numRayMarchSteps;
+  if (pass->kind == kPassMoreSteps) {
+    maxSteps = pass->numCenterSteps - progressive->numCenterSteps;
+  }
+  int maxRays = tile.numColumns * raysPerPixel;
+  Ray *rays = malloc(maxRays * sizeof(Ray));
+  bool *hits = malloc(maxRays * sizeof(bool));
+  Point *intPoints = malloc(maxRays * sizeof(Point));
+  Color *colors = malloc(maxRays * sizeof(Color));
+  ProgressivePixel **passPixels =
+      malloc(tile.numColumns * sizeof(ProgressivePixel *));
+
+  for (int pixelRow = tile.row; pixelRow < tile.row + tile.numRows;
+       ++pixelRow) {
+    int numPixels = 0;
+    int numRays = 0;
+    for (int column = 0; column < tile.numColumns; ++column) {
+      int pixelColumn = tile.column + column;
+      ProgressivePixel *pixel =
+          &progressive->pixels[(size_t)pixelRow * renderContext->imageWidth +
+                               pixelColumn];
+      if (!isInProgressivePass(pass, pixel, pixelRow, pixelColumn)) {
+        continue;
+      }
+      passPixels[numPixels++] = pixel;
+      if (pass->kind == kPassGridRow) {
+        for (int i = 0; i < subPixelsDim; ++i) {
+          rays[numRays++] = primaryRay(
+              renderContext,
+              subPixelPoint(renderContext, pixelRow, pixelColumn, subPixelsDim,
+                            pass->gridRow * subPixelsDim + i));
+        }
+        continue;
       }
+      rays[numRays] = primaryRay(
+          renderContext,
+          subPixelPoint(renderContext, pixelRow, pixelColumn, 1, 0));
+      if (pass->kind == kPassMoreSteps) {
+        // Hits only need shading again, since reflections get more steps too.
+        if (pixel->centerHit) {
+          pixel->centerColor = primaryRayColor(renderContext, rays[numRays],
+                                               true, pixel->centerPoint);
+          numPixels--;
+          continue;
+        }
+        rays[numRays].origin = pixel->centerPoint;
+      }
+      numRays++;
+    }
+    marchRays(renderContext, kRayPrimary, rays, numRays, maxSteps, hits,
+              intPoints);
+    shadeRays(renderContext, rays, hits, intPoints, numRays, colors);
 
-      int pixelIndex = pixelRow * kNumPixelRows + pixelColumn;
-      Color avgColor = scaleColor(colorSum, 0xFF / kNumSubPixels);
-      pixels[pixelIndex] = makePixel(avgColor.r, avgColor.g, avgColor.b);
+    for (int p = 0; p < numPixels; ++p) {
+      ProgressivePixel *pixel = passPixels[p];
+      if (pass->kind == kPassGridRow) {
+        for (int i = p * subPixelsDim; i < (p + 1) * subPixelsDim; ++i) {
+          pixel->gridSum = addColors(pixel->gridSum, colors[i]);
+        }
+        pixel->numGridRows++;
+        continue;
+      }
+      pixel->isSampled = true;
+      pixel->centerHit = hits[p];
+      pixel->centerPoint = intPoints[p];
+      pixel->centerColor = colors[p];
     }
   }
-  return writeBitmap(pixels, kNumPixelRows, kNumPixelColumns, "image.bmp");
-}
\ No newline at end of file
+
+  flushMarchStats(renderContext);
+  free(passPixels);
+  free(colors);
+  free(intPoints);
+  free(hits);
+  free(rays);
+}
+
+// Writes the image next to filename and renames it over filename, so the file
+// always holds a whole image.
+int replaceImage(const Pixel *pixels, int width, int height,
+                 ImageFormat format, const char *filename, TilePool *pool) {
+  size_t tmpFilenameSize = strlen(filename) + 5;
+  char *tmpFilename = malloc(tmpFilenameSize);
+  snprintf(tmpFilename, tmpFilenameSize, "%s.tmp", filename);
+  int result = writeImage(pixels, width, height, format, tmpFilename, pool);
+  if (result == 0 && rename(tmpFilename, filename) != 0) {
+    printf("Failed to rename image file: %d (%s)\n", errno, strerror(errno));
+    result = 1;
+  }
+  free(tmpFilename);
+  return result;
+}
+
+int renderProgressive(TilePool *pool, const Options *options,
+                      RenderContext *context) {
+  size_t numPixels = (size_t)context->imageWidth * context->imageHeight;
+  ProgressivePass *passes =
+      malloc((6 + context->subPixelsDim) * sizeof(ProgressivePass));
+  int numPasses = planProgressivePasses(context->numRayMarchSteps,
+                                        context->subPixelsDim, passes);
+  ProgressiveRender progressive = {
+      .renderContext = context,
+      .pixels = calloc(numPixels, sizeof(ProgressivePixel))};
+  Pixel *image = malloc(numPixels * sizeof(Pixel));
+  int numRayMarchSteps = context->numRayMarchSteps;
+
+  double start = wallClockSeconds();
+  double deadline = start + options->budgetMilliseconds / 1000.0;
+  int result = 0;
+  int numPassesDone = 0;
+  while (numPassesDone < numPasses && result == 0) {
+    if (numPassesDone > 0 && wallClockSeconds() >= deadline) {
+      break;
+    }
+    progressive.pass = passes[numPassesDone];
+    progressive.passDeadline = numPassesDone > 0 ? deadline : INFINITY;
+    atomic_init(&progressive.isPassIncomplete, false);
+    // Reflections get as many steps as the pixel-center rays.
+    context->numRayMarchSteps =
+        progressive.pass.kind == kPassGridRow ? numRayMarchSteps
+                                              : progressive.pass.numCenterSteps;
+    renderTiles(pool, context->imageWidth, context->imageHeight,
+                options->tileSize, renderProgressiveTile, &progressive);
+    progressive.numCenterSteps = progressive.pass.numCenterSteps;
+
+    composeProgressiveImage(progressive.pixels, context->imageWidth,
+                            context->imageHeight, context->subPixelsDim,
+                            image);
+    result = replaceImage(image, context->imageWidth, context->imageHeight,
+                          options->outputFormat, options->outputFilename,
+                          pool);
+    bool isIncomplete = atomic_load(&progressive.isPassIncomplete);
+    char description[64];
+    describeProgressivePass(&progressive.pass, context->subPixelsDim,
+                            description, sizeof(description));
+    printf("Pass %d of %d (%s)%s written at %.0f ms\n", numPassesDone + 1,
+           numPasses, description, isIncomplete ? ", cut short," : "",
+           (wallClockSeconds() - start) * 1e3);
+    numPassesDone++;
+    if (isIncomplete) {
+      break;
+    }
+  }
+  context->numRayMarchSteps = numRayMarchSteps;
+  free(image);
+  free(progressive.pixels);
+  free(passes);
+  return result;
+}
+
+/**
+ * Checkpointed rendering. Tiles render into a framebuffer mapped from a
+ * checkpoint file, so a render that is cut short can be resumed, skipping the
+ * tiles the checkpoint has saved.
+ */
+
+uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// A hash of every option and scene detail that changes the pixels, so that
+// workers with different settings from the coordinator's are turned away and
+// checkpoints aren't resumed with different settings.
+uint64_t renderSettingsHash(const Options *options) {
+  int settings[] = {options->imageWidth,
+                    options->imageHeight,
+                    options->subPixelsDim,
+                    options->numRayMarchSteps,
+                    options->tileSize,
+                    options->brickMapFilename != NULL,
+                    options->usesDepthPrepass,
+                    options->usesFresnelTables,
+                    options->shadowCacheCells,
+                    options->isRelaxedMarch[kRayPrimary],
+                    options->isRelaxedMarch[kRayReflection],
+                    options->isRelaxedMarch[kRayShadow]};
+  Point view[] = {options->view.cameraPosition, options->view.cameraTarget,
+                  options->view.lightPosition};
+  uint64_t hash = hashBytes(0xcbf29ce484222325ull, settings, sizeof(settings));
+  hash = hashBytes(hash, view, sizeof(view));
+  // Instructions are zeroed before they're filled in, so their padding hashes
+  // the same in every process.
+  hash = hashBytes(hash, gScene.tape,
+                   gScene.tapeLength * sizeof(SceneInstruction));
+  for (int i = 0; i < gScene.numMaterials; ++i) {
+    const Material *material = &gScene.materials[i];
+    Color colors[] = {material->diffuse, material->refractiveIndex,
+                      material->extinctionCoeff};
+    int isConductive = material->isConductive;
+    hash = hashBytes(hash, colors, sizeof(colors));
+    hash = hashBytes(hash, &isConductive, sizeof(isConductive));
+  }
+  return hash;
+}
+
+typedef struct CheckpointJob {
+  RenderContext *context;
+  Checkpoint *checkpoint;
+  int tileSize;
+  int numTileColumns;
+} CheckpointJob;
+
+void renderCheckpointedTile(Tile tile, void *context) {
+  CheckpointJob *job = context;
+  int index = tile.row / job->tileSize * job->numTileColumns +
+              tile.column / job->tileSize;
+  if (isCheckpointTileDone(job->checkpoint, index)) {
+    return;
+  }
+  renderTile(tile, job->context);
+  finishCheckpointTile(job->checkpoint, index);
+}
+
+int renderCheckpointed(TilePool *pool, const Options *options,
+                       RenderContext *context) {
+  int tileSize = options->tileSize;
+  int numTileColumns = (context->imageWidth + tileSize - 1) / tileSize;
+  int numTileRows = (context->imageHeight + tileSize - 1) / tileSize;
+  int numTiles = numTileColumns * numTileRows;
+  size_t filenameSize = strlen(options->outputFilename) + 12;
+  char *filename = malloc(filenameSize);
+  snprintf(filename, filenameSize, "%s.checkpoint", options->outputFilename);
+  Checkpoint *checkpoint = openCheckpoint(
+      filename, renderSettingsHash(options), context->imageWidth,
+      context->imageHeight, numTiles, options->checkpointSeconds,
+      options->resumes);
+  if (!checkpoint) {
+    free(filename);
+    return 1;
+  }
+  int numTilesDone = numCheckpointTilesDone(checkpoint);
+  if (numTilesDone > 0) {
+    printf("Resuming from %s: %d of %d tiles already rendered\n", filename,
+           numTilesDone, numTiles);
+  }
+  free(filename);
+
+  context->framebuffer = checkpointPixels(checkpoint);
+  CheckpointJob job = {.context = context,
+                       .checkpoint = checkpoint,
+                       .tileSize = tileSize,
+                       .numTileColumns = numTileColumns};
+  renderTiles(pool, context->imageWidth, context->imageHeight, tileSize,
+              renderCheckpointedTile, &job);
+  int result =
+      writeImage(context->framebuffer, context->imageWidth,
+                 context->imageHeight, options->outputFormat,
+                 options->outputFilename, pool);
+  context->framebuffer = NULL;
+  // Without the image, the checkpoint is kept to write it from next time.
+  closeCheckpoint(checkpoint, result == 0);
+  return result;
+}
+
+/**
+ * Batch rendering. Everything set up for the first frame, the scene, the
+ * brick map and the thread pool, is reused for the rest. Frames are rendered
+ * into one of two framebuffers, and while the pool renders the next frame into
+ * one, an encoder thread writes out the previous frame from the other.
+ */
+
+typedef struct EncodeJob {
+  Pixel *pixels;
+  int imageWidth;
+  int imageHeight;
+  ImageFormat format;
+  char *filename;
+  int result;
+  pthread_t thread;
+  bool isRunning;
+} EncodeJob;
+
+void *encodeFrame(void *arg) {
+  EncodeJob *job = arg;
+  // The pool is busy with the next frame, which this overlaps with anyway.
+  job->result = writeImage(job->pixels, job->imageWidth, job->imageHeight,
+                           job->format, job->filename, NULL);
+  return NULL;
+}
+
+// Waits for the job's encoder, if it has one. Returns its result.
+int finishEncodeJob(EncodeJob *job) {
+  if (!job->isRunning) {
+    return 0;
+  }
+  pthread_join(job->thread, NULL);
+  job->isRunning = false;
+  return job->result;
+}
+
+// Writes the name of a frame's file into filename: pattern with its last run of
+// '#' replaced by the zero-padded frame number.
+void frameFilename(const char *pattern, int frame, char *filename,
+                   size_t filenameSize) {
+  const char *runEnd = strrchr(pattern, '#');
+  if (!runEnd) {
+    snprintf(filename, filenameSize, "%s", pattern);
+    return;
+  }
+  const char *runStart = runEnd;
+  while (runStart > pattern && runStart[-1] == '#') {
+    runStart--;
+  }
+  snprintf(filename, filenameSize, "%.*s%0*d%s", (int)(runStart - pattern),
+           pattern, (int)(runEnd - runStart + 1), frame, runEnd + 1);
+}
+
+// Bakes visibility of the context's light as diffuseColor() sees it. The cache
+// samples points off surfaces, so this finds the surface point nearest them;
+// on surfaces facing away from the light, points just off them see more of the
+// light than the surface does.
+float bakedLightVisibility(Point point, void *context) {
+  Vector normal = sceneNormal(point);
+  Point surfacePoint = addVectorToPoint(point, normal, -sceneSDF(point));
+  return surfaceLightVisibility(context, surfacePoint);
+}
+
+// A hash of what the shadow cache's samples depend on besides the light and
+// the cache's resolution, so that saved caches are only loaded where baking
+// would give the same samples.
+uint64_t shadowCacheSettingsHash(const RenderContext *context) {
+  MarchSettings settings = marchSettings(context, kRayShadow);
+  int maxSteps =
+      context->isRelaxedMarch[kRayShadow] ? context->numRayMarchSteps : 0;
+  uint64_t hash =
+      hashBytes(0xcbf29ce484222325ull, &settings, sizeof(settings));
+  hash = hashBytes(hash, &maxSteps, sizeof(maxSteps));
+  return hashBytes(hash, gScene.tape,
+                   gScene.tapeLength * sizeof(SceneInstruction));
+}
+
+// Bakes the shadow cache for the context's light, unless it's already baked
+// for it or the cache file has it, saving what it bakes to the file. Returns 1
+// on failure.
+int updateShadowCache(TilePool *pool, const Options *options,
+                      RenderContext *context) {
+  Point light = context->lightPosition;
+  ShadowCache *cache = context->shadowCache;
+  if (!options->shadowCacheCells ||
+      (cache && light.x == cache->lightPosition.x &&
+       light.y == cache->lightPosition.y &&
+       light.z == cache->lightPosition.z)) {
+    return 0;
+  }
+  freeShadowCache(cache);
+  double start = wallClockSeconds();
+  uint64_t settingsHash = shadowCacheSettingsHash(context);
+  const char *filename = options->shadowCacheFilename;
+  context->shadowCache =
+      filename ? loadShadowCache(filename, light, options->shadowCacheCells,
+                                 settingsHash)
+               : NULL;
+  const char *source = "loaded";
+  if (!context->shadowCache) {
+    // Baking marches shadows on their own, so they don't count as the
+    // image's.
+    RenderContext bakeContext = *context;
+    bakeContext.shadowCache = NULL;
+    bakeContext.countsMarchSteps = false;
+    context->shadowCache =
+        bakeShadowCache(&gScene, light, options->shadowCacheCells,
+                        bakedLightVisibility, &bakeContext, pool);
+    if (!context->shadowCache) {
+      return 1;
+    }
+    // A cache that can't be saved still speeds up this render.
+    if (filename) {
+      saveShadowCache(context->shadowCache, filename, settingsHash);
+    }
+    source = "baked";
+  }
+  printf("Shadow cache %s in %.2f s: %d bricks near surfaces, %.1f MiB\n",
+         source, wallClockSeconds() - start,
+         context->shadowCache->numNearBricks,
+         shadowCacheMemorySize(context->shadowCache) / 1048576.0);
+  return 0;
+}
+
+int renderAnimation(TilePool *pool, const Options *options,
+                    RenderContext *context, const Animation *animation) {
+  int firstFrame = animation->keys[0].frame;
+  int lastFrame = animation->keys[animation->numKeys - 1].frame;
+  if (options->hasFrameRange) {
+    firstFrame = options->firstFrame;
+    lastFrame = options->lastFrame;
+  }
+  if (!strchr(options->outputFilename, '#') && firstFrame != lastFrame) {
+    printf("Output name needs a run of '#' for the frame number: %s\n",
+           options->outputFilename);
+    return 1;
+  }
+
+  size_t filenameSize = strlen(options->outputFilename) + 16;
+  size_t numPixels = (size_t)context->imageWidth * context->imageHeight;
+  EncodeJob jobs[2];
+  for (int i = 0; i < 2; ++i) {
+    jobs[i] = (EncodeJob){.pixels = malloc(numPixels * sizeof(Pixel)),
+                          .imageWidth = context->imageWidth,
+                          .imageHeight = context->imageHeight,
+                          .format = options->outputFormat,
+                          .filename = malloc(filenameSize)};
+  }
+
+  if (options->usesTemporalCache) {
+    context->temporalCache = createTemporalCache(
+        context->imageWidth, context->imageHeight, context->subPixelsDim);
+  }
+
+  int result = 0;
+  double start = wallClockSeconds();
+  for (int frame = firstFrame; frame <= lastFrame && result == 0; ++frame) {
+    EncodeJob *job = &jobs[(frame - firstFrame) % 2];
+    // The frame before last may still be being written from this buffer.
+    result = finishEncodeJob(job);
+    if (result != 0) {
+      break;
+    }
+    AnimationKey key = animationFrame(animation, frame);
+    aimCamera(context, key.cameraPosition, key.cameraTarget);
+    context->lightPosition = key.lightPosition;
+    context->framebuffer = job->pixels;
+    result = updateShadowCache(pool, options, context);
+    if (result != 0) {
+      break;
+    }
+    if (context->temporalCache) {
+      TemporalCamera camera = temporalCamera(context);
+      reprojectTemporalCache(context->temporalCache, &camera);
+    }
+    renderImage(pool, options->tileSize, context);
+    if (context->temporalCache) {
+      finishTemporalFrame(context->temporalCache, context->lightPosition);
+    }
+
+    frameFilename(options->outputFilename, frame, job->filename, filenameSize);
+    if (pthread_create(&job->thread, NULL, encodeFrame, job) == 0) {
+      job->isRunning = true;
+    } else {
+      encodeFrame(job);
+      result = job->result;
+    }
+  }
+  for (int i = 0; i < 2; ++i) {
+    int jobResult = finishEncodeJob(&jobs[i]);
+    result = result ? result : jobResult;
+    free(jobs[i].filename);
+    free(jobs[i].pixels);
+  }
+  double elapsed = wallClockSeconds() - start;
+  if (result == 0) {
+    int numFrames = lastFrame - firstFrame + 1;
+    printf("Rendered %d frames in %.2f s (%.3f s per frame)\n", numFrames,
+           elapsed, elapsed / numFrames);
+    if (context->temporalCache) {
+      TemporalCache *cache = context->temporalCache;
+      double numRays = (double)numFrames * cache->width * cache->height;
+      printf("Temporal cache: %.1f%% of primary rays started from reprojected "
+             "hits, %.1f%% reused their colors\n",
+             atomic_load(&cache->numSeededRays) / numRays * 100.0,
+             atomic_load(&cache->numReusedColors) / numRays * 100.0);
+    }
+  }
+  freeTemporalCache(context->temporalCache);
+  context->temporalCache = NULL;
+  return result;
+}
+
+int renderSingleImage(TilePool *pool, const Options *options,
+                      RenderContext *context) {
+  aimCamera(context, options->view.cameraPosition,
+            options->view.cameraTarget);
+  context->lightPosition = options->view.lightPosition;
+  if (updateShadowCache(pool, options, context) != 0) {
+    return 1;
+  }
+  if (options->budgetMilliseconds) {
+    return renderProgressive(pool, options, context);
+  }
+  if (options->checkpointSeconds) {
+    return renderCheckpointed(pool, options, context);
+  }
+  context->output =
+      createImageFile(options->outputFilename, options->outputFormat,
+                      context->imageWidth, context->imageHeight);
+  if (!context->output) {
+    return 1;
+  }
+  renderImage(pool, options->tileSize, context);
+  return closeImageFile(context->output);
+}
+
+/**
+ * Distributed rendering. The coordinator hands out squares of
+ * kDistributedTileSpan x kDistributedTileSpan render tiles, which workers
+ * split back into the render tiles a single process would have rendered, so
+ * the image comes out exactly the same.
+ */
+
+const int kDistributedTileSpan = 4;
+
+extern char **environ;
+
+typedef struct WorkerJob {
+  TilePool *pool;
+  int tileSize;
+  RenderContext *context;
+} WorkerJob;
+
+void renderWorkerTile(Tile tile, Pixel *pixels, void *context) {
+  WorkerJob *job = context;
+  job->context->framebuffer = pixels;
+  job->context->framebufferTile = tile;
+  renderRegionTiles(job->pool, tile, job->tileSize, renderTile, job->context);
+}
+
+// Renders tiles for the coordinator in options until it has none left.
+int runWorker(TilePool *pool, const Options *options,
+              RenderContext *context) {
+  aimCamera(context, options->view.cameraPosition,
+            options->view.cameraTarget);
+  context->lightPosition = options->view.lightPosition;
+  if (updateShadowCache(pool, options, context) != 0) {
+    return 1;
+  }
+  WorkerJob job = {.pool = pool, .tileSize = options->tileSize,
+                   .context = context};
+  return serveTiles(options->workerAddress, renderSettingsHash(options),
+                    renderWorkerTile, &job);
+}
+
+// Starts options->numSpawnedWorkers copies of this program with the same
+// options, rendering tiles for the coordinator on port with their share of
+// the threads. Returns how many started, with their pids in pids.
+int spawnWorkers(int argc, char **argv, const Options *options, int port,
+                 pid_t *pids) {
+  char address[300];
+  snprintf(address, sizeof(address), "%s:%d",
+           options->coordinatorHost ? options->coordinatorHost : "localhost",
+           port);
+  char threads[16];
+  int numThreads = options->numThreads / options->numSpawnedWorkers;
+  snprintf(threads, sizeof(threads), "%d", numThreads > 1 ? numThreads : 1);
+  char **workerArgv = malloc((argc + 5) * sizeof(char *));
+  memcpy(workerArgv, argv, argc * sizeof(char *));
+  workerArgv[argc] = "--worker";
+  workerArgv[argc + 1] = address;
+  workerArgv[argc + 2] = "-j";
+  workerArgv[argc + 3] = threads;
+  workerArgv[argc + 4] = NULL;
+  // Workers report what they bake just as this process does, so only their
+  // errors are worth seeing, and those come back as missing tiles.
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  int numSpawned = 0;
+  for (int i = 0; i < options->numSpawnedWorkers; ++i) {
+    int error = posix_spawn(&pids[numSpawned], "/proc/self/exe", &actions,
+                            NULL, workerArgv, environ);
+    if (error != 0) {
+      printf("Failed to start worker: %d (%s)\n", error, strerror(error));
+      continue;
+    }
+    numSpawned++;
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  free(workerArgv);
+  return numSpawned;
+}
+
+void storeDistributedTile(Tile tile, const Pixel *pixels, void *context) {
+  const RenderContext *renderContext = context;
+  for (int row = 0; row < tile.numRows; ++row) {
+    storePixelRow(renderContext, tile.row + row, tile.column,
+                  pixels + (size_t)row * tile.numColumns, tile.numColumns);
+  }
+}
+
+// Splits the image into tiles and hands them out to workers, writing each to
+// the output as it comes back.
+int renderDistributed(const Options *options, RenderContext *context,
+                      int argc, char **argv) {
+  Coordinator *coordinator =
+      createCoordinator(options->coordinatorHost, options->coordinatorPort);
+  if (!coordinator) {
+    return 1;
+  }
+  int port = coordinatorPort(coordinator);
+  printf("Coordinating on port %d\n", port);
+  fflush(stdout);
+  context->output =
+      createImageFile(options->outputFilename, options->outputFormat,
+                      context->imageWidth, context->imageHeight);
+  if (!context->output) {
+    destroyCoordinator(coordinator);
+    return 1;
+  }
+
+  int tileSize = options->tileSize * kDistributedTileSpan;
+  int numTileColumns = (context->imageWidth + tileSize - 1) / tileSize;
+  int numTileRows = (context->imageHeight + tileSize - 1) / tileSize;
+  int numTiles = numTileColumns * numTileRows;
+  Tile *tiles = malloc(numTiles * sizeof(Tile));
+  for (int i = 0; i < numTiles; ++i) {
+    Tile *tile = &tiles[i];
+    tile->row = i / numTileColumns * tileSize;
+    tile->column = i % numTileColumns * tileSize;
+    tile->numRows = context->imageHeight - tile->row < tileSize
+                        ? context->imageHeight - tile->row
+                        : tileSize;
+    tile->numColumns = context->imageWidth - tile->column < tileSize
+                           ? context->imageWidth - tile->column
+                           : tileSize;
+  }
+
+  pid_t *pids = malloc((options->numSpawnedWorkers + 1) * sizeof(pid_t));
+  int numSpawned = 0;
+  if (options->numSpawnedWorkers) {
+    numSpawned = spawnWorkers(argc, argv, options, port, pids);
+  }
+  if (options->numSpawnedWorkers && !numSpawned) {
+    free(pids);
+    free(tiles);
+    closeImageFile(context->output);
+    destroyCoordinator(coordinator);
+    return 1;
+  }
+  double start = wallClockSeconds();
+  int result = coordinateTiles(coordinator, renderSettingsHash(options),
+                               tiles, numTiles, pids, numSpawned,
+                               storeDistributedTile, context);
+  printf("Distributed render took %.2f s\n", wallClockSeconds() - start);
+  destroyCoordinator(coordinator);
+  // Workers still starting up have nothing left to do.
+  for (int i = 0; i < numSpawned; ++i) {
+    kill(pids[i], SIGTERM);
+    waitpid(pids[i], NULL, 0);
+  }
+  free(pids);
+  free(tiles);
+  int closeResult = closeImageFile(context->output);
+  return result ? result : closeResult;
+}
+
+/**
+ * Render server. The scene, brick map, Fresnel tables, shadow cache and thread
+ * pool stay loaded between requests, so a request only pays for its render.
+ */
+
+typedef struct ServerJob {
+  TilePool *pool;
+  const Options *options;
+  RenderContext *context;
+} ServerJob;
+
+uint8_t *renderRequest(const RenderRequest *request, size_t *size,
+                       void *context) {
+  ServerJob *job = context;
+  RenderContext *renderContext = job->context;
+  renderContext->imageWidth = request->imageWidth;
+  renderContext->imageHeight = request->imageHeight;
+  renderContext->subPixelsDim = request->subPixelsDim;
+  renderContext->numRayMarchSteps = request->numRayMarchSteps;
+  aimCamera(renderContext, request->cameraPosition, request->cameraTarget);
+  renderContext->lightPosition = request->lightPosition;
+  if (updateShadowCache(job->pool, job->options, renderContext) != 0) {
+    return NULL;
+  }
+  size_t numPixels = (size_t)request->imageWidth * request->imageHeight;
+  Pixel *pixels = malloc(numPixels * sizeof(Pixel));
+  if (!pixels) {
+    return NULL;
+  }
+  renderContext->framebuffer = pixels;
+  renderImage(job->pool, job->options->tileSize, renderContext);
+  renderContext->framebuffer = NULL;
+  if (request->format == kImageFormatRaw) {
+    *size = numPixels * sizeof(Pixel);
+    return (uint8_t *)pixels;
+  }
+  uint8_t *bytes = encodeImage(pixels, request->imageWidth, request->imageHeight,
+                               request->format, job->pool, size);
+  free(pixels);
+  return bytes;
+}
+
+int runServer(TilePool *pool, const Options *options,
+              RenderContext *context) {
+  RenderRequest defaults = {.imageWidth = options->imageWidth,
+                            .imageHeight = options->imageHeight,
+                            .subPixelsDim = options->subPixelsDim,
+                            .numRayMarchSteps = options->numRayMarchSteps,
+                            .cameraPosition = options->view.cameraPosition,
+                            .cameraTarget = options->view.cameraTarget,
+                            .lightPosition = options->view.lightPosition,
+                            .format = options->outputFormat};
+  ServerJob job = {.pool = pool, .options = options, .context = context};
+  return runRenderServer(options->serverPath, &defaults, renderRequest, &job);
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!parseOptions(argc, argv, &options)) {
+    return 1;
+  }
+  Animation animation = {0};
+  if (options.animationFilename &&
+      loadAnimation(options.animationFilename, &options.view, &animation) !=
+          0) {
+    return 1;
+  }
+  int result = options.sceneFilename
+                   ? loadScene(options.sceneFilename, &gScene)
+                   : parseScene(kDefaultSceneDescription, "default scene",
+                                &gScene);
+  if (result != 0) {
+    return 1;
+  }
+  TilePool *pool = createTilePool(options.numThreads);
+  if (!pool) {
+    return 1;
+  }
+  if (options.brickMapFilename) {
+    gBrickMap = prepareBrickMap(options.brickMapFilename, pool);
+    if (!gBrickMap) {
+      return 1;
+    }
+  }
+  if (options.sceneKernelDirectory) {
+    // Without a kernel, the generic code renders the same image.
+    gSceneKernel = loadSceneKernel(&gScene, options.sceneKernelDirectory);
+  }
+  RenderContext context = {.imageWidth = options.imageWidth,
+                           .imageHeight = options.imageHeight,
+                           .subPixelsDim = options.subPixelsDim,
+                           .numRayMarchSteps = options.numRayMarchSteps,
+                           .packetBackend = options.packetBackend,
+                           .adaptiveDim = options.adaptiveDim,
+                           .countsMarchSteps = options.countsMarchSteps,
+                           .usesDepthPrepass = options.usesDepthPrepass,
+                           .usesFresnelTables = options.usesFresnelTables,
+                           .numDenoisePasses = options.numDenoisePasses};
+  memcpy(context.isRelaxedMarch, options.isRelaxedMarch,
+         sizeof(context.isRelaxedMarch));
+#if INSTRUMENT
+  if (options.heatmapPrefix) {
+    context.pixelCosts = calloc((size_t)context.imageWidth * context.imageHeight,
+                                sizeof(PixelCost));
+  }
+#endif
+  if (options.denoises) {
+    context.gbuffer = createGBuffer(context.imageWidth, context.imageHeight);
+    if (!context.gbuffer) {
+      printf("Failed to allocate the G-buffer\n");
+      return 1;
+    }
+  }
+  if (options.serverPath) {
+    result = runServer(pool, &options, &context);
+  } else if (options.workerAddress) {
+    result = runWorker(pool, &options, &context);
+  } else if (options.isCoordinator) {
+    result = renderDistributed(&options, &context, argc, argv);
+  } else if (options.animationFilename) {
+    result = renderAnimation(pool, &options, &context, &animation);
+  } else {
+    result = renderSingleImage(pool, &options, &context);
+  }
+  if (result == 0 && options.countsMarchSteps) {
+    printMarchStats(&context);
+  }
+#if INSTRUMENT
+  if (result == 0 && options.heatmapPrefix) {
+    result = writeCostHeatmaps(context.pixelCosts, context.imageWidth,
+                               context.imageHeight, options.heatmapPrefix);
+  }
+  free(context.pixelCosts);
+#endif
+  destroyTilePool(pool);
+  freeAnimation(&animation);
+  freeGBuffer(context.gbuffer);
+  freeShadowCache(context.shadowCache);
+  freeSceneKernel(gSceneKernel);
+  freeBrickMap(gBrickMap);
+  freeScene(&gScene);
+  return result;
+}
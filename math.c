@@ -3,12 +3,10 @@
 #include <math.h>
 #include <stdint.h>
 
-#define SDF_EPSILON 0.0001
-
 #if HQ
-const int kNumRayMarchSteps = 1024;
+const int kDefaultNumRayMarchSteps = 1024;
 #else
-const int kNumRayMarchSteps = 128;
+const int kDefaultNumRayMarchSteps = 128;
 #endif
 
 const Point kPointOrigin = {.x = 0.0, .y = 0.0, .z = 0.0};
@@ -53,6 +51,12 @@ float dotProduct(Vector a, Vector b) {
   return a.x * b.x + a.y * b.y + a.z * b.z;
 }
 
+Vector crossProduct(Vector a, Vector b) {
+  return (Vector){.x = a.y * b.z - a.z * b.y,
+                  .y = a.z * b.x - a.x * b.z,
+                  .z = a.x * b.y - a.y * b.x};
+}
+
 Vector normalizedVector(Vector vector) {
   float length = vectorLength(vector);
   return (Vector){
@@ -135,6 +139,10 @@ Transform combineTransforms(Transform t1, Transform t2) {
   return makeTransform(a, b, c, d, e, f, g, h, i);
 }
 
+Transform transposeTransform(Transform t) {
+  return makeTransform(t.a, t.d, t.g, t.b, t.e, t.h, t.c, t.f, t.i);
+}
+
 Color mixColors(Color c1, Color c2, float t1, float t2) {
   return makeColor(c1.r * t1 + c2.r * t2, c1.g * t1 + c2.g * t2,
                    c1.b * t1 + c2.b * t2);
@@ -159,9 +167,14 @@ Color clampColor(Color c, float lowerBound, float upperBound) {
   return makeColor(r, g, b);
 }
 
-bool rayMarch(Ray ray, SDF SDF, Point *intersectionPoint) {
+float sampleSumScale(int numSamples, int subPixelsDim) {
+  int gridSize = subPixelsDim * subPixelsDim;
+  return (float)(0xFF / gridSize) * gridSize / numSamples;
+}
+
+bool rayMarch(Ray ray, SDF SDF, int maxSteps, Point *intersectionPoint) {
   Point point = ray.origin;
-  for (int i = 0; i < kNumRayMarchSteps; ++i) {
+  for (int i = 0; i < maxSteps; ++i) {
     float d = SDF(point);
     if (d <= SDF_EPSILON) {
       if (intersectionPoint) {
@@ -173,6 +186,9 @@ bool rayMarch(Ray ray, SDF SDF, Point *intersectionPoint) {
                     .y = point.y + ray.direction.y * d,
                     .z = point.z + ray.direction.z * d};
   }
+  if (intersectionPoint) {
+    *intersectionPoint = point;
+  }
   return false;
 }
 
@@ -201,6 +217,139 @@ float softShadow(Point start, Point end, SDF SDF, float k) {
   return result;
 }
 
+float conductiveReflectance(float refractiveIndex, float extinctionCoeff,
+                            float angle) {
+  return conductiveReflectanceForCosine(refractiveIndex, extinctionCoeff,
+                                        cosf(angle));
+}
+
+float conductiveReflectanceForCosine(float refractiveIndex,
+                                     float extinctionCoeff, float cosine) {
+  float n = refractiveIndex;
+  float k = extinctionCoeff;
+  float c = cosine;
+  float rp = ((n * n + k * k) * c * c - 2.0 * n * c + 1.0) /
+             ((n * n + k * k) * c * c + 2.0 * n * c + 1.0);
+  float rs = ((n * n + k * k) - 2.0 * n * c + c * c) /
+             ((n * n + k * k) + 2.0 * n * c + c * c);
+  return (rp + rs) * 0.5;
+}
+
+Color conductiveReflectance2(Color refractiveIndex, Color extinctionCoeff,
+                             float angle) {
+  float r = conductiveReflectance(refractiveIndex.r, extinctionCoeff.r, angle);
+  float g = conductiveReflectance(refractiveIndex.g, extinctionCoeff.g, angle);
+  float b = conductiveReflectance(refractiveIndex.b, extinctionCoeff.b, angle);
+  return makeColor(r, g, b);
+}
+
+void buildFresnelTable(Color refractiveIndex, Color extinctionCoeff,
+                       FresnelTable *table) {
+  for (int i = 0; i <= kFresnelTableSize; ++i) {
+    float cosine = (float)i / kFresnelTableSize;
+    table->reflectances[i] = makeColor(
+        conductiveReflectanceForCosine(refractiveIndex.r, extinctionCoeff.r,
+                                       cosine),
+        conductiveReflectanceForCosine(refractiveIndex.g, extinctionCoeff.g,
+                                       cosine),
+        conductiveReflectanceForCosine(refractiveIndex.b, extinctionCoeff.b,
+                                       cosine));
+  }
+}
+
+Color lookupFresnelTable(const FresnelTable *table, float cosine) {
+  float x = fminf(fmaxf(cosine, 0.0), 1.0) * kFresnelTableSize;
+  int i = (int)x;
+  if (i == kFresnelTableSize) {
+    i--;
+  }
+  float t = x - i;
+  Color a = table->reflectances[i];
+  Color b = table->reflectances[i + 1];
+  return makeColor(a.r + (b.r - a.r) * t, a.g + (b.g - a.g) * t,
+                   a.b + (b.b - a.b) * t);
+}
+
+MarchResult sphereTrace(Ray ray, SDF SDF, int maxSteps,
+                        const MarchSettings *settings) {
+  Point point = ray.origin;
+  float relaxation = settings->relaxation;
+  float t = 0.0;
+  float stepLength = 0.0;
+  float previousRadius = 0.0;
+  for (int i = 0; i < maxSteps; ++i) {
+    float d = SDF(point);
+    float radius = fabsf(d);
+    if (relaxation > 1.0 && radius + previousRadius < stepLength) {
+      // The empty spheres around this point and the last don't overlap, so
+      // there may be a surface between them. Go back and take the plain step.
+      float back = previousRadius - stepLength;
+      point = addVectorToPoint(point, ray.direction, back);
+      t += back;
+      stepLength = previousRadius;
+      relaxation = 1.0;
+      continue;
+    }
+    if (d <= SDF_EPSILON || d <= settings->coneRadius * t) {
+      return (MarchResult){
+          .outcome = kMarchHit, .point = point, .numSteps = i + 1};
+    }
+    stepLength = d * relaxation;
+    previousRadius = radius;
+    point = (Point){.x = point.x + ray.direction.x * stepLength,
+                    .y = point.y + ray.direction.y * stepLength,
+                    .z = point.z + ray.direction.z * stepLength};
+    t += stepLength;
+    if (t > settings->maxDistance) {
+      return (MarchResult){
+          .outcome = kMarchEscaped, .point = point, .numSteps = i + 1};
+    }
+  }
+  return (MarchResult){
+      .outcome = kMarchOutOfSteps, .point = point, .numSteps = maxSteps};
+}
+
+float sphereTraceSoftShadow(Point start, Point end, SDF SDF, float k,
+                            int maxSteps, const MarchSettings *settings,
+                            MarchResult *march) {
+  float result = 1.0;
+  Vector startToEnd = vectorFromPointToPoint(start, end);
+  // Like softShadow(), t is measured in units of startToEnd, and
+  // distances along it have to be scaled by its length to compare them with
+  // the SDF's.
+  float length = vectorLength(startToEnd);
+  float coneRadius = settings->coneRadius * length;
+  float relaxation = settings->relaxation;
+  float stepLength = 0.0;
+  float previousRadius = 0.0;
+  float t = 0.0;
+  int i = 0;
+  for (; i < maxSteps && t < 1.0; ++i) {
+    Point p = addVectorToPoint(start, startToEnd, t);
+    float d = SDF(p);
+    if (relaxation > 1.0 && fabsf(d) + previousRadius < stepLength * length) {
+      t += previousRadius - stepLength;
+      stepLength = previousRadius;
+      relaxation = 1.0;
+      continue;
+    }
+    if (d <= SDF_EPSILON || d <= coneRadius * t) {
+      *march = (MarchResult){
+          .outcome = kMarchHit, .point = p, .numSteps = i + 1};
+      return 0.0;
+    }
+    result = min(result, k * d / t);
+    stepLength = d * relaxation;
+    previousRadius = d;
+    t += stepLength;
+  }
+  *march = (MarchResult){
+      .outcome = t < 1.0 ? kMarchOutOfSteps : kMarchReachedEnd,
+      .point = addVectorToPoint(start, startToEnd, t),
+      .numSteps = i};
+  return result;
+}
+
 float unionOp(float v1, float v2) { return min(v1, v2); }
 
 float sphereSDF(Point p, float radius) {
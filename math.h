@@ -3,6 +3,13 @@
 
 #include <stdbool.h>
 
+// Distances at or below this count as an intersection.
+#define SDF_EPSILON 0.0001
+
+// The number of steps rayMarch() takes before giving up, unless told
+// otherwise.
+extern const int kDefaultNumRayMarchSteps;
+
 typedef struct Point {
   float x, y, z;
 } Point;
@@ -48,6 +55,8 @@ float vectorLength(Vector vector);
 
 float dotProduct(Vector a, Vector b);
 
+Vector crossProduct(Vector a, Vector b);
+
 Vector normalizedVector(Vector vector);
 
 Vector scaleVector(Vector v, float t);
@@ -79,6 +88,8 @@ Vector applyTransform(Transform t, Vector v);
 
 Transform combineTransforms(Transform t1, Transform t2);
 
+Transform transposeTransform(Transform t);
+
 Color mixColors(Color c1, Color c2, float t1, float t2);
 
 Color addColors(Color c1, Color c2);
@@ -89,11 +100,18 @@ Color multiplyColors(Color c1, Color c2);
 
 Color clampColor(Color c, float lowerBound, float upperBound);
 
+// The factor a pixel's sum of sample colors is scaled by. The fixed grid has
+// always scaled its sum by 0xFF / (number of sub-pixels) rounded down, so
+// partial grids get the same overall gain to match it.
+float sampleSumScale(int numSamples, int subPixelsDim);
+
 // Travels from the ray's origin in the ray's direction, passing the current
-// point into the specified SDF function. Returns 1 if an intersection was
-// found, and returns the intersection point.
+// point into the specified SDF function, for at most maxSteps steps. Returns
+// 1 if an intersection was found, and returns the intersection point. On a
+// miss, returns the point marching stopped at instead, so a march can be
+// continued with more steps by marching on from there.
 typedef float (*SDF)(Point);
-bool rayMarch(Ray ray, SDF SDF, Point *intersectionPoint);
+bool rayMarch(Ray ray, SDF SDF, int maxSteps, Point *intersectionPoint);
 
 // Finds the normal for a point. This is a implemented using the generic
 // approach of integrating over the signed distance function.
@@ -101,6 +119,89 @@ Vector normalForPointAndSDF(Point p, SDF SDF);
 
 float softShadow(Point start, Point end, SDF SDF, float k);
 
+// Returns the amount of incoming light reflected from a conductive material in
+// the range of [0.0, 1.0].
+// https://www.pbr-book.org/3ed-2018/Reflection_Models/Specular_Reflection_and_Transmission
+float conductiveReflectance(float refractiveIndex, float extinctionCoeff,
+                            float angle);
+
+// conductiveReflectance() for each color channel.
+Color conductiveReflectance2(Color refractiveIndex, Color extinctionCoeff,
+                             float angle);
+
+// conductiveReflectance(), given the cosine of the angle rather than the angle.
+float conductiveReflectanceForCosine(float refractiveIndex,
+                                     float extinctionCoeff, float cosine);
+
+/**
+ * Fresnel tables. A conductive material's reflectance for each color channel,
+ * sampled at kFresnelTableSize + 1 evenly spaced cosines from 0 to 1 and
+ * interpolated linearly in between. For refractive indices and extinction
+ * coefficients between 0.05 and 5, lookups are within 1e-4 of the exact
+ * reflectance, a fortieth of a brightness level.
+ */
+
+#define kFresnelTableSize 1024
+
+typedef struct FresnelTable {
+  Color reflectances[kFresnelTableSize + 1];
+} FresnelTable;
+
+void buildFresnelTable(Color refractiveIndex, Color extinctionCoeff,
+                       FresnelTable *table);
+
+// The reflectance at an angle whose cosine is given, clamped to [0, 1].
+Color lookupFresnelTable(const FresnelTable *table, float cosine);
+
+/**
+ * Enhanced sphere tracing. Steps are stretched past the distance bound, which
+ * crosses open space in fewer steps, and a stretched step that may have jumped
+ * over a surface is retaken unstretched (over-relaxed sphere tracing, Keinert
+ * et al. 2014). Hits are also accepted further from the surface the further
+ * the ray has travelled, so that they only need to be as precise as the
+ * pixel's cone is wide there. With a relaxation of 1, a cone radius of 0 and
+ * an infinite maximum distance, rays are marched exactly as rayMarch() and
+ * softShadow() march them.
+ */
+
+typedef struct MarchSettings {
+  // Steps are stretched by this factor, between 1 (plain sphere tracing) and
+  // 2.
+  float relaxation;
+  // The radius of the pixel's cone per unit of distance along the ray. A point
+  // within that of a surface is a hit, as is one within SDF_EPSILON.
+  float coneRadius;
+  // Rays that get further than this from their origin miss. Without a limit,
+  // misses march until their step budget runs out.
+  float maxDistance;
+} MarchSettings;
+
+typedef enum MarchOutcome {
+  kMarchHit,
+  // The march gave up because its step budget ran out.
+  kMarchOutOfSteps,
+  // The ray got further than the settings' maxDistance.
+  kMarchEscaped,
+  // A soft shadow march got to the light.
+  kMarchReachedEnd,
+} MarchOutcome;
+
+typedef struct MarchResult {
+  MarchOutcome outcome;
+  // The hit point, or where marching stopped.
+  Point point;
+  // How many times the SDF was evaluated.
+  int numSteps;
+} MarchResult;
+
+MarchResult sphereTrace(Ray ray, SDF SDF, int maxSteps,
+                        const MarchSettings *settings);
+
+// softShadow(), marched with the settings, giving up after maxSteps steps.
+float sphereTraceSoftShadow(Point start, Point end, SDF SDF, float k,
+                            int maxSteps, const MarchSettings *settings,
+                            MarchResult *march);
+
 /**
  * Signed distance functions. More info at:
  * https://www.iquilezles.org/www/articles/distfunctions/distfunctions.htm
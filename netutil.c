@@ -0,0 +1,44 @@
+#include "netutil.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+double monotonicSeconds(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+bool sendAll(int fd, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  while (size > 0) {
+    ssize_t numSent = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (numSent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numSent <= 0) {
+      return false;
+    }
+    bytes += numSent;
+    size -= numSent;
+  }
+  return true;
+}
+
+bool receiveAll(int fd, void *data, size_t size) {
+  uint8_t *bytes = data;
+  while (size > 0) {
+    ssize_t numReceived = recv(fd, bytes, size, 0);
+    if (numReceived < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numReceived <= 0) {
+      return false;
+    }
+    bytes += numReceived;
+    size -= numReceived;
+  }
+  return true;
+}
@@ -0,0 +1,18 @@
+#ifndef NETUTIL_H
+#define NETUTIL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Helpers the render coordinator, its workers and the render server share.
+
+// Seconds on a clock that only moves forward, for timeouts and latencies.
+double monotonicSeconds(void);
+
+// Sends or receives exactly size bytes on a socket, retrying interrupted and
+// partial transfers. Return false if the connection fails or closes first.
+// Sending never raises SIGPIPE.
+bool sendAll(int fd, const void *data, size_t size);
+bool receiveAll(int fd, void *data, size_t size);
+
+#endif /* NETUTIL_H */
@@ -0,0 +1,299 @@
+#include "packet.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "brickmap.h"
+#include "bvh.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PACKET_HAS_X86 1
+#include <immintrin.h>
+#endif
+
+// The rays of one packet in structure-of-arrays form.
+typedef struct PacketLanes {
+  float originX[kMaxPacketWidth];
+  float originY[kMaxPacketWidth];
+  float originZ[kMaxPacketWidth];
+  float directionX[kMaxPacketWidth];
+  float directionY[kMaxPacketWidth];
+  float directionZ[kMaxPacketWidth];
+  float pointX[kMaxPacketWidth];
+  float pointY[kMaxPacketWidth];
+  float pointZ[kMaxPacketWidth];
+} PacketLanes;
+
+/* Scalar fallback: one lane, plain C. */
+
+#define PACKET_SUFFIX scalar
+#define PACKET_TARGET
+#define PACKET_WIDTH 1
+#define vfloat float
+#define vmask bool
+#define vset1(x) ((float)(x))
+#define vloadu(p) (*(p))
+#define vstoreu(p, v) (*(p) = (v))
+#define vadd(a, b) ((a) + (b))
+#define vsub(a, b) ((a) - (b))
+#define vmul(a, b) ((a) * (b))
+#define vsqrt(a) sqrtf(a)
+#define vmin(a, b) min(a, b)
+#define vmax(a, b) max(a, b)
+#define vaddd(a, c) ((float)((double)(a) + (c)))
+#define vcmple(a, b) ((a) <= (b))
+#define vcmplt(a, b) ((a) < (b))
+#define vmaskall() true
+#define vmaskand(a, b) ((a) && (b))
+#define vmaskandnot(a, b) ((a) && !(b))
+#define vmaskor(a, b) ((a) || (b))
+#define vmaskany(m) (m)
+#define vmaskbits(m) ((int)(m))
+#define vselect(m, a, b) ((m) ? (b) : (a))
+#include "packet_impl.h"
+
+#if PACKET_HAS_X86
+
+/* SSE2: four lanes. */
+
+static __attribute__((target("sse2"))) inline __m128 addDouble4(__m128 a,
+                                                                double c) {
+  __m128d lo = _mm_add_pd(_mm_cvtps_pd(a), _mm_set1_pd(c));
+  __m128d hi = _mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(a, a)), _mm_set1_pd(c));
+  return _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+}
+
+#define PACKET_SUFFIX sse
+#define PACKET_TARGET __attribute__((target("sse2")))
+#define PACKET_WIDTH 4
+#define vfloat __m128
+#define vmask __m128
+#define vset1(x) _mm_set1_ps(x)
+#define vloadu(p) _mm_loadu_ps(p)
+#define vstoreu(p, v) _mm_storeu_ps(p, v)
+#define vadd(a, b) _mm_add_ps(a, b)
+#define vsub(a, b) _mm_sub_ps(a, b)
+#define vmul(a, b) _mm_mul_ps(a, b)
+#define vsqrt(a) _mm_sqrt_ps(a)
+#define vmin(a, b) _mm_min_ps(a, b)
+#define vmax(a, b) _mm_max_ps(a, b)
+#define vaddd(a, c) addDouble4(a, c)
+#define vcmple(a, b) _mm_cmple_ps(a, b)
+#define vcmplt(a, b) _mm_cmplt_ps(a, b)
+#define vmaskall() _mm_castsi128_ps(_mm_set1_epi32(-1))
+#define vmaskand(a, b) _mm_and_ps(a, b)
+#define vmaskandnot(a, b) _mm_andnot_ps(b, a)
+#define vmaskor(a, b) _mm_or_ps(a, b)
+#define vmaskany(m) (_mm_movemask_ps(m) != 0)
+#define vmaskbits(m) _mm_movemask_ps(m)
+#define vselect(m, a, b) _mm_or_ps(_mm_and_ps(m, b), _mm_andnot_ps(m, a))
+#include "packet_impl.h"
+
+/* AVX2: eight lanes. */
+
+static __attribute__((target("avx2"))) inline __m256 addDouble8(__m256 a,
+                                                                double c) {
+  __m256d lo = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(a)),
+                             _mm256_set1_pd(c));
+  __m256d hi = _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(a, 1)),
+                             _mm256_set1_pd(c));
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(lo)),
+                              _mm256_cvtpd_ps(hi), 1);
+}
+
+#define PACKET_SUFFIX avx2
+#define PACKET_TARGET __attribute__((target("avx2")))
+#define PACKET_WIDTH 8
+#define vfloat __m256
+#define vmask __m256
+#define vset1(x) _mm256_set1_ps(x)
+#define vloadu(p) _mm256_loadu_ps(p)
+#define vstoreu(p, v) _mm256_storeu_ps(p, v)
+#define vadd(a, b) _mm256_add_ps(a, b)
+#define vsub(a, b) _mm256_sub_ps(a, b)
+#define vmul(a, b) _mm256_mul_ps(a, b)
+#define vsqrt(a) _mm256_sqrt_ps(a)
+#define vmin(a, b) _mm256_min_ps(a, b)
+#define vmax(a, b) _mm256_max_ps(a, b)
+#define vaddd(a, c) addDouble8(a, c)
+#define vcmple(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define vcmplt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define vmaskall() _mm256_castsi256_ps(_mm256_set1_epi32(-1))
+#define vmaskand(a, b) _mm256_and_ps(a, b)
+#define vmaskandnot(a, b) _mm256_andnot_ps(b, a)
+#define vmaskor(a, b) _mm256_or_ps(a, b)
+#define vmaskany(m) (_mm256_movemask_ps(m) != 0)
+#define vmaskbits(m) _mm256_movemask_ps(m)
+#define vselect(m, a, b) _mm256_blendv_ps(a, b, m)
+#include "packet_impl.h"
+
+/* AVX-512: sixteen lanes. AVX-512F includes FMA, which GCC would otherwise
+ * contract multiply-adds into, changing the rounding relative to the scalar
+ * path. */
+
+#define PACKET_AVX512_ATTRIBUTES \
+  __attribute__((target("avx512f"), optimize("fp-contract=off")))
+
+static PACKET_AVX512_ATTRIBUTES inline __m512 addDouble16(__m512 a, double c) {
+  __m256 a0 = _mm512_castps512_ps256(a);
+  __m256 a1 = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a), 1));
+  __m512d lo = _mm512_add_pd(_mm512_cvtps_pd(a0), _mm512_set1_pd(c));
+  __m512d hi = _mm512_add_pd(_mm512_cvtps_pd(a1), _mm512_set1_pd(c));
+  __m512d result = _mm512_insertf64x4(
+      _mm512_castps_pd(_mm512_castps256_ps512(_mm512_cvtpd_ps(lo))),
+      _mm256_castps_pd(_mm512_cvtpd_ps(hi)), 1);
+  return _mm512_castpd_ps(result);
+}
+
+#define PACKET_SUFFIX avx512
+#define PACKET_TARGET PACKET_AVX512_ATTRIBUTES
+#define PACKET_WIDTH 16
+#define vfloat __m512
+#define vmask __mmask16
+#define vset1(x) _mm512_set1_ps(x)
+#define vloadu(p) _mm512_loadu_ps(p)
+#define vstoreu(p, v) _mm512_storeu_ps(p, v)
+#define vadd(a, b) _mm512_add_ps(a, b)
+#define vsub(a, b) _mm512_sub_ps(a, b)
+#define vmul(a, b) _mm512_mul_ps(a, b)
+#define vsqrt(a) _mm512_sqrt_ps(a)
+#define vmin(a, b) _mm512_min_ps(a, b)
+#define vmax(a, b) _mm512_max_ps(a, b)
+#define vaddd(a, c) addDouble16(a, c)
+#define vcmple(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ)
+#define vcmplt(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ)
+#define vmaskall() ((__mmask16)0xFFFF)
+#define vmaskand(a, b) ((__mmask16)((a) & (b)))
+#define vmaskandnot(a, b) ((__mmask16)((a) & ~(b)))
+#define vmaskor(a, b) ((__mmask16)((a) | (b)))
+#define vmaskany(m) ((m) != 0)
+#define vmaskbits(m) ((int)(m))
+#define vselect(m, a, b) _mm512_mask_blend_ps(m, a, b)
+#include "packet_impl.h"
+
+#endif /* PACKET_HAS_X86 */
+
+typedef int (*RayMarchPacketFunc)(const Scene *scene, const BrickMap *map,
+                                  PacketLanes *lanes, float epsilon,
+                                  int maxSteps);
+typedef int (*SphereTracePacketFunc)(const Scene *scene, const BrickMap *map,
+                                     PacketLanes *lanes, float epsilon,
+                                     int maxSteps,
+                                     const MarchSettings *settings);
+
+typedef struct PacketBackendInfo {
+  const char *name;
+  int width;
+  RayMarchPacketFunc rayMarchPacket;
+  SphereTracePacketFunc sphereTracePacket;
+} PacketBackendInfo;
+
+static const PacketBackendInfo kPacketBackends[kNumPacketBackends] = {
+    [kPacketBackendScalar] = {"scalar", 1, rayMarchPacket_scalar,
+                              sphereTracePacket_scalar},
+#if PACKET_HAS_X86
+    [kPacketBackendSSE] = {"sse", 4, rayMarchPacket_sse,
+                           sphereTracePacket_sse},
+    [kPacketBackendAVX2] = {"avx2", 8, rayMarchPacket_avx2,
+                            sphereTracePacket_avx2},
+    [kPacketBackendAVX512] = {"avx512", 16, rayMarchPacket_avx512,
+                              sphereTracePacket_avx512},
+#else
+    [kPacketBackendSSE] = {"sse", 4, NULL, NULL},
+    [kPacketBackendAVX2] = {"avx2", 8, NULL, NULL},
+    [kPacketBackendAVX512] = {"avx512", 16, NULL, NULL},
+#endif
+};
+
+static bool isPacketBackendSupported(PacketBackend backend) {
+#if PACKET_HAS_X86
+  switch (backend) {
+    case kPacketBackendScalar:
+      return true;
+    case kPacketBackendSSE:
+      return __builtin_cpu_supports("sse2");
+    case kPacketBackendAVX2:
+      return __builtin_cpu_supports("avx2");
+    case kPacketBackendAVX512:
+      return __builtin_cpu_supports("avx512f");
+    default:
+      return false;
+  }
+#else
+  return backend == kPacketBackendScalar;
+#endif
+}
+
+PacketBackend detectPacketBackend(void) {
+  for (int backend = kNumPacketBackends - 1; backend > kPacketBackendScalar;
+       --backend) {
+    if (isPacketBackendSupported(backend)) {
+      return backend;
+    }
+  }
+  return kPacketBackendScalar;
+}
+
+int packetWidth(PacketBackend backend) {
+  return kPacketBackends[backend].width;
+}
+
+const char *packetBackendName(PacketBackend backend) {
+  return kPacketBackends[backend].name;
+}
+
+bool parsePacketBackend(const char *name, PacketBackend *backend) {
+  for (int i = 0; i < kNumPacketBackends; ++i) {
+    if (strcmp(name, kPacketBackends[i].name) == 0) {
+      if (!isPacketBackendSupported(i)) {
+        return false;
+      }
+      *backend = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// rayMarch() compares float distances against the double SDF_EPSILON. This is
+// the largest float that compares the same way.
+static float marchEpsilon(void) {
+  float epsilon = (float)SDF_EPSILON;
+  if (epsilon > SDF_EPSILON) {
+    epsilon = nextafterf(epsilon, 0.0f);
+  }
+  return epsilon;
+}
+
+void rayMarchPackets(PacketBackend backend, const Scene *scene,
+                     const BrickMap *brickMap, const Ray *rays, int numRays,
+                     int maxSteps, const MarchSettings *settings, bool *hits,
+                     Point *intersectionPoints) {
+  const PacketBackendInfo *info = &kPacketBackends[backend];
+  float epsilon = marchEpsilon();
+  PacketLanes lanes;
+  for (int first = 0; first < numRays; first += info->width) {
+    int numLanes =
+        numRays - first < info->width ? numRays - first : info->width;
+    for (int lane = 0; lane < info->width; ++lane) {
+      // Pad partial packets with copies of their last ray.
+      const Ray *ray = &rays[first + (lane < numLanes ? lane : numLanes - 1)];
+      lanes.originX[lane] = ray->origin.x;
+      lanes.originY[lane] = ray->origin.y;
+      lanes.originZ[lane] = ray->origin.z;
+      lanes.directionX[lane] = ray->direction.x;
+      lanes.directionY[lane] = ray->direction.y;
+      lanes.directionZ[lane] = ray->direction.z;
+    }
+    int hitBits = settings ? info->sphereTracePacket(scene, brickMap, &lanes,
+                                                     epsilon, maxSteps,
+                                                     settings)
+                           : info->rayMarchPacket(scene, brickMap, &lanes,
+                                                  epsilon, maxSteps);
+    for (int lane = 0; lane < numLanes; ++lane) {
+      hits[first + lane] = (hitBits >> lane) & 1;
+      intersectionPoints[first + lane] = makePoint(
+          lanes.pointX[lane], lanes.pointY[lane], lanes.pointZ[lane]);
+    }
+  }
+}
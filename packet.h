@@ -0,0 +1,53 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdbool.h>
+
+#include "brickmap.h"
+#include "math.h"
+#include "scene.h"
+
+/**
+ * Ray packets. Coherent rays (e.g. the sub-pixel rays of one pixel) are
+ * marched together, one ray per SIMD lane, using structure-of-arrays versions
+ * of the math.h vector operations. Lanes that hit something are masked off
+ * while the rest of the packet keeps marching. Every backend performs the
+ * same float operations in the same order as rayMarch() and sphereTrace(), so
+ * packets find exactly the same intersection points as the scalar path.
+ */
+
+// The widest packet any backend marches at once.
+#define kMaxPacketWidth 16
+
+typedef enum PacketBackend {
+  kPacketBackendScalar,
+  kPacketBackendSSE,
+  kPacketBackendAVX2,
+  kPacketBackendAVX512,
+  kNumPacketBackends,
+} PacketBackend;
+
+// Returns the widest backend supported by the CPU we're running on.
+PacketBackend detectPacketBackend(void);
+
+// Returns the number of rays the backend marches per packet.
+int packetWidth(PacketBackend backend);
+
+const char *packetBackendName(PacketBackend backend);
+
+// Parses a backend name as returned by packetBackendName(). Returns false if
+// the name is unknown or the CPU doesn't support the backend.
+bool parsePacketBackend(const char *name, PacketBackend *backend);
+
+// Marches numRays rays through the scene, packetWidth(backend) rays at a time.
+// hits[i] and intersectionPoints[i] are set as rayMarch() would set them for
+// rays[i] and maxSteps, including the stopping point of rays that miss, or as
+// sphereTrace() would with settings if they aren't NULL. With a brick map,
+// rays are marched through brickMapDistance() instead of the scene's own
+// distances.
+void rayMarchPackets(PacketBackend backend, const Scene *scene,
+                     const BrickMap *brickMap, const Ray *rays, int numRays,
+                     int maxSteps, const MarchSettings *settings, bool *hits,
+                     Point *intersectionPoints);
+
+#endif /* PACKET_H */
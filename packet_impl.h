@@ -0,0 +1,337 @@
+/**
+ * The packet marcher, written once against a small set of lane-wise
+ * operations and included by packet.c once per backend. Before including this
+ * file, define:
+ *
+ *   PACKET_SUFFIX      Appended to every name defined here.
+ *   PACKET_TARGET      Function attributes enabling the backend's ISA.
+ *   PACKET_WIDTH       The number of lanes.
+ *   vfloat, vmask      The lane types for floats and comparison results.
+ *   vset1(x), vloadu(p), vstoreu(p, v)
+ *   vadd(a, b), vsub(a, b), vmul(a, b), vsqrt(a)
+ *   vmin(a, b)         a < b ? a : b, like min() in math.c.
+ *   vmax(a, b)         a > b ? a : b, like max() in math.c.
+ *   vaddd(a, c)        (float)((double)a + c) for a double constant c.
+ *   vcmple(a, b), vcmplt(a, b)
+ *   vmaskall(), vmaskand(a, b), vmaskandnot(a, b) (a & ~b), vmaskor(a, b)
+ *   vmaskany(m)        Whether any lane of m is set.
+ *   vmaskbits(m)       The lanes of m as a bit mask, lane 0 in bit 0.
+ *   vselect(m, a, b)   m ? b : a.
+ *
+ * All of these are undefined again at the end of this file.
+ *
+ * Every operation is performed in the same order as the scalar code in
+ * math.c, so each lane computes bit-identical results.
+ */
+
+#define PACKET_CONCAT_(name, suffix) name##_##suffix
+#define PACKET_CONCAT(name, suffix) PACKET_CONCAT_(name, suffix)
+#define PACKET_NAME(name) PACKET_CONCAT(name, PACKET_SUFFIX)
+
+#define VPoint PACKET_NAME(VPoint)
+
+typedef struct VPoint {
+  vfloat x, y, z;
+} VPoint;
+
+static PACKET_TARGET inline VPoint PACKET_NAME(translatePoint)(
+    VPoint p, const double translation[3]) {
+  return (VPoint){.x = vaddd(p.x, translation[0]),
+                  .y = vaddd(p.y, translation[1]),
+                  .z = vaddd(p.z, translation[2])};
+}
+
+static PACKET_TARGET inline VPoint PACKET_NAME(applyTransform)(
+    const Transform *t, VPoint v) {
+  vfloat x = vadd(vadd(vmul(vset1(t->a), v.x), vmul(vset1(t->b), v.y)),
+                  vmul(vset1(t->c), v.z));
+  vfloat y = vadd(vadd(vmul(vset1(t->d), v.x), vmul(vset1(t->e), v.y)),
+                  vmul(vset1(t->f), v.z));
+  vfloat z = vadd(vadd(vmul(vset1(t->g), v.x), vmul(vset1(t->h), v.y)),
+                  vmul(vset1(t->i), v.z));
+  return (VPoint){.x = x, .y = y, .z = z};
+}
+
+static PACKET_TARGET inline vfloat PACKET_NAME(dotProduct)(VPoint p,
+                                                          Vector v) {
+  return vadd(vadd(vmul(p.x, vset1(v.x)), vmul(p.y, vset1(v.y))),
+              vmul(p.z, vset1(v.z)));
+}
+
+static PACKET_TARGET inline vfloat PACKET_NAME(sphereSDF)(VPoint p,
+                                                         float radius) {
+  vfloat lengthSquared =
+      vadd(vadd(vmul(p.x, p.x), vmul(p.y, p.y)), vmul(p.z, p.z));
+  return vsub(vsqrt(lengthSquared), vset1(radius));
+}
+
+static PACKET_TARGET inline vfloat PACKET_NAME(planeSDF)(VPoint p,
+                                                        Vector normal,
+                                                        float h) {
+  return vadd(PACKET_NAME(dotProduct)(p, normal), vset1(h));
+}
+
+static PACKET_TARGET inline vfloat PACKET_NAME(unionOp)(vfloat v1,
+                                                       vfloat v2) {
+  return vmin(v1, v2);
+}
+
+static PACKET_TARGET inline void PACKET_NAME(runFrame)(
+    const SceneInstruction *instruction, VPoint *frames) {
+  VPoint p = frames[0];
+  if (instruction->hasTranslation) {
+    p = PACKET_NAME(translatePoint)(p, instruction->translation);
+  }
+  frames[instruction->frame] =
+      PACKET_NAME(applyTransform)(&instruction->transform, p);
+}
+
+static PACKET_TARGET inline vfloat PACKET_NAME(primitiveSDF)(
+    const SceneInstruction *instruction, const VPoint *frames) {
+  VPoint p = frames[instruction->frame];
+  if (instruction->hasTranslation) {
+    p = PACKET_NAME(translatePoint)(p, instruction->translation);
+  }
+  if (instruction->op == kSceneOpSphere) {
+    return PACKET_NAME(sphereSDF)(p, instruction->radius);
+  }
+  return PACKET_NAME(planeSDF)(p, instruction->plane.normal,
+                               instruction->plane.h);
+}
+
+static PACKET_TARGET inline vfloat PACKET_NAME(bvhNodeLowerBound)(
+    const BVHNode *node, VPoint p) {
+  vfloat zero = vset1(0.0f);
+  vfloat dx = vmax(vmax(vsub(vset1(node->lower[0]), p.x),
+                        vsub(p.x, vset1(node->upper[0]))),
+                   zero);
+  vfloat dy = vmax(vmax(vsub(vset1(node->lower[1]), p.y),
+                        vsub(p.y, vset1(node->upper[1]))),
+                   zero);
+  vfloat dz = vmax(vmax(vsub(vset1(node->lower[2]), p.z),
+                        vsub(p.z, vset1(node->upper[2]))),
+                   zero);
+  vfloat distance =
+      vsqrt(vadd(vadd(vmul(dx, dx), vmul(dy, dy)), vmul(dz, dz)));
+  return vsub(distance, vset1(node->radius));
+}
+
+// Like bvhEvaluateScene(), but a node is only skipped once it's farther away
+// than the closest primitive in every active lane. Lanes that have stopped
+// don't get a say, or every step would walk down to the surfaces they are
+// parked on.
+static PACKET_TARGET vfloat PACKET_NAME(bvhSceneSDF)(const Scene *scene,
+                                                     VPoint p, vmask active) {
+  const BVH *bvh = scene->bvh;
+  VPoint frames[kMaxSceneFrames];
+  frames[0] = p;
+  vfloat result = vset1(INFINITY);
+  for (int i = 0; i < bvh->numUnbounded; ++i) {
+    const SceneInstruction *instruction = &scene->tape[bvh->unbounded[i]];
+    if (instruction->op == kSceneOpFrame) {
+      PACKET_NAME(runFrame)(instruction, frames);
+    } else {
+      result = PACKET_NAME(unionOp)(
+          result, PACKET_NAME(primitiveSDF)(instruction, frames));
+    }
+  }
+  if (bvh->numNodes == 0) {
+    return result;
+  }
+
+  int stack[kMaxBVHStackSize];
+  int stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize > 0) {
+    const BVHNode *node = &bvh->nodes[stack[--stackSize]];
+    vfloat lowerBound = PACKET_NAME(bvhNodeLowerBound)(node, p);
+    if (!vmaskany(vmaskand(active, vcmplt(lowerBound, result)))) {
+      continue;
+    }
+    if (node->count == 0) {
+      stack[stackSize++] = node->first;
+      stack[stackSize++] = node - bvh->nodes + 1;
+      continue;
+    }
+    for (int i = 0; i < node->count; ++i) {
+      const SceneInstruction *instruction =
+          &scene->tape[bvh->primitives[node->first + i]];
+      result = PACKET_NAME(unionOp)(
+          result, PACKET_NAME(primitiveSDF)(instruction, frames));
+    }
+  }
+  return result;
+}
+
+// Evaluates the scene's instruction tape like sceneDistance() does. Only the
+// active lanes' distances are exact.
+static PACKET_TARGET vfloat PACKET_NAME(sceneSDF)(const Scene *scene,
+                                                  VPoint p, vmask active) {
+  if (scene->bvh) {
+    return PACKET_NAME(bvhSceneSDF)(scene, p, active);
+  }
+  VPoint frames[kMaxSceneFrames];
+  frames[0] = p;
+  vfloat result = vset1(INFINITY);
+  for (int i = 0; i < scene->tapeLength; ++i) {
+    const SceneInstruction *instruction = &scene->tape[i];
+    if (instruction->op == kSceneOpFrame) {
+      PACKET_NAME(runFrame)(instruction, frames);
+    } else {
+      result = PACKET_NAME(unionOp)(
+          result, PACKET_NAME(primitiveSDF)(instruction, frames));
+    }
+  }
+  return result;
+}
+
+// Looks up every lane in the map like brickMapDistance() does, and evaluates
+// the scene for the whole packet only when an active lane needs it.
+static PACKET_TARGET vfloat PACKET_NAME(brickMapSDF)(const Scene *scene,
+                                                     const BrickMap *map,
+                                                     VPoint p, vmask active) {
+  float x[PACKET_WIDTH], y[PACKET_WIDTH], z[PACKET_WIDTH];
+  float bounds[PACKET_WIDTH];
+  vstoreu(x, p.x);
+  vstoreu(y, p.y);
+  vstoreu(z, p.z);
+  for (int lane = 0; lane < PACKET_WIDTH; ++lane) {
+    bounds[lane] = brickMapBound(map, makePoint(x[lane], y[lane], z[lane]));
+  }
+  vfloat bound = vloadu(bounds);
+  vmask isBounded = vcmple(vset1(0.0f), bound);
+  if (!vmaskany(vmaskandnot(active, isBounded))) {
+    return bound;
+  }
+  return vselect(isBounded, PACKET_NAME(sceneSDF)(scene, p, active), bound);
+}
+
+// The distances rays are marched by: the brick map's when there is one.
+static PACKET_TARGET inline vfloat PACKET_NAME(marchSDF)(const Scene *scene,
+                                                        const BrickMap *map,
+                                                        VPoint p,
+                                                        vmask active) {
+  if (map) {
+    return PACKET_NAME(brickMapSDF)(scene, map, p, active);
+  }
+  return PACKET_NAME(sceneSDF)(scene, p, active);
+}
+
+static PACKET_TARGET int PACKET_NAME(rayMarchPacket)(const Scene *scene,
+                                                     const BrickMap *map,
+                                                     PacketLanes *lanes,
+                                                     float epsilon,
+                                                     int maxSteps) {
+  VPoint point = {.x = vloadu(lanes->originX),
+                  .y = vloadu(lanes->originY),
+                  .z = vloadu(lanes->originZ)};
+  VPoint direction = {.x = vloadu(lanes->directionX),
+                      .y = vloadu(lanes->directionY),
+                      .z = vloadu(lanes->directionZ)};
+  vmask active = vmaskall();
+  vmask hit = vmaskandnot(active, active);
+  for (int i = 0; i < maxSteps; ++i) {
+    vfloat d = PACKET_NAME(marchSDF)(scene, map, point, active);
+    vmask hitNow = vmaskand(active, vcmple(d, vset1(epsilon)));
+    hit = vmaskor(hit, hitNow);
+    active = vmaskandnot(active, hitNow);
+    if (!vmaskany(active)) {
+      break;
+    }
+    point.x = vselect(active, point.x, vadd(point.x, vmul(direction.x, d)));
+    point.y = vselect(active, point.y, vadd(point.y, vmul(direction.y, d)));
+    point.z = vselect(active, point.z, vadd(point.z, vmul(direction.z, d)));
+  }
+  vstoreu(lanes->pointX, point.x);
+  vstoreu(lanes->pointY, point.y);
+  vstoreu(lanes->pointZ, point.z);
+  return vmaskbits(hit);
+}
+
+// rayMarchPacket() for sphereTrace()'s enhanced marching. Each lane keeps its
+// own step length, relaxation and distance travelled, and takes the same
+// stretched steps, retreats and cone tests as sphereTrace() would.
+static PACKET_TARGET int PACKET_NAME(sphereTracePacket)(
+    const Scene *scene, const BrickMap *map, PacketLanes *lanes,
+    float epsilon, int maxSteps, const MarchSettings *settings) {
+  VPoint point = {.x = vloadu(lanes->originX),
+                  .y = vloadu(lanes->originY),
+                  .z = vloadu(lanes->originZ)};
+  VPoint direction = {.x = vloadu(lanes->directionX),
+                      .y = vloadu(lanes->directionY),
+                      .z = vloadu(lanes->directionZ)};
+  vfloat zero = vset1(0.0f);
+  vfloat one = vset1(1.0f);
+  vfloat coneRadius = vset1(settings->coneRadius);
+  vfloat maxDistance = vset1(settings->maxDistance);
+  vfloat relaxation = vset1(settings->relaxation);
+  vfloat t = zero;
+  vfloat stepLength = zero;
+  vfloat previousRadius = zero;
+  vmask active = vmaskall();
+  vmask hit = vmaskandnot(active, active);
+  for (int i = 0; i < maxSteps; ++i) {
+    vfloat d = PACKET_NAME(marchSDF)(scene, map, point, active);
+    vfloat radius = vmax(d, vsub(zero, d));
+    // Lanes whose empty spheres don't overlap go back and take the plain
+    // step instead.
+    vmask retreat =
+        vmaskand(vmaskand(active, vcmplt(one, relaxation)),
+                 vcmplt(vadd(radius, previousRadius), stepLength));
+    vmask marching = vmaskandnot(active, retreat);
+    vmask hitNow = vmaskand(
+        marching, vmaskor(vcmple(d, vset1(epsilon)),
+                          vcmple(d, vmul(coneRadius, t))));
+    hit = vmaskor(hit, hitNow);
+    vmask stepping = vmaskandnot(marching, hitNow);
+    vmask moving = vmaskor(stepping, retreat);
+    if (!vmaskany(moving)) {
+      break;
+    }
+    vfloat step = vmul(d, relaxation);
+    vfloat move = vselect(retreat, step, vsub(previousRadius, stepLength));
+    point.x = vselect(moving, point.x, vadd(point.x, vmul(direction.x, move)));
+    point.y = vselect(moving, point.y, vadd(point.y, vmul(direction.y, move)));
+    point.z = vselect(moving, point.z, vadd(point.z, vmul(direction.z, move)));
+    t = vselect(moving, t, vadd(t, move));
+    stepLength = vselect(stepping, stepLength, step);
+    stepLength = vselect(retreat, stepLength, previousRadius);
+    previousRadius = vselect(stepping, previousRadius, radius);
+    relaxation = vselect(retreat, relaxation, one);
+    vmask escaped = vmaskand(stepping, vcmplt(maxDistance, t));
+    active = vmaskandnot(vmaskandnot(active, hitNow), escaped);
+  }
+  vstoreu(lanes->pointX, point.x);
+  vstoreu(lanes->pointY, point.y);
+  vstoreu(lanes->pointZ, point.z);
+  return vmaskbits(hit);
+}
+
+#undef VPoint
+#undef PACKET_NAME
+#undef PACKET_CONCAT
+#undef PACKET_CONCAT_
+#undef PACKET_SUFFIX
+#undef PACKET_TARGET
+#undef PACKET_WIDTH
+#undef vfloat
+#undef vmask
+#undef vset1
+#undef vloadu
+#undef vstoreu
+#undef vadd
+#undef vsub
+#undef vmul
+#undef vsqrt
+#undef vmin
+#undef vmax
+#undef vaddd
+#undef vcmple
+#undef vcmplt
+#undef vmaskall
+#undef vmaskand
+#undef vmaskandnot
+#undef vmaskor
+#undef vmaskany
+#undef vmaskbits
+#undef vselect
@@ -0,0 +1,234 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The tasks owned by a single worker, as a range of task indices. The owner
+// takes tasks from the front and thieves take them from the back, so the two
+// only contend once the range is nearly empty.
+typedef struct TaskQueue {
+  pthread_mutex_t lock;
+  int begin;
+  int end;
+} TaskQueue;
+
+typedef struct Worker {
+  TilePool *pool;
+  int index;
+} Worker;
+
+struct TilePool {
+  int numThreads;
+  pthread_t *threads;
+  Worker *workers;
+  TaskQueue *queues;
+
+  pthread_mutex_t lock;
+  pthread_cond_t jobReady;
+  pthread_cond_t jobDone;
+  int generation;
+  int numBusyWorkers;
+  bool isShuttingDown;
+
+  // The job currently being run.
+  TaskFunc func;
+  void *context;
+};
+
+static bool popTask(TaskQueue *queue, int *taskIndex) {
+  pthread_mutex_lock(&queue->lock);
+  bool found = queue->begin < queue->end;
+  if (found) {
+    *taskIndex = queue->begin++;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static bool stealTask(TaskQueue *queue, int *taskIndex) {
+  pthread_mutex_lock(&queue->lock);
+  bool found = queue->begin < queue->end;
+  if (found) {
+    *taskIndex = --queue->end;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static bool nextTask(TilePool *pool, int workerIndex, int *taskIndex) {
+  if (popTask(&pool->queues[workerIndex], taskIndex)) {
+    return true;
+  }
+  for (int i = 1; i < pool->numThreads; ++i) {
+    int victim = (workerIndex + i) % pool->numThreads;
+    if (stealTask(&pool->queues[victim], taskIndex)) {
+      return true;
+    }
+  }
+  // Tasks never spawn more tasks, so once every queue is empty we're done.
+  return false;
+}
+
+static void runWorker(TilePool *pool, int workerIndex) {
+  int taskIndex;
+  while (nextTask(pool, workerIndex, &taskIndex)) {
+    pool->func(taskIndex, pool->context);
+  }
+}
+
+static void *workerMain(void *arg) {
+  Worker *worker = arg;
+  TilePool *pool = worker->pool;
+  int seenGeneration = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->isShuttingDown && pool->generation == seenGeneration) {
+      pthread_cond_wait(&pool->jobReady, &pool->lock);
+    }
+    if (pool->isShuttingDown) {
+      break;
+    }
+    seenGeneration = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    runWorker(pool, worker->index);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->numBusyWorkers == 0) {
+      pthread_cond_signal(&pool->jobDone);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+TilePool *createTilePool(int numThreads) {
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  TilePool *pool = calloc(1, sizeof(TilePool));
+  pool->numThreads = numThreads;
+  pool->threads = calloc(numThreads, sizeof(pthread_t));
+  pool->workers = calloc(numThreads, sizeof(Worker));
+  pool->queues = calloc(numThreads, sizeof(TaskQueue));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->jobReady, NULL);
+  pthread_cond_init(&pool->jobDone, NULL);
+  for (int i = 0; i < numThreads; ++i) {
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+    pool->workers[i] = (Worker){.pool = pool, .index = i};
+  }
+  // Worker 0 is whichever thread calls runTasks().
+  for (int i = 1; i < numThreads; ++i) {
+    int error = pthread_create(&pool->threads[i], NULL, workerMain,
+                               &pool->workers[i]);
+    if (error) {
+      printf("Failed to start worker thread: %d (%s)\n", error,
+             strerror(error));
+      pool->numThreads = i;
+      destroyTilePool(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void destroyTilePool(TilePool *pool) {
+  if (!pool) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->isShuttingDown = true;
+  pthread_cond_broadcast(&pool->jobReady);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 1; i < pool->numThreads; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (int i = 0; i < pool->numThreads; ++i) {
+    pthread_mutex_destroy(&pool->queues[i].lock);
+  }
+  pthread_cond_destroy(&pool->jobDone);
+  pthread_cond_destroy(&pool->jobReady);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->queues);
+  free(pool->workers);
+  free(pool->threads);
+  free(pool);
+}
+
+int tilePoolNumThreads(const TilePool *pool) { return pool->numThreads; }
+
+void runTasks(TilePool *pool, int numTasks, TaskFunc func, void *context) {
+  pthread_mutex_lock(&pool->lock);
+  pool->func = func;
+  pool->context = context;
+  for (int i = 0; i < pool->numThreads; ++i) {
+    pool->queues[i].begin = (long)numTasks * i / pool->numThreads;
+    pool->queues[i].end = (long)numTasks * (i + 1) / pool->numThreads;
+  }
+  pool->numBusyWorkers = pool->numThreads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->jobReady);
+  pthread_mutex_unlock(&pool->lock);
+
+  runWorker(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->numBusyWorkers > 0) {
+    pthread_cond_wait(&pool->jobDone, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+typedef struct TileJob {
+  Tile region;
+  int tileSize;
+  int numTileColumns;
+  TileFunc func;
+  void *context;
+} TileJob;
+
+static void runTileTask(int taskIndex, void *context) {
+  const TileJob *job = context;
+  Tile region = job->region;
+  Tile tile;
+  tile.row = region.row + (taskIndex / job->numTileColumns) * job->tileSize;
+  tile.column =
+      region.column + (taskIndex % job->numTileColumns) * job->tileSize;
+  int regionEndRow = region.row + region.numRows;
+  int regionEndColumn = region.column + region.numColumns;
+  tile.numRows = regionEndRow - tile.row < job->tileSize
+                     ? regionEndRow - tile.row
+                     : job->tileSize;
+  tile.numColumns = regionEndColumn - tile.column < job->tileSize
+                        ? regionEndColumn - tile.column
+                        : job->tileSize;
+  job->func(tile, job->context);
+}
+
+void renderRegionTiles(TilePool *pool, Tile region, int tileSize,
+                       TileFunc func, void *context) {
+  TileJob job = {.region = region,
+                 .tileSize = tileSize,
+                 .numTileColumns =
+                     (region.numColumns + tileSize - 1) / tileSize,
+                 .func = func,
+                 .context = context};
+  int numTileRows = (region.numRows + tileSize - 1) / tileSize;
+  runTasks(pool, job.numTileColumns * numTileRows, runTileTask, &job);
+}
+
+void renderTiles(TilePool *pool, int imageWidth, int imageHeight, int tileSize,
+                 TileFunc func, void *context) {
+  Tile image = {.numRows = imageHeight, .numColumns = imageWidth};
+  renderRegionTiles(pool, image, tileSize, func, context);
+}
+
+int defaultNumThreads(void) {
+  long numProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+  return numProcessors > 0 ? (int)numProcessors : 1;
+}
@@ -0,0 +1,46 @@
+#ifndef POOL_H
+#define POOL_H
+
+// A rectangular region of the framebuffer, in pixels.
+typedef struct Tile {
+  int row, column;
+  int numRows, numColumns;
+} Tile;
+
+typedef void (*TileFunc)(Tile tile, void *context);
+
+typedef void (*TaskFunc)(int taskIndex, void *context);
+
+typedef struct TilePool TilePool;
+
+// Creates a pool of numThreads workers. The calling thread counts as one of
+// them, so a pool with a single thread renders everything on the caller.
+// Returns NULL if the worker threads could not be started.
+TilePool *createTilePool(int numThreads);
+
+void destroyTilePool(TilePool *pool);
+
+int tilePoolNumThreads(const TilePool *pool);
+
+// Calls func on every task index in [0, numTasks) exactly once, spread over
+// the pool's threads. Each worker starts out with a contiguous run of tasks
+// and, once its own run is exhausted, steals tasks from the back of the other
+// workers' runs, so a few expensive tasks don't leave the remaining threads
+// idle. Returns once all tasks are done.
+void runTasks(TilePool *pool, int numTasks, TaskFunc func, void *context);
+
+// Splits an imageWidth x imageHeight framebuffer into tiles of at most
+// tileSize x tileSize pixels and calls func on every tile exactly once, using
+// runTasks().
+void renderTiles(TilePool *pool, int imageWidth, int imageHeight, int tileSize,
+                 TileFunc func, void *context);
+
+// renderTiles() for the tiles of a region of the framebuffer, split from its
+// top left corner.
+void renderRegionTiles(TilePool *pool, Tile region, int tileSize,
+                       TileFunc func, void *context);
+
+// The number of online processors, or 1 if that can't be determined.
+int defaultNumThreads(void);
+
+#endif /* POOL_H */
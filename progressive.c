@@ -0,0 +1,100 @@
+#include "progressive.h"
+
+#include <stdio.h>
+
+int planProgressivePasses(int numRayMarchSteps, int subPixelsDim,
+                          ProgressivePass *passes) {
+  int numSteps = numRayMarchSteps;
+  int quarterSteps = numSteps / 4 > 0 ? numSteps / 4 : 1;
+  int halfSteps = numSteps / 2 > 0 ? numSteps / 2 : 1;
+  int numPasses = 0;
+  for (int spacing = kProgressiveCoarsestSpacing; spacing >= 1; spacing /= 2) {
+    int steps = spacing >= kProgressiveCoarsestSpacing / 2 ? quarterSteps
+                                                           : halfSteps;
+    if (numPasses > 0 && steps > passes[numPasses - 1].numCenterSteps) {
+      passes[numPasses++] =
+          (ProgressivePass){.kind = kPassMoreSteps, .numCenterSteps = steps};
+    }
+    passes[numPasses++] = (ProgressivePass){
+        .kind = kPassLattice, .spacing = spacing, .numCenterSteps = steps};
+  }
+  if (numSteps > halfSteps) {
+    passes[numPasses++] =
+        (ProgressivePass){.kind = kPassMoreSteps, .numCenterSteps = numSteps};
+  }
+  // With a single sub-pixel, the grid is the pixel-center ray.
+  if (subPixelsDim > 1) {
+    for (int row = 0; row < subPixelsDim; ++row) {
+      passes[numPasses++] = (ProgressivePass){
+          .kind = kPassGridRow, .numCenterSteps = numSteps, .gridRow = row};
+    }
+  }
+  return numPasses;
+}
+
+void describeProgressivePass(const ProgressivePass *pass, int subPixelsDim,
+                             char *description, size_t descriptionSize) {
+  switch (pass->kind) {
+    case kPassLattice:
+      if (pass->spacing == 1) {
+        snprintf(description, descriptionSize, "every pixel, %d steps",
+                 pass->numCenterSteps);
+      } else {
+        snprintf(description, descriptionSize, "every %d pixels, %d steps",
+                 pass->spacing, pass->numCenterSteps);
+      }
+      break;
+    case kPassMoreSteps:
+      snprintf(description, descriptionSize, "%d steps", pass->numCenterSteps);
+      break;
+    case kPassGridRow:
+      snprintf(description, descriptionSize, "grid row %d of %d",
+               pass->gridRow + 1, subPixelsDim);
+      break;
+  }
+}
+
+bool isInProgressivePass(const ProgressivePass *pass,
+                         const ProgressivePixel *pixel, int pixelRow,
+                         int pixelColumn) {
+  switch (pass->kind) {
+    case kPassLattice:
+      return !pixel->isSampled && pixelRow % pass->spacing == 0 &&
+             pixelColumn % pass->spacing == 0;
+    case kPassMoreSteps:
+      return pixel->isSampled;
+    case kPassGridRow:
+      return pixel->numGridRows == pass->gridRow;
+  }
+  return false;
+}
+
+void composeProgressiveImage(const ProgressivePixel *pixels, int imageWidth,
+                             int imageHeight, int subPixelsDim, Pixel *image) {
+  for (int row = 0; row < imageHeight; ++row) {
+    for (int column = 0; column < imageWidth; ++column) {
+      const ProgressivePixel *pixel =
+          &pixels[(size_t)row * imageWidth + column];
+      Color color = makeColor(0.0, 0.0, 0.0);
+      if (pixel->numGridRows > 0) {
+        color = scaleColor(pixel->gridSum,
+                           sampleSumScale(pixel->numGridRows * subPixelsDim,
+                                          subPixelsDim));
+      } else {
+        const ProgressivePixel *source = pixel;
+        for (int spacing = 2;
+             !source->isSampled && spacing <= kProgressiveCoarsestSpacing;
+             spacing *= 2) {
+          source = &pixels[(size_t)(row & ~(spacing - 1)) * imageWidth +
+                           (column & ~(spacing - 1))];
+        }
+        if (source->isSampled) {
+          color = scaleColor(source->centerColor,
+                             sampleSumScale(1, subPixelsDim));
+        }
+      }
+      image[(size_t)row * imageWidth + column] =
+          makePixel(color.r, color.g, color.b);
+    }
+  }
+}
@@ -0,0 +1,80 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bitmap.h"
+#include "math.h"
+
+/**
+ * Progressive rendering. The image is refined pass by pass until a wall-clock
+ * budget runs out, and the best image so far is written out after every pass.
+ * No pass redoes the work of an earlier one:
+ *
+ *   1. Lattice passes cast one ray through the center of every 8th pixel in
+ *      both directions, then every 4th, 2nd and finally every pixel, each
+ *      only for pixels that don't have one yet. Until a pixel has its own
+ *      ray, it shows the pixel at the corner of its lattice cell.
+ *   2. Those rays start out with a quarter of the march steps. As the step
+ *      count goes up, misses are marched on from where they stopped, which
+ *      ends where marching them in one go would.
+ *   3. Grid row passes add one row of each pixel's sub-pixel grid at a time.
+ *      Once every row is in, the image is exactly what the fixed grid renders.
+ *
+ * This module plans the passes and keeps every pixel's samples; the renderer
+ * casts and shades the rays of each pass.
+ */
+
+// The lattice spacing of the first pass. A power of two.
+#define kProgressiveCoarsestSpacing 8
+
+typedef enum ProgressivePassKind {
+  kPassLattice,
+  // Marches the pixel-center rays further.
+  kPassMoreSteps,
+  kPassGridRow,
+} ProgressivePassKind;
+
+typedef struct ProgressivePass {
+  ProgressivePassKind kind;
+  // Lattice passes sample the pixels whose row and column are multiples of
+  // spacing.
+  int spacing;
+  // How many steps pixel-center rays have been marched after the pass.
+  int numCenterSteps;
+  int gridRow;
+} ProgressivePass;
+
+typedef struct ProgressivePixel {
+  bool isSampled;
+  bool centerHit;
+  // Where the pixel-center ray hit, or where it stopped if it missed.
+  Point centerPoint;
+  Color centerColor;
+  // The sum of the samples in the first numGridRows rows of the grid.
+  int numGridRows;
+  Color gridSum;
+} ProgressivePixel;
+
+// Fills passes with the passes to render in order for a render with
+// numRayMarchSteps steps and a subPixelsDim x subPixelsDim grid, and returns
+// how many there are, at most 6 + subPixelsDim.
+int planProgressivePasses(int numRayMarchSteps, int subPixelsDim,
+                          ProgressivePass *passes);
+
+void describeProgressivePass(const ProgressivePass *pass, int subPixelsDim,
+                             char *description, size_t descriptionSize);
+
+// Whether the pass samples the pixel at pixelRow and pixelColumn.
+bool isInProgressivePass(const ProgressivePass *pass,
+                         const ProgressivePixel *pixel, int pixelRow,
+                         int pixelColumn);
+
+// Turns the pixels' samples, row by row, into an image. Pixels show their grid
+// samples if they have any, and otherwise the pixel-center ray of the nearest
+// sampled lattice corner.
+void composeProgressiveImage(const ProgressivePixel *pixels, int imageWidth,
+                             int imageHeight, int subPixelsDim, Pixel *image);
+
+#endif /* PROGRESSIVE_H */
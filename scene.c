@@ -0,0 +1,494 @@
+#include "scene.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+
+const char *const kDefaultSceneDescription =
+    "material gold diffuse 1 1 1 conductive ior 0.183 0.421 1.373 "
+    "extinction 3.424 2.346 1.77\n"
+    "material silver diffuse 1 1 1 conductive ior 0.159 0.145 0.135 "
+    "extinction 3.929 3.190 2.380\n"
+    "material wall diffuse 0.7 0.7 0.7\n"
+    "\n"
+    "sphere center -0.15 0.2 0.15 radius 0.1 material gold\n"
+    "sphere center 0.2 0 0 radius 0.2 material silver\n"
+    "\n"
+    "frame corner position 0 -0.25 -1 rotate y -0.8\n"
+    "plane frame corner normal 1 0 0 material wall\n"
+    "plane frame corner normal 0 1 0 material wall\n"
+    "plane frame corner normal 0 0 1 material wall\n";
+
+#define kMaxNameLength 64
+
+typedef struct NamedFrame {
+  char name[kMaxNameLength];
+  double position[3];
+  // The frame register holding the rotated frame, or 0 (the world frame) if
+  // the frame only translates.
+  int frame;
+} NamedFrame;
+
+typedef struct SceneParser {
+  const char *sourceName;
+  int lineNumber;
+  Scene *scene;
+  char (*materialNames)[kMaxNameLength];
+  NamedFrame frames[kMaxSceneFrames];
+  int numFrames;
+  int tapeCapacity;
+  int materialCapacity;
+} SceneParser;
+
+static int parseError(const SceneParser *parser, const char *message,
+                      const char *token) {
+  printf("%s:%d: %s%s%s\n", parser->sourceName, parser->lineNumber, message,
+         token ? ": " : "", token ? token : "");
+  return 1;
+}
+
+static bool parseNumbers(char **savePtr, double *values, int count) {
+  for (int i = 0; i < count; ++i) {
+    char *token = strtok_r(NULL, " \t\r", savePtr);
+    if (!token) {
+      return false;
+    }
+    char *end;
+    values[i] = strtod(token, &end);
+    if (*end != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool parseColor(char **savePtr, Color *color) {
+  double values[3];
+  if (!parseNumbers(savePtr, values, 3)) {
+    return false;
+  }
+  *color = makeColor(values[0], values[1], values[2]);
+  return true;
+}
+
+static int findMaterial(const SceneParser *parser, const char *name) {
+  for (int i = 0; i < parser->scene->numMaterials; ++i) {
+    if (strcmp(parser->materialNames[i], name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static const NamedFrame *findFrame(const SceneParser *parser,
+                                   const char *name) {
+  for (int i = 0; i < parser->numFrames; ++i) {
+    if (strcmp(parser->frames[i].name, name) == 0) {
+      return &parser->frames[i];
+    }
+  }
+  return NULL;
+}
+
+static SceneInstruction *appendInstruction(SceneParser *parser) {
+  Scene *scene = parser->scene;
+  if (scene->tapeLength == parser->tapeCapacity) {
+    parser->tapeCapacity = parser->tapeCapacity ? parser->tapeCapacity * 2 : 16;
+    scene->tape =
+        realloc(scene->tape, parser->tapeCapacity * sizeof(SceneInstruction));
+  }
+  SceneInstruction *instruction = &scene->tape[scene->tapeLength++];
+  memset(instruction, 0, sizeof(SceneInstruction));
+  return instruction;
+}
+
+static void setTranslation(SceneInstruction *instruction,
+                           const double offset[3]) {
+  for (int i = 0; i < 3; ++i) {
+    instruction->translation[i] = offset[i];
+    // Zero offsets are folded away entirely.
+    instruction->hasTranslation |= offset[i] != 0.0;
+  }
+}
+
+static int parseMaterial(SceneParser *parser, char **savePtr) {
+  char *name = strtok_r(NULL, " \t\r", savePtr);
+  if (!name || strlen(name) >= kMaxNameLength) {
+    return parseError(parser, "expected a material name", NULL);
+  }
+  if (findMaterial(parser, name) >= 0) {
+    return parseError(parser, "duplicate material", name);
+  }
+  Material material = {.diffuse = makeColor(1.0, 1.0, 1.0),
+                       .isConductive = false,
+                       .refractiveIndex = makeColor(1.0, 1.0, 1.0),
+                       .extinctionCoeff = makeColor(1.0, 1.0, 1.0)};
+  char *token;
+  while ((token = strtok_r(NULL, " \t\r", savePtr))) {
+    bool ok = true;
+    if (strcmp(token, "diffuse") == 0) {
+      ok = parseColor(savePtr, &material.diffuse);
+    } else if (strcmp(token, "conductive") == 0) {
+      material.isConductive = true;
+    } else if (strcmp(token, "ior") == 0) {
+      ok = parseColor(savePtr, &material.refractiveIndex);
+    } else if (strcmp(token, "extinction") == 0) {
+      ok = parseColor(savePtr, &material.extinctionCoeff);
+    } else {
+      return parseError(parser, "unknown material property", token);
+    }
+    if (!ok) {
+      return parseError(parser, "expected three numbers after", token);
+    }
+  }
+
+  Scene *scene = parser->scene;
+  if (scene->numMaterials == parser->materialCapacity) {
+    parser->materialCapacity =
+        parser->materialCapacity ? parser->materialCapacity * 2 : 8;
+    scene->materials =
+        realloc(scene->materials, parser->materialCapacity * sizeof(Material));
+    parser->materialNames =
+        realloc(parser->materialNames,
+                parser->materialCapacity * sizeof(*parser->materialNames));
+  }
+  if (material.isConductive) {
+    material.fresnelTable = malloc(sizeof(FresnelTable));
+    buildFresnelTable(material.refractiveIndex, material.extinctionCoeff,
+                      material.fresnelTable);
+  }
+  strcpy(parser->materialNames[scene->numMaterials], name);
+  scene->materials[scene->numMaterials++] = material;
+  return 0;
+}
+
+static int parseFrame(SceneParser *parser, char **savePtr) {
+  char *name = strtok_r(NULL, " \t\r", savePtr);
+  if (!name || strlen(name) >= kMaxNameLength) {
+    return parseError(parser, "expected a frame name", NULL);
+  }
+  if (findFrame(parser, name)) {
+    return parseError(parser, "duplicate frame", name);
+  }
+  if (parser->numFrames + 1 == kMaxSceneFrames) {
+    return parseError(parser, "too many frames", name);
+  }
+  NamedFrame *frame = &parser->frames[parser->numFrames];
+  memset(frame, 0, sizeof(NamedFrame));
+  strcpy(frame->name, name);
+
+  // Primitives are evaluated in the frame's local space, so we bake the
+  // inverse of the frame's placement: undo the translation, then undo the
+  // rotations in reverse order.
+  bool hasRotation = false;
+  Transform inverseRotation;
+  char *token;
+  while ((token = strtok_r(NULL, " \t\r", savePtr))) {
+    if (strcmp(token, "position") == 0) {
+      if (!parseNumbers(savePtr, frame->position, 3)) {
+        return parseError(parser, "expected three numbers after", token);
+      }
+    } else if (strcmp(token, "rotate") == 0) {
+      char *axis = strtok_r(NULL, " \t\r", savePtr);
+      double angle;
+      if (!axis || !parseNumbers(savePtr, &angle, 1)) {
+        return parseError(parser, "expected an axis and an angle after",
+                          token);
+      }
+      float inverseAngle = -(float)angle;
+      Transform inverse;
+      if (strcmp(axis, "x") == 0) {
+        inverse = makeRotationX(inverseAngle);
+      } else if (strcmp(axis, "y") == 0) {
+        inverse = makeRotationY(inverseAngle);
+      } else if (strcmp(axis, "z") == 0) {
+        inverse = makeRotationZ(inverseAngle);
+      } else {
+        return parseError(parser, "unknown rotation axis", axis);
+      }
+      inverseRotation = hasRotation
+                            ? combineTransforms(inverseRotation, inverse)
+                            : inverse;
+      hasRotation = true;
+    } else {
+      return parseError(parser, "unknown frame property", token);
+    }
+  }
+
+  // Frames that only translate are folded into their primitives' offsets and
+  // don't need a register.
+  if (hasRotation) {
+    frame->frame = parser->numFrames + 1;
+    SceneInstruction *instruction = appendInstruction(parser);
+    instruction->op = kSceneOpFrame;
+    instruction->frame = frame->frame;
+    parser->scene->frameInstructions[frame->frame] =
+        parser->scene->tapeLength - 1;
+    double offset[3] = {-frame->position[0], -frame->position[1],
+                        -frame->position[2]};
+    setTranslation(instruction, offset);
+    instruction->transform = inverseRotation;
+    // The frame's position has been applied, primitives mustn't apply it
+    // again.
+    memset(frame->position, 0, sizeof(frame->position));
+  }
+  parser->numFrames++;
+  return 0;
+}
+
+static int parsePrimitive(SceneParser *parser, char **savePtr, SceneOp op) {
+  const NamedFrame *frame = NULL;
+  int materialId = -1;
+  double center[3] = {0.0, 0.0, 0.0};
+  double normal[3] = {0.0, 0.0, 0.0};
+  double radius = 0.0;
+  double h = 0.0;
+  bool hasShape = false;
+  char *token;
+  while ((token = strtok_r(NULL, " \t\r", savePtr))) {
+    bool ok = true;
+    if (strcmp(token, "frame") == 0) {
+      char *name = strtok_r(NULL, " \t\r", savePtr);
+      if (!name || !(frame = findFrame(parser, name))) {
+        return parseError(parser, "unknown frame", name);
+      }
+    } else if (strcmp(token, "material") == 0) {
+      char *name = strtok_r(NULL, " \t\r", savePtr);
+      if (!name || (materialId = findMaterial(parser, name)) < 0) {
+        return parseError(parser, "unknown material", name);
+      }
+    } else if (op == kSceneOpSphere && strcmp(token, "center") == 0) {
+      ok = parseNumbers(savePtr, center, 3);
+    } else if (op == kSceneOpSphere && strcmp(token, "radius") == 0) {
+      ok = parseNumbers(savePtr, &radius, 1);
+      hasShape = true;
+    } else if (op == kSceneOpPlane && strcmp(token, "normal") == 0) {
+      ok = parseNumbers(savePtr, normal, 3);
+      hasShape = true;
+    } else if (op == kSceneOpPlane && strcmp(token, "h") == 0) {
+      ok = parseNumbers(savePtr, &h, 1);
+    } else {
+      return parseError(parser, "unknown primitive property", token);
+    }
+    if (!ok) {
+      return parseError(parser, "expected a number after", token);
+    }
+  }
+  if (materialId < 0) {
+    return parseError(parser, "primitive has no material", NULL);
+  }
+  if (!hasShape) {
+    return parseError(parser, op == kSceneOpSphere ? "sphere has no radius"
+                                                   : "plane has no normal",
+                      NULL);
+  }
+  if (op == kSceneOpSphere && !(radius > 0.0)) {
+    return parseError(parser, "sphere radius must be positive", NULL);
+  }
+  // Sphere tracing needs distances that are never overestimates, so planes
+  // are stored with a unit normal, and h scaled along with it.
+  double normalLength = sqrt(normal[0] * normal[0] + normal[1] * normal[1] +
+                              normal[2] * normal[2]);
+  if (op == kSceneOpPlane &&
+      !(normalLength > 0.0 && isfinite(normalLength))) {
+    return parseError(parser, "plane normal must be nonzero", NULL);
+  }
+
+  SceneInstruction *instruction = appendInstruction(parser);
+  instruction->op = op;
+  instruction->frame = frame ? frame->frame : 0;
+  instruction->materialId = materialId;
+  double offset[3];
+  for (int i = 0; i < 3; ++i) {
+    offset[i] = -center[i] - (frame ? frame->position[i] : 0.0);
+  }
+  setTranslation(instruction, offset);
+  if (op == kSceneOpSphere) {
+    instruction->radius = radius;
+  } else {
+    instruction->plane.normal =
+        makeVector(normal[0] / normalLength, normal[1] / normalLength,
+                   normal[2] / normalLength);
+    instruction->plane.h = h / normalLength;
+  }
+  parser->scene->numPrimitives++;
+  return 0;
+}
+
+static int parseLine(SceneParser *parser, char *line) {
+  char *comment = strchr(line, '#');
+  if (comment) {
+    *comment = '\0';
+  }
+  char *savePtr;
+  char *directive = strtok_r(line, " \t\r", &savePtr);
+  if (!directive) {
+    return 0;
+  }
+  if (strcmp(directive, "material") == 0) {
+    return parseMaterial(parser, &savePtr);
+  }
+  if (strcmp(directive, "frame") == 0) {
+    return parseFrame(parser, &savePtr);
+  }
+  if (strcmp(directive, "sphere") == 0) {
+    return parsePrimitive(parser, &savePtr, kSceneOpSphere);
+  }
+  if (strcmp(directive, "plane") == 0) {
+    return parsePrimitive(parser, &savePtr, kSceneOpPlane);
+  }
+  return parseError(parser, "unknown directive", directive);
+}
+
+int parseScene(const char *description, const char *sourceName, Scene *scene) {
+  memset(scene, 0, sizeof(Scene));
+  SceneParser parser = {.sourceName = sourceName, .scene = scene};
+  char *text = strdup(description);
+  int result = 0;
+  for (char *line = text; line && result == 0;) {
+    char *nextLine = strchr(line, '\n');
+    if (nextLine) {
+      *nextLine++ = '\0';
+    }
+    parser.lineNumber++;
+    result = parseLine(&parser, line);
+    line = nextLine;
+  }
+  if (result == 0 && scene->numPrimitives == 0) {
+    printf("%s: scene has no primitives\n", sourceName);
+    result = 1;
+  }
+  free(text);
+  free(parser.materialNames);
+  if (result != 0) {
+    freeScene(scene);
+  } else if (scene->numPrimitives >= kMinBVHPrimitives) {
+    buildSceneBVH(scene);
+  }
+  return result;
+}
+
+int loadScene(const char *filename, Scene *scene) {
+  FILE *sceneFile = fopen(filename, "r");
+  if (!sceneFile) {
+    printf("Failed to open scene file: %d (%s)\n", errno, strerror(errno));
+    return 1;
+  }
+  fseek(sceneFile, 0, SEEK_END);
+  long size = ftell(sceneFile);
+  fseek(sceneFile, 0, SEEK_SET);
+  char *description = malloc(size + 1);
+  size_t numRead = fread(description, 1, size, sceneFile);
+  description[numRead] = '\0';
+  fclose(sceneFile);
+
+  int result = parseScene(description, filename, scene);
+  free(description);
+  return result;
+}
+
+void freeScene(Scene *scene) {
+  freeSceneBVH(scene);
+  for (int i = 0; i < scene->numMaterials; ++i) {
+    free(scene->materials[i].fresnelTable);
+  }
+  free(scene->materials);
+  free(scene->tape);
+  memset(scene, 0, sizeof(Scene));
+}
+
+float sceneDistance(const Scene *scene, Point p) {
+  if (scene->bvh) {
+    return bvhEvaluateScene(scene, p).distance;
+  }
+  Point frames[kMaxSceneFrames];
+  frames[0] = p;
+  float distance = INFINITY;
+  for (int i = 0; i < scene->tapeLength; ++i) {
+    const SceneInstruction *instruction = &scene->tape[i];
+    if (instruction->op == kSceneOpFrame) {
+      runSceneFrame(instruction, frames);
+      continue;
+    }
+    distance = unionOp(distance, scenePrimitiveDistance(instruction, frames));
+  }
+  return distance;
+}
+
+SDFResult evaluateScene(const Scene *scene, Point p) {
+  if (scene->bvh) {
+    return bvhEvaluateScene(scene, p);
+  }
+  Point frames[kMaxSceneFrames];
+  frames[0] = p;
+  SDFResult result = {.distance = INFINITY, .materialId = 0, .primitive = -1};
+  for (int i = 0; i < scene->tapeLength; ++i) {
+    const SceneInstruction *instruction = &scene->tape[i];
+    if (instruction->op == kSceneOpFrame) {
+      runSceneFrame(instruction, frames);
+      continue;
+    }
+    float distance = scenePrimitiveDistance(instruction, frames);
+    // Like unionOp(), but ties go to the earlier primitive's material.
+    if (unionOp(result.distance, distance) != result.distance) {
+      result = (SDFResult){.distance = distance,
+                           .materialId = instruction->materialId,
+                           .primitive = i};
+    }
+  }
+  return result;
+}
+
+// The gradient of a primitive's distance function at p, in world space.
+// Returns false if the primitive has no analytic gradient there.
+static bool primitiveGradient(const Scene *scene,
+                              const SceneInstruction *instruction, Point p,
+                              Vector *gradient) {
+  Point frames[kMaxSceneFrames];
+  frames[0] = p;
+  // The derivative of the frame's point with respect to p.
+  Transform jacobian = makeTransform(1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0,
+                                     1.0);
+  if (instruction->frame != 0) {
+    const SceneInstruction *frame =
+        &scene->tape[scene->frameInstructions[instruction->frame]];
+    runSceneFrame(frame, frames);
+    jacobian = frame->transform;
+  }
+  Vector localGradient;
+  switch (instruction->op) {
+    case kSceneOpSphere: {
+      Vector v = vectorFromOriginToPoint(
+          sceneTranslatedPoint(instruction, frames[instruction->frame]));
+      float length = vectorLength(v);
+      if (length == 0.0f) {
+        // The center of a sphere.
+        return false;
+      }
+      localGradient = scaleVector(v, 1.0f / length);
+      break;
+    }
+    case kSceneOpPlane:
+      localGradient = instruction->plane.normal;
+      break;
+    default:
+      return false;
+  }
+  *gradient = applyTransform(transposeTransform(jacobian), localGradient);
+  return true;
+}
+
+SceneSample sampleScene(const Scene *scene, Point p) {
+  SDFResult result = evaluateScene(scene, p);
+  SceneSample sample = {.distance = result.distance,
+                        .materialId = result.materialId};
+  if (result.primitive >= 0) {
+    sample.hasGradient = primitiveGradient(
+        scene, &scene->tape[result.primitive], p, &sample.gradient);
+  }
+  return sample;
+}
@@ -0,0 +1,163 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "math.h"
+
+typedef struct Material {
+  Color diffuse;
+  bool isConductive;
+  // How much a ray of light bends when passing from one medium to another.
+  Color refractiveIndex;
+  // The reduction in intensity as light propagates through the material due to
+  // scattering of light and absorption.
+  Color extinctionCoeff;
+  // The material's reflectance by angle, for conductive materials.
+  FresnelTable *fresnelTable;
+} Material;
+
+typedef struct SDFResult {
+  float distance;
+  // An index into the scene's material table.
+  int materialId;
+  // The tape index of the closest primitive, or -1 for an empty scene.
+  int primitive;
+} SDFResult;
+
+// Everything shading needs to know about the scene at a point.
+typedef struct SceneSample {
+  float distance;
+  int materialId;
+  // The gradient of the signed distance function, which is the surface normal
+  // at a hit. Only set if hasGradient is true.
+  Vector gradient;
+  bool hasGradient;
+} SceneSample;
+
+typedef enum SceneOp {
+  // frames[dst] = transform * (p + translation)
+  kSceneOpFrame,
+  // sphereSDF(frames[src] + translation, radius)
+  kSceneOpSphere,
+  // planeSDF(frames[src] + translation, normal, h)
+  kSceneOpPlane,
+} SceneOp;
+
+// The most coordinate frames a scene can use, including the world frame.
+#define kMaxSceneFrames 16
+
+// One step of a compiled scene. Frame instructions always come before the
+// primitives that read them.
+typedef struct SceneInstruction {
+  uint8_t op;
+  // The frame register written by kSceneOpFrame or read by primitives.
+  uint8_t frame;
+  bool hasTranslation;
+  uint16_t materialId;
+  // Kept in double precision because that's the precision the scene's offsets
+  // have always been applied in.
+  double translation[3];
+  union {
+    Transform transform;
+    float radius;
+    struct {
+      Vector normal;
+      float h;
+    } plane;
+  };
+} SceneInstruction;
+
+// A scene compiled into a flat instruction tape. Evaluating it is a single
+// pass over the tape: transforms are baked into frame instructions when the
+// scene is loaded, and results carry material IDs rather than materials.
+typedef struct Scene {
+  Material *materials;
+  int numMaterials;
+  SceneInstruction *tape;
+  int tapeLength;
+  int numPrimitives;
+  // The tape index of the frame instruction that writes each frame register.
+  // Register 0, the world frame, isn't written by any.
+  int frameInstructions[kMaxSceneFrames];
+  // An acceleration structure over the tape, for scenes with many primitives.
+  struct BVH *bvh;
+} Scene;
+
+/**
+ * Scene descriptions are plain text, one directive per line. Everything after
+ * a '#' is a comment.
+ *
+ *   material NAME diffuse R G B [conductive ior R G B extinction R G B]
+ *   frame NAME [position X Y Z] [rotate x|y|z RADIANS]...
+ *   sphere [frame NAME] center X Y Z radius R material NAME
+ *   plane [frame NAME] normal X Y Z [h H] material NAME
+ *
+ * A frame places the primitives that reference it: they are rotated by each
+ * rotation in turn and then moved to the frame's position. Materials and
+ * frames must be declared before they're used. Sphere radii must be positive,
+ * and plane normals nonzero; a plane's normal and h are scaled together to
+ * make the normal unit length.
+ */
+
+// The scene we've always rendered: a gold and a silver sphere in front of
+// the corner of three planes.
+extern const char *const kDefaultSceneDescription;
+
+// Compiles a scene description. On failure, prints an error mentioning
+// sourceName and the offending line and returns 1.
+int parseScene(const char *description, const char *sourceName, Scene *scene);
+
+// Reads and compiles a scene description file. Returns 1 on failure.
+int loadScene(const char *filename, Scene *scene);
+
+void freeScene(Scene *scene);
+
+// Evaluates the scene's signed distance function, ignoring materials.
+float sceneDistance(const Scene *scene, Point p);
+
+// Evaluates the scene's signed distance function and the material of the
+// closest primitive.
+SDFResult evaluateScene(const Scene *scene, Point p);
+
+// Like evaluateScene(), but also returns the gradient of the closest
+// primitive, taken analytically in its frame and carried back to world space
+// through the frame's transform. Costs one scene evaluation, where finite
+// differences cost six. Primitives without an analytic gradient leave
+// hasGradient false, for the caller to fall back on finite differences.
+SceneSample sampleScene(const Scene *scene, Point p);
+
+// The building blocks of the evaluators above, for code that walks the tape in
+// a different order.
+
+static inline Point sceneTranslatedPoint(
+    const SceneInstruction *instruction, Point p) {
+  if (!instruction->hasTranslation) {
+    return p;
+  }
+  return makePoint(p.x + instruction->translation[0],
+                   p.y + instruction->translation[1],
+                   p.z + instruction->translation[2]);
+}
+
+// Runs a frame instruction, which reads the world frame, frames[0].
+static inline void runSceneFrame(const SceneInstruction *instruction,
+                                 Point *frames) {
+  Point p = sceneTranslatedPoint(instruction, frames[0]);
+  frames[instruction->frame] = vectorToPoint(
+      applyTransform(instruction->transform, vectorFromOriginToPoint(p)));
+}
+
+// Evaluates a sphere or plane instruction. The operations mirror sphereSDF()
+// and planeSDF() in math.c.
+static inline float scenePrimitiveDistance(
+    const SceneInstruction *instruction, const Point *frames) {
+  Point p = sceneTranslatedPoint(instruction, frames[instruction->frame]);
+  if (instruction->op == kSceneOpSphere) {
+    return sphereSDF(p, instruction->radius);
+  }
+  return planeSDF(p, instruction->plane.normal, instruction->plane.h);
+}
+
+#endif /* SCENE_H */
@@ -0,0 +1,401 @@
+#include "scenekernel.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static const char *const kKernelCompilerFlags[] = {"-O2", "-fPIC", "-shared"};
+
+// The declarations the generated code shares with math.h, and the marchers,
+// which mirror rayMarch(), normalForPointAndSDF() and softShadow() in math.c
+// operation for operation.
+static const char kKernelPrologue[] =
+    "#include <math.h>\n"
+    "#include <stdbool.h>\n"
+    "\n"
+    "#define SDF_EPSILON 0.0001\n"
+    "\n"
+    "typedef struct Point {\n"
+    "  float x, y, z;\n"
+    "} Point;\n"
+    "\n"
+    "typedef struct Vector {\n"
+    "  float x, y, z;\n"
+    "} Vector;\n"
+    "\n"
+    "typedef struct Ray {\n"
+    "  Point origin;\n"
+    "  Vector direction;\n"
+    "} Ray;\n"
+    "\n"
+    "static inline float sceneSDF(Point p);\n"
+    "\n"
+    "float sceneKernelDistance(Point p) { return sceneSDF(p); }\n"
+    "\n"
+    "bool sceneKernelRayMarch(Ray ray, int maxSteps, Point *intersectionPoint) "
+    "{\n"
+    "  Point point = ray.origin;\n"
+    "  for (int i = 0; i < maxSteps; ++i) {\n"
+    "    float d = sceneSDF(point);\n"
+    "    if (d <= SDF_EPSILON) {\n"
+    "      if (intersectionPoint) {\n"
+    "        *intersectionPoint = point;\n"
+    "      }\n"
+    "      return true;\n"
+    "    }\n"
+    "    point = (Point){.x = point.x + ray.direction.x * d,\n"
+    "                    .y = point.y + ray.direction.y * d,\n"
+    "                    .z = point.z + ray.direction.z * d};\n"
+    "  }\n"
+    "  if (intersectionPoint) {\n"
+    "    *intersectionPoint = point;\n"
+    "  }\n"
+    "  return false;\n"
+    "}\n"
+    "\n"
+    "Vector sceneKernelNormal(Point p) {\n"
+    "  float x = sceneSDF((Point){.x = p.x + SDF_EPSILON, .y = p.y, .z = p.z}) "
+    "-\n"
+    "            sceneSDF((Point){.x = p.x - SDF_EPSILON, .y = p.y, .z = "
+    "p.z});\n"
+    "  float y = sceneSDF((Point){.x = p.x, .y = p.y + SDF_EPSILON, .z = p.z}) "
+    "-\n"
+    "            sceneSDF((Point){.x = p.x, .y = p.y - SDF_EPSILON, .z = "
+    "p.z});\n"
+    "  float z = sceneSDF((Point){.x = p.x, .y = p.y, .z = p.z + SDF_EPSILON}) "
+    "-\n"
+    "            sceneSDF((Point){.x = p.x, .y = p.y, .z = p.z - "
+    "SDF_EPSILON});\n"
+    "  float length = sqrt(x * x + y * y + z * z);\n"
+    "  return (Vector){.x = x / length, .y = y / length, .z = z / length};\n"
+    "}\n"
+    "\n"
+    "float sceneKernelSoftShadow(Point start, Point end, float k) {\n"
+    "  float result = 1.0;\n"
+    "  Vector startToEnd = {.x = end.x - start.x,\n"
+    "                       .y = end.y - start.y,\n"
+    "                       .z = end.z - start.z};\n"
+    "  for (float t = 0.0; t < 1.0;) {\n"
+    "    Point p = {.x = start.x + startToEnd.x * t,\n"
+    "               .y = start.y + startToEnd.y * t,\n"
+    "               .z = start.z + startToEnd.z * t};\n"
+    "    float d = sceneSDF(p);\n"
+    "    if (d <= SDF_EPSILON) {\n"
+    "      return 0.0;\n"
+    "    }\n"
+    "    float shadow = k * d / t;\n"
+    "    result = result < shadow ? result : shadow;\n"
+    "    t += d;\n"
+    "  }\n"
+    "  return result;\n"
+    "}\n"
+    "\n";
+
+// Writes the sum of coefficients[i] * terms[i] the way applyTransform() and
+// dotProduct() add them up, leaving out terms multiplied by 0 and
+// multiplications by 1.
+static void writeLinearCombination(FILE *out, const float *coefficients,
+                                   const char *const *terms) {
+  bool isEmpty = true;
+  for (int i = 0; i < 3; ++i) {
+    if (coefficients[i] == 0.0f) {
+      continue;
+    }
+    fprintf(out, "%s", isEmpty ? "" : " + ");
+    if (coefficients[i] == 1.0f) {
+      fprintf(out, "%s", terms[i]);
+    } else {
+      fprintf(out, "%af * %s", coefficients[i], terms[i]);
+    }
+    isEmpty = false;
+  }
+  if (isEmpty) {
+    fprintf(out, "0.0f");
+  }
+}
+
+// Writes the declarations of NAMEx, NAMEy and NAMEz, the point in source
+// moved by the instruction's translation as sceneTranslatedPoint() moves it.
+static void writeTranslatedPoint(FILE *out, const char *name,
+                                 const char *source,
+                                 const SceneInstruction *instruction) {
+  for (int i = 0; i < 3; ++i) {
+    char axis = "xyz"[i];
+    if (instruction->hasTranslation && instruction->translation[i] != 0.0) {
+      fprintf(out, "  float %s%c = (float)(%s.%c + %a);\n", name, axis,
+              source, axis, instruction->translation[i]);
+    } else {
+      fprintf(out, "  float %s%c = %s.%c;\n", name, axis, source, axis);
+    }
+  }
+}
+
+// Writes sceneSDF(), the tape unrolled into straight-line code.
+static void writeSceneSDF(FILE *out, const Scene *scene) {
+  fprintf(out, "static inline float sceneSDF(Point p) {\n");
+  int numDistances = 0;
+  for (int i = 0; i < scene->tapeLength; ++i) {
+    const SceneInstruction *instruction = &scene->tape[i];
+    char name[16];
+    char source[16] = "p";
+    char terms[3][24];
+    const char *termPointers[3] = {terms[0], terms[1], terms[2]};
+    snprintf(name, sizeof(name), "t%d", i);
+    // Frame instructions read the world frame, p.
+    if (instruction->op != kSceneOpFrame && instruction->frame != 0) {
+      snprintf(source, sizeof(source), "f%d", instruction->frame);
+    }
+    writeTranslatedPoint(out, name, source, instruction);
+    for (int axis = 0; axis < 3; ++axis) {
+      snprintf(terms[axis], sizeof(terms[axis]), "%s%c", name, "xyz"[axis]);
+    }
+    if (instruction->op == kSceneOpFrame) {
+      const Transform *t = &instruction->transform;
+      const float rows[3][3] = {
+          {t->a, t->b, t->c}, {t->d, t->e, t->f}, {t->g, t->h, t->i}};
+      fprintf(out, "  Point f%d;\n", instruction->frame);
+      for (int axis = 0; axis < 3; ++axis) {
+        fprintf(out, "  f%d.%c = ", instruction->frame, "xyz"[axis]);
+        writeLinearCombination(out, rows[axis], termPointers);
+        fprintf(out, ";\n");
+      }
+      continue;
+    }
+    fprintf(out, "  float d%d = ", numDistances);
+    if (instruction->op == kSceneOpSphere) {
+      fprintf(out, "(float)sqrt(%s * %s + %s * %s + %s * %s) - %af;\n",
+              terms[0], terms[0], terms[1], terms[1], terms[2], terms[2],
+              instruction->radius);
+    } else {
+      Vector normal = instruction->plane.normal;
+      const float coefficients[3] = {normal.x, normal.y, normal.z};
+      writeLinearCombination(out, coefficients, termPointers);
+      if (instruction->plane.h != 0.0f) {
+        fprintf(out, " + %af", instruction->plane.h);
+      }
+      fprintf(out, ";\n");
+    }
+    // Like unionOp().
+    if (numDistances == 0) {
+      fprintf(out, "  float d = d0;\n");
+    } else {
+      fprintf(out, "  d = d < d%d ? d : d%d;\n", numDistances, numDistances);
+    }
+    numDistances++;
+  }
+  fprintf(out, "  return d;\n}\n");
+}
+
+// Returns the kernel's source, which the caller frees, or NULL.
+static char *kernelSource(const Scene *scene) {
+  char *source = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&source, &size);
+  if (!out) {
+    return NULL;
+  }
+  fprintf(out, "%s", kKernelPrologue);
+  writeSceneSDF(out, scene);
+  if (fclose(out) != 0) {
+    free(source);
+    return NULL;
+  }
+  return source;
+}
+
+static const char *kernelCompiler(void) {
+  const char *compiler = getenv("CC");
+  return compiler && *compiler ? compiler : "cc";
+}
+
+// FNV-1a over the source and the compiler command, so a different compiler
+// gets its own kernels.
+static uint64_t kernelHash(const char *source) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  const char *parts[2 + sizeof(kKernelCompilerFlags) /
+                            sizeof(kKernelCompilerFlags[0])];
+  int numParts = 0;
+  parts[numParts++] = source;
+  parts[numParts++] = kernelCompiler();
+  for (size_t i = 0;
+       i < sizeof(kKernelCompilerFlags) / sizeof(kKernelCompilerFlags[0]);
+       ++i) {
+    parts[numParts++] = kKernelCompilerFlags[i];
+  }
+  for (int i = 0; i < numParts; ++i) {
+    // The terminators keep "ab" + "c" apart from "a" + "bc".
+    for (const char *c = parts[i];; ++c) {
+      hash = (hash ^ (uint8_t)*c) * 0x100000001b3ull;
+      if (!*c) {
+        break;
+      }
+    }
+  }
+  return hash;
+}
+
+static int writeFile(const char *path, const char *text) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    printf("Failed to open %s: %d (%s)\n", path, errno, strerror(errno));
+    return 1;
+  }
+  size_t length = strlen(text);
+  bool ok = fwrite(text, 1, length, file) == length;
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    printf("Failed to write %s\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+// Compiles sourcePath into the shared library at libraryPath. Returns 1 on
+// failure.
+static int compileKernel(const char *sourcePath, const char *libraryPath) {
+  const char *compiler = kernelCompiler();
+  const char *argv[16];
+  int argc = 0;
+  argv[argc++] = compiler;
+  for (size_t i = 0;
+       i < sizeof(kKernelCompilerFlags) / sizeof(kKernelCompilerFlags[0]);
+       ++i) {
+    argv[argc++] = kKernelCompilerFlags[i];
+  }
+  argv[argc++] = "-o";
+  argv[argc++] = libraryPath;
+  argv[argc++] = sourcePath;
+  argv[argc++] = "-lm";
+  argv[argc] = NULL;
+  pid_t pid;
+  int error =
+      posix_spawnp(&pid, compiler, NULL, NULL, (char *const *)argv, environ);
+  if (error) {
+    printf("Failed to run %s: %d (%s)\n", compiler, error, strerror(error));
+    return 1;
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      printf("Failed to wait for %s: %d (%s)\n", compiler, errno,
+             strerror(errno));
+      return 1;
+    }
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("%s failed to compile %s\n", compiler, sourcePath);
+    return 1;
+  }
+  return 0;
+}
+
+// Compiles the kernel into libraryPath, by way of files only this process
+// writes, which are then renamed into place. Processes racing to compile the
+// same kernel each end up with a whole library.
+static int buildKernel(const char *source, const char *cacheDirectory,
+                       const char *name, const char *libraryPath) {
+  if (mkdir(cacheDirectory, 0755) != 0 && errno != EEXIST) {
+    printf("Failed to create %s: %d (%s)\n", cacheDirectory, errno,
+           strerror(errno));
+    return 1;
+  }
+  size_t pathSize = strlen(cacheDirectory) + strlen(name) + 32;
+  char *sourcePath = malloc(pathSize);
+  char *finalSourcePath = malloc(pathSize);
+  char *temporaryPath = malloc(pathSize);
+  snprintf(sourcePath, pathSize, "%s/%s-%d.c", cacheDirectory, name,
+           (int)getpid());
+  snprintf(finalSourcePath, pathSize, "%s/%s.c", cacheDirectory, name);
+  snprintf(temporaryPath, pathSize, "%s/%s-%d.so", cacheDirectory, name,
+           (int)getpid());
+  int result = writeFile(sourcePath, source);
+  if (result == 0) {
+    result = compileKernel(sourcePath, temporaryPath);
+  }
+  if (result == 0 && rename(temporaryPath, libraryPath) != 0) {
+    printf("Failed to rename %s: %d (%s)\n", temporaryPath, errno,
+           strerror(errno));
+    result = 1;
+  }
+  if (result == 0) {
+    // The source stays next to the library, for whoever wants to read it.
+    rename(sourcePath, finalSourcePath);
+  } else {
+    unlink(sourcePath);
+    unlink(temporaryPath);
+  }
+  free(temporaryPath);
+  free(finalSourcePath);
+  free(sourcePath);
+  return result;
+}
+
+SceneKernel *loadSceneKernel(const Scene *scene, const char *cacheDirectory) {
+  if (scene->bvh) {
+    printf("Scene kernels are only for scenes without a BVH; using the "
+           "generic scene code\n");
+    return NULL;
+  }
+  char *source = kernelSource(scene);
+  if (!source) {
+    printf("Failed to generate the scene kernel\n");
+    return NULL;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "scene-%016llx",
+           (unsigned long long)kernelHash(source));
+  size_t pathSize = strlen(cacheDirectory) + strlen(name) + 8;
+  char *libraryPath = malloc(pathSize);
+  snprintf(libraryPath, pathSize, "%s/%s.so", cacheDirectory, name);
+
+  int result = 0;
+  if (access(libraryPath, F_OK) != 0) {
+    printf("Compiling the scene kernel into %s\n", libraryPath);
+    result = buildKernel(source, cacheDirectory, name, libraryPath);
+  }
+  free(source);
+  SceneKernel *kernel = NULL;
+  void *library = result == 0 ? dlopen(libraryPath, RTLD_NOW | RTLD_LOCAL)
+                              : NULL;
+  if (result == 0 && !library) {
+    printf("Failed to load %s: %s\n", libraryPath, dlerror());
+  }
+  if (library) {
+    kernel = calloc(1, sizeof(SceneKernel));
+    kernel->library = library;
+    // POSIX guarantees that function pointers survive the trip through
+    // void *.
+    *(void **)&kernel->distance = dlsym(library, "sceneKernelDistance");
+    *(void **)&kernel->rayMarch = dlsym(library, "sceneKernelRayMarch");
+    *(void **)&kernel->normal = dlsym(library, "sceneKernelNormal");
+    *(void **)&kernel->softShadow = dlsym(library, "sceneKernelSoftShadow");
+    if (!kernel->distance || !kernel->rayMarch || !kernel->normal ||
+        !kernel->softShadow) {
+      printf("%s is missing kernel functions\n", libraryPath);
+      freeSceneKernel(kernel);
+      kernel = NULL;
+    }
+  }
+  if (!kernel) {
+    printf("Using the generic scene code\n");
+  }
+  free(libraryPath);
+  return kernel;
+}
+
+void freeSceneKernel(SceneKernel *kernel) {
+  if (!kernel) {
+    return;
+  }
+  dlclose(kernel->library);
+  free(kernel);
+}
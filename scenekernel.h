@@ -0,0 +1,35 @@
+#ifndef SCENEKERNEL_H
+#define SCENEKERNEL_H
+
+#include <stdbool.h>
+
+#include "math.h"
+#include "scene.h"
+
+// A scene's distance function compiled into C with the scene written out in
+// full: no tape, no loops over it, translations and transform coefficients as
+// constants, and terms that multiply by 0 or 1 folded away. The marchers that
+// call it most are compiled alongside it, so the distance function is inlined
+// into them. Each operation is the one the tape evaluators apply, in the same
+// order, so the kernel finds exactly the same distances, hits and shadows.
+typedef struct SceneKernel {
+  void *library;
+  float (*distance)(Point p);
+  // Like rayMarch(), normalForPointAndSDF() and softShadow() in math.c, with
+  // the scene's distance function as the SDF.
+  bool (*rayMarch)(Ray ray, int maxSteps, Point *intersectionPoint);
+  Vector (*normal)(Point p);
+  float (*softShadow)(Point start, Point end, float k);
+} SceneKernel;
+
+// Loads the scene's kernel from cacheDirectory, compiling it first with the
+// compiler in $CC, or cc, if it isn't there yet. Kernels are named by a hash
+// of their source and the compiler command, so each scene is compiled once.
+// Scenes with a BVH, for which a kernel would evaluate every primitive, have
+// no kernel. Returns NULL, after printing why, when there's no kernel to be
+// had, in which case callers carry on with the tape evaluators.
+SceneKernel *loadSceneKernel(const Scene *scene, const char *cacheDirectory);
+
+void freeSceneKernel(SceneKernel *kernel);
+
+#endif /* SCENEKERNEL_H */
@@ -0,0 +1,503 @@
+#include "server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "netutil.h"
+
+// Requests longer than this are turned away.
+#define kMaxRequestLength 1024
+
+// Percentiles are taken over this many of the latest requests.
+#define kLatencyWindow 1024
+
+// The largest image width or height, samples per side and march steps a
+// request may ask for.
+#define kMaxImageDim 16384
+#define kMaxSubPixelsDim 64
+#define kMaxRayMarchSteps 1000000
+
+typedef struct Server Server;
+
+typedef struct Connection {
+  Server *server;
+  int fd;
+  // Replies come from the render thread as well as the connection's own.
+  pthread_mutex_t writeLock;
+  // The connection's thread and queued requests each hold a reference.
+  int numReferences;
+  struct Connection *next;
+} Connection;
+
+typedef struct QueuedRequest {
+  RenderRequest request;
+  Connection *connection;
+  double arrivalTime;
+  struct QueuedRequest *next;
+} QueuedRequest;
+
+// The latest kLatencyWindow samples of a duration.
+typedef struct LatencyWindow {
+  double seconds[kLatencyWindow];
+  long numSamples;
+} LatencyWindow;
+
+struct Server {
+  int listenFd;
+  RenderRequest defaults;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  QueuedRequest *queueHead;
+  QueuedRequest *queueTail;
+  int queueLength;
+  bool isQuitting;
+  Connection *connections;
+  int numConnections;
+
+  // Metrics, guarded by lock.
+  long numRequests;
+  long numRenders;
+  long numCoalesced;
+  long numErrors;
+  // From a request arriving to its reply going out.
+  LatencyWindow latencies;
+  // From a render starting to its image being ready.
+  LatencyWindow renderTimes;
+};
+
+static void sendReply(Connection *connection, const void *body, size_t size) {
+  char header[32];
+  int headerLength = snprintf(header, sizeof(header), "OK %zu\n", size);
+  pthread_mutex_lock(&connection->writeLock);
+  if (sendAll(connection->fd, header, headerLength)) {
+    sendAll(connection->fd, body, size);
+  }
+  pthread_mutex_unlock(&connection->writeLock);
+}
+
+static void sendError(Connection *connection, const char *message) {
+  char reply[256];
+  int length = snprintf(reply, sizeof(reply), "ERROR %s\n", message);
+  pthread_mutex_lock(&connection->writeLock);
+  sendAll(connection->fd, reply, length);
+  pthread_mutex_unlock(&connection->writeLock);
+}
+
+static void addSample(LatencyWindow *window, double seconds) {
+  window->seconds[window->numSamples++ % kLatencyWindow] = seconds;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// The nearest-rank percentiles p50 and p99 of the window, in milliseconds.
+static void windowPercentiles(const LatencyWindow *window, double *p50,
+                              double *p99) {
+  int n = window->numSamples < kLatencyWindow ? window->numSamples
+                                               : kLatencyWindow;
+  if (n == 0) {
+    *p50 = *p99 = 0.0;
+    return;
+  }
+  double sorted[kLatencyWindow];
+  memcpy(sorted, window->seconds, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), compareDoubles);
+  *p50 = sorted[(n * 50 + 99) / 100 - 1] * 1000.0;
+  *p99 = sorted[(n * 99 + 99) / 100 - 1] * 1000.0;
+}
+
+static void sendMetrics(Server *server, Connection *connection) {
+  double latencyP50, latencyP99, renderP50, renderP99;
+  char text[512];
+  pthread_mutex_lock(&server->lock);
+  windowPercentiles(&server->latencies, &latencyP50, &latencyP99);
+  windowPercentiles(&server->renderTimes, &renderP50, &renderP99);
+  int length = snprintf(text, sizeof(text),
+                        "requests %ld\n"
+                        "renders %ld\n"
+                        "coalesced %ld\n"
+                        "errors %ld\n"
+                        "queued %d\n"
+                        "connections %d\n"
+                        "latency_p50_ms %.3f\n"
+                        "latency_p99_ms %.3f\n"
+                        "render_p50_ms %.3f\n"
+                        "render_p99_ms %.3f\n",
+                        server->numRequests, server->numRenders,
+                        server->numCoalesced, server->numErrors,
+                        server->queueLength, server->numConnections,
+                        latencyP50, latencyP99, renderP50, renderP99);
+  pthread_mutex_unlock(&server->lock);
+  sendReply(connection, text, length);
+}
+
+// Drops a reference to the connection, closing it with the last one. Called
+// with the server's lock held.
+static void releaseConnection(Connection *connection) {
+  if (--connection->numReferences > 0) {
+    return;
+  }
+  Server *server = connection->server;
+  for (Connection **link = &server->connections; *link;
+       link = &(*link)->next) {
+    if (*link == connection) {
+      *link = connection->next;
+      break;
+    }
+  }
+  server->numConnections--;
+  pthread_cond_broadcast(&server->changed);
+  close(connection->fd);
+  pthread_mutex_destroy(&connection->writeLock);
+  free(connection);
+}
+
+static bool parseInt(const char *text, int maxValue, int *value) {
+  char *end;
+  long parsed = strtol(text, &end, 10);
+  if (*end != '\0' || parsed < 1 || parsed > maxValue) {
+    return false;
+  }
+  *value = parsed;
+  return true;
+}
+
+static bool parsePoint(const char *text, Point *point) {
+  char trailing;
+  return sscanf(text, "%f,%f,%f%c", &point->x, &point->y, &point->z,
+                &trailing) == 3;
+}
+
+// Parses the settings after "render". Returns an error message, or NULL.
+static const char *parseRenderRequest(char *settings, RenderRequest *request) {
+  char *savePtr;
+  for (char *setting = strtok_r(settings, " \t", &savePtr); setting;
+       setting = strtok_r(NULL, " \t", &savePtr)) {
+    char *value = strchr(setting, '=');
+    if (!value) {
+      return "settings must be NAME=VALUE";
+    }
+    *value++ = '\0';
+    bool ok;
+    if (strcmp(setting, "width") == 0) {
+      ok = parseInt(value, kMaxImageDim, &request->imageWidth);
+    } else if (strcmp(setting, "height") == 0) {
+      ok = parseInt(value, kMaxImageDim, &request->imageHeight);
+    } else if (strcmp(setting, "samples") == 0) {
+      ok = parseInt(value, kMaxSubPixelsDim, &request->subPixelsDim);
+    } else if (strcmp(setting, "steps") == 0) {
+      ok = parseInt(value, kMaxRayMarchSteps, &request->numRayMarchSteps);
+    } else if (strcmp(setting, "camera") == 0) {
+      ok = parsePoint(value, &request->cameraPosition);
+    } else if (strcmp(setting, "target") == 0) {
+      ok = parsePoint(value, &request->cameraTarget);
+    } else if (strcmp(setting, "light") == 0) {
+      ok = parsePoint(value, &request->lightPosition);
+    } else if (strcmp(setting, "format") == 0) {
+      request->format = kImageFormatRaw;
+      ok = strcmp(value, "raw") == 0 ||
+           parseImageFormat(value, &request->format);
+    } else {
+      return "unknown setting";
+    }
+    if (!ok) {
+      return "bad setting value";
+    }
+  }
+  return NULL;
+}
+
+static bool isSameRequest(const RenderRequest *a, const RenderRequest *b) {
+  return a->imageWidth == b->imageWidth && a->imageHeight == b->imageHeight &&
+         a->subPixelsDim == b->subPixelsDim &&
+         a->numRayMarchSteps == b->numRayMarchSteps &&
+         a->cameraPosition.x == b->cameraPosition.x &&
+         a->cameraPosition.y == b->cameraPosition.y &&
+         a->cameraPosition.z == b->cameraPosition.z &&
+         a->cameraTarget.x == b->cameraTarget.x &&
+         a->cameraTarget.y == b->cameraTarget.y &&
+         a->cameraTarget.z == b->cameraTarget.z &&
+         a->lightPosition.x == b->lightPosition.x &&
+         a->lightPosition.y == b->lightPosition.y &&
+         a->lightPosition.z == b->lightPosition.z && a->format == b->format;
+}
+
+// Acts on one line from a client. Returns false once the client asked the
+// server to quit.
+static bool handleLine(Connection *connection, char *line, double arrivalTime) {
+  Server *server = connection->server;
+  char *savePtr;
+  char *command = strtok_r(line, " \t", &savePtr);
+  if (!command) {
+    return true;
+  }
+  if (strcmp(command, "metrics") == 0) {
+    sendMetrics(server, connection);
+    return true;
+  }
+  if (strcmp(command, "quit") == 0) {
+    pthread_mutex_lock(&server->lock);
+    server->isQuitting = true;
+    pthread_cond_broadcast(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+    sendReply(connection, NULL, 0);
+    return false;
+  }
+  if (strcmp(command, "render") != 0) {
+    pthread_mutex_lock(&server->lock);
+    server->numErrors++;
+    pthread_mutex_unlock(&server->lock);
+    sendError(connection, "unknown request");
+    return true;
+  }
+
+  QueuedRequest *queued = malloc(sizeof(QueuedRequest));
+  *queued = (QueuedRequest){.request = server->defaults,
+                            .connection = connection,
+                            .arrivalTime = arrivalTime};
+  const char *error = parseRenderRequest(savePtr, &queued->request);
+  pthread_mutex_lock(&server->lock);
+  server->numRequests++;
+  if (error || server->isQuitting) {
+    server->numErrors++;
+    pthread_mutex_unlock(&server->lock);
+    sendError(connection, error ? error : "server is quitting");
+    free(queued);
+    return true;
+  }
+  connection->numReferences++;
+  if (server->queueTail) {
+    server->queueTail->next = queued;
+  } else {
+    server->queueHead = queued;
+  }
+  server->queueTail = queued;
+  server->queueLength++;
+  pthread_cond_broadcast(&server->changed);
+  pthread_mutex_unlock(&server->lock);
+  return true;
+}
+
+// Reads requests from a client until it disconnects.
+static void *connectionMain(void *arg) {
+  Connection *connection = arg;
+  Server *server = connection->server;
+  char buffer[kMaxRequestLength + 1];
+  size_t length = 0;
+  bool isOpen = true;
+  while (isOpen) {
+    ssize_t numReceived =
+        recv(connection->fd, buffer + length, kMaxRequestLength - length, 0);
+    if (numReceived < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numReceived <= 0) {
+      break;
+    }
+    double arrivalTime = monotonicSeconds();
+    length += numReceived;
+    char *lineStart = buffer;
+    char *newline;
+    while (isOpen && (newline = memchr(lineStart, '\n',
+                                       buffer + length - lineStart))) {
+      *newline = '\0';
+      isOpen = handleLine(connection, lineStart, arrivalTime);
+      lineStart = newline + 1;
+    }
+    length -= lineStart - buffer;
+    memmove(buffer, lineStart, length);
+    if (length == kMaxRequestLength) {
+      sendError(connection, "request too long");
+      break;
+    }
+  }
+  pthread_mutex_lock(&server->lock);
+  releaseConnection(connection);
+  pthread_mutex_unlock(&server->lock);
+  return NULL;
+}
+
+static void *acceptMain(void *arg) {
+  Server *server = arg;
+  for (;;) {
+    int fd = accept(server->listenFd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      // The listening socket was shut down.
+      return NULL;
+    }
+    Connection *connection = calloc(1, sizeof(Connection));
+    connection->server = server;
+    connection->fd = fd;
+    connection->numReferences = 1;
+    pthread_mutex_init(&connection->writeLock, NULL);
+    pthread_mutex_lock(&server->lock);
+    connection->next = server->connections;
+    server->connections = connection;
+    server->numConnections++;
+    pthread_mutex_unlock(&server->lock);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, connectionMain, connection) != 0) {
+      pthread_mutex_lock(&server->lock);
+      releaseConnection(connection);
+      pthread_mutex_unlock(&server->lock);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+// Binds a socket at path, replacing a socket left there by an earlier server
+// but nothing else. Returns -1 on failure.
+static int listenOnPath(const char *path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Socket path is too long: %s\n", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  struct stat status;
+  if (lstat(path, &status) == 0) {
+    if (!S_ISSOCK(status.st_mode)) {
+      printf("%s exists and isn't a socket\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    printf("Failed to listen on %s: %d (%s)\n", path, errno, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// Takes the request at the head of the queue, with every queued request
+// identical to it, off the queue. Returns NULL once the server is quitting and
+// the queue is empty.
+static QueuedRequest *takeRequests(Server *server) {
+  pthread_mutex_lock(&server->lock);
+  while (!server->queueHead && !server->isQuitting) {
+    pthread_cond_wait(&server->changed, &server->lock);
+  }
+  QueuedRequest *batch = server->queueHead;
+  if (batch) {
+    QueuedRequest *batchTail = batch;
+    QueuedRequest *rest = NULL;
+    QueuedRequest *restTail = NULL;
+    QueuedRequest *queued = batch->next;
+    batch->next = NULL;
+    server->queueLength--;
+    while (queued) {
+      QueuedRequest *next = queued->next;
+      queued->next = NULL;
+      if (isSameRequest(&queued->request, &batch->request)) {
+        batchTail->next = queued;
+        batchTail = queued;
+        server->queueLength--;
+        server->numCoalesced++;
+      } else if (restTail) {
+        restTail->next = queued;
+        restTail = queued;
+      } else {
+        rest = restTail = queued;
+      }
+      queued = next;
+    }
+    server->queueHead = rest;
+    server->queueTail = restTail;
+  }
+  pthread_mutex_unlock(&server->lock);
+  return batch;
+}
+
+int runRenderServer(const char *path, const RenderRequest *defaults,
+                    RenderRequestFunc render, void *context) {
+  Server *server = calloc(1, sizeof(Server));
+  server->defaults = *defaults;
+  server->listenFd = listenOnPath(path);
+  if (server->listenFd < 0) {
+    free(server);
+    return 1;
+  }
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->changed, NULL);
+  pthread_t acceptThread;
+  if (pthread_create(&acceptThread, NULL, acceptMain, server) != 0) {
+    printf("Failed to start the server's accept thread\n");
+    close(server->listenFd);
+    unlink(path);
+    free(server);
+    return 1;
+  }
+  printf("Serving render requests on %s\n", path);
+  fflush(stdout);
+
+  QueuedRequest *batch;
+  while ((batch = takeRequests(server))) {
+    double start = monotonicSeconds();
+    size_t size;
+    uint8_t *image = render(&batch->request, &size, context);
+    pthread_mutex_lock(&server->lock);
+    server->numRenders++;
+    addSample(&server->renderTimes, monotonicSeconds() - start);
+    pthread_mutex_unlock(&server->lock);
+    while (batch) {
+      QueuedRequest *queued = batch;
+      batch = queued->next;
+      if (image) {
+        sendReply(queued->connection, image, size);
+      } else {
+        sendError(queued->connection, "render failed");
+      }
+      pthread_mutex_lock(&server->lock);
+      addSample(&server->latencies,
+                monotonicSeconds() - queued->arrivalTime);
+      server->numErrors += !image;
+      releaseConnection(queued->connection);
+      pthread_mutex_unlock(&server->lock);
+      free(queued);
+    }
+    free(image);
+  }
+
+  // Stop taking connections, then hang up on the clients still connected and
+  // wait for their threads to let go.
+  shutdown(server->listenFd, SHUT_RDWR);
+  pthread_join(acceptThread, NULL);
+  close(server->listenFd);
+  unlink(path);
+  pthread_mutex_lock(&server->lock);
+  for (Connection *connection = server->connections; connection;
+       connection = connection->next) {
+    shutdown(connection->fd, SHUT_RDWR);
+  }
+  while (server->numConnections > 0) {
+    pthread_cond_wait(&server->changed, &server->lock);
+  }
+  pthread_mutex_unlock(&server->lock);
+  printf("Served %ld requests with %ld renders\n", server->numRequests,
+         server->numRenders);
+  pthread_cond_destroy(&server->changed);
+  pthread_mutex_destroy(&server->lock);
+  free(server);
+  return 0;
+}
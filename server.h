@@ -0,0 +1,51 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "imagefile.h"
+#include "math.h"
+
+// A render server. Clients connect to a Unix domain socket and send requests,
+// one per line:
+//
+//   render [width=N] [height=N] [samples=N] [steps=N] [camera=X,Y,Z]
+//          [target=X,Y,Z] [light=X,Y,Z] [format=bmp|qoi|png|raw]
+//   metrics
+//   quit
+//
+// Settings a render request leaves out come from the server's defaults. Each
+// request is answered with "OK SIZE\n" followed by SIZE bytes, or with
+// "ERROR MESSAGE\n". Renders come back as a BMP, QOI or PNG file or, in the
+// raw format, as width x height 3-byte BGR pixels, bottom row first. metrics
+// answers with request counts and latency percentiles, one "NAME VALUE" per
+// line, and quit stops the server once the requests ahead of it are done.
+//
+// Renders run one at a time, in the order they arrive. Identical requests
+// waiting in the queue are rendered once and answered together. Everything
+// else is answered as soon as it arrives, ahead of any renders the same client
+// still has queued.
+
+typedef struct RenderRequest {
+  int imageWidth;
+  int imageHeight;
+  int subPixelsDim;
+  int numRayMarchSteps;
+  Point cameraPosition;
+  Point cameraTarget;
+  Point lightPosition;
+  ImageFormat format;
+} RenderRequest;
+
+// Renders a request into a new image in the request's format, setting size to
+// its size. Returns NULL on failure.
+typedef uint8_t *(*RenderRequestFunc)(const RenderRequest *request,
+                                      size_t *size, void *context);
+
+// Serves requests on a socket at path until a client asks the server to quit,
+// rendering them with render on the calling thread. Returns 1 on failure.
+int runRenderServer(const char *path, const RenderRequest *defaults,
+                    RenderRequestFunc render, void *context);
+
+#endif /* SERVER_H */
@@ -0,0 +1,323 @@
+#include "shadowcache.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define kShadowCacheVersion 1
+
+#define kBrickSamplesPerAxis (kShadowCacheCellsPerBrick + 1)
+#define kSamplesPerBrick \
+  (kBrickSamplesPerAxis * kBrickSamplesPerAxis * kBrickSamplesPerAxis)
+
+// The brick slot of bricks without samples.
+#define kBrickEmpty -1
+
+// The sample of corners inside the scene or away from its surfaces.
+#define kSampleSkipped -1.0f
+
+// Lookups whose sampled corners weigh less than this in total would lean on
+// corners a cell away, so they report a miss instead.
+#define kMinSampledWeight 0.01f
+
+// Nor are cells blended whose sampled corners differ by more than this, about
+// two brightness levels: a shadow's edge crosses them, and blending would
+// smear it.
+#define kMaxSampleSpread 0.01f
+
+typedef struct ShadowCacheHeader {
+  char magic[8];
+  uint64_t settingsHash;
+  Point lightPosition;
+  uint32_t version;
+  uint32_t cellsPerAxis;
+  uint32_t cellsPerBrick;
+  uint32_t numNearBricks;
+} ShadowCacheHeader;
+
+static const char kShadowCacheMagic[8] = "SDFSHADE";
+
+typedef struct BakeJob {
+  const Scene *scene;
+  VisibilityFunc visibility;
+  void *context;
+  ShadowCache *cache;
+  float cellSize;
+  // The bricks with samples, in slot order.
+  int *nearBricks;
+} BakeJob;
+
+static Point cornerPoint(const BakeJob *job, int x, int y, int z) {
+  return makePoint(-kShadowCacheHalfSize + x * job->cellSize,
+                   -kShadowCacheHalfSize + y * job->cellSize,
+                   -kShadowCacheHalfSize + z * job->cellSize);
+}
+
+// Marks bricks with a corner that may be sampled. Those are the corners within
+// a cell diagonal of a surface, and the distance field is 1-Lipschitz.
+static void classifyBrick(int brick, void *context) {
+  BakeJob *job = context;
+  int bricksPerAxis = job->cache->bricksPerAxis;
+  int cells = kShadowCacheCellsPerBrick;
+  int x = brick % bricksPerAxis * cells;
+  int y = brick / bricksPerAxis % bricksPerAxis * cells;
+  int z = brick / (bricksPerAxis * bricksPerAxis) * cells;
+  Point corner = cornerPoint(job, x, y, z);
+  float half = 0.5f * cells * job->cellSize;
+  Point center = makePoint(corner.x + half, corner.y + half, corner.z + half);
+  float distance = sceneDistance(job->scene, center);
+  float halfDiagonal = 1.7320508f * half;
+  float cellDiagonal = 1.7320508f * job->cellSize;
+  bool isNear = distance - halfDiagonal <= cellDiagonal &&
+                distance + halfDiagonal > 0.0f;
+  job->cache->brickSlots[brick] = isNear ? 0 : kBrickEmpty;
+}
+
+static void sampleBrick(int slot, void *context) {
+  BakeJob *job = context;
+  int bricksPerAxis = job->cache->bricksPerAxis;
+  int brick = job->nearBricks[slot];
+  int cells = kShadowCacheCellsPerBrick;
+  int x0 = brick % bricksPerAxis * cells;
+  int y0 = brick / bricksPerAxis % bricksPerAxis * cells;
+  int z0 = brick / (bricksPerAxis * bricksPerAxis) * cells;
+  float cellDiagonal = 1.7320508f * job->cellSize;
+  float *samples = job->cache->samples + (size_t)slot * kSamplesPerBrick;
+  for (int z = 0; z < kBrickSamplesPerAxis; ++z) {
+    for (int y = 0; y < kBrickSamplesPerAxis; ++y) {
+      for (int x = 0; x < kBrickSamplesPerAxis; ++x) {
+        Point p = cornerPoint(job, x0 + x, y0 + y, z0 + z);
+        float distance = sceneDistance(job->scene, p);
+        *samples++ = distance > 0.0f && distance <= cellDiagonal
+                         ? job->visibility(p, job->context)
+                         : kSampleSkipped;
+      }
+    }
+  }
+}
+
+ShadowCache *bakeShadowCache(const Scene *scene, Point lightPosition,
+                             int cellsPerAxis, VisibilityFunc visibility,
+                             void *context, TilePool *pool) {
+  if (cellsPerAxis < kShadowCacheCellsPerBrick ||
+      cellsPerAxis % kShadowCacheCellsPerBrick != 0) {
+    printf("Shadow cache resolution must be a multiple of %d: %d\n",
+           kShadowCacheCellsPerBrick, cellsPerAxis);
+    return NULL;
+  }
+  ShadowCache *cache = calloc(1, sizeof(ShadowCache));
+  cache->lightPosition = lightPosition;
+  cache->cellsPerAxis = cellsPerAxis;
+  cache->bricksPerAxis = cellsPerAxis / kShadowCacheCellsPerBrick;
+  int numBricks =
+      cache->bricksPerAxis * cache->bricksPerAxis * cache->bricksPerAxis;
+  cache->brickSlots = malloc(numBricks * sizeof(int32_t));
+  BakeJob job = {.scene = scene,
+                 .visibility = visibility,
+                 .context = context,
+                 .cache = cache,
+                 .cellSize = 2.0f * kShadowCacheHalfSize / cellsPerAxis,
+                 .nearBricks = malloc(numBricks * sizeof(int))};
+  runTasks(pool, numBricks, classifyBrick, &job);
+
+  for (int brick = 0; brick < numBricks; ++brick) {
+    if (cache->brickSlots[brick] != kBrickEmpty) {
+      job.nearBricks[cache->numNearBricks] = brick;
+      cache->brickSlots[brick] = cache->numNearBricks++;
+    }
+  }
+  size_t samplesSize =
+      (size_t)cache->numNearBricks * kSamplesPerBrick * sizeof(float);
+  cache->samples = malloc(samplesSize);
+  if (!cache->samples) {
+    printf("Failed to allocate %zu bytes for the shadow cache\n", samplesSize);
+    free(job.nearBricks);
+    freeShadowCache(cache);
+    return NULL;
+  }
+  runTasks(pool, cache->numNearBricks, sampleBrick, &job);
+  free(job.nearBricks);
+  return cache;
+}
+
+int saveShadowCache(const ShadowCache *cache, const char *filename,
+                    uint64_t settingsHash) {
+  ShadowCacheHeader header;
+  // Zeroed first so the padding is written the same every time.
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kShadowCacheMagic, sizeof(header.magic));
+  header.settingsHash = settingsHash;
+  header.lightPosition = cache->lightPosition;
+  header.version = kShadowCacheVersion;
+  header.cellsPerAxis = cache->cellsPerAxis;
+  header.cellsPerBrick = kShadowCacheCellsPerBrick;
+  header.numNearBricks = cache->numNearBricks;
+  int bricksPerAxis = cache->bricksPerAxis;
+  size_t numBricks = (size_t)bricksPerAxis * bricksPerAxis * bricksPerAxis;
+  size_t numSamples = (size_t)cache->numNearBricks * kSamplesPerBrick;
+
+  // Write next to the destination and rename, so renders reading the old file
+  // never see a partial one.
+  size_t pathSize = strlen(filename) + sizeof(".tmp");
+  char *tempFilename = malloc(pathSize);
+  snprintf(tempFilename, pathSize, "%s.tmp", filename);
+  FILE *file = fopen(tempFilename, "wb");
+  if (!file) {
+    printf("Failed to create shadow cache file: %d (%s)\n", errno,
+           strerror(errno));
+    free(tempFilename);
+    return 1;
+  }
+  bool isWritten =
+      fwrite(&header, sizeof(header), 1, file) == 1 &&
+      fwrite(cache->brickSlots, sizeof(int32_t), numBricks, file) ==
+          numBricks &&
+      fwrite(cache->samples, sizeof(float), numSamples, file) == numSamples;
+  int closeResult = fclose(file);
+  if (!isWritten || closeResult != 0 || rename(tempFilename, filename) != 0) {
+    printf("Failed to write shadow cache file: %d (%s)\n", errno,
+           strerror(errno));
+    unlink(tempFilename);
+    free(tempFilename);
+    return 1;
+  }
+  free(tempFilename);
+  return 0;
+}
+
+ShadowCache *loadShadowCache(const char *filename, Point lightPosition,
+                             int cellsPerAxis, uint64_t settingsHash) {
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    if (errno != ENOENT) {
+      printf("Failed to open shadow cache file: %d (%s)\n", errno,
+             strerror(errno));
+    }
+    return NULL;
+  }
+  ShadowCacheHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, kShadowCacheMagic, sizeof(header.magic)) != 0 ||
+      header.version != kShadowCacheVersion ||
+      header.cellsPerBrick != kShadowCacheCellsPerBrick) {
+    fclose(file);
+    printf("%s: not a shadow cache of this version, rebaking\n", filename);
+    return NULL;
+  }
+  if (header.settingsHash != settingsHash ||
+      header.cellsPerAxis != (uint32_t)cellsPerAxis ||
+      header.lightPosition.x != lightPosition.x ||
+      header.lightPosition.y != lightPosition.y ||
+      header.lightPosition.z != lightPosition.z) {
+    fclose(file);
+    printf("%s: baked for a different scene, light or resolution, rebaking\n",
+           filename);
+    return NULL;
+  }
+
+  ShadowCache *cache = calloc(1, sizeof(ShadowCache));
+  cache->lightPosition = lightPosition;
+  cache->cellsPerAxis = cellsPerAxis;
+  cache->bricksPerAxis = cellsPerAxis / kShadowCacheCellsPerBrick;
+  cache->numNearBricks = header.numNearBricks;
+  int bricksPerAxis = cache->bricksPerAxis;
+  size_t numBricks = (size_t)bricksPerAxis * bricksPerAxis * bricksPerAxis;
+  size_t numSamples = (size_t)cache->numNearBricks * kSamplesPerBrick;
+  cache->brickSlots = malloc(numBricks * sizeof(int32_t));
+  cache->samples = malloc(numSamples * sizeof(float));
+  bool isRead =
+      cache->brickSlots && cache->samples &&
+      fread(cache->brickSlots, sizeof(int32_t), numBricks, file) ==
+          numBricks &&
+      fread(cache->samples, sizeof(float), numSamples, file) == numSamples &&
+      fgetc(file) == EOF;
+  fclose(file);
+  // Lookups index samples through the slots, so they have to be in range.
+  for (size_t brick = 0; isRead && brick < numBricks; ++brick) {
+    int32_t slot = cache->brickSlots[brick];
+    isRead = slot == kBrickEmpty || (slot >= 0 && slot < cache->numNearBricks);
+  }
+  if (!isRead) {
+    printf("%s: truncated or corrupt, rebaking\n", filename);
+    freeShadowCache(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+void freeShadowCache(ShadowCache *cache) {
+  if (!cache) {
+    return;
+  }
+  free(cache->samples);
+  free(cache->brickSlots);
+  free(cache);
+}
+
+float shadowCacheVisibility(const ShadowCache *cache, Point p) {
+  int cellsPerAxis = cache->cellsPerAxis;
+  float scale = cellsPerAxis / (2.0f * kShadowCacheHalfSize);
+  float u = (p.x + kShadowCacheHalfSize) * scale;
+  float v = (p.y + kShadowCacheHalfSize) * scale;
+  float w = (p.z + kShadowCacheHalfSize) * scale;
+  // Written so that NaNs fail too.
+  if (!(u >= 0.0f && u < cellsPerAxis && v >= 0.0f && v < cellsPerAxis &&
+        w >= 0.0f && w < cellsPerAxis)) {
+    return -1.0f;
+  }
+  int x = (int)u;
+  int y = (int)v;
+  int z = (int)w;
+  int bricksPerAxis = cache->bricksPerAxis;
+  int brick = ((z / kShadowCacheCellsPerBrick) * bricksPerAxis +
+               y / kShadowCacheCellsPerBrick) *
+                  bricksPerAxis +
+              x / kShadowCacheCellsPerBrick;
+  int32_t slot = cache->brickSlots[brick];
+  if (slot == kBrickEmpty) {
+    return -1.0f;
+  }
+
+  int lx = x % kShadowCacheCellsPerBrick;
+  int ly = y % kShadowCacheCellsPerBrick;
+  int lz = z % kShadowCacheCellsPerBrick;
+  float t[3] = {u - x, v - y, w - z};
+  const float *s = cache->samples + (size_t)slot * kSamplesPerBrick +
+                   (lz * kBrickSamplesPerAxis + ly) * kBrickSamplesPerAxis + lx;
+  // Trilinear weights, renormalized over the corners that were sampled.
+  float sum = 0.0f;
+  float weightSum = 0.0f;
+  float minSample = 1.0f;
+  float maxSample = 0.0f;
+  for (int corner = 0; corner < 8; ++corner) {
+    int dx = corner & 1;
+    int dy = corner >> 1 & 1;
+    int dz = corner >> 2;
+    float sample =
+        s[(dz * kBrickSamplesPerAxis + dy) * kBrickSamplesPerAxis + dx];
+    if (sample < 0.0f) {
+      continue;
+    }
+    float weight = (dx ? t[0] : 1.0f - t[0]) * (dy ? t[1] : 1.0f - t[1]) *
+                   (dz ? t[2] : 1.0f - t[2]);
+    sum += sample * weight;
+    weightSum += weight;
+    minSample = fminf(minSample, sample);
+    maxSample = fmaxf(maxSample, sample);
+  }
+  if (weightSum < kMinSampledWeight ||
+      maxSample - minSample > kMaxSampleSpread) {
+    return -1.0f;
+  }
+  return sum / weightSum;
+}
+
+size_t shadowCacheMemorySize(const ShadowCache *cache) {
+  int numBricks =
+      cache->bricksPerAxis * cache->bricksPerAxis * cache->bricksPerAxis;
+  return sizeof(ShadowCache) + numBricks * sizeof(int32_t) +
+         (size_t)cache->numNearBricks * kSamplesPerBrick * sizeof(float);
+}
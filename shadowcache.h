@@ -0,0 +1,67 @@
+#ifndef SHADOWCACHE_H
+#define SHADOWCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "math.h"
+#include "pool.h"
+#include "scene.h"
+
+// The cache covers the cube of side 2 * kShadowCacheHalfSize centered at the
+// origin, which holds the 1x1x1 cube the scene lives in and the walls around
+// it, split into bricks of kShadowCacheCellsPerBrick^3 cells.
+#define kShadowCacheHalfSize 2.0f
+#define kShadowCacheCellsPerBrick 8
+
+// The light visibility of the surface nearest a point outside the scene, from
+// 0 to 1.
+typedef float (*VisibilityFunc)(Point point, void *context);
+
+// A sparse sampling of how much of a light gets to the scene's surfaces, for a
+// light that stays put. Bricks that come near a surface store the visibility at
+// every cell corner within a cell diagonal of a surface; the rest store
+// nothing, as nothing is shaded there. Corners inside the scene or away from
+// surfaces are left out of lookups, so a point on a surface is only blended
+// from the corners on its open side.
+typedef struct ShadowCache {
+  Point lightPosition;
+  int cellsPerAxis;
+  int bricksPerAxis;
+  int numNearBricks;
+  // For every brick, its index among the near bricks, or -1.
+  int32_t *brickSlots;
+  // (kShadowCacheCellsPerBrick + 1)^3 samples per near brick, x fastest, with
+  // negative samples for corners left out.
+  float *samples;
+} ShadowCache;
+
+// Samples visibility around the scene's surfaces on the pool's threads, with
+// cellsPerAxis cells along each axis of the cube, a multiple of
+// kShadowCacheCellsPerBrick. lightPosition is only recorded, for callers to
+// tell whether the cache is still valid. Returns NULL on failure.
+ShadowCache *bakeShadowCache(const Scene *scene, Point lightPosition,
+                             int cellsPerAxis, VisibilityFunc visibility,
+                             void *context, TilePool *pool);
+
+// Writes the cache to a file, along with a hash of whatever else its samples
+// depend on, such as the scene. Returns 1 on failure.
+int saveShadowCache(const ShadowCache *cache, const char *filename,
+                    uint64_t settingsHash);
+
+// Reads a cache saved by saveShadowCache(). Returns NULL if the file doesn't
+// exist, can't be read, or was baked for a different light, resolution or
+// settingsHash.
+ShadowCache *loadShadowCache(const char *filename, Point lightPosition,
+                             int cellsPerAxis, uint64_t settingsHash);
+
+void freeShadowCache(ShadowCache *cache);
+
+// The visibility at p, blended from the corners of its cell that were sampled,
+// or -1 if p is outside the cube, none of them were, or they disagree, as
+// they do where a shadow's edge crosses the cell.
+float shadowCacheVisibility(const ShadowCache *cache, Point p);
+
+size_t shadowCacheMemorySize(const ShadowCache *cache);
+
+#endif /* SHADOWCACHE_H */
@@ -0,0 +1,211 @@
+#include "temporal.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// Rays start this fraction short of the nearest depth splatted within
+// kSplatRadius rays of them. The radius covers silhouettes, which slide over
+// the surfaces behind them as the camera moves.
+static const float kDepthMargin = 0.02;
+static const int kSplatRadius = 1;
+
+// Colors are reused for hits within this many primary ray spacings of where
+// they were shaded.
+static const float kReuseSpacings = 1.0;
+// Nor are they reused if a channel of the next ray's color over on the last
+// frame differed by more than this, about two brightness levels.
+static const float kReuseMaxContrast = 0.008;
+
+TemporalCache *createTemporalCache(int imageWidth, int imageHeight,
+                                   int subPixelsDim) {
+  TemporalCache *cache = calloc(1, sizeof(TemporalCache));
+  if (!cache) {
+    return NULL;
+  }
+  cache->imageWidth = imageWidth;
+  cache->imageHeight = imageHeight;
+  cache->subPixelsDim = subPixelsDim;
+  cache->width = imageWidth * subPixelsDim;
+  cache->height = imageHeight * subPixelsDim;
+  size_t numSamples = (size_t)cache->width * cache->height;
+  cache->samples = malloc(numSamples * sizeof(TemporalSample));
+  cache->nextSamples = malloc(numSamples * sizeof(TemporalSample));
+  cache->splats = malloc(numSamples * sizeof(int));
+  cache->splatDepths = malloc(numSamples * sizeof(float));
+  cache->startDistances = malloc(numSamples * sizeof(float));
+  if (!cache->samples || !cache->nextSamples || !cache->splats ||
+      !cache->splatDepths || !cache->startDistances) {
+    freeTemporalCache(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+void freeTemporalCache(TemporalCache *cache) {
+  if (!cache) {
+    return;
+  }
+  free(cache->startDistances);
+  free(cache->splatDepths);
+  free(cache->splats);
+  free(cache->nextSamples);
+  free(cache->samples);
+  free(cache);
+}
+
+// Finds where the line from the camera through point crosses the image
+// plane, in fractional pixel rows and columns. Returns false if point is
+// behind the camera.
+static bool projectToImagePlane(const TemporalCache *cache,
+                                const TemporalCamera *camera, Point point,
+                                float *pixelRow, float *pixelColumn) {
+  Vector toCenter =
+      vectorFromPointToPoint(camera->position, camera->imagePlaneCenter);
+  Vector toPoint = vectorFromPointToPoint(camera->position, point);
+  float depth = dotProduct(toPoint, toCenter);
+  if (depth <= 0.0) {
+    return false;
+  }
+  // The image plane is perpendicular to toCenter.
+  Vector offset = subtractVectors(
+      scaleVector(toPoint, dotProduct(toCenter, toCenter) / depth), toCenter);
+  Vector right = camera->imagePlaneRight;
+  Vector up = camera->imagePlaneUp;
+  float x = dotProduct(offset, right) / dotProduct(right, right);
+  float y = dotProduct(offset, up) / dotProduct(up, up);
+  *pixelColumn = (x + 0.5) * cache->imageWidth;
+  *pixelRow = (y + 0.5) * cache->imageHeight;
+  return true;
+}
+
+void reprojectTemporalCache(TemporalCache *cache,
+                            const TemporalCamera *camera) {
+  size_t numSamples = (size_t)cache->width * cache->height;
+  for (size_t i = 0; i < numSamples; ++i) {
+    cache->splats[i] = -1;
+    cache->startDistances[i] = 0.0;
+  }
+  if (!cache->hasSamples) {
+    return;
+  }
+  int subPixelsDim = cache->subPixelsDim;
+  for (size_t i = 0; i < numSamples; ++i) {
+    const TemporalSample *sample = &cache->samples[i];
+    float pixelRow;
+    float pixelColumn;
+    if (sample->materialId < 0 ||
+        !projectToImagePlane(cache, camera, sample->hitPoint, &pixelRow,
+                             &pixelColumn)) {
+      continue;
+    }
+    int row = (int)floorf(pixelRow * subPixelsDim);
+    int column = (int)floorf(pixelColumn * subPixelsDim);
+    if (row < 0 || row >= cache->height || column < 0 ||
+        column >= cache->width) {
+      continue;
+    }
+    size_t index = (size_t)row * cache->width + column;
+    float depth = vectorLength(
+        vectorFromPointToPoint(camera->position, sample->hitPoint));
+    if (cache->splats[index] < 0 || depth < cache->splatDepths[index]) {
+      cache->splats[index] = i;
+      cache->splatDepths[index] = depth;
+    }
+  }
+  for (int row = 0; row < cache->height; ++row) {
+    for (int column = 0; column < cache->width; ++column) {
+      float nearest = INFINITY;
+      for (int r = row - kSplatRadius; r <= row + kSplatRadius && nearest > 0.0;
+           ++r) {
+        for (int c = column - kSplatRadius; c <= column + kSplatRadius; ++c) {
+          size_t index = (size_t)r * cache->width + c;
+          if (r < 0 || r >= cache->height || c < 0 || c >= cache->width ||
+              cache->splats[index] < 0) {
+            nearest = 0.0;
+            break;
+          }
+          nearest = min(nearest, cache->splatDepths[index]);
+        }
+      }
+      cache->startDistances[(size_t)row * cache->width + column] =
+          nearest * (1.0 - kDepthMargin);
+    }
+  }
+}
+
+void finishTemporalFrame(TemporalCache *cache, Point lightPosition) {
+  TemporalSample *samples = cache->samples;
+  cache->samples = cache->nextSamples;
+  cache->nextSamples = samples;
+  cache->hasSamples = true;
+  cache->lightPosition = lightPosition;
+}
+
+size_t temporalSampleIndex(const TemporalCache *cache, int pixelRow,
+                           int pixelColumn, int subPixel) {
+  int subPixelsDim = cache->subPixelsDim;
+  int row = pixelRow * subPixelsDim + subPixel / subPixelsDim;
+  int column = pixelColumn * subPixelsDim + subPixel % subPixelsDim;
+  return (size_t)row * cache->width + column;
+}
+
+float temporalStartDistance(const TemporalCache *cache, size_t sampleIndex,
+                            Ray ray, SDF SDF) {
+  float t = cache->startDistances[sampleIndex];
+  if (t > 0.0 &&
+      SDF(addVectorToPoint(ray.origin, ray.direction, t)) <= SDF_EPSILON) {
+    // Starting inside the scene would find a false hit.
+    return 0.0;
+  }
+  return t;
+}
+
+// Whether the colors of the last frame's rays next to a sample's are all
+// within kReuseMaxContrast of its own.
+static bool isSmoothSample(const TemporalCache *cache, int index) {
+  const TemporalSample *sample = &cache->samples[index];
+  int row = index / cache->width;
+  int column = index % cache->width;
+  const int offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  for (int i = 0; i < 4; ++i) {
+    int r = row + offsets[i][0];
+    int c = column + offsets[i][1];
+    if (r < 0 || r >= cache->height || c < 0 || c >= cache->width) {
+      continue;
+    }
+    Color color = cache->samples[(size_t)r * cache->width + c].color;
+    if (fabsf(color.r - sample->color.r) > kReuseMaxContrast ||
+        fabsf(color.g - sample->color.g) > kReuseMaxContrast ||
+        fabsf(color.b - sample->color.b) > kReuseMaxContrast) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const TemporalSample *reusableTemporalSample(const TemporalCache *cache,
+                                             const Scene *scene,
+                                             const TemporalCamera *camera,
+                                             Point lightPosition,
+                                             size_t sampleIndex,
+                                             Point hitPoint) {
+  int splat = cache->splats[sampleIndex];
+  Point light = cache->lightPosition;
+  if (splat < 0 || lightPosition.x != light.x ||
+      lightPosition.y != light.y || lightPosition.z != light.z) {
+    return NULL;
+  }
+  const TemporalSample *sample = &cache->samples[splat];
+  if (scene->materials[sample->materialId].isConductive) {
+    return NULL;
+  }
+  Vector toShaded = vectorFromPointToPoint(sample->shadedPoint, hitPoint);
+  Vector toHit = vectorFromPointToPoint(camera->position, hitPoint);
+  // The spacing of primary rays at the hit's distance.
+  float spacing = 2.0 * camera->pixelConeRadius * vectorLength(toHit);
+  if (vectorLength(toShaded) > kReuseSpacings * spacing ||
+      !isSmoothSample(cache, splat)) {
+    return NULL;
+  }
+  return sample;
+}
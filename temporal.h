@@ -0,0 +1,110 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "math.h"
+#include "scene.h"
+
+/**
+ * Temporal reprojection. Animations only move the camera and the light, so
+ * the surfaces one frame's primary rays hit are still there on the next.
+ * Every primary ray's hit point, normal, material and color are kept, and
+ * before the next frame the hit points are projected into the new camera and
+ * splatted onto its grid of primary rays, the nearest one winning. Rays then
+ * start marching a little short of the nearest depth splatted around them,
+ * unless one of their neighbours got no splat, which is where surfaces may
+ * have come into view, or unless that start is inside the scene. A diffuse
+ * hit near where its splat's color was shaded, with the same material and
+ * normal and with the light where it was, reuses the color instead of being
+ * shaded again, as long as the colors around the splat on the last frame
+ * were close to it. Near creases and shadow edges, color changes faster
+ * than the hit moves, so those are shaded again.
+ */
+
+typedef struct TemporalSample {
+  // -1 if the ray missed.
+  int materialId;
+  Point hitPoint;
+  // Where color was shaded, which for reused colors was on an earlier frame.
+  Point shadedPoint;
+  Vector normal;
+  Color color;
+} TemporalSample;
+
+// Where a frame is seen from. Image coordinates in [-0.5, 0.5] map to
+// imagePlaneCenter + x * imagePlaneRight + y * imagePlaneUp, and
+// pixelConeRadius is the radius of a primary ray's cone per unit of distance.
+typedef struct TemporalCamera {
+  Point position;
+  Point imagePlaneCenter;
+  Vector imagePlaneRight;
+  Vector imagePlaneUp;
+  float pixelConeRadius;
+} TemporalCamera;
+
+typedef struct TemporalCache {
+  int imageWidth;
+  int imageHeight;
+  int subPixelsDim;
+  // The grid of primary rays, subPixelsDim times the size of the image.
+  int width;
+  int height;
+  // The last frame's rays and the current frame's, row by row. The renderer
+  // fills in nextSamples.
+  TemporalSample *samples;
+  TemporalSample *nextSamples;
+  bool hasSamples;
+  // Where the light was for the last frame.
+  Point lightPosition;
+  // For each ray, the index of the last frame's sample splatted onto it, or
+  // -1, and the splat's distance from the current camera.
+  int *splats;
+  float *splatDepths;
+  // Where each ray of the current frame starts, or 0 for the camera.
+  float *startDistances;
+  atomic_long numSeededRays;
+  atomic_long numReusedColors;
+} TemporalCache;
+
+// Hits only reuse a sample's color if their normal is within this cosine of
+// the sample's.
+#define kTemporalReuseMinCosine 0.99f
+
+// Returns NULL if the buffers can't be allocated.
+TemporalCache *createTemporalCache(int imageWidth, int imageHeight,
+                                   int subPixelsDim);
+
+void freeTemporalCache(TemporalCache *cache);
+
+// Splats the last frame's samples onto the camera's rays and works out where
+// each ray starts.
+void reprojectTemporalCache(TemporalCache *cache, const TemporalCamera *camera);
+
+// Makes the frame just rendered the one the next frame is reprojected from.
+void finishTemporalFrame(TemporalCache *cache, Point lightPosition);
+
+// The index of a sub-pixel's ray in the cache's grid.
+size_t temporalSampleIndex(const TemporalCache *cache, int pixelRow,
+                           int pixelColumn, int subPixel);
+
+// Where a primary ray from the camera can start marching, or 0. SDF is the
+// distance the ray is marched by.
+float temporalStartDistance(const TemporalCache *cache, size_t sampleIndex,
+                            Ray ray, SDF SDF);
+
+// The last frame's sample whose color might stand in for shading a hit: the
+// one splatted onto the ray, if it's diffuse, was shaded with the light where
+// it is now, was shaded near the hit and had colors like its own around it.
+// Returns NULL if there isn't one. The caller still has to check the hit's
+// material and normal against the sample's.
+const TemporalSample *reusableTemporalSample(const TemporalCache *cache,
+                                             const Scene *scene,
+                                             const TemporalCamera *camera,
+                                             Point lightPosition,
+                                             size_t sampleIndex,
+                                             Point hitPoint);
+
+#endif /* TEMPORAL_H */